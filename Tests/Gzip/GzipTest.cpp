@@ -0,0 +1,207 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file GzipTest.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+// Checks that CVDUGzipEncoder writes gzip streams zlib inflates to the very data fed in
+// Builds without Windows, see Makefile
+
+#include "pch.h"
+#include "VDUGzip.h"
+#include <cstdio>
+#include <random>
+#include <string>
+#include <zlib.h>
+
+static INT failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+//Compresses data fed in pieces of random size up to maxPiece
+static std::vector<BYTE> Compress(const std::vector<BYTE>& data, size_t maxPiece, std::mt19937& random)
+{
+	CVDUGzipEncoder encoder;
+	std::vector<BYTE> out;
+	size_t offset = 0;
+	while (offset < data.size())
+	{
+		size_t piece = min(data.size() - offset, (size_t)(random() % maxPiece) + 1);
+		encoder.Update(data.data() + offset, piece, out);
+		offset += piece;
+	}
+	encoder.Finish(out);
+	CHECK(encoder.GetLength() == data.size());
+	return out;
+}
+
+//Inflates a whole gzip stream, returns FALSE if zlib does not take it
+static BOOL Inflate(const std::vector<BYTE>& compressed, std::vector<BYTE>& data)
+{
+	z_stream stream = {};
+	if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+		return FALSE;
+
+	stream.next_in = (Bytef*)compressed.data();
+	stream.avail_in = (uInt)compressed.size();
+
+	BYTE buf[0x10000];
+	INT status;
+	do
+	{
+		stream.next_out = buf;
+		stream.avail_out = sizeof(buf);
+		status = inflate(&stream, Z_NO_FLUSH);
+		data.insert(data.end(), buf, buf + (sizeof(buf) - stream.avail_out));
+	} while (status == Z_OK);
+
+	//Stream has to end exactly with the data, trailer checked by zlib
+	BOOL ok = status == Z_STREAM_END && stream.avail_in == 0;
+	inflateEnd(&stream);
+	return ok;
+}
+
+//Compresses and inflates data, returns compressed size
+static size_t RoundTrip(const char* name, const std::vector<BYTE>& data, size_t maxPiece, std::mt19937& random)
+{
+	std::vector<BYTE> compressed = Compress(data, maxPiece, random);
+	std::vector<BYTE> inflated;
+	BOOL ok = Inflate(compressed, inflated);
+	CHECK(ok);
+	CHECK(inflated == data);
+	if (!ok || inflated != data)
+		printf("%s: %zu bytes do not round trip\n", name, data.size());
+	return compressed.size();
+}
+
+//Log lines with repeating structure, like the documents and logs uploads mostly are
+static std::vector<BYTE> MakeText(size_t length, std::mt19937& random)
+{
+	static const char* words[] = { "upload", "download", "token", "server", "client", "accepted", "refused", "file", "version",
+		"connection", "timeout", "retry", "queued", "sent", "received", "bytes" };
+	std::string text;
+	for (INT line = 0; text.size() < length; line++)
+	{
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix), "[12:%02d:%02d] [SERVER] ", (line / 60) % 60, line % 60);
+		text += prefix;
+		for (INT word = 0, count = 4 + random() % 8; word < count; word++)
+		{
+			text += words[random() % ARRAYSIZE(words)];
+			text += word + 1 < count ? " " : "\r\n";
+		}
+	}
+	text.resize(length);
+	return std::vector<BYTE>(text.begin(), text.end());
+}
+
+static void TestEdgeCases()
+{
+	std::mt19937 random(30);
+
+	RoundTrip("empty", std::vector<BYTE>(), 1, random);
+	RoundTrip("one byte", std::vector<BYTE>(1, 'x'), 1, random);
+	RoundTrip("two bytes", std::vector<BYTE>{ 'a', 'b' }, 1, random);
+	RoundTrip("three bytes", std::vector<BYTE>{ 'a', 'a', 'a' }, 1, random);
+
+	//Longest matches, and runs whose matches overlap the data they copy
+	size_t runLength = RoundTrip("run", std::vector<BYTE>(100000, 'z'), 5000, random);
+	CHECK(runLength < 1000);
+	RoundTrip("run of 258", std::vector<BYTE>(GZIP_MAX_MATCH + 1, 'z'), 1, random);
+
+	//Every byte value, literals above 143 take 9 bits
+	std::vector<BYTE> bytes;
+	for (INT i = 0; i < 4096; i++)
+		bytes.push_back((BYTE)(i * 7));
+	RoundTrip("byte values", bytes, 300, random);
+}
+
+static void TestWindow()
+{
+	std::mt19937 random(31);
+
+	//Data repeating at distances right below and beyond what a match may refer to
+	for (size_t period : { (size_t)1000, (size_t)GZIP_WINDOW_SIZE - 300, (size_t)GZIP_WINDOW_SIZE - 262, (size_t)GZIP_WINDOW_SIZE,
+		(size_t)GZIP_WINDOW_SIZE + 1 })
+	{
+		std::vector<BYTE> block(period);
+		for (auto it = block.begin(); it != block.end(); it++)
+			*it = (BYTE)random();
+
+		std::vector<BYTE> data;
+		for (INT i = 0; i < 6; i++)
+			data.insert(data.end(), block.begin(), block.end());
+
+		//Fed at once, in small pieces and in pieces crossing the window several times
+		RoundTrip("period", data, data.size(), random);
+		RoundTrip("period", data, 100, random);
+		RoundTrip("period", data, 3 * GZIP_WINDOW_SIZE, random);
+	}
+}
+
+static void TestRandomData()
+{
+	std::mt19937 random(32);
+	for (INT round = 0; round < 50; round++)
+	{
+		//Random bytes mixed with copies of earlier data, from tiny to several windows long
+		size_t length = random() % (round < 25 ? 2000 : 500000);
+		std::vector<BYTE> data;
+		while (data.size() < length)
+		{
+			if (data.size() > 10 && random() % 2)
+			{
+				size_t from = random() % data.size();
+				size_t count = min((size_t)(random() % 600), data.size() - from);
+				for (size_t i = 0; i < count; i++)
+					data.push_back(data[from + i]);
+			}
+			else
+			{
+				for (INT i = 0, count = random() % 50; i < count; i++)
+					data.push_back((BYTE)(random() % (random() % 2 ? 4 : 256)));
+			}
+		}
+		RoundTrip("random", data, 1 + random() % 100000, random);
+	}
+}
+
+static void TestText()
+{
+	std::mt19937 random(33);
+	std::vector<BYTE> text = MakeText(1000000, random);
+	size_t compressed = RoundTrip("text", text, 0x100000, random);
+
+	//Well below what the client asks for before it sends an upload compressed
+	printf("Text of %zu bytes compressed to %zu bytes\n", text.size(), compressed);
+	CHECK(compressed * 2 < text.size());
+
+	//Incompressible data grows only by the codes of its literals
+	std::vector<BYTE> noise(100000);
+	for (auto it = noise.begin(); it != noise.end(); it++)
+		*it = (BYTE)random();
+	compressed = RoundTrip("noise", noise, 0x10000, random);
+	CHECK(compressed < noise.size() * 9 / 8 + 64);
+}
+
+int main()
+{
+	TestEdgeCases();
+	TestWindow();
+	TestRandomData();
+	TestText();
+
+	if (failures)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All gzip tests passed\n");
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file pch.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+// Stands in for the MFC precompiled header, so the gzip encoder builds without Windows headers
+
+#ifndef PCH_H
+#define PCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef uint8_t BYTE;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef unsigned long long ULONGLONG;
+
+#define TRUE 1
+#define FALSE 0
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+//Windows defines these as macros, they are functions here so the standard headers above stay intact
+template <typename T> inline T min(T a, T b) { return b < a ? b : a; }
+template <typename T> inline T max(T a, T b) { return a < b ? b : a; }
+
+#endif //PCH_H
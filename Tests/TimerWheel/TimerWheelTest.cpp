@@ -0,0 +1,345 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file TimerWheelTest.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+// Checks that timers of CVDUTimerWheel expire exactly at their deadline and in order
+// Builds without Windows, see Makefile
+
+#include "pch.h"
+#include "VDUTimerWheel.h"
+#include <cstdio>
+#include <map>
+#include <random>
+
+#define LAP_1 (1ULL << TIMERWHEEL_SLOT_BITS) //Ticks of one lap of the lowest level
+#define LAP_2 (1ULL << (TIMERWHEEL_SLOT_BITS * 2))
+#define LAP_3 (1ULL << (TIMERWHEEL_SLOT_BITS * 3))
+#define WHEEL_RANGE (1ULL << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) //Farthest deadline the wheel holds without parking it
+
+static INT failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+//Timer as seen from its callback
+struct Fired
+{
+	ULONGLONG deadline; //Deadline it was scheduled with
+	ULONGLONG sequence; //Order it was scheduled in by the test
+	ULONGLONG tick; //Last tick processed when it expired
+};
+
+static std::vector<Fired> fired;
+static ULONGLONG processed = 0;
+
+static ULONGLONG Schedule(CVDUTimerWheel& wheel, ULONGLONG deadline, ULONGLONG sequence)
+{
+	return wheel.Schedule(deadline, [deadline, sequence]()
+	{
+		fired.push_back({ deadline, sequence, processed });
+	});
+}
+
+//Processes ticks up to now and runs callbacks of expired timers
+static void Advance(CVDUTimerWheel& wheel, ULONGLONG now)
+{
+	std::vector<VDU_TIMER_CALLBACK> expired;
+	wheel.Advance(now, expired);
+	processed = now;
+	for (auto it = expired.begin(); it != expired.end(); it++)
+		(*it)();
+}
+
+//Jumps from one tick with work to the next like the scheduler does, until no timer is left
+//Every timer has to expire at the very tick of its deadline
+static void RunAll(CVDUTimerWheel& wheel)
+{
+	size_t steps = 0;
+	while (wheel.GetCount() && steps++ < 100000)
+	{
+		ULONGLONG next = wheel.GetNextTick();
+		CHECK(next != TIMERWHEEL_NEVER);
+		if (next == TIMERWHEEL_NEVER)
+			return;
+
+		size_t first = fired.size();
+		Advance(wheel, next);
+		for (size_t i = first; i < fired.size(); i++)
+			CHECK(fired[i].deadline == next);
+	}
+	CHECK(!wheel.GetCount());
+	CHECK(wheel.GetNextTick() == TIMERWHEEL_NEVER);
+}
+
+//Returns whether timers expired by deadline and those of the same deadline in the order they were scheduled
+static BOOL IsOrdered(const std::vector<Fired>& timers)
+{
+	for (size_t i = 1; i < timers.size(); i++)
+	{
+		if (timers[i - 1].deadline > timers[i].deadline ||
+			(timers[i - 1].deadline == timers[i].deadline && timers[i - 1].sequence > timers[i].sequence))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void TestSameDeadline()
+{
+	fired.clear();
+	CVDUTimerWheel wheel(0);
+
+	//Interleaved with other deadlines, in a slot of a higher level and in the lowest one
+	ULONGLONG sequence = 0;
+	for (ULONGLONG deadline : { 1000ULL, 999ULL, 1000ULL, 1001ULL, 1000ULL, 5ULL, 1000ULL, 5ULL, 5ULL })
+		Schedule(wheel, deadline, sequence++);
+
+	Advance(wheel, 2000);
+	CHECK(fired.size() == sequence);
+	CHECK(IsOrdered(fired));
+	CHECK(!wheel.GetCount());
+}
+
+static void TestCascade()
+{
+	fired.clear();
+	CVDUTimerWheel wheel(0);
+
+	//Right before, at and after the first tick of every level, scheduled last to first
+	std::vector<ULONGLONG> deadlines = { LAP_1 - 1, LAP_1, LAP_1 + 1, 2 * LAP_1 - 1, LAP_2 - 1, LAP_2, LAP_2 + 1,
+		LAP_3 - 1, LAP_3, LAP_3 + 1, WHEEL_RANGE - LAP_3, WHEEL_RANGE - 1 };
+	ULONGLONG sequence = 0;
+	for (auto it = deadlines.rbegin(); it != deadlines.rend(); it++)
+		Schedule(wheel, *it, sequence++);
+
+	RunAll(wheel);
+	CHECK(fired.size() == deadlines.size());
+	CHECK(IsOrdered(fired));
+}
+
+static void TestLapBoundaries()
+{
+	//Wheel starts right before, at and after the end of laps of every level
+	for (ULONGLONG start : { 250ULL, 255ULL, 256ULL, 257ULL, LAP_2 - 6, LAP_2, LAP_3 - 1, LAP_3 + 3,
+		WHEEL_RANGE - 3, WHEEL_RANGE, 0x123456789ULL, 0xFFFFFFFFFFULL })
+	{
+		fired.clear();
+		processed = start;
+		CVDUTimerWheel wheel(start);
+
+		std::vector<ULONGLONG> deadlines;
+		for (ULONGLONG distance : { 0ULL, 1ULL, 5ULL, LAP_1 - 1, LAP_1, LAP_1 + 1, LAP_2 - 1, LAP_2, LAP_2 + 1, LAP_3 - 1, LAP_3, LAP_3 + 1 })
+			deadlines.push_back(start + distance);
+
+		//Ends of the laps the wheel is in, a tick apart from where the slots of higher levels move down
+		for (ULONGLONG lap : { LAP_1, LAP_2, LAP_3, WHEEL_RANGE })
+		{
+			ULONGLONG end = (start / lap + 1) * lap;
+			deadlines.push_back(end - 1);
+			deadlines.push_back(end);
+			deadlines.push_back(end + 1);
+		}
+
+		ULONGLONG sequence = 0;
+		for (auto it = deadlines.begin(); it != deadlines.end(); it++)
+			Schedule(wheel, *it, sequence++);
+
+		RunAll(wheel);
+		CHECK(fired.size() == deadlines.size());
+		CHECK(IsOrdered(fired));
+	}
+}
+
+static void TestBeyondRange()
+{
+	fired.clear();
+	processed = 7;
+	CVDUTimerWheel wheel(7);
+
+	//Parked in the last slot reached and placed again until they are in range
+	std::vector<ULONGLONG> deadlines = { 100, 7 + WHEEL_RANGE - 1, 7 + WHEEL_RANGE, 7 + WHEEL_RANGE + 1,
+		7 + 3 * WHEEL_RANGE + LAP_2 + 11, 7 + 256 * WHEEL_RANGE + 12345 };
+	ULONGLONG sequence = 0;
+	for (auto it = deadlines.begin(); it != deadlines.end(); it++)
+		Schedule(wheel, *it, sequence++);
+
+	RunAll(wheel);
+	CHECK(fired.size() == deadlines.size());
+	CHECK(IsOrdered(fired));
+
+	//Same in a single step
+	fired.clear();
+	CVDUTimerWheel jump(7);
+	sequence = 0;
+	for (auto it = deadlines.begin(); it != deadlines.end(); it++)
+		Schedule(jump, *it, sequence++);
+
+	Advance(jump, deadlines.back() - 1);
+	CHECK(fired.size() == deadlines.size() - 1);
+	Advance(jump, deadlines.back());
+	CHECK(fired.size() == deadlines.size());
+	CHECK(IsOrdered(fired));
+}
+
+static void TestPastDeadline()
+{
+	fired.clear();
+	CVDUTimerWheel wheel(0);
+	Advance(wheel, 1000);
+
+	//Expires with the next processed tick, after timers of that tick scheduled before it
+	Schedule(wheel, 1001, 0);
+	Schedule(wheel, 5, 1);
+	CHECK(wheel.GetNextTick() == 1001);
+
+	Advance(wheel, 1001);
+	CHECK(fired.size() == 2);
+	CHECK(fired.size() == 2 && fired[0].sequence == 0 && fired[1].sequence == 1);
+}
+
+static void TestStaleCancel()
+{
+	fired.clear();
+	CVDUTimerWheel wheel(0);
+
+	CHECK(!wheel.Cancel(0));
+	CHECK(!wheel.Cancel(12345));
+
+	//Expired timer cannot be cancelled
+	ULONGLONG expired = Schedule(wheel, 10, 0);
+	Advance(wheel, 10);
+	CHECK(fired.size() == 1);
+	CHECK(!wheel.Cancel(expired));
+
+	//Entry is reused with a new id, the old one does not cancel the new timer
+	ULONGLONG reused = Schedule(wheel, 20, 1);
+	CHECK(reused != expired);
+	CHECK((UINT32)reused == (UINT32)expired);
+	CHECK(!wheel.Cancel(expired));
+	CHECK(wheel.GetCount() == 1);
+
+	//Cancelled timer is cancelled once and never expires
+	CHECK(wheel.Cancel(reused));
+	CHECK(!wheel.Cancel(reused));
+	CHECK(!wheel.GetCount());
+
+	//Cancelled from a higher level before it moves down, and after
+	ULONGLONG far = Schedule(wheel, LAP_2 + 3, 2);
+	ULONGLONG near = Schedule(wheel, LAP_2 + 4, 3);
+	ULONGLONG kept = Schedule(wheel, LAP_2 + 5, 4);
+	CHECK(wheel.Cancel(far));
+	Advance(wheel, LAP_2);
+	CHECK(wheel.Cancel(near));
+	CHECK(!wheel.Cancel(far));
+	Advance(wheel, LAP_2 + 10);
+	CHECK(fired.size() == 2 && fired[1].sequence == 4);
+	CHECK(!wheel.Cancel(kept));
+	CHECK(!wheel.GetCount());
+}
+
+static void TestRandom()
+{
+	fired.clear();
+	std::mt19937_64 random(44);
+	CVDUTimerWheel wheel(0);
+	ULONGLONG now = 0;
+	processed = 0;
+
+	//Timers that did not expire yet by deadline and order, deadlines in the past count as the next tick to be processed
+	std::map<std::pair<ULONGLONG, ULONGLONG>, ULONGLONG> pending;
+	std::map<ULONGLONG, std::pair<ULONGLONG, ULONGLONG>> byId;
+	std::vector<ULONGLONG> staleIds;
+	ULONGLONG sequence = 0;
+
+	for (INT step = 0; step < 200000; step++)
+	{
+		UINT32 action = random() % 10;
+		if (action < 5)
+		{
+			//Distances of every level and beyond, some of them in the past
+			static const ULONGLONG ranges[] = { 8, LAP_1 + 8, LAP_2 + 8, LAP_3 + 8, WHEEL_RANGE + LAP_3 };
+			ULONGLONG range = ranges[random() % 5];
+			ULONGLONG deadline = now + random() % range;
+			if (random() % 20 == 0)
+				deadline = deadline > range ? deadline - range : 0;
+
+			ULONGLONG id = Schedule(wheel, deadline, sequence);
+			std::pair<ULONGLONG, ULONGLONG> key(max(deadline, now), sequence);
+			pending[key] = id;
+			byId[id] = key;
+			sequence++;
+		}
+		else if (action < 7)
+		{
+			if (!byId.empty())
+			{
+				auto it = byId.begin();
+				std::advance(it, random() % byId.size());
+				CHECK(wheel.Cancel(it->first));
+				pending.erase(it->second);
+				staleIds.push_back(it->first);
+				byId.erase(it);
+			}
+			if (!staleIds.empty())
+				CHECK(!wheel.Cancel(staleIds[random() % staleIds.size()]));
+		}
+		else
+		{
+			//Next tick with work, or a jump of any length
+			ULONGLONG next = wheel.GetNextTick();
+			if (!pending.empty())
+				CHECK(next <= pending.begin()->first.first);
+			else
+				CHECK(next == TIMERWHEEL_NEVER);
+
+			ULONGLONG target = action == 7 && next != TIMERWHEEL_NEVER ? next : now + 1 + random() % (random() % 2 ? LAP_1 : LAP_3);
+			size_t first = fired.size();
+			Advance(wheel, target);
+
+			for (size_t i = first; i < fired.size(); i++)
+			{
+				CHECK(!pending.empty());
+				if (pending.empty())
+					break;
+
+				//Expired timer is the earliest pending one
+				auto expected = pending.begin();
+				CHECK(expected->first.second == fired[i].sequence);
+				CHECK(expected->first.first <= target);
+				staleIds.push_back(expected->second);
+				byId.erase(expected->second);
+				pending.erase(expected);
+			}
+			CHECK(pending.empty() || pending.begin()->first.first > target);
+			now = target + 1;
+		}
+		CHECK(wheel.GetCount() == pending.size());
+		if (failures)
+			break;
+	}
+}
+
+int main()
+{
+	TestSameDeadline();
+	TestCascade();
+	TestLapBoundaries();
+	TestBeyondRange();
+	TestPastDeadline();
+	TestStaleCancel();
+	TestRandom();
+
+	if (failures)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All timer wheel tests passed\n");
+	return 0;
+}
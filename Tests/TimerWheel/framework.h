@@ -0,0 +1,13 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file framework.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+#pragma once
+
+// Stands in for the MFC framework header, the timer wheel needs nothing from it
@@ -15,6 +15,11 @@
 #include "VDUClientDlg.h"
 #include "VDUSession.h"
 #include "VDUFilesystem.h"
+#include "VDUConnectionPool.h"
+#include "VDUWorkerPool.h"
+#include "VDUScheduler.h"
+#include <algorithm>
+#include <map>
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -27,7 +32,7 @@ END_MESSAGE_MAP()
 
 
 // VDUClient construction
-VDUClient::VDUClient() : m_srefThread(nullptr), m_svc(nullptr), m_svcThread(nullptr),
+VDUClient::VDUClient() : m_conPool(nullptr), m_workers(nullptr), m_scheduler(nullptr), m_svc(nullptr), m_svcThread(nullptr),
 m_testMode(FALSE), m_insecure(FALSE)
 {
 	// support Restart Manager
@@ -35,11 +40,18 @@ m_testMode(FALSE), m_insecure(FALSE)
 	
 	// Place all significant initialization in InitInstance
 	m_session = new CVDUSession(_T(""));
+	m_fileEventsWake = CreateEvent(NULL, FALSE, FALSE, NULL);
 }
 
 VDUClient::~VDUClient()
 {
+	//Timers hand work to the workers, stop them first
+	delete m_scheduler;
+	m_scheduler = nullptr;
+	delete m_workers;
 	delete m_session;
+	delete m_conPool;
+	CloseHandle(m_fileEventsWake);
 }
 
 CVDUSession* VDUClient::GetSession()
@@ -47,9 +59,24 @@ CVDUSession* VDUClient::GetSession()
 	return m_session;
 }
 
-CWinThread* VDUClient::GetSessionRefreshingThread()
+void VDUClient::WakeFileEvents()
 {
-	return m_srefThread;
+	SetEvent(m_fileEventsWake);
+}
+
+CVDUConnectionPool* VDUClient::GetConnectionPool()
+{
+	return m_conPool;
+}
+
+CVDUWorkerPool* VDUClient::GetWorkerPool()
+{
+	return m_workers;
+}
+
+CVDUScheduler* VDUClient::GetScheduler()
+{
+	return m_scheduler;
 }
 
 CWinThread* VDUClient::GetFileSystemServiceThread()
@@ -72,12 +99,26 @@ CVDUFileSystemService* VDUClient::GetFileSystemService()
 	return m_svc;
 }
 
+void VDUClient::EndStartupPhase(LPCTSTR name)
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+
+	m_startupTimings.AppendFormat(_T("%s%s=%.1f"), m_startupTimings.IsEmpty() ? _T("") : _T(" "), name,
+		(now.QuadPart - m_phaseStart.QuadPart) * 1000.0 / frequency.QuadPart);
+	m_phaseStart = now;
+}
+
 // The one and only VDUClient object
 VDUClient vduClient;
 
 // VDUClient initialization
 BOOL VDUClient::InitInstance()
 {
+	QueryPerformanceCounter(&m_phaseStart);
+	LARGE_INTEGER startTime = m_phaseStart;
+
 	// InitCommonControlsEx() is required on Windows XP if an application
 	// manifest specifies use of ComCtl32.dll version 6 or later to enable
 	// visual styles.  Otherwise, any window creation will fail.
@@ -110,23 +151,17 @@ BOOL VDUClient::InitInstance()
 	key.Close();
 
 	//Check if an instance is already running
-	//Create mailslot for messages
-	HANDLE hMailslot = CreateMailslot(S_MAILSLOT, 0, MAILSLOT_WAIT_FOREVER, NULL);
-	if (hMailslot == INVALID_HANDLE_VALUE)
+	//Create pipe for commands, only the first instance gets it
+	HANDLE hPipe = CreateCommandPipe(TRUE);
+	if (hPipe == INVALID_HANDLE_VALUE)
 	{
 		//This is second instance of the process
-		//Write the command into the mailslot, the first instance will run it
-		hMailslot = CreateFile(S_MAILSLOT, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-		if (hMailslot != INVALID_HANDLE_VALUE)
-		{
-			DWORD writeLen;
-			WriteFile(hMailslot, m_lpCmdLine, (DWORD)_tcslen(m_lpCmdLine) * sizeof(*m_lpCmdLine) + sizeof(*m_lpCmdLine), &writeLen, NULL);
-			CloseHandle(hMailslot);
-		}
-
-		ExitProcess(EXIT_SUCCESS);
+		//Send the command to the first instance, it runs it and answers with the results
+		ExitProcess(SendCommands(m_lpCmdLine));
 	}
 
+	EndStartupPhase(_T("instance"));
+
 	//Acquire the executable path
 	CString moduleFilePath;
 	AfxGetModuleFileName(NULL, moduleFilePath);
@@ -174,8 +209,19 @@ BOOL VDUClient::InitInstance()
 		APP->WriteProfileString(SECTION_SETTINGS, _T("PreferredDriveLetter"), _T("V:"));
 	preferredLetter = APP->GetProfileString(SECTION_SETTINGS, _T("PreferredDriveLetter"), _T(""));
 
-	//Create worker thread
-	m_srefThread = AfxBeginThread(ThreadProcLoginRefresh, (LPVOID)nullptr);
+	EndStartupPhase(_T("settings"));
+
+	//All requests share keep-alive connections from this pool
+	m_conPool = new CVDUConnectionPool(APP->GetProfileInt(SECTION_SETTINGS, _T("MaxConnections"), POOL_DEFAULT_MAX_CONNECTIONS),
+		APP->GetProfileInt(SECTION_SETTINGS, _T("ConnectionIdleTimeout"), POOL_DEFAULT_IDLE_TIMEOUT));
+
+	//Requests are executed by a fixed amount of workers instead of a thread per request
+	m_workers = new CVDUWorkerPool(APP->GetProfileInt(SECTION_SETTINGS, _T("WorkerThreads"), WORKERPOOL_DEFAULT_THREADS));
+
+	//One thread runs all timers, refreshes are planned by the session from now on
+	m_scheduler = new CVDUScheduler();
+
+	EndStartupPhase(_T("workers"));
 
 	//Dont create dialog in test mode
 	if (!IsTestMode())
@@ -209,17 +255,25 @@ BOOL VDUClient::InitInstance()
 	ControlBarCleanUp();
 #endif
 
+	EndStartupPhase(_T("dialog"));
+
 	//Start the file system service
 	m_svcThread = AfxBeginThread(ThreadProcFilesystemService, (LPVOID)(m_svc = new CVDUFileSystemService(preferredLetter)));
 
-	//Make sure the file system service is started
-	ULONGLONG startTicks = GetTickCount64();
-	while (!PathFileExists(GetFileSystemService()->GetDrivePath()))
-	{
-		ULONGLONG timeWaited = GetTickCount64() - startTicks;
-		if (timeWaited > 10 * 1000)
-			ExitProcess(-3);
-	}
+	//Make sure the file system service is started, it signals once the drive is mounted
+	if (!GetFileSystemService()->WaitStarted(FILESYSTEM_START_TIMEOUT))
+		ExitProcess(-3);
+
+	//Kept for comparing startups, the file system service adds its own phases
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	m_startupTimings.AppendFormat(_T(" total=%.1f"), (now.QuadPart - startTime.QuadPart) * 1000.0 / frequency.QuadPart);
+	APP->WriteProfileString(SECTION_SETTINGS, _T("StartupTimings"), m_startupTimings);
+
+	//Accessed files are kept fresh with metadata requests, files about to expire are checked by their own timers
+	GetFileSystemService()->ScheduleRefreshVDUFiles();
+	AfxBeginThread(ThreadProcFileEvents, (LPVOID)nullptr);
 
 	//In test mode we execute input actions and quit with proper code
 	if (IsTestMode())
@@ -230,26 +284,24 @@ BOOL VDUClient::InitInstance()
 		ExitProcess(EXIT_SUCCESS);
 	}
 
-	//Start reading mailslot messages
-	AfxBeginThread(ThreadProcMailslot, (LPVOID)hMailslot);
-
-	//Write current command line for execution
-	hMailslot = CreateFile(S_MAILSLOT, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (hMailslot != INVALID_HANDLE_VALUE)
-	{
-		DWORD writeLen;
-		WriteFile(hMailslot, m_lpCmdLine, (DWORD)_tcslen(m_lpCmdLine) * sizeof(*m_lpCmdLine) + sizeof(*m_lpCmdLine), &writeLen, NULL);
-		CloseHandle(hMailslot);
-	}
+	//Run current command line, then serve commands of other instances
+	AfxBeginThread(ThreadProcCommandPipe, (LPVOID)hPipe);
 
 	return TRUE;
 }
 
 INT VDUClient::ExitInstance()
 {
+	//Changes are sent while still logged in, those the server does not take stay queued for the next start
+	GetFileSystemService()->DrainUploads();
+
 	if (auto* s = GetSession())
 		if (s->IsLoggedIn())
-			AfxBeginThread(CVDUConnection::ThreadProc, (LPVOID)new CVDUConnection(s->GetServerURL(), VDUAPIType::DELETE_AUTH_KEY));
+		{
+			//Give the server a moment to invalidate the key before workers are stopped
+			VDUTaskResult logout = GetWorkerPool()->Submit(new CVDUConnection(s->GetServerURL(), VDUAPIType::DELETE_AUTH_KEY));
+			logout.result.wait_for(std::chrono::seconds(2));
+		}
 
 	GetFileSystemService()->Stop();
 
@@ -258,267 +310,572 @@ INT VDUClient::ExitInstance()
 	return CWinApp::ExitInstance();
 }
 
-void VDUClient::HandleCommands(LPCWSTR cmdline, BOOL async)
+void VDUClient::HandleCommands(LPCWSTR cmdline, BOOL async, CString* results)
 {
 	int argc;
-	if (TCHAR** argv = CommandLineToArgvW(cmdline, &argc))
+	TCHAR** argv = CommandLineToArgvW(cmdline, &argc);
+	if (!argv)
+		return;
+
+	std::vector<VDUCommand> commands;
+	std::map<CString, size_t> lastOnToken; //Last action on each file since the last action running alone
+	std::vector<size_t> sinceAlone; //Actions since the last action running alone
+	size_t lastAlone = COMMAND_NONE; //Last action running alone
+
+	//Action waits for the last one on each of its files, or for everything before it if it has no files
+	auto addToken = [&](size_t index, CString token)
 	{
-		for (int i = 0; i < argc; i++)
+		VDUCommand& command = commands[index];
+		auto last = lastOnToken.find(token);
+		if (last != lastOnToken.end() && last->second != index &&
+			std::find(command.after.begin(), command.after.end(), last->second) == command.after.end())
+			command.after.push_back(last->second);
+
+		command.tokens.push_back(token);
+		lastOnToken[token] = index;
+	};
+	auto add = [&](LPCTSTR action, std::vector<CString> args, std::vector<CString> tokens)
+	{
+		size_t index = commands.size();
+		commands.push_back(VDUCommand());
+		commands[index].action = action;
+		commands[index].args = args;
+
+		if (tokens.empty())
 		{
-			TCHAR* arg = argv[i];
-			INT result;
+			commands[index].after = sinceAlone;
+			if (sinceAlone.empty() && lastAlone != COMMAND_NONE)
+				commands[index].after.push_back(lastAlone);
+
+			lastAlone = index;
+			sinceAlone.clear();
+			lastOnToken.clear();
+			return;
+		}
 
-			if (!_tcscmp(arg, _T("-server")))
-			{
-				CMDLINE_ASSERT_ARGC(argc, i);
-				TCHAR* server = argv[++i];
+		if (lastAlone != COMMAND_NONE)
+			commands[index].after.push_back(lastAlone);
+		for (auto it = tokens.begin(); it != tokens.end(); it++)
+			addToken(index, *it);
+		sinceAlone.push_back(index);
+	};
 
-				GetSession()->Reset(server);
-			}
-			else if (!_tcscmp(arg, _T("-user")))
-			{
-				CMDLINE_ASSERT_ARGC(argc, i);
-				TCHAR* user = argv[++i];
-
-				result = GetSession()->Login(user, _T(""), async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
-			}
-			else if (!_tcscmp(arg, _T("-logout")))
-			{
-				result = GetSession()->Logout(async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
-			}
-			else if (!_tcscmp(arg, _T("-accessfile")))
+	//Consecutive file accesses are sent as one batch
+	BOOL accessing = FALSE;
+	auto access = [&](CString token)
+	{
+		if (accessing)
+		{
+			commands.back().args.push_back(token);
+			addToken(commands.size() - 1, token);
+		}
+		else
+		{
+			add(_T("-accessfile"), { token }, { token });
+		}
+		accessing = TRUE;
+	};
+
+	for (int i = 0; i < argc; i++)
+	{
+		TCHAR* arg = argv[i];
+		BOOL wasAccessing = accessing;
+		accessing = FALSE;
+
+		if (!_tcscmp(arg, _T("-server")) || !_tcscmp(arg, _T("-user")) || !_tcscmp(arg, _T("-wait")))
+		{
+			CMDLINE_ASSERT_ARGC(argc, i);
+			add(arg, { argv[++i] }, {});
+		}
+		else if (!_tcscmp(arg, _T("-logout")))
+		{
+			add(arg, {}, {});
+		}
+		else if (!_tcscmp(arg, _T("-accessfile")))
+		{
+			CMDLINE_ASSERT_ARGC(argc, i);
+			accessing = wasAccessing;
+			access(argv[++i]);
+		}
+		else if (!_tcscmp(arg, _T("-accessnetfile")))
+		{
+			CMDLINE_ASSERT_ARGC(argc, i);
+			CString parsedToken = argv[++i];
+			parsedToken = parsedToken.Right(parsedToken.GetLength() - 4);
+
+			//Parse url backslashes
+			while (parsedToken.GetLength() > 0 && parsedToken.GetAt(0) == '/')
+				parsedToken = parsedToken.Right(parsedToken.GetLength() - 1);
+
+			while (parsedToken.GetLength() > 0 && parsedToken.GetAt(parsedToken.GetLength() - 1) == '/')
+				parsedToken = parsedToken.Left(parsedToken.GetLength() - 1);
+
+			accessing = wasAccessing;
+			if (!parsedToken.IsEmpty())
+				access(parsedToken);
+		}
+		else if (!_tcscmp(arg, _T("-deletefile")))
+		{
+			CMDLINE_ASSERT_ARGC(argc, i);
+			CString token = argv[++i];
+			add(arg, { token }, { token });
+		}
+		else if (!_tcscmp(arg, _T("-rename")) || !_tcscmp(arg, _T("-check")) || !_tcscmp(arg, _T("-write")) || !_tcscmp(arg, _T("-read")) ||
+			!_tcscmp(arg, _T("-hold")))
+		{
+			CMDLINE_ASSERT_ARGC(argc, i + 1);
+			CString token = argv[++i];
+			CString value = argv[++i];
+			add(arg, { token, value }, { token });
+		}
+	}
+	LocalFree(argv);
+
+	//Every action is started as soon as the actions it waits for are done
+	std::vector<size_t> waiting(commands.size());
+	std::vector<std::vector<size_t>> dependents(commands.size());
+	for (size_t i = 0; i < commands.size(); i++)
+	{
+		waiting[i] = commands[i].after.size();
+		for (auto it = commands[i].after.begin(); it != commands[i].after.end(); it++)
+			dependents[*it].push_back(i);
+	}
+
+	SRWLOCK finishedLock = SRWLOCK_INIT;
+	std::vector<size_t> finished; //Actions done since the last look, guarded by finishedLock
+	HANDLE finishedEvent = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	auto start = [&](size_t index)
+	{
+		VDUCommand* command = &commands[index];
+		GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, command, index, async, &finishedLock, &finished, finishedEvent]()
+		{
+			RunCommand(*command, async);
+
+			AcquireSRWLockExclusive(&finishedLock);
+			finished.push_back(index);
+			ReleaseSRWLockExclusive(&finishedLock);
+			ReleaseSemaphore(finishedEvent, 1, NULL);
+			return EXIT_SUCCESS;
+		});
+	};
+
+	for (size_t i = 0; i < commands.size(); i++)
+	{
+		if (!waiting[i])
+			start(i);
+	}
+
+	std::vector<size_t> done;
+	for (size_t left = commands.size(); left > 0; left--)
+	{
+		WaitForSingleObject(finishedEvent, INFINITE);
+
+		AcquireSRWLockExclusive(&finishedLock);
+		done.swap(finished);
+		ReleaseSRWLockExclusive(&finishedLock);
+
+		for (auto it = done.begin(); it != done.end(); it++)
+		{
+			for (auto next = dependents[*it].begin(); next != dependents[*it].end(); next++)
 			{
-				CMDLINE_ASSERT_ARGC(argc, i);
-				TCHAR* token = argv[++i];
-
-				result = GetSession()->AccessFile(token, async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
+				if (!--waiting[*next])
+					start(*next);
 			}
-			else if (!_tcscmp(arg, _T("-accessnetfile")))
-			{
-				CMDLINE_ASSERT_ARGC(argc, i);
-				TCHAR* token = argv[++i];
+		}
+		done.clear();
+	}
+	CloseHandle(finishedEvent);
+
+	//Results keep the order of the command line
+	if (results)
+	{
+		for (auto it = commands.begin(); it != commands.end(); it++)
+			*results += it->results;
+	}
+}
+
+void VDUClient::RunCommand(VDUCommand& command, BOOL async)
+{
+	//Every action answers with a line, e.g. "0\t-accessfile\ta"
+	auto report = [&](INT result, LPCTSTR argument)
+	{
+		command.results.AppendFormat(_T("%d\t%s\t%s\n"), result, (LPCTSTR)command.action, argument);
+	};
+
+	INT result;
+	if (command.action == _T("-server"))
+	{
+		GetSession()->Reset(command.args[0]);
+		report(EXIT_SUCCESS, command.args[0]);
+	}
+	else if (command.action == _T("-user"))
+	{
+		result = GetSession()->Login(command.args[0], _T(""), async);
+		report(result, command.args[0]);
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
+	}
+	else if (command.action == _T("-logout"))
+	{
+		result = GetSession()->Logout(async);
+		report(result, _T(""));
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
+	}
+	else if (command.action == _T("-accessfile"))
+	{
+		std::vector<INT> fileResults;
+		result = GetSession()->AccessFiles(command.args, async, &fileResults);
+		for (size_t i = 0; i < command.args.size(); i++)
+			report(async ? result : fileResults[i], command.args[i]);
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
+	}
+	else if (command.action == _T("-deletefile"))
+	{
+		CString token = command.args[0];
+		CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
 
-				CString parsedToken = token;
-				parsedToken = parsedToken.Right(parsedToken.GetLength() - 4);
+		result = GetFileSystemService()->DeleteVDUFile(vdufile, async);
+		report(result, token);
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
 
-				//Parse url backslashes
-				while (parsedToken.GetLength() > 0 && parsedToken.GetAt(0) == '/')
-					parsedToken = parsedToken.Right(parsedToken.GetLength() - 1);
+		//Make sure file gets deleted
+		GetFileSystemService()->DeleteFileInternal(token);
+	}
+	else if (command.action == _T("-rename"))
+	{
+		CString token = command.args[0];
+		CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
 
-				while (parsedToken.GetLength() > 0 && parsedToken.GetAt(parsedToken.GetLength() - 1) == '/')
-					parsedToken = parsedToken.Left(parsedToken.GetLength() - 1);
+		result = GetFileSystemService()->RenameVDUFile(vdufile, command.args[1], async);
+		report(result, token);
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
+	}
+	else if (command.action == _T("-check"))
+	{
+		CString token = command.args[0];
+		UINT count = _ttoi(command.args[1]);
 
-				if (parsedToken.IsEmpty())
-					continue;
+		//Checks metadata of file count times, all at once, e.g. to keep requests in flight across key refreshes
+		std::vector<VDUTaskResult> checks;
+		for (UINT n = 0; n < count; n++)
+			checks.push_back(GetWorkerPool()->Submit(
+				new CVDUConnection(GetSession()->GetServerURL(), VDUAPIType::HEAD_FILE, CVDUSession::CallbackRefreshFile, _T(""), token)));
 
-				result = GetSession()->AccessFile(parsedToken, async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
-			}
-			else if (!_tcscmp(arg, _T("-deletefile")))
-			{
-				CMDLINE_ASSERT_ARGC(argc, i);
-				TCHAR* token = argv[++i];
+		result = EXIT_SUCCESS;
+		for (auto it = checks.begin(); it != checks.end(); it++)
+		{
+			if (GetWorkerPool()->Wait(*it) != EXIT_SUCCESS)
+				result = EXIT_FAILURE;
+		}
+		report(result, token);
 
-				CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
+		if (result != EXIT_SUCCESS && APP->IsTestMode())
+		{
+			ExitProcess(result);
+		}
+	}
+	else if (command.action == _T("-wait"))
+	{
+		//Lets time pass between actions, background work like listening for file changes goes on meanwhile
+		Sleep(_ttoi(command.args[0]));
+		report(EXIT_SUCCESS, command.args[0]);
+	}
+	else if (command.action == _T("-hold"))
+	{
+		CString token = command.args[0];
+		CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
 
-				result = GetFileSystemService()->DeleteVDUFile(vdufile, async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
+		//Keeps the file open a while, like an application editing it, its token is kept alive meanwhile
+		result = EXIT_FAILURE;
+		TRY
+		{
+			CFile file(GetFileSystemService()->GetDrivePath() + vdufile.m_name, CFile::modeRead | CFile::shareDenyNone);
+			Sleep(_ttoi(command.args[1]));
+			file.Close();
+			result = EXIT_SUCCESS;
+		}
+		CATCH(CException, e)
+		{
+			if (APP->IsTestMode())
+				ExitProcess(EXIT_FAILURE);
+		}
+		END_CATCH
+		report(result, token);
+	}
+	else if (command.action == _T("-write"))
+	{
+		CString token = command.args[0];
+		CString text = command.args[1];
+		CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
 
-				//Make sure file gets deleted
-				GetFileSystemService()->DeleteFileInternal(token);
-			}
-			else if (!_tcscmp(arg, _T("-rename")))
-			{
-				CMDLINE_ASSERT_ARGC(argc, i + 1);
-				TCHAR* token = argv[++i];
-				TCHAR* name = argv[++i];
+		result = EXIT_FAILURE;
+		TRY
+		{
+			//Writing unicode text to a file
+			CStdioFile stdf(GetFileSystemService()->GetDrivePath() + vdufile.m_name,
+				CFile::modeWrite | CFile::typeText | CFile::shareDenyNone);
 
-				CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
+			stdf.WriteString(text);
+			stdf.Flush();
+			stdf.Close();
 
-				result = GetFileSystemService()->UpdateVDUFile(vdufile, name, async);
-				if (result != EXIT_SUCCESS && APP->IsTestMode())
-				{
-					ExitProcess(result);
-				}
-			}
-			else if (!_tcscmp(arg, _T("-write")))
+			result = GetFileSystemService()->UpdateVDUFile(vdufile, _T(""), async);
+			if (result != EXIT_SUCCESS && APP->IsTestMode())
 			{
-				CMDLINE_ASSERT_ARGC(argc, i + 1);
-				TCHAR* token = argv[++i];
-				TCHAR* text = argv[++i];
-
-				CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
-
-				TRY
-				{
-					//Writing unicode text to a file
-					CStdioFile stdf(GetFileSystemService()->GetDrivePath() + vdufile.m_name,
-						CFile::modeWrite | CFile::typeText | CFile::shareDenyNone);
-
-					stdf.WriteString(text);
-					stdf.Flush();
-					stdf.Close();
-
-					result = GetFileSystemService()->UpdateVDUFile(vdufile, _T(""), async);
-					if (result != EXIT_SUCCESS && APP->IsTestMode())
-					{
-						ExitProcess(result);
-					}
-				}
-				CATCH(CException, e)
-				{
-					if (!async && APP->IsTestMode())
-						ExitProcess(EXIT_FAILURE);
-				}
-				END_CATCH
+				ExitProcess(result);
 			}
-			else if (!_tcscmp(arg, _T("-read")))
+		}
+		CATCH(CException, e)
+		{
+			if (!async && APP->IsTestMode())
+				ExitProcess(EXIT_FAILURE);
+		}
+		END_CATCH
+		report(result, token);
+	}
+	else if (command.action == _T("-read"))
+	{
+		CString token = command.args[0];
+		CString text = command.args[1];
+		CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
+
+		result = EXIT_FAILURE;
+		TRY
+		{
+			CStdioFile stdf(GetFileSystemService()->GetDrivePath() + vdufile.m_name,
+			CFile::modeRead | CFile::typeText | CFile::shareDenyNone);
+
+			//Reading unicode text from a file and compare it to input
+			CString fileContent;
+			stdf.ReadString(fileContent);
+			stdf.Close();
+
+			//Compare only the exact amount of characters
+			fileContent = fileContent.Left(text.GetLength());
+			result = text == fileContent ? EXIT_SUCCESS : EXIT_FAILURE;
+			if (!async && result != EXIT_SUCCESS && APP->IsTestMode())
 			{
-				CMDLINE_ASSERT_ARGC(argc, i + 1);
-				TCHAR* token = argv[++i];
-				TCHAR* text = argv[++i];
-
-				CVDUFile vdufile = GetFileSystemService()->GetVDUFileByToken(token);
-
-				TRY
-				{
-					CStdioFile stdf(GetFileSystemService()->GetDrivePath() + vdufile.m_name,
-					CFile::modeRead | CFile::typeText | CFile::shareDenyNone);
-
-					//Reading unicode text from a file and compare it to input
-					CString fileContent;
-					stdf.ReadString(fileContent);
-					stdf.Close();
-
-					//Compare only the exact amount of characters
-					fileContent = fileContent.Left((INT)_tcslen(text));
-					if (!async && text != fileContent && APP->IsTestMode())
-					{
-						ExitProcess(EXIT_FAILURE);
-					}
-				}
-				CATCH(CException, e)
-				{
-					if (!async && APP->IsTestMode())
-						ExitProcess(EXIT_FAILURE);
-				}
-				END_CATCH
+				ExitProcess(EXIT_FAILURE);
 			}
 		}
-		LocalFree(argv);
+		CATCH(CException, e)
+		{
+			if (!async && APP->IsTestMode())
+				ExitProcess(EXIT_FAILURE);
+		}
+		END_CATCH
+		report(result, token);
 	}
-
 }
 
-UINT VDUClient::ThreadProcMailslot(LPVOID slothandle)
+INT VDUClient::SendCommands(LPCWSTR cmdline)
 {
-	HANDLE hSlot = (HANDLE)slothandle;
-	TCHAR msgBuf[250] = { 0 };
+	//Several callers are served at the same time, others wait for their turn a limited time
+	HANDLE hPipe;
+	ULONGLONG deadline = GetTickCount64() + COMMAND_PIPE_WAIT;
+	while ((hPipe = CreateFile(S_COMMAND_PIPE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
+	{
+		DWORD error = GetLastError();
+		ULONGLONG now = GetTickCount64();
+		if (error != ERROR_PIPE_BUSY || now >= deadline || !WaitNamedPipe(S_COMMAND_PIPE, (DWORD)(deadline - now)))
+			return EXIT_FAILURE;
+	}
 
+	DWORD mode = PIPE_READMODE_MESSAGE;
+	CString results;
+	if (!SetNamedPipeHandleState(hPipe, &mode, NULL, NULL) || !WriteCommandMessage(hPipe, nullptr, cmdline) || !ReadCommandMessage(hPipe, nullptr, results))
+	{
+		CloseHandle(hPipe);
+		return EXIT_FAILURE;
+	}
+	CloseHandle(hPipe);
+
+	//Each line starts with the exit code of an action
+	INT pos = 0;
+	CString line = results.Tokenize(_T("\n"), pos);
+	while (pos >= 0)
+	{
+		INT result = _ttoi(line);
+		if (result != EXIT_SUCCESS)
+			return result;
+
+		line = results.Tokenize(_T("\n"), pos);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+BOOL VDUClient::ReadCommandMessage(HANDLE pipe, OVERLAPPED* overlapped, CString& message)
+{
+	std::vector<BYTE> data;
+	BYTE buffer[COMMAND_PIPE_BUFFER];
 	while (TRUE)
 	{
-		Sleep(500);
+		DWORD readBytes = 0;
+		BOOL done = ReadFile(pipe, buffer, sizeof(buffer), &readBytes, overlapped);
+		if (!done && overlapped && GetLastError() == ERROR_IO_PENDING)
+			done = WaitCommandPipe(pipe, overlapped, readBytes);
 
-		DWORD nextSize;
-		DWORD msgCount;
-		if (!GetMailslotInfo(hSlot, 0, &nextSize, &msgCount, NULL))
-			continue;
+		//Rest of a longer message is read by the next call
+		if (!done && GetLastError() != ERROR_MORE_DATA)
+			return FALSE;
 
-		if (nextSize == MAILSLOT_NO_MESSAGE)
-			continue;
+		data.insert(data.end(), buffer, buffer + readBytes);
+		if (done)
+			break;
+	}
 
-		DWORD readBytes;
-		if (!ReadFile(hSlot, msgBuf, min(nextSize, ARRAYSIZE(msgBuf) - 1), &readBytes, NULL))
-			continue;
+	message = CString((LPCWSTR)data.data(), (INT)(data.size() / sizeof(WCHAR)));
+	return TRUE;
+}
+
+BOOL VDUClient::WriteCommandMessage(HANDLE pipe, OVERLAPPED* overlapped, const CString& message)
+{
+	DWORD size = message.GetLength() * sizeof(WCHAR);
+	DWORD writeLen = 0;
+	BOOL done = WriteFile(pipe, (LPCWSTR)message, size, &writeLen, overlapped);
+	if (!done && overlapped && GetLastError() == ERROR_IO_PENDING)
+		done = WaitCommandPipe(pipe, overlapped, writeLen);
+
+	return done && writeLen == size;
+}
 
-		//Read all the launch options from message
-		APP->HandleCommands(msgBuf, FALSE);
-		SecureZeroMemory(msgBuf, sizeof(msgBuf));
+BOOL VDUClient::WaitCommandPipe(HANDLE pipe, OVERLAPPED* overlapped, DWORD& transferred)
+{
+	//A caller that stopped sending or reading does not keep its pipe instance
+	if (WaitForSingleObject(overlapped->hEvent, COMMAND_PIPE_TIMEOUT) != WAIT_OBJECT_0)
+	{
+		CancelIoEx(pipe, overlapped);
+		GetOverlappedResult(pipe, overlapped, &transferred, TRUE);
+		SetLastError(ERROR_TIMEOUT);
+		return FALSE;
 	}
+
+	return GetOverlappedResult(pipe, overlapped, &transferred, FALSE);
 }
 
-UINT VDUClient::ThreadProcFilesystemService(LPVOID service)
+HANDLE VDUClient::CreateCommandPipe(BOOL first)
 {
-	CVDUFileSystemService* svc = (CVDUFileSystemService*) service;
-	ASSERT(svc);
-	//Run the service here forever
-	return svc->Run();
+	return CreateNamedPipe(S_COMMAND_PIPE, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+		PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, COMMAND_PIPE_INSTANCES, COMMAND_PIPE_BUFFER, COMMAND_PIPE_BUFFER, 0, NULL);
 }
 
-UINT VDUClient::ThreadProcLoginRefresh(LPVOID)
+void VDUClient::ServeCommandPipe(HANDLE pipe, OVERLAPPED* overlapped)
 {
-	while (TRUE)
+	//A caller may send several command lines, each is answered with its results before the next is read
+	CString commands;
+	while (ReadCommandMessage(pipe, overlapped, commands))
 	{
-		VDU_SESSION_LOCK;
+		CString results;
+		APP->HandleCommands(commands, FALSE, &results);
+		if (!WriteCommandMessage(pipe, overlapped, results))
+			break;
+	}
+}
+
+UINT VDUClient::ThreadProcCommandPipe(LPVOID pipehandle)
+{
+	HANDLE hPipe = (HANDLE)pipehandle;
+	OVERLAPPED overlapped = { 0 };
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-		CTime expires = session->GetAuthTokenExpires();
+	//Launch options of this instance go first
+	APP->HandleCommands(APP->m_lpCmdLine, FALSE);
 
-		//Session is not set up yet, we wait
-		if (expires <= 0)
+	while (TRUE)
+	{
+		//Wakes up as soon as another instance connects, no polling
+		BOOL connected = ConnectNamedPipe(hPipe, &overlapped);
+		if (!connected)
 		{
-			VDU_SESSION_UNLOCK;
-			Sleep(1000);
-			continue;
+			DWORD error = GetLastError();
+			if (error == ERROR_IO_PENDING)
+			{
+				DWORD unused;
+				connected = GetOverlappedResult(hPipe, &overlapped, &unused, TRUE);
+			}
+			else
+			{
+				connected = error == ERROR_PIPE_CONNECTED;
+			}
 		}
 
-		//NOTE: CTime::GetCurrentTime() is offset by timezone, do not use
-		SYSTEMTIME cstime;
-		SecureZeroMemory(&cstime, sizeof(cstime));
-		GetSystemTime(&cstime);
-		CTime now(cstime);
-		CTimeSpan delta = expires - now;
+		if (!connected)
+		{
+			DisconnectNamedPipe(hPipe);
+			continue;
+		}
 
-		//Sleep till its time to refresh or refresh immediately
-		if (delta < 3)
+		//Caller is served on its own thread, the next one connects to a new instance meanwhile
+		HANDLE hNext = CreateCommandPipe(FALSE);
+		if (hNext != INVALID_HANDLE_VALUE)
 		{
-			CWinThread* refreshThread = AfxBeginThread(CVDUConnection::ThreadProc, (LPVOID)
-				(new CVDUConnection(session->GetServerURL(), VDUAPIType::GET_AUTH_KEY, CVDUSession::CallbackLoginRefresh)),0,0,CREATE_SUSPENDED);
+			AfxBeginThread(ThreadProcCommandCaller, (LPVOID)hPipe);
+			hPipe = hNext;
+			continue;
+		}
 
-			ASSERT(refreshThread);
-			refreshThread->m_bAutoDelete = FALSE;
-			DWORD resumeResult = refreshThread->ResumeThread();
+		//All instances are taken, this caller is served here before the next one is awaited
+		ServeCommandPipe(hPipe, &overlapped);
+		DisconnectNamedPipe(hPipe);
+	}
 
-			VDU_SESSION_UNLOCK;
+	return EXIT_SUCCESS;
+}
 
-			//We wait for our refreshing thread to finish
-			if (resumeResult != 0xFFFFFFFF) //Should not happen, but dont get stuck
-				WaitForSingleObject(refreshThread->m_hThread, INFINITE);
+UINT VDUClient::ThreadProcCommandCaller(LPVOID pipehandle)
+{
+	HANDLE hPipe = (HANDLE)pipehandle;
+	OVERLAPPED overlapped = { 0 };
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-			DWORD exitCode = 0;
-			GetExitCodeThread(refreshThread->m_hThread, &exitCode);
+	ServeCommandPipe(hPipe, &overlapped);
 
-			//With m_bAutoDelete we are responsibile for deleting the thread
-			delete refreshThread;
+	DisconnectNamedPipe(hPipe);
+	CloseHandle(hPipe);
+	CloseHandle(overlapped.hEvent);
+	return EXIT_SUCCESS;
+}
 
-			if (exitCode == 2) //Failed to refresh due to connection, we wait for a bit
-			{
-				Sleep(4000);
-			}
-		}
-		else //Sleep until its time to check again
+UINT VDUClient::ThreadProcFilesystemService(LPVOID service)
+{
+	CVDUFileSystemService* svc = (CVDUFileSystemService*) service;
+	ASSERT(svc);
+	//Run the service here forever
+	return svc->Run();
+}
+
+UINT VDUClient::ThreadProcFileEvents(LPVOID)
+{
+	//Sequence 0 asks for the current version of every file, so changes made before listening are not missed
+	CString sequence = _T("0");
+	while (TRUE)
+	{
+		//Nothing to listen for until somebody logs in and accesses a file
+		if (!APP->GetSession()->IsLoggedIn() || APP->GetFileSystemService()->GetVDUFileCount() == 0)
 		{
-			VDU_SESSION_UNLOCK;
-			Sleep(1000);
+			sequence = _T("0");
+			WaitForSingleObject(APP->m_fileEventsWake, INFINITE);
 			continue;
 		}
+
+		//Servers without notifications are left to the periodic checks
+		if (!APP->GetFileSystemService()->WaitVDUFileEvents(sequence))
+			Sleep(FILE_EVENTS_RETRY_DELAY);
 	}
 
 	return EXIT_SUCCESS;
@@ -17,33 +17,44 @@
 #endif
 
 #include "resource.h"		// main symbols
+#include <vector>
 
 #define PROJNAME _T("VDU")
 #define URL_PROTOCOL _T("vdu")
 #define SECTION_SETTINGS _T("Settings")
 #define TITLENAME _T("VDU Client")
-#define S_MAILSLOT _T("\\\\.\\mailslot\\VDUClientMailSlot")
+#define S_COMMAND_PIPE _T("\\\\.\\pipe\\VDUClientCommands")
+#define COMMAND_PIPE_BUFFER 0x1000 //Pipe buffer size in bytes, longer messages are read in parts
+#define COMMAND_PIPE_INSTANCES 4 //Most other instances served at the same time
+#define COMMAND_PIPE_TIMEOUT 30000 //Time in ms an instance has to send its commands or read its results before it is dropped
+#define COMMAND_PIPE_WAIT 60000 //Longest time in ms an instance waits for the pipe to be free
 
 //VDUClient CWinApp 
 #define APP ((VDUClient*)AfxGetApp())
 //Main window of program
 #define WND ((CVDUClientDlg*)APP->GetMainWnd())
 
-//Locks the session to be used by current thread, use UNLOCK when done
-#define VDU_SESSION_LOCK CVDUSession* session = APP->GetSession();AcquireSRWLockExclusive(&session->m_lock)
-//Unlocks session for other threads to use, do not forget this
-#define VDU_SESSION_UNLOCK ReleaseSRWLockExclusive(&APP->GetSession()->m_lock)
-//Block current thread until pWinThread exits, output the error code and delete the thread
-//pWinThread MUST be flagged CREATE_SUSPENDED
-#define WAIT_THREAD_EXITCODE(pWinThread, out_exitCode) ASSERT(pWinThread);pWinThread->m_bAutoDelete = FALSE; \
-DWORD resumeResult = pWinThread->ResumeThread();if (resumeResult != 0xFFFFFFFF) WaitForSingleObject(pWinThread->m_hThread, INFINITE); \
-GetExitCodeThread(pWinThread->m_hThread, &out_exitCode);delete pWinThread;
+
+#define COMMAND_NONE ((size_t)-1) //Index of no command
 
 //Assert that there are enough parameters
 #define CMDLINE_ASSERT_ARGC(argc, i) if (i + 1 >= argc) {ASSERT(FALSE); if (APP->IsTestMode()) ExitProcess(2);}
 
+//Action of a command line, actions on different files run at the same time
+struct VDUCommand
+{
+	CString action; //Action, e.g. -accessfile
+	std::vector<CString> args; //Arguments of the action, all tokens of a batched access
+	std::vector<CString> tokens; //Files the action works on, actions without any run alone, e.g. -user
+	std::vector<size_t> after; //Indices of actions that have to be done before this one starts
+	CString results; //Result lines of the action
+};
+
 class CVDUFileSystemService;
 class CVDUSession;
+class CVDUConnectionPool;
+class CVDUWorkerPool;
+class CVDUScheduler;
 
 // VDUClient:
 // See VDUClient.cpp for the implementation of this class
@@ -52,21 +63,34 @@ class VDUClient : public CWinApp
 {
 private:
 	CVDUSession* m_session; //Client session
-	CWinThread* m_srefThread; //Session refresh thread
+	CVDUConnectionPool* m_conPool; //Keep-alive connections shared by all requests
+	CVDUWorkerPool* m_workers; //Executes all server requests
+	CVDUScheduler* m_scheduler; //Timers of all periodic and delayed work
 	CWinThread* m_svcThread; //File system thread
 	CVDUFileSystemService* m_svc; //File system pointer, running on m_svcThread
 	BOOL m_testMode; //Is APP in test mode
 	BOOL m_insecure; //Whether or not to validate SSL certificates
+	LARGE_INTEGER m_phaseStart; //Start of the current startup phase
+	CString m_startupTimings; //Durations of finished startup phases in ms, e.g. "init=3.1 mount=48.0"
+	HANDLE m_fileEventsWake; //Auto reset event, set on login and when a file is added, wakes the idle file events listener
 public:
 	VDUClient();
 	~VDUClient() override;
 
-	//Only use when you have exclusive access to the session by locking
-	//Otherwise you risk out-of-date information
+	//Session accessors are thread-safe, each value is read atomically
 	CVDUSession* GetSession();
 
-	//Refreshes session auth token when its about to expire
-	CWinThread* GetSessionRefreshingThread();
+	//Returns pool of keep-alive server connections
+	CVDUConnectionPool* GetConnectionPool();
+
+	//Returns worker pool executing server requests
+	CVDUWorkerPool* GetWorkerPool();
+
+	//Returns scheduler running timers, e.g. auth token refresh and file expiry checks
+	CVDUScheduler* GetScheduler();
+
+	//Wakes the file events listener waiting for a login or a file to listen for
+	void WakeFileEvents();
 
 	//Handles the filesystem service
 	CWinThread* GetFileSystemServiceThread();
@@ -80,7 +104,38 @@ public:
 	//Allows operations with the filesystem service
 	CVDUFileSystemService* GetFileSystemService();
 
-	void HandleCommands(LPCWSTR cmdline, BOOL async);
+	//Ends the current startup phase under name and starts the next one
+	//Phases run one after another, also across the file system service thread
+	void EndStartupPhase(LPCTSTR name);
+
+	//Runs actions of cmdline, appends a line per action to results if given: exit code, action and its argument separated by tabs
+	//Actions on different files run at the same time on workers, actions on the same file keep their order
+	//Session actions and waits run alone, after all actions before them and before all after them
+	void HandleCommands(LPCWSTR cmdline, BOOL async, CString* results = nullptr);
+
+	//Runs a single action, appends its result lines to it
+	void RunCommand(VDUCommand& command, BOOL async);
+
+	//Sends cmdline to the running instance and waits for its results
+	//Returns exit code of the first failed action, EXIT_SUCCESS if all succeeded
+	static INT SendCommands(LPCWSTR cmdline);
+
+	//Creates an instance of the command pipe, first fails if another process already has the pipe
+	static HANDLE CreateCommandPipe(BOOL first);
+
+	//Runs command lines of a connected instance and answers each with its results, until it disconnects or times out
+	static void ServeCommandPipe(HANDLE pipe, OVERLAPPED* overlapped);
+
+	//Reads a whole message from pipe, of any length, overlapped may be nullptr for blocking handles
+	//Overlapped reads fail after COMMAND_PIPE_TIMEOUT
+	static BOOL ReadCommandMessage(HANDLE pipe, OVERLAPPED* overlapped, CString& message);
+
+	//Writes message to pipe as a single message, overlapped may be nullptr for blocking handles
+	//Overlapped writes fail after COMMAND_PIPE_TIMEOUT
+	static BOOL WriteCommandMessage(HANDLE pipe, OVERLAPPED* overlapped, const CString& message);
+
+	//Finishes a pending overlapped operation on pipe, cancels it after COMMAND_PIPE_TIMEOUT
+	static BOOL WaitCommandPipe(HANDLE pipe, OVERLAPPED* overlapped, DWORD& transferred);
 
 //Overrides
 
@@ -94,10 +149,13 @@ public:
 
 	//Runs the file system service and the underlying file system
 	static UINT ThreadProcFilesystemService(LPVOID service);
-	//Refreshes user session
-	static UINT ThreadProcLoginRefresh(LPVOID);
-	//Reads commands from mail slot, and executes them
-	static UINT ThreadProcMailslot(LPVOID slothandle);
+	//Waits for the server to announce changes of accessed files, fetches new versions of unedited ones
+	static UINT ThreadProcFileEvents(LPVOID);
+	//Runs commands of this instance, then waits for other instances on the command pipe
+	//Each connected instance is served on its own thread while the next one is awaited on a new pipe instance
+	static UINT ThreadProcCommandPipe(LPVOID pipehandle);
+	//Runs commands of the instance connected to the pipe and answers with the results, then closes the pipe instance
+	static UINT ThreadProcCommandCaller(LPVOID pipehandle);
 
 //Implementation
 	DECLARE_MESSAGE_MAP()
@@ -15,6 +15,7 @@
 #include "VDUClient.h"
 #include "VDUClientDlg.h"
 #include "afxdialogex.h"
+#include "VDUWorkerPool.h"
 
 #define ID_SYSTEMTRAY 0x1000
 #define WM_TRAYICON_EVENT (WM_APP + 1)
@@ -184,9 +185,7 @@ BOOL CVDUClientDlg::OnInitDialog()
 		GetDlgItem(IDC_STATIC_DRIVELETTER)->EnableWindow(TRUE);
 	}
 
-	VDU_SESSION_LOCK;
-	session->Reset(m_server);
-	VDU_SESSION_UNLOCK;
+	APP->GetSession()->Reset(m_server);
 
 	//Handle autologin
 	if (APP->GetProfileInt(SECTION_SETTINGS, _T("AutoLogin"), FALSE))
@@ -520,19 +519,16 @@ void CVDUClientDlg::OnEnChangeServerAddress()
 		GetDlgItem(IDC_BUTTON_LOGIN)->EnableWindow(FALSE);
 	}
 
-	VDU_SESSION_LOCK;
-	session->Reset(m_server);
-	VDU_SESSION_UNLOCK;
+	APP->GetSession()->Reset(m_server);
 }
 
 void CVDUClientDlg::TryPing()
 {
-	AfxBeginThread(CVDUConnection::ThreadProc, (LPVOID)new CVDUConnection(m_server, VDUAPIType::GET_PING, CVDUSession::CallbackPing));
+	APP->GetWorkerPool()->Submit(new CVDUConnection(m_server, VDUAPIType::GET_PING, CVDUSession::CallbackPing));
 }
 
 void CVDUClientDlg::OnBnClickedButtonLogin()
 {
-	//VDU_SESSION_LOCK;
 	CVDUSession* session = APP->GetSession();
 
 	if (!session->IsLoggedIn()) //Loggin in 
@@ -547,8 +543,6 @@ void CVDUClientDlg::OnBnClickedButtonLogin()
 		session->Logout();
 	}
 
-	//VDU_SESSION_UNLOCK;
-
 	((CEdit*)GetDlgItem(IDC_SERVER_ADDRESS))->SetSel(-1, FALSE);
 	((CEdit*)GetDlgItem(IDC_USERNAME))->SetSel(-1, FALSE);
 	GetDlgItem(IDC_BUTTON_LOGIN)->EnableWindow(FALSE);
@@ -654,7 +648,6 @@ void CVDUClientDlg::OnBnClickedAccessFile()
 		return;
 	}
 
-	//VDU_SESSION_LOCK not needed? Access token is filled in last anyway..
 	CVDUSession* session = APP->GetSession();
 	ASSERT(session);
 
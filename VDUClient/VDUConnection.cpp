@@ -12,212 +12,429 @@
 #include "pch.h"
 #include "framework.h"
 #include "VDUConnection.h"
+#include "VDUConnectionPool.h"
 #include "VDUClient.h"
 #include "VDUClientDlg.h"
 #include "afxdialogex.h"
 
-//initialize error buffer
-TCHAR CVDUConnection::LastError[0x400] = { 0 };
+//initialize error buffer of each thread
+thread_local TCHAR CVDUConnection::LastError[0x400] = { 0 };
+thread_local DWORD CVDUConnection::LastErrorCode = 0;
 
-INT CVDUConnection::Process()
+BOOL CVDUConnection::ResolveRequest(CString& httpVerb, CString& httpObjectPath)
 {
-	CInternetSession inetsession(_T("VDUClient 1.0, Windows"));
-	int httpVerb;
 	TCHAR* apiPath = NULL;
+	TCHAR* apiSuffix = NULL;
 
 	switch (m_type)
 	{
 	case VDUAPIType::GET_PING:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_GET;
+		httpVerb = _T("GET");
 		apiPath = _T("/ping");
 		break;
 	}
 	case VDUAPIType::POST_AUTH_KEY:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_POST;
+		httpVerb = _T("POST");
 		apiPath = _T("/auth/key");
 		break;
 	}
 	case VDUAPIType::GET_AUTH_KEY:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_GET;
+		httpVerb = _T("GET");
 		apiPath = _T("/auth/key");
 		break;
 	}
 	case VDUAPIType::DELETE_AUTH_KEY:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_DELETE;
+		httpVerb = _T("DELETE");
 		apiPath = _T("/auth/key");
 		break;
 	}
 	case VDUAPIType::GET_FILE:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_GET;
+		httpVerb = _T("GET");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::HEAD_FILE:
+	{
+		httpVerb = _T("HEAD");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::POST_FILE_TOUCH:
+	{
+		httpVerb = _T("POST");
 		apiPath = _T("/file/");
+		apiSuffix = _T("/touch");
+		break;
+	}
+	case VDUAPIType::POST_FILES:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/files");
 		break;
 	}
 	case VDUAPIType::POST_FILE:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_POST;
+		httpVerb = _T("POST");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::POST_FILE_DELTA:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/file/");
+		apiSuffix = _T("/delta");
+		break;
+	}
+	case VDUAPIType::POST_EVENTS:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/events");
+		break;
+	}
+	case VDUAPIType::POST_FILES_UPLOAD:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/files/upload");
+		break;
+	}
+	case VDUAPIType::POST_UPLOAD:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/file/");
+		apiSuffix = _T("/uploads");
+		break;
+	}
+	case VDUAPIType::PUT_UPLOAD_PART:
+	{
+		httpVerb = _T("PUT");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::GET_UPLOAD:
+	{
+		httpVerb = _T("GET");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::POST_UPLOAD_COMMIT:
+	{
+		httpVerb = _T("POST");
+		apiPath = _T("/file/");
+		apiSuffix = _T("/commit");
+		break;
+	}
+	case VDUAPIType::DELETE_UPLOAD:
+	{
+		httpVerb = _T("DELETE");
+		apiPath = _T("/file/");
+		break;
+	}
+	case VDUAPIType::PATCH_FILE:
+	{
+		//Not among the verbs of CHttpConnection, requests are opened by verb name
+		httpVerb = _T("PATCH");
 		apiPath = _T("/file/");
 		break;
 	}
 	case VDUAPIType::DELETE_FILE:
 	{
-		httpVerb = CHttpConnection::HTTP_VERB_DELETE;
+		httpVerb = _T("DELETE");
 		apiPath = _T("/file/");
 		break;
 	}
 	default:
-		WND->MessageBox(_T("Invalid VDUAPI Type"), TITLENAME, MB_ICONWARNING);
-		return EXIT_FAILURE;
+		return FALSE;
 	}
 
-	CString httpObjectPath;
-	httpObjectPath += apiPath;
+	httpObjectPath = apiPath;
 	httpObjectPath += m_parameter;
+	if (apiSuffix)
+		httpObjectPath += apiSuffix;
+	return TRUE;
+}
+
+CHttpFile* CVDUConnection::Open()
+{
+	Close();
 
-	CString serverURL, httpObj;
+	CString httpVerb;
+	CString httpObjectPath;
+	if (!ResolveRequest(httpVerb, httpObjectPath))
+	{
+		StringCchCopy(LastError, ARRAYSIZE(LastError), _T("Invalid VDUAPI Type"));
+		return nullptr;
+	}
+
+	CString httpObj;
 	DWORD service;
-	INTERNET_PORT port = INTERNET_DEFAULT_HTTPS_PORT;
+	m_port = INTERNET_DEFAULT_HTTPS_PORT;
 
 	//Implicit https if only ip is input
 	if (m_serverURL.Find(_T("://")) == -1)
 		m_serverURL = _T("https://") + m_serverURL;
 
-	AfxParseURL(m_serverURL, service, serverURL, httpObj, port);
+	AfxParseURL(m_serverURL, service, m_server, httpObj, m_port);
 
-	//Lock the session if this connection has a callback, it will then be responsibile for unlocking
-	if (m_callback != nullptr)
-	{
-		VDU_SESSION_LOCK;
-	}
+	//Keep-alive lets the pool reuse the socket for following requests
+	DWORD flags = INTERNET_FLAG_SECURE | INTERNET_FLAG_RELOAD | INTERNET_FLAG_DONT_CACHE | INTERNET_FLAG_KEEP_CONNECTION;
 
-	INT result = EXIT_SUCCESS;
-	CHttpConnection* con = NULL;
-	CHttpFile* pFile = NULL;
+	//Insecure mode does not validate certificates
+	if (APP->IsInsecure())
+		flags |= INTERNET_FLAG_IGNORE_CERT_CN_INVALID | INTERNET_FLAG_IGNORE_CERT_DATE_INVALID;
+
+	m_reusable = TRUE;
 	TRY
 	{
-		con = inetsession.GetHttpConnection(serverURL, port, NULL, NULL);
+		//Waiting for events must not take a connection from requests, the wait lasts until the server has news
+		m_con = APP->GetConnectionPool()->Acquire(m_server, m_port, flags, m_type == VDUAPIType::POST_EVENTS);
+
+		m_file = m_con->OpenRequest(httpVerb, httpObjectPath, NULL, 1, NULL, NULL, flags);
+
+		//Downloads accept compressed bodies, WinInet inflates them transparently while reading
+		if (m_type == VDUAPIType::GET_FILE)
+			m_file->SetOption(INTERNET_OPTION_HTTP_DECODING, (DWORD)TRUE);
 
-		//Insecure mode does not validate certificates
 		if (APP->IsInsecure())
 		{
-			pFile = con->OpenRequest(httpVerb, httpObjectPath, NULL, 1, NULL, NULL,
-				INTERNET_FLAG_SECURE | INTERNET_FLAG_RELOAD | INTERNET_FLAG_DONT_CACHE
-				| INTERNET_FLAG_IGNORE_CERT_CN_INVALID | INTERNET_FLAG_IGNORE_CERT_DATE_INVALID);
 			DWORD opt;
-			pFile->QueryOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
+			m_file->QueryOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
 			opt |= SECURITY_SET_MASK;
-			pFile->SetOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
+			m_file->SetOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
 		}
-		else
+
+		//Auth token is read once, atomically, right before the request is sent
+		//The session is not locked for the rest of the exchange
+		CString headers = m_requestHeaders;
+		if (m_type == VDUAPIType::GET_FILE)
+			headers += _T("Accept-Encoding: gzip\r\n");
+		if (m_expectContinue && !m_contentFile.IsEmpty())
+			headers += _T("Expect: 100-continue\r\n");
+
+		//Changes made by this client are not announced back to it
+		CString clientId = APP->GetSession()->GetClientId();
+		if (!clientId.IsEmpty())
 		{
-			pFile = con->OpenRequest(httpVerb, httpObjectPath, NULL, 1, NULL, NULL,
-				INTERNET_FLAG_SECURE | INTERNET_FLAG_RELOAD | INTERNET_FLAG_DONT_CACHE);
+			headers += CLIENT_ID_HEADER;
+			headers += _T(": ");
+			headers += clientId;
+			headers += _T("\r\n");
 		}
 
-		//For every other API, transactions need to be done one after the other
-		//And for that reason, auth token is filled in last, in order to be sure its up to date
-		if (m_type != VDUAPIType::GET_PING && !APP->GetSession()->GetAuthToken().IsEmpty())
+		CString authToken = APP->GetSession()->GetAuthToken();
+		if (m_type != VDUAPIType::GET_PING && !authToken.IsEmpty())
 		{
-			CString headers;
 			headers += APIKEY_HEADER;
 			headers += _T(": ");
-			headers += APP->GetSession()->GetAuthToken();
+			headers += authToken;
 			headers += _T("\r\n");
-			m_requestHeaders += headers;
 		}
 
-		if (!m_requestHeaders.IsEmpty())
-			pFile->AddRequestHeaders(m_requestHeaders);
+		if (!headers.IsEmpty())
+			m_file->AddRequestHeaders(headers);
 	
-		if (m_contentFile.IsEmpty())
-		{
-			pFile->SendRequest();
-		}
+		if (!m_contentData.IsEmpty())
+			m_file->SendRequest(NULL, 0, (LPVOID)m_contentData.GetString(), (DWORD)m_contentData.GetLength());
+		else if (m_contentFile.IsEmpty())
+			m_file->SendRequest();
 		else
-		{
-			CStdioFile stdf(m_contentFile, CFile::modeRead | CFile::typeBinary | CFile::shareDenyNone);
-			CFileStatus fst;
-			stdf.GetStatus(fst);
-			ULONGLONG writeLen = fst.m_size;
+			SendContent();
 
-			pFile->SendRequestEx((DWORD)writeLen);
-
-			BYTE buf[0x400];
-			UINT readLen;
-			while ((readLen = stdf.Read(buf, ARRAYSIZE(buf))) > 0)
-			{
-				pFile->Write(buf, readLen);
-			}
-			stdf.Close();
-			pFile->EndRequest();
-		}
+		//Server renews keys close to expiry with any response, which spares the refresh request
+		if (m_file && m_type != VDUAPIType::GET_AUTH_KEY && m_type != VDUAPIType::POST_AUTH_KEY && m_type != VDUAPIType::DELETE_AUTH_KEY &&
+			APP->GetSession()->AdoptRenewedAuthData(m_file, authToken) && !APP->IsTestMode())
+			WND->UpdateStatus();
 
 	}
 	CATCH(CException, e)
 	{
 		e->GetErrorMessage(LastError, ARRAYSIZE(LastError));
+		LastErrorCode = e->IsKindOf(RUNTIME_CLASS(CInternetException)) ? ((CInternetException*)e)->m_dwError : 0;
+
+		//Do not reuse a connection that has failed
+		m_reusable = FALSE;
+		Close();
+	}
+	END_CATCH
+
+	return m_file;
+}
+
+void CVDUConnection::SendContent()
+{
+	HANDLE hFile = CreateFile(m_contentFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		LONG err = (LONG)GetLastError();
+		AfxThrowFileException(CFileException::OsErrorToException(err), err, m_contentFile);
+	}
+
+	//Closed however the request ends, sending throws when the server is not reachable
+	CHandle file(hFile);
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		LONG err = (LONG)GetLastError();
+		AfxThrowFileException(CFileException::OsErrorToException(err), err, m_contentFile);
+	}
+	ULONGLONG first = min(m_contentOffset, (ULONGLONG)fileSize.QuadPart);
+	ULONGLONG total = min(m_contentLength, (ULONGLONG)fileSize.QuadPart - first);
+
+	//NOTE: WinInet takes the body length as DWORD, single request bodies are limited to 4 GB
+	//Larger files are sent as parts of a chunked upload
+	m_file->SendRequestEx((DWORD)total);
 
-		if (pFile)
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	//Body is written straight from the page cache, no intermediate copy into a read buffer
+	ULONGLONG offset = 0;
+	DWORD chunk = UPLOAD_CHUNK_MIN;
+	BOOL refused = FALSE;
+	while (offset < total && !refused)
+	{
+		//Views start at a multiple of allocation granularity, content range may start anywhere
+		ULONGLONG position = first + offset;
+		ULONGLONG viewStart = position & ~(ULONGLONG)(UPLOAD_CHUNK_MIN - 1);
+		DWORD skip = (DWORD)(position - viewStart);
+		DWORD len = (DWORD)min((ULONGLONG)chunk, total - offset);
+
+		//Only the chunk being written is mapped, applications cannot truncate a file while a mapping of it exists
+		//Saving over the file is blocked for one chunk at most, not for the whole upload
+		ULONGLONG mapEnd = viewStart + skip + len;
+		CHandle map(CreateFileMapping(hFile, NULL, PAGE_READONLY, (DWORD)(mapEnd >> 32), (DWORD)mapEnd, NULL));
+		LPVOID view = map ? MapViewOfFile(map, FILE_MAP_READ, (DWORD)(viewStart >> 32), (DWORD)viewStart, skip + len) : NULL;
+		if (!view)
 		{
-			pFile->Close();
-			delete pFile;
+			LONG err = (LONG)GetLastError();
+			AfxThrowFileException(CFileException::OsErrorToException(err), err, m_contentFile);
 		}
-		pFile = nullptr;
 
-		if (con)
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		TRY
 		{
-			con->Close();
-			delete con;
+			m_file->Write((BYTE*)view + skip, len);
 		}
-		con = nullptr;
+		CATCH_ALL(e)
+		{
+			//WinInet does not wait for 100 Continue, a server refusing the request closes the connection instead
+			//Its answer has arrived before, it is read below
+			if (m_expectContinue)
+				refused = TRUE;
+			else
+			{
+				UnmapViewOfFile(view);
+				THROW_LAST();
+			}
+		}
+		END_CATCH_ALL
+		QueryPerformanceCounter(&end);
+
+		UnmapViewOfFile(view);
+		offset += len;
 
-		inetsession.Close();
+		//Grow chunks while the transport keeps up, shrink them when writes stall
+		LONGLONG elapsedMs = (end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart;
+		if (elapsedMs < UPLOAD_CHUNK_GROW_MS && chunk < UPLOAD_CHUNK_MAX)
+			chunk *= 2;
+		else if (elapsedMs > UPLOAD_CHUNK_SHRINK_MS && chunk > UPLOAD_CHUNK_MIN)
+			chunk /= 2;
 	}
-	END_CATCH
 
-	//Call our callback
-	if (m_callback != nullptr)
-	{
-		result = m_callback(pFile);
+	//Connection of a refused request is not reused
+	if (refused)
+		m_reusable = FALSE;
+
+	m_file->EndRequest();
+}
 
-		VDU_SESSION_UNLOCK;
+void CVDUConnection::Close()
+{
+	if (m_file)
+	{
+		m_file->Close();
+		delete m_file;
 	}
+	m_file = nullptr;
 
-	inetsession.Close();
+	if (m_con)
+		APP->GetConnectionPool()->Release(m_con, m_server, m_port, m_reusable, m_type == VDUAPIType::POST_EVENTS);
+	m_con = nullptr;
+}
 
-	if (pFile)
+BOOL CVDUConnection::IsServerUnreachable()
+{
+	switch (LastErrorCode)
 	{
-		pFile->Close();
-		delete pFile;
+	case ERROR_INTERNET_CANNOT_CONNECT:
+	case ERROR_INTERNET_TIMEOUT:
+	case ERROR_INTERNET_CONNECTION_RESET:
+	case ERROR_INTERNET_CONNECTION_ABORTED:
+	case ERROR_INTERNET_NAME_NOT_RESOLVED:
+		return TRUE;
+	default:
+		return FALSE;
 	}
-	if (con)
+}
+
+INT CVDUConnection::Process()
+{
+	CString httpVerb;
+	CString httpObjectPath;
+	if (!ResolveRequest(httpVerb, httpObjectPath))
 	{
-		con->Close();
-		delete con;
+		WND->MessageBox(_T("Invalid VDUAPI Type"), TITLENAME, MB_ICONWARNING);
+		return EXIT_FAILURE;
 	}
 
+	INT result = EXIT_SUCCESS;
+	CHttpFile* pFile = Open();
+
+	//Call our callback
+	if (m_callback != nullptr)
+		result = m_callback(pFile);
+
+	Close();
+
 	return result;
 }
 
 CVDUConnection::CVDUConnection(CString serverURL, VDUAPIType type, VDU_CONNECTION_CALLBACK callback, CString requestHeaders, CString parameter, CString fileContentPath) :
-	m_serverURL(serverURL), m_parameter(parameter), m_type(type), m_requestHeaders(requestHeaders), m_contentFile(fileContentPath), m_callback(callback)
+	m_serverURL(serverURL), m_parameter(parameter), m_type(type), m_requestHeaders(requestHeaders), m_contentFile(fileContentPath), m_callback(callback),
+	m_contentOffset(0), m_contentLength(ULLONG_MAX), m_expectContinue(FALSE),
+	m_port(INTERNET_DEFAULT_HTTPS_PORT), m_con(nullptr), m_file(nullptr), m_reusable(TRUE)
 {
 }
 
-UINT CVDUConnection::ThreadProc(LPVOID pCon)
+CVDUConnection::~CVDUConnection()
 {
-	//NOTE: For destructor to be called, connection has to be properly casted
-	if (CVDUConnection* con = (CVDUConnection*)pCon)
-	{
-		INT returnCode = con->Process();
-		delete con;
-		return returnCode;
-	}
-	else
-		WND->MessageBoxNB(_T("Connection::ThreadProc: connection was null"), TITLENAME, MB_ICONERROR);
-	return EXIT_SUCCESS;
+	Close();
+}
+
+void CVDUConnection::SetContentRange(ULONGLONG offset, ULONGLONG length)
+{
+	m_contentOffset = offset;
+	m_contentLength = length;
+}
+
+void CVDUConnection::SetContentData(CStringA data)
+{
+	m_contentData = data;
+}
+
+void CVDUConnection::SetExpectContinue(BOOL expect)
+{
+	m_expectContinue = expect;
+}
+
+VDUAPIType CVDUConnection::GetType()
+{
+	return m_type;
 }
\ No newline at end of file
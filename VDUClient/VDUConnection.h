@@ -13,6 +13,11 @@
 
 #include <afxinet.h>
 
+#define UPLOAD_CHUNK_MIN 0x10000 //Smallest upload chunk, 64 KB, multiple of allocation granularity for mapped views
+#define UPLOAD_CHUNK_MAX 0x400000 //Largest upload chunk, 4 MB
+#define UPLOAD_CHUNK_GROW_MS 50 //Chunk doubles when it was written faster than this
+#define UPLOAD_CHUNK_SHRINK_MS 1000 //Chunk halves when it was written slower than this
+
 //Declares valid VDU api types
 enum class VDUAPIType
 {
@@ -21,12 +26,24 @@ enum class VDUAPIType
 	POST_AUTH_KEY, //Get auth key for the first time
 	DELETE_AUTH_KEY, //Invalidate auth key
 	GET_FILE, //Download file
+	HEAD_FILE, //Query file metadata without its content
+	POST_FILE_TOUCH, //Extend file token without sending or checking content
+	POST_FILES, //Download several files in one response
 	POST_FILE, //Upload file
+	POST_FILE_DELTA, //Upload changed blocks of file
+	POST_FILES_UPLOAD, //Upload several small files in one request
+	POST_EVENTS, //Wait for changes of accessed files on the server
+	POST_UPLOAD, //Start chunked upload of file
+	PUT_UPLOAD_PART, //Upload part of chunked upload
+	GET_UPLOAD, //Query received parts of chunked upload
+	POST_UPLOAD_COMMIT, //Finish chunked upload
+	DELETE_UPLOAD, //Abandon chunked upload
+	PATCH_FILE, //Change file metadata, e.g. rename it, without sending its content
 	DELETE_FILE, //Invalidate file token
 };
 
 //Connection callback with HTTP response as a parameter
-//Has guaranteed exclusive access to VDU session
+//Runs concurrently with other requests, session is not locked during the callback
 //Is executed on calling thread
 //Return value will be thread exit code
 typedef INT (*VDU_CONNECTION_CALLBACK)(CHttpFile* httpResponse);
@@ -40,21 +57,63 @@ protected:
 	CString m_parameter; //Http path parameter
 	CString m_requestHeaders; //HTTP Request headers
 	CString m_contentFile; //File path of HTTP content
+	ULONGLONG m_contentOffset; //Offset of HTTP content in content file
+	ULONGLONG m_contentLength; //Length of HTTP content, ULLONG_MAX for the rest of content file
+	CStringA m_contentData; //HTTP content held in memory, used instead of content file if set
+	BOOL m_expectContinue; //Whether the server is asked to accept the request before its content is sent
 	VDU_CONNECTION_CALLBACK m_callback; //Function to call after http file is received
+	CString m_server; //Server host name parsed from URL
+	INTERNET_PORT m_port; //Server port parsed from URL
+	CHttpConnection* m_con; //Pooled connection, valid between Open() and Close()
+	CHttpFile* m_file; //HTTP response, valid between Open() and Close()
+	BOOL m_reusable; //Whether the pooled connection can be reused after Close()
+
+	//Translates API type into HTTP verb and object path, returns FALSE for invalid types
+	BOOL ResolveRequest(CString& httpVerb, CString& httpObjectPath);
+
+	//Sends the request with content file as body, streamed in adaptive chunks each mapped only while it is written
+	//Throws CException on failure
+	void SendContent();
 public:
 	//Sets up the connection - construction does NOT initiate the connection, call Process()
 	//content is copied if set
 	CVDUConnection(CString serverURL, VDUAPIType type, VDU_CONNECTION_CALLBACK callback = nullptr,
 		CString requestHeaders = _T(""), CString parameter = _T(""), CString fileContentPath = _T(""));
+	~CVDUConnection();
 
 	//Processes the connection and halts executing thread until done
 	//Should NOT be run in main thread
 	//Returns callback result or SUCCESS
 	INT Process();
 
-	//Starting thread procedure for new threads, expects connection created by 'new'
-	static UINT ThreadProc(LPVOID pCon);
+	//Sends the request over a pooled connection and halts executing thread until response headers arrive
+	//Returns the HTTP response or nullptr on failure, in which case LastError is set
+	//The response stays valid until Close() or destruction
+	CHttpFile* Open();
+
+	//Closes the response and returns the connection into the pool
+	void Close();
+
+	//Limits HTTP content to a range of content file, e.g. a part of a chunked upload
+	void SetContentRange(ULONGLONG offset, ULONGLONG length);
+
+	//Sets HTTP content held in memory, for small request bodies
+	void SetContentData(CStringA data);
+
+	//Sends Expect: 100-continue, so the server can refuse the request before the content file is transmitted
+	void SetExpectContinue(BOOL expect);
+
+	//Returns which API is called
+	VDUAPIType GetType();
 
 	//Signifies last translated connection error to inform user
-	static TCHAR LastError[0x400];
+	//Kept per thread, requests run concurrently on workers and each reports its own error
+	static thread_local TCHAR LastError[0x400];
+
+	//WinInet or system error code of the last failed request on this thread, 0 when it failed otherwise, e.g. reading the content file
+	static thread_local DWORD LastErrorCode;
+
+	//Returns whether the last failed request on this thread did not get through to the server, e.g. it is offline
+	//Only such failures pass by waiting, others are reported
+	static BOOL IsServerUnreachable();
 };
\ No newline at end of file
@@ -0,0 +1,233 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUConnectionPool.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUConnectionPool.h"
+
+CVDUConnectionPool::CVDUConnectionPool(UINT maxConnections, DWORD idleTimeout) : m_lock(SRWLOCK_INIT), m_released(CONDITION_VARIABLE_INIT),
+	m_maxConnections(max(maxConnections, 1)), m_idleTimeout(idleTimeout)
+{
+	m_inetSession = new CInternetSession(_T("VDUClient 1.0, Windows"));
+
+	//WinInet limits connections per server on its own, keep it in line with the pool and leave room for long polls
+	m_inetSession->SetOption(INTERNET_OPTION_MAX_CONNS_PER_SERVER, (DWORD)(m_maxConnections + POOL_LONG_POLL_CONNECTIONS));
+	m_inetSession->SetOption(INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER, (DWORD)(m_maxConnections + POOL_LONG_POLL_CONNECTIONS));
+}
+
+CVDUConnectionPool::~CVDUConnectionPool()
+{
+	Clear();
+	m_inetSession->Close();
+	delete m_inetSession;
+}
+
+CString CVDUConnectionPool::ServerKey(CString server, INTERNET_PORT port)
+{
+	CString key;
+	key.Format(_T("%s:%u"), server.MakeLower().GetString(), (UINT)port);
+	return key;
+}
+
+CHttpConnection* CVDUConnectionPool::Acquire(CString server, INTERNET_PORT port, DWORD flags, BOOL longPoll)
+{
+	CString key = ServerKey(server, port);
+
+	std::vector<CHttpConnection*> expired;
+	AcquireSRWLockExclusive(&m_lock);
+	PurgeLocked(expired);
+	ReleaseSRWLockExclusive(&m_lock);
+	CloseConnections(expired);
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	//Wait for a free slot if all connections to this server are in use
+	//A request that cannot get one in time fails instead of hanging, e.g. when every holder waits for another request
+	ULONGLONG deadline = GetTickCount64() + POOL_ACQUIRE_TIMEOUT;
+	while (!longPoll && m_busy[key] >= m_maxConnections)
+	{
+		ULONGLONG now = GetTickCount64();
+		if (now >= deadline)
+		{
+			ReleaseSRWLockExclusive(&m_lock);
+			AfxThrowInternetException(0, ERROR_TIMEOUT);
+		}
+		SleepConditionVariableSRW(&m_released, &m_lock, (DWORD)(deadline - now), 0);
+	}
+
+	if (!longPoll)
+		m_busy[key]++;
+
+	//Most recently used connection is the most likely to still have a live socket
+	CHttpConnection* con = NULL;
+	ULONGLONG idleTime = 0;
+	for (auto it = m_idle.rbegin(); it != m_idle.rend(); it++)
+	{
+		if (ServerKey(it->server, it->port) == key)
+		{
+			con = it->con;
+			idleTime = GetTickCount64() - it->lastUsed;
+			m_idle.erase(std::next(it).base());
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+
+	//One idle for long is probed first, a socket the server closed meanwhile fails the probe instead of the request
+	if (con && (idleTime <= POOL_PROBE_IDLE_TIME || Probe(con, flags)))
+		return con;
+
+	//Dead connection is replaced by a new one in the same slot, other idle ones are not probed in a row
+	if (con)
+	{
+		con->Close();
+		delete con;
+		con = NULL;
+	}
+
+	TRY
+	{
+		con = m_inetSession->GetHttpConnection(server, port, NULL, NULL);
+	}
+	CATCH(CException, e)
+	{
+		//Give the slot back before passing the error on
+		AcquireSRWLockExclusive(&m_lock);
+		if (!longPoll)
+			m_busy[key]--;
+		ReleaseSRWLockExclusive(&m_lock);
+		WakeConditionVariable(&m_released);
+		THROW_LAST();
+	}
+	END_CATCH
+
+	return con;
+}
+
+void CVDUConnectionPool::Release(CHttpConnection* con, CString server, INTERNET_PORT port, BOOL reusable, BOOL longPoll)
+{
+	if (!con)
+		return;
+
+	CString key = ServerKey(server, port);
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	if (!longPoll && m_busy[key] > 0)
+		m_busy[key]--;
+
+	if (reusable && m_idleTimeout > 0)
+	{
+		IdleConnection idle;
+		idle.server = server;
+		idle.port = port;
+		idle.con = con;
+		idle.lastUsed = GetTickCount64();
+		m_idle.push_back(idle);
+		con = NULL;
+	}
+
+	std::vector<CHttpConnection*> closing;
+	PurgeLocked(closing);
+
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_released);
+
+	//Only the failed connection is dropped, a single failed request says little about the other ones to the server
+	if (con)
+		closing.push_back(con);
+
+	CloseConnections(closing);
+}
+
+void CVDUConnectionPool::PurgeLocked(std::vector<CHttpConnection*>& expired)
+{
+	ULONGLONG now = GetTickCount64();
+	for (auto it = m_idle.begin(); it != m_idle.end();)
+	{
+		if (now - it->lastUsed > m_idleTimeout)
+		{
+			expired.push_back(it->con);
+			it = m_idle.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+void CVDUConnectionPool::CloseConnections(std::vector<CHttpConnection*>& connections)
+{
+	for (auto it = connections.begin(); it != connections.end(); it++)
+	{
+		(*it)->Close();
+		delete (*it);
+	}
+	connections.clear();
+}
+
+BOOL CVDUConnectionPool::Probe(CHttpConnection* con, DWORD flags)
+{
+	BOOL alive = FALSE;
+	CHttpFile* file = NULL;
+	TRY
+	{
+		file = con->OpenRequest(_T("GET"), POOL_PROBE_PATH, NULL, 1, NULL, NULL, flags);
+
+		//Certificates are not validated for requests that do not validate them either
+		if (flags & INTERNET_FLAG_IGNORE_CERT_CN_INVALID)
+		{
+			DWORD opt;
+			file->QueryOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
+			opt |= SECURITY_SET_MASK;
+			file->SetOption(INTERNET_OPTION_SECURITY_FLAGS, opt);
+		}
+
+		//Any answer will do, the server only has to be there
+		file->SendRequest();
+		DWORD statusCode = 0;
+		alive = file->QueryInfoStatusCode(statusCode) && statusCode != 0;
+	}
+	CATCH(CException, e)
+	{
+		alive = FALSE;
+	}
+	END_CATCH
+
+	if (file)
+	{
+		file->Close();
+		delete file;
+	}
+
+	return alive;
+}
+
+void CVDUConnectionPool::Purge()
+{
+	std::vector<CHttpConnection*> expired;
+	AcquireSRWLockExclusive(&m_lock);
+	PurgeLocked(expired);
+	ReleaseSRWLockExclusive(&m_lock);
+
+	CloseConnections(expired);
+}
+
+void CVDUConnectionPool::Clear()
+{
+	std::vector<CHttpConnection*> idle;
+	AcquireSRWLockExclusive(&m_lock);
+	for (auto it = m_idle.begin(); it != m_idle.end(); it++)
+		idle.push_back(it->con);
+	m_idle.clear();
+	ReleaseSRWLockExclusive(&m_lock);
+
+	CloseConnections(idle);
+}
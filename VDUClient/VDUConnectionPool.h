@@ -0,0 +1,80 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUConnectionPool.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include <afxinet.h>
+#include <vector>
+#include <map>
+
+#define POOL_DEFAULT_MAX_CONNECTIONS 8 //Default maximum of connections to a single server
+#define POOL_DEFAULT_IDLE_TIMEOUT 30000 //Default time in ms an unused connection is kept alive
+#define POOL_ACQUIRE_TIMEOUT 60000 //Longest time in ms a request waits for a free connection before it fails
+#define POOL_LONG_POLL_CONNECTIONS 1 //Connections to a single server held by long polls, on top of the maximum
+#define POOL_PROBE_IDLE_TIME 5000 //Time in ms a connection may stay idle before it is checked on reuse, servers close keep-alive sockets after a few seconds
+#define POOL_PROBE_PATH _T("/ping") //Cheap request checking that an idle connection still gets through to the server
+
+//Keeps keep-alive HTTP connections to VDU servers, so consecutive requests do not pay for a new TCP + TLS handshake
+//All connections share one internet session, which owns the underlying WinInet socket pool
+class CVDUConnectionPool
+{
+protected:
+	//Connection that is currently not used by any request
+	struct IdleConnection
+	{
+		CString server; //Server host name
+		INTERNET_PORT port; //Server port
+		CHttpConnection* con; //Connection handle
+		ULONGLONG lastUsed; //Tick count when connection was returned to the pool
+	};
+
+	SRWLOCK m_lock; //Guards all members below
+	CONDITION_VARIABLE m_released; //Signalled when a connection is returned to the pool
+	CInternetSession* m_inetSession; //Session shared by every pooled connection
+	std::vector<IdleConnection> m_idle; //Connections ready to be reused
+	std::map<CString, UINT> m_busy; //Connections in use per server key
+	UINT m_maxConnections; //Maximum of connections to a single server
+	DWORD m_idleTimeout; //Time in ms after which an idle connection is closed
+
+	//Returns key identifying server connections
+	static CString ServerKey(CString server, INTERNET_PORT port);
+
+	//Moves idle connections over the idle timeout to expired, expects exclusive lock
+	//They are closed once the lock is released, closing may wait for the network
+	void PurgeLocked(std::vector<CHttpConnection*>& expired);
+
+	//Closes connections taken out of the pool, must not be called with the lock held
+	static void CloseConnections(std::vector<CHttpConnection*>& connections);
+
+	//Returns whether connection still gets an answer from its server, flags are those of the request it is reused for
+	//This function is BLOCKING, it must not be called with the lock held
+	static BOOL Probe(CHttpConnection* con, DWORD flags);
+public:
+	CVDUConnectionPool(UINT maxConnections = POOL_DEFAULT_MAX_CONNECTIONS, DWORD idleTimeout = POOL_DEFAULT_IDLE_TIMEOUT);
+	~CVDUConnectionPool();
+
+	//Returns an idle connection to server or opens a new one
+	//Blocks while the maximum of connections to this server is in use, at most POOL_ACQUIRE_TIMEOUT
+	//A long poll holds its connection until the server has news, it does not count against the maximum and never blocks
+	//Connections idle for longer than POOL_PROBE_IDLE_TIME are probed with request flags first, dead ones are closed
+	//May throw CInternetException when a new connection cannot be opened or no connection was freed in time
+	CHttpConnection* Acquire(CString server, INTERNET_PORT port, DWORD flags, BOOL longPoll = FALSE);
+
+	//Returns connection to the pool, a connection that failed is not reusable and is closed instead
+	//longPoll has to match the value the connection was acquired with
+	void Release(CHttpConnection* con, CString server, INTERNET_PORT port, BOOL reusable = TRUE, BOOL longPoll = FALSE);
+
+	//Closes all idle connections that were not used for longer than the idle timeout
+	void Purge();
+
+	//Closes all idle connections, e.g. when switching servers
+	void Clear();
+};
@@ -0,0 +1,386 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUDelta.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUDelta.h"
+#include <unordered_map>
+
+//Writes delta records, consecutive block copies are merged into one record
+class CVDUDeltaWriter
+{
+protected:
+	HANDLE m_hFile; //Delta file
+	UINT32 m_copyFirst; //First block of the pending copy
+	UINT32 m_copyCount; //Blocks in the pending copy
+	ULONGLONG m_written; //Bytes written
+	BOOL m_failed; //Set when a write failed
+
+	void Write(const void* data, DWORD length)
+	{
+		DWORD writeLen;
+		if (m_failed || !WriteFile(m_hFile, data, length, &writeLen, NULL) || writeLen != length)
+			m_failed = TRUE;
+		else
+			m_written += length;
+	}
+
+	void FlushCopy()
+	{
+		if (m_copyCount == 0)
+			return;
+
+		BYTE op = 'C';
+		Write(&op, sizeof(op));
+		Write(&m_copyFirst, sizeof(m_copyFirst));
+		Write(&m_copyCount, sizeof(m_copyCount));
+		m_copyCount = 0;
+	}
+public:
+	CVDUDeltaWriter(HANDLE hFile, UINT32 blockSize, ULONGLONG length) : m_hFile(hFile), m_copyFirst(0), m_copyCount(0), m_written(0), m_failed(FALSE)
+	{
+		Write("VDUD", 4);
+		Write(&blockSize, sizeof(blockSize));
+		Write(&length, sizeof(length));
+	}
+
+	void Copy(UINT32 block)
+	{
+		if (m_copyCount > 0 && m_copyFirst + m_copyCount == block)
+		{
+			m_copyCount++;
+			return;
+		}
+
+		FlushCopy();
+		m_copyFirst = block;
+		m_copyCount = 1;
+	}
+
+	void Literal(const BYTE* data, size_t length)
+	{
+		if (length == 0)
+			return;
+
+		FlushCopy();
+		BYTE op = 'L';
+		UINT32 len = (UINT32)length;
+		Write(&op, sizeof(op));
+		Write(&len, sizeof(len));
+		Write(data, len);
+	}
+
+	//Returns FALSE if any write failed
+	BOOL Finish()
+	{
+		FlushCopy();
+		return !m_failed;
+	}
+
+	ULONGLONG GetWritten()
+	{
+		return m_written;
+	}
+};
+
+CVDUSignatureBuilder::CVDUSignatureBuilder(ULONGLONG length) : m_hProv(NULL), m_failed(FALSE)
+{
+	m_signature = std::make_shared<VDUDeltaSignature>();
+	m_signature->blockSize = CVDUDelta::BlockSizeFor(length);
+	m_signature->length = 0;
+	m_signature->blocks.reserve((size_t)(length / m_signature->blockSize + 1));
+	m_block.reserve(m_signature->blockSize);
+
+	if (!CryptAcquireContext(&m_hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+	{
+		m_hProv = NULL;
+		m_failed = TRUE;
+	}
+}
+
+CVDUSignatureBuilder::~CVDUSignatureBuilder()
+{
+	if (m_hProv)
+		CryptReleaseContext(m_hProv, 0);
+}
+
+void CVDUSignatureBuilder::AddBlock(const BYTE* data, UINT32 length)
+{
+	VDUBlockSignature block;
+	block.weak = CVDUDelta::WeakChecksum(data, length);
+	if (!CVDUDelta::StrongChecksum(m_hProv, data, length, block.strong))
+		m_failed = TRUE;
+
+	m_signature->blocks.push_back(block);
+	m_signature->length += length;
+}
+
+void CVDUSignatureBuilder::Update(const BYTE* data, size_t length)
+{
+	if (m_failed)
+		return;
+
+	const UINT32 blockSize = m_signature->blockSize;
+	while (length > 0)
+	{
+		//Whole blocks are hashed in place, the rest is gathered until the block is full
+		if (m_block.empty() && length >= blockSize)
+		{
+			AddBlock(data, blockSize);
+			data += blockSize;
+			length -= blockSize;
+			continue;
+		}
+
+		size_t take = min(length, blockSize - m_block.size());
+		m_block.insert(m_block.end(), data, data + take);
+		data += take;
+		length -= take;
+
+		if (m_block.size() == blockSize)
+		{
+			AddBlock(m_block.data(), blockSize);
+			m_block.clear();
+		}
+	}
+}
+
+VDU_DELTA_SIGNATURE CVDUSignatureBuilder::Finish()
+{
+	if (!m_block.empty())
+	{
+		AddBlock(m_block.data(), (UINT32)m_block.size());
+		m_block.clear();
+	}
+
+	if (m_failed)
+		return nullptr;
+
+	return m_signature;
+}
+
+UINT32 CVDUDelta::BlockSizeFor(ULONGLONG length)
+{
+	//Power of two closest to the square root balances signature size and the data resent per change
+	UINT32 blockSize = DELTA_MIN_BLOCK_SIZE;
+	while (blockSize < DELTA_MAX_BLOCK_SIZE && (ULONGLONG)blockSize * blockSize < length)
+		blockSize <<= 1;
+	return blockSize;
+}
+
+UINT32 CVDUDelta::WeakChecksum(const BYTE* data, UINT32 length)
+{
+	//a is the sum of the bytes, b weighs every byte by its distance from the block end
+	//Both roll in constant time, see CreateDelta
+	UINT32 a = 0, b = 0;
+	for (UINT32 i = 0; i < length; i++)
+	{
+		a += data[i];
+		b += (length - i) * data[i];
+	}
+	return (a & 0xFFFF) | (b << 16);
+}
+
+BOOL CVDUDelta::StrongChecksum(HCRYPTPROV hProv, const BYTE* data, UINT32 length, BYTE* md5)
+{
+	HCRYPTHASH hHash;
+	if (!hProv || !CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash))
+		return FALSE;
+
+	DWORD cbHash = MD5_LEN;
+	BOOL result = CryptHashData(hHash, data, length, 0) && CryptGetHashParam(hHash, HP_HASHVAL, md5, &cbHash, 0);
+
+	CryptDestroyHash(hHash);
+	return result;
+}
+
+VDU_DELTA_SIGNATURE CVDUDelta::CalcSignature(CString filePath)
+{
+	HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		CloseHandle(hFile);
+		return nullptr;
+	}
+
+	CVDUSignatureBuilder builder(fileSize.QuadPart);
+	std::vector<BYTE> buf(DELTA_MAX_BLOCK_SIZE);
+	DWORD readLen;
+	BOOL bResult;
+	while ((bResult = ReadFile(hFile, buf.data(), (DWORD)buf.size(), &readLen, NULL)) && readLen > 0)
+		builder.Update(buf.data(), readLen);
+
+	CloseHandle(hFile);
+
+	if (!bResult)
+		return nullptr;
+
+	return builder.Finish();
+}
+
+BOOL CVDUDelta::CreateDelta(CString filePath, const VDUDeltaSignature& base, CString deltaPath, ULONGLONG& deltaSize)
+{
+	deltaSize = 0;
+
+	HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	HANDLE hDelta = CreateFile(deltaPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	if (hDelta == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	HCRYPTPROV hProv;
+	if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+	{
+		CloseHandle(hDelta);
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	const UINT32 blockSize = base.blockSize;
+	const size_t fullBlocks = (size_t)(base.length / blockSize);
+	const UINT32 tailLength = (UINT32)(base.length % blockSize);
+
+	//Full blocks of the previous version by weak checksum, the short last block can only match at the end
+	std::unordered_multimap<UINT32, UINT32> index;
+	index.reserve(fullBlocks);
+	for (size_t i = 0; i < fullBlocks; i++)
+		index.emplace(base.blocks[i].weak, (UINT32)i);
+
+	CVDUDeltaWriter writer(hDelta, blockSize, fileSize.QuadPart);
+	std::vector<BYTE> buf(DELTA_WINDOW_SIZE + blockSize);
+	size_t end = 0; //End of valid data in buffer
+	size_t pos = 0; //Start of the block being matched
+	size_t literalStart = 0; //Start of data not matched by any block
+	BOOL eof = FALSE;
+	BOOL recompute = TRUE;
+	BOOL bResult = TRUE;
+	UINT32 a = 0, b = 0;
+
+	while (bResult)
+	{
+		//Refill the window once less than a block remains, unmatched data is written out first
+		if (end - pos < blockSize && !eof)
+		{
+			writer.Literal(&buf[literalStart], pos - literalStart);
+			memmove(buf.data(), &buf[pos], end - pos);
+			end -= pos;
+			pos = 0;
+			literalStart = 0;
+			recompute = TRUE;
+
+			DWORD readLen;
+			if (!(bResult = ReadFile(hFile, &buf[end], (DWORD)(buf.size() - end), &readLen, NULL)))
+				break;
+			if (readLen == 0)
+				eof = TRUE;
+			end += readLen;
+			continue;
+		}
+
+		if (end - pos < blockSize)
+			break;
+
+		if (recompute)
+		{
+			a = b = 0;
+			for (UINT32 i = 0; i < blockSize; i++)
+			{
+				a += buf[pos + i];
+				b += (blockSize - i) * buf[pos + i];
+			}
+			recompute = FALSE;
+		}
+
+		UINT32 weak = (a & 0xFFFF) | (b << 16);
+		auto candidates = index.equal_range(weak);
+		if (candidates.first != candidates.second)
+		{
+			BYTE strong[MD5_LEN];
+			if (!(bResult = StrongChecksum(hProv, &buf[pos], blockSize, strong)))
+				break;
+
+			auto match = candidates.second;
+			for (auto it = candidates.first; it != candidates.second; it++)
+			{
+				if (memcmp(base.blocks[it->second].strong, strong, MD5_LEN) == 0)
+				{
+					match = it;
+					break;
+				}
+			}
+
+			if (match != candidates.second)
+			{
+				writer.Literal(&buf[literalStart], pos - literalStart);
+				writer.Copy(match->second);
+				pos += blockSize;
+				literalStart = pos;
+				recompute = TRUE;
+				continue;
+			}
+		}
+
+		//No match, roll the checksum by one byte
+		if (pos + blockSize < end)
+		{
+			BYTE out = buf[pos];
+			BYTE in = buf[pos + blockSize];
+			a = a - out + in;
+			b = b - blockSize * out + a;
+		}
+		else
+			recompute = TRUE;
+		pos++;
+	}
+
+	if (bResult)
+	{
+		//Unchanged end of the file matches the short last block
+		BYTE strong[MD5_LEN];
+		if (tailLength > 0 && end - pos == tailLength && StrongChecksum(hProv, &buf[pos], tailLength, strong) &&
+			memcmp(base.blocks[fullBlocks].strong, strong, MD5_LEN) == 0)
+		{
+			writer.Literal(&buf[literalStart], pos - literalStart);
+			writer.Copy((UINT32)fullBlocks);
+		}
+		else
+			writer.Literal(&buf[literalStart], end - literalStart);
+
+		bResult = writer.Finish();
+	}
+
+	deltaSize = writer.GetWritten();
+
+	CryptReleaseContext(hProv, 0);
+	CloseHandle(hDelta);
+	CloseHandle(hFile);
+
+	if (!bResult)
+		DeleteFile(deltaPath);
+
+	return bResult;
+}
@@ -0,0 +1,89 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUDelta.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <Wincrypt.h>
+#include "VDUFile.h"
+
+#define DELTA_MIN_FILE_SIZE 0x100000 //Files smaller than 1 MB are always uploaded whole
+#define DELTA_MIN_BLOCK_SIZE 0x800 //Smallest block, 2 KB
+#define DELTA_MAX_BLOCK_SIZE 0x10000 //Largest block, 64 KB
+#define DELTA_WINDOW_SIZE 0x400000 //Amount of the new file scanned at once, 4 MB
+#define DELTA_RESULT_FALLBACK 2 //Callback result when the server cannot apply a delta and the file has to be uploaded whole
+
+//Delta file layout, all numbers little endian:
+//Header: "VDUD", UINT32 block size, UINT64 length of the new file
+//Records: 'C', UINT32 first block, UINT32 block count - copy blocks of the previous version
+//         'L', UINT32 length, bytes - literal data
+
+//Signature of a single block
+struct VDUBlockSignature
+{
+	UINT32 weak; //Rolling checksum, finds block candidates at any offset
+	BYTE strong[MD5_LEN]; //MD5, confirms the candidate
+};
+
+//Block signatures of a file version, all blocks but the last have blockSize
+struct VDUDeltaSignature
+{
+	UINT32 blockSize; //Block size
+	ULONGLONG length; //Length of the file version
+	std::vector<VDUBlockSignature> blocks; //Block signatures in file order
+};
+
+typedef std::shared_ptr<const VDUDeltaSignature> VDU_DELTA_SIGNATURE;
+
+//Computes block signatures of data fed in order, e.g. while a file is downloaded
+class CVDUSignatureBuilder
+{
+protected:
+	HCRYPTPROV m_hProv; //Crypto provider for MD5
+	std::shared_ptr<VDUDeltaSignature> m_signature; //Signature being built
+	std::vector<BYTE> m_block; //Data of the block being filled
+	BOOL m_failed; //Set when hashing failed
+
+	//Appends signature of a complete block
+	void AddBlock(const BYTE* data, UINT32 length);
+public:
+	//length is the expected length of the data, it determines the block size
+	CVDUSignatureBuilder(ULONGLONG length);
+	~CVDUSignatureBuilder();
+
+	//Feeds next part of the data
+	void Update(const BYTE* data, size_t length);
+
+	//Returns signature of all data fed or nullptr on failure
+	VDU_DELTA_SIGNATURE Finish();
+};
+
+//rsync-style block delta of a file against signatures of its previous version
+class CVDUDelta
+{
+public:
+	//Block size for a file of given length, square root of the length within limits
+	static UINT32 BlockSizeFor(ULONGLONG length);
+
+	//Rolling checksum of data
+	static UINT32 WeakChecksum(const BYTE* data, UINT32 length);
+
+	//MD5 of data, returns FALSE on failure
+	static BOOL StrongChecksum(HCRYPTPROV hProv, const BYTE* data, UINT32 length, BYTE* md5);
+
+	//Computes signature of a file, returns nullptr on failure
+	static VDU_DELTA_SIGNATURE CalcSignature(CString filePath);
+
+	//Writes delta of a file against signature of its previous version into deltaPath
+	//Returns FALSE on failure, deltaSize is the size of the written delta
+	static BOOL CreateDelta(CString filePath, const VDUDeltaSignature& base, CString deltaPath, ULONGLONG& deltaSize);
+};
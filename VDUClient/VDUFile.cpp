@@ -14,7 +14,7 @@
 
 CVDUFile CVDUFile::InvalidFile = CVDUFile();
 
-CVDUFile::CVDUFile(CString token, BOOL canRead, BOOL canWrite, UINT32 length, CString encoding, CString name, CString type,
+CVDUFile::CVDUFile(CString token, BOOL canRead, BOOL canWrite, ULONGLONG length, CString encoding, CString name, CString type,
 	SYSTEMTIME& lastModified, SYSTEMTIME& expires, CString md5b64, CString etag) :
 m_token(token), m_canRead(canRead), m_canWrite(canWrite), m_length(length), m_encoding(encoding), m_name(name),
 m_type(type), m_lastModified(lastModified),m_expires(expires), m_etag(etag), m_md5base64(md5b64)
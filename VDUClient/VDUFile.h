@@ -25,7 +25,7 @@ public:
 	CString m_token; //Access token
 	BOOL m_canRead; //Is file readable?
 	BOOL m_canWrite; //Is file writable?
-	UINT32 m_length; //content length
+	ULONGLONG m_length; //content length
 	CString m_encoding; //Content MIME encoding
 	CString m_name; //File name
 	CString m_type; //Content MIME type
@@ -34,7 +34,7 @@ public:
 	CString m_md5base64; //Base64 of MD5 hash
 	CString m_etag; //File version
 public:
-	CVDUFile(CString token, BOOL canRead, BOOL canWrite, UINT32 length, CString enconding, CString name, CString type,
+	CVDUFile(CString token, BOOL canRead, BOOL canWrite, ULONGLONG length, CString enconding, CString name, CString type,
 		SYSTEMTIME& lastModified, SYSTEMTIME& expires, CString md5b64, CString etag);
 	CVDUFile();
 	~CVDUFile();
@@ -25,6 +25,10 @@
 
 #include "pch.h"
 #include "VDUFilesystem.h"
+#include "VDUWorkerPool.h"
+#include "VDUScheduler.h"
+#include "VDUGzip.h"
+#include <algorithm>
 
 CVDUFileSystem::CVDUFileSystem() : FileSystemBase(), _Path()
 {
@@ -306,6 +310,12 @@ NTSTATUS CVDUFileSystem::Create(
         return result;
     }
 
+    if (vdufile.IsValid())
+    {
+        FileDesc->Token = vdufile.m_token;
+        APP->GetFileSystemService()->OpenHandleInternal(vdufile.m_token);
+    }
+
     *PFileDesc = FileDesc;
 
     return GetFileInfoInternal(FileDesc->Handle, &OpenFileInfo->FileInfo);
@@ -386,6 +396,13 @@ NTSTATUS CVDUFileSystem::Open(
         return NtStatusFromWin32(GetLastError());
     }
 
+    //Token of the file is kept alive while it is open
+    if (vdufile.IsValid())
+    {
+        FileDesc->Token = vdufile.m_token;
+        APP->GetFileSystemService()->OpenHandleInternal(vdufile.m_token);
+    }
+
     *PFileDesc = FileDesc;
 
     return GetFileInfoInternal(FileDesc->Handle, &OpenFileInfo->FileInfo);
@@ -535,8 +552,11 @@ VOID CVDUFileSystem::Close(
     }
 #endif
 
-    //Free the original handle
+    //Free the original handle, the token stays valid for the upload below even if it is no longer extended
+    CString token = FileDesc->Token;
     delete FileDesc;
+    if (!token.IsEmpty())
+        APP->GetFileSystemService()->CloseHandleInternal(token);
 
     //Attempt to check if the file has been changed
     if (vdufile.IsValid() && handleHasWriteRights)
@@ -851,7 +871,7 @@ NTSTATUS CVDUFileSystem::Rename(
         HandleFromFileDesc(FileDesc) = INVALID_HANDLE_VALUE;
 
         //Handle renaming by requesting it from the server and waiting for result
-        INT result = APP->GetFileSystemService()->UpdateVDUFile(vdufile, newname, FALSE);
+        INT result = APP->GetFileSystemService()->RenameVDUFile(vdufile, newname, FALSE);
 
         if (result != EXIT_SUCCESS)
             return STATUS_UNSUCCESSFUL;
@@ -863,8 +883,13 @@ NTSTATUS CVDUFileSystem::Rename(
     //After successful move, update file internally
     if (vdufile.IsValid() && !ReplaceIfExists)
     {
-        vdufile.m_name = newname;
-        APP->GetFileSystemService()->UpdateFileInternal(vdufile);
+        //Server answer has updated its version meanwhile, an expired token has removed it
+        vdufile = APP->GetFileSystemService()->GetVDUFileByToken(vdufile.m_token);
+        if (vdufile.IsValid())
+        {
+            vdufile.m_name = newname;
+            APP->GetFileSystemService()->UpdateFileInternal(vdufile);
+        }
     }
 
     return STATUS_SUCCESS;
@@ -1075,9 +1100,22 @@ static ULONG wcstol_deflt(wchar_t* w, ULONG deflt)
     return L'\0' != w[0] && L'\0' == *endp ? ul : deflt;
 }
 
-CVDUFileSystemService::CVDUFileSystemService(CString DriveLetter) : Service(_T(PROGNAME)), m_fs(), m_host(m_fs), m_filesLock(SRWLOCK_INIT)//, m_hWorkDir(INVALID_HANDLE_VALUE)
+CVDUFileSystemService::CVDUFileSystemService(CString DriveLetter) : Service(_T(PROGNAME)), m_fs(), m_host(m_fs), m_filesLock(SRWLOCK_INIT), m_uploadsLock(SRWLOCK_INIT),
+m_manifestLock(SRWLOCK_INIT), m_manifestQueued(FALSE),
+m_replayScheduled(FALSE), m_replayDelay(UPLOAD_REPLAY_DELAY), m_replayAwaitsLogin(FALSE), m_replayLock(SRWLOCK_INIT)//, m_hWorkDir(INVALID_HANDLE_VALUE)
 {
     StringCchCopy(m_driveLetter, ARRAYSIZE(m_driveLetter), DriveLetter);
+    m_started = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+CVDUFileSystemService::~CVDUFileSystemService()
+{
+    CloseHandle(m_started);
+}
+
+BOOL CVDUFileSystemService::WaitStarted(DWORD timeout)
+{
+    return WaitForSingleObject(m_started, timeout) == WAIT_OBJECT_0;
 }
 
 Fsp::FileSystemHost& CVDUFileSystemService::GetHost()
@@ -1141,6 +1179,14 @@ ULONGLONG CVDUFileSystemService::GetVDUFileCount()
     return (ULONGLONG)size;
 }
 
+std::vector<CVDUFile> CVDUFileSystemService::GetVDUFiles()
+{
+    AcquireSRWLockShared(&m_filesLock);
+    std::vector<CVDUFile> files = m_files;
+    ReleaseSRWLockShared(&m_filesLock);
+    return files;
+}
+
 void CVDUFileSystemService::DeleteFileInternal(CString token)
 {
     AcquireSRWLockExclusive(&m_filesLock);
@@ -1169,6 +1215,137 @@ void CVDUFileSystemService::DeleteFileInternal(CString token)
             if (f == vdufile)
             {
                 m_files.erase(it);
+                QueueSaveCacheManifestLocked();
+                break;
+            }
+        }
+    }
+
+    m_signatures.erase(token);
+    m_remoteVersions.erase(token);
+
+    auto timer = m_keepAliveTimers.find(token);
+    if (timer != m_keepAliveTimers.end())
+    {
+        APP->GetScheduler()->Cancel(timer->second);
+        m_keepAliveTimers.erase(timer);
+    }
+
+    ReleaseSRWLockExclusive(&m_filesLock);
+}
+
+void CVDUFileSystemService::ScheduleKeepAliveLocked(CVDUFile file)
+{
+    auto timer = m_keepAliveTimers.find(file.m_token);
+    if (timer != m_keepAliveTimers.end())
+    {
+        APP->GetScheduler()->Cancel(timer->second);
+        m_keepAliveTimers.erase(timer);
+    }
+
+    //Tokens of files no application has open are not extended
+    if (m_openHandles.find(file.m_token) == m_openHandles.end())
+        return;
+
+    //Files without a known expiration are left to the periodic checks
+    if (file.m_expires.wYear < 1970)
+        return;
+
+    //NOTE: CTime::GetCurrentTime() is offset by timezone, do not use
+    SYSTEMTIME cstime;
+    GetSystemTime(&cstime);
+    CTime now(cstime);
+
+    //Files that already expired cannot be extended
+    LONGLONG left = (CTime(file.m_expires) - now).GetTotalSeconds() * 1000;
+    if (left < 0)
+        return;
+
+    //Short lived tokens are extended halfway, so a failed attempt still leaves time for another
+    LONGLONG wait = left > FILE_REFRESH_EXPIRES_MARGIN * 2000LL ? left - FILE_REFRESH_EXPIRES_MARGIN * 1000LL : left / 2;
+    wait = max(wait, (LONGLONG)FILE_KEEPALIVE_MIN_DELAY);
+    CString token = file.m_token;
+    m_keepAliveTimers[token] = APP->GetScheduler()->Schedule(wait, [this, token]()
+    {
+        APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, token]()
+        {
+            return KeepAliveVDUFile(token);
+        });
+    });
+}
+
+INT CVDUFileSystemService::KeepAliveVDUFile(CString token)
+{
+    if (!APP->GetSession()->IsLoggedIn())
+        return EXIT_FAILURE;
+
+    //Touch costs the server no look at the file, unlike HEAD, which matters for large files being edited
+    CVDUConnection touch(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILE_TOUCH, CVDUSession::CallbackTouchFile, _T(""), token);
+    INT result = touch.Process();
+    if (result == TOUCH_RESULT_FALLBACK)
+    {
+        CVDUConnection check(APP->GetSession()->GetServerURL(), VDUAPIType::HEAD_FILE, CVDUSession::CallbackRefreshFile, _T(""), token);
+        result = check.Process();
+    }
+
+    //Success updates the file, which plans the next one
+    if (result != EXIT_SUCCESS)
+        RescheduleKeepAlive(token);
+
+    return result;
+}
+
+void CVDUFileSystemService::RescheduleKeepAlive(CString token)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    for (auto it = m_files.begin(); it != m_files.end(); it++)
+    {
+        if (it->m_token == token)
+        {
+            ScheduleKeepAliveLocked(*it);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&m_filesLock);
+}
+
+BOOL CVDUFileSystemService::AddFileInternal(CVDUFile newfile)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+
+    //DONT call the Get function, dont deadlock us...
+    for (auto it = m_files.begin(); it != m_files.end(); it++)
+    {
+        if ((*it).m_token == newfile.m_token)
+        {
+            ReleaseSRWLockExclusive(&m_filesLock);
+            return FALSE;
+        }
+    }
+
+    m_files.push_back(newfile);
+    ScheduleKeepAliveLocked(newfile);
+    QueueSaveCacheManifestLocked();
+
+    ReleaseSRWLockExclusive(&m_filesLock);
+
+    //Changes of the file on the server are listened for from now on
+    APP->WakeFileEvents();
+    return TRUE;
+}
+
+void CVDUFileSystemService::OpenHandleInternal(CString token)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+
+    //The first handle starts extending the token
+    if (m_openHandles[token]++ == 0)
+    {
+        for (auto it = m_files.begin(); it != m_files.end(); it++)
+        {
+            if (it->m_token == token)
+            {
+                ScheduleKeepAliveLocked(*it);
                 break;
             }
         }
@@ -1177,6 +1354,27 @@ void CVDUFileSystemService::DeleteFileInternal(CString token)
     ReleaseSRWLockExclusive(&m_filesLock);
 }
 
+void CVDUFileSystemService::CloseHandleInternal(CString token)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+
+    //The last handle stops extending the token, it expires on its own unless the file is opened again
+    auto handles = m_openHandles.find(token);
+    if (handles != m_openHandles.end() && --handles->second == 0)
+    {
+        m_openHandles.erase(handles);
+
+        auto timer = m_keepAliveTimers.find(token);
+        if (timer != m_keepAliveTimers.end())
+        {
+            APP->GetScheduler()->Cancel(timer->second);
+            m_keepAliveTimers.erase(timer);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&m_filesLock);
+}
+
 void CVDUFileSystemService::UpdateFileInternal(CVDUFile newfile)
 {
     AcquireSRWLockExclusive(&m_filesLock);
@@ -1188,8 +1386,13 @@ void CVDUFileSystemService::UpdateFileInternal(CVDUFile newfile)
 
         if (f.m_token == newfile.m_token)
         {
+            //Version of the content changed
+            if (f.m_etag != newfile.m_etag)
+                QueueSaveCacheManifestLocked();
+
             //Now proceed to update the file internally
             f = newfile;
+            ScheduleKeepAliveLocked(newfile);
             break;
         }
     }
@@ -1197,6 +1400,377 @@ void CVDUFileSystemService::UpdateFileInternal(CVDUFile newfile)
     ReleaseSRWLockExclusive(&m_filesLock);
 }
 
+VDU_DELTA_SIGNATURE CVDUFileSystemService::GetSignatureInternal(CString token)
+{
+    AcquireSRWLockShared(&m_filesLock);
+    auto it = m_signatures.find(token);
+    VDU_DELTA_SIGNATURE signature = it != m_signatures.end() ? it->second : nullptr;
+    ReleaseSRWLockShared(&m_filesLock);
+    return signature;
+}
+
+void CVDUFileSystemService::SetSignatureInternal(CString token, VDU_DELTA_SIGNATURE signature)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    if (signature)
+        m_signatures[token] = signature;
+    else
+        m_signatures.erase(token);
+    ReleaseSRWLockExclusive(&m_filesLock);
+}
+
+void CVDUFileSystemService::UpdateSignatureInternal(CVDUFile file)
+{
+    CString filePath = GetWorkDirPath() + _T("\\") + file.m_name;
+
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!file.m_canWrite || !GetFileAttributesEx(filePath, GetFileExInfoStandard, &attr) ||
+        (((ULONGLONG)attr.nFileSizeHigh << 32) | attr.nFileSizeLow) < DELTA_MIN_FILE_SIZE)
+    {
+        SetSignatureInternal(file.m_token, nullptr);
+        return;
+    }
+
+    SetSignatureInternal(file.m_token, CVDUDelta::CalcSignature(filePath));
+}
+
+BOOL CVDUFileSystemService::GetPartialDownloadInternal(CString token, VDUPartialDownload& partial)
+{
+    AcquireSRWLockShared(&m_filesLock);
+    auto it = m_partials.find(token);
+    BOOL found = it != m_partials.end();
+    if (found)
+        partial = it->second;
+    ReleaseSRWLockShared(&m_filesLock);
+    return found;
+}
+
+BOOL CVDUFileSystemService::TakePartialDownloadInternal(CString token, VDUPartialDownload& partial)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    auto it = m_partials.find(token);
+    BOOL found = it != m_partials.end();
+    if (found)
+    {
+        partial = it->second;
+        m_partials.erase(it);
+    }
+    ReleaseSRWLockExclusive(&m_filesLock);
+    return found;
+}
+
+void CVDUFileSystemService::SetPartialDownloadInternal(CString token, VDUPartialDownload partial)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    auto it = m_partials.find(token);
+    if (it != m_partials.end() && it->second.path != partial.path)
+        DeleteFile(it->second.path);
+    m_partials[token] = partial;
+    ReleaseSRWLockExclusive(&m_filesLock);
+}
+
+BOOL CVDUFileSystemService::GetCachedFileInternal(CString token, VDUCachedFile& cached)
+{
+    AcquireSRWLockShared(&m_filesLock);
+    auto it = m_cache.find(token);
+    BOOL found = it != m_cache.end();
+    if (found)
+        cached = it->second;
+    ReleaseSRWLockShared(&m_filesLock);
+    return found;
+}
+
+BOOL CVDUFileSystemService::TakeCachedFileInternal(CString token, VDUCachedFile& cached)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    auto it = m_cache.find(token);
+    BOOL found = it != m_cache.end();
+    if (found)
+    {
+        cached = it->second;
+        m_cache.erase(it);
+        QueueSaveCacheManifestLocked();
+    }
+    ReleaseSRWLockExclusive(&m_filesLock);
+    return found;
+}
+
+void CVDUFileSystemService::CacheFileInternal(CVDUFile file)
+{
+    //Content without a version cannot be revalidated
+    if (!file.IsValid() || !file.m_canRead || file.m_etag.IsEmpty())
+        return;
+
+    CacheContentInternal(file.m_token, file.m_etag, GetWorkDirPath() + _T("\\") + file.m_name);
+}
+
+void CVDUFileSystemService::CacheContentInternal(CString token, CString etag, CString filePath)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesEx(filePath, GetFileExInfoStandard, &attr))
+        return;
+
+    ULONGLONG maxSize = (ULONGLONG)APP->GetProfileInt(SECTION_SETTINGS, _T("CacheSize"), CACHE_DEFAULT_SIZE_MB) << 20;
+    size_t maxFiles = APP->GetProfileInt(SECTION_SETTINGS, _T("CacheFiles"), CACHE_MAX_FILES);
+    VDUCachedFile cached;
+    cached.etag = etag;
+    cached.size = ((ULONGLONG)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+    cached.released = GetSystemTimeNow();
+    if (cached.size > maxSize)
+        return;
+
+    CString cacheDir = GetCacheDirPath();
+    CreateDirectory(cacheDir, NULL);
+
+    TCHAR cachePath[MAX_PATH] = { 0 };
+    if (GetTempFileName(cacheDir, _T("vdc"), 0, cachePath) <= 0)
+        return;
+
+    //File still open by an application stays where it is
+    if (!MoveFileEx(filePath, cachePath, MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFile(cachePath);
+        return;
+    }
+    cached.path = cachePath;
+
+    AcquireSRWLockExclusive(&m_filesLock);
+    auto it = m_cache.find(token);
+    if (it != m_cache.end())
+        DeleteFile(it->second.path);
+    m_cache[token] = cached;
+
+    ULONGLONG totalSize = 0;
+    for (auto entry = m_cache.begin(); entry != m_cache.end(); entry++)
+        totalSize += entry->second.size;
+
+    while (totalSize > maxSize || m_cache.size() > maxFiles)
+    {
+        auto oldest = m_cache.begin();
+        for (auto entry = m_cache.begin(); entry != m_cache.end(); entry++)
+        {
+            if (entry->second.released < oldest->second.released)
+                oldest = entry;
+        }
+
+        totalSize -= oldest->second.size;
+        DeleteFile(oldest->second.path);
+        m_cache.erase(oldest);
+    }
+    QueueSaveCacheManifestLocked();
+    ReleaseSRWLockExclusive(&m_filesLock);
+
+    ScheduleCacheExpiry(token, cached.released);
+}
+
+void CVDUFileSystemService::ScheduleCacheExpiry(CString token, ULONGLONG released)
+{
+    //Content nobody accessed again for long is not worth the space, time before a restart counts too
+    ULONGLONG expires = released + CACHE_MAX_AGE * 10000000ULL;
+    ULONGLONG now = GetSystemTimeNow();
+    ULONGLONG delay = expires > now ? min((expires - now) / 10000, CACHE_MAX_AGE * 1000ULL) : 0;
+    APP->GetScheduler()->Schedule(delay, [this, token, released]()
+    {
+        APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, token, released]()
+        {
+            //Content taken or cached again meanwhile is not touched
+            AcquireSRWLockExclusive(&m_filesLock);
+            auto it = m_cache.find(token);
+            if (it != m_cache.end() && it->second.released == released)
+            {
+                DeleteFile(it->second.path);
+                m_cache.erase(it);
+                QueueSaveCacheManifestLocked();
+            }
+            ReleaseSRWLockExclusive(&m_filesLock);
+            return EXIT_SUCCESS;
+        });
+    });
+}
+
+BOOL CVDUFileSystemService::ReportRemoteVersionInternal(CString token, CString etag)
+{
+    AcquireSRWLockExclusive(&m_filesLock);
+    auto it = m_remoteVersions.find(token);
+    BOOL reported = it != m_remoteVersions.end() && it->second == etag;
+    m_remoteVersions[token] = etag;
+    ReleaseSRWLockExclusive(&m_filesLock);
+    return !reported;
+}
+
+BOOL CVDUFileSystemService::GetRemoteVersionInternal(CString token, CString& etag)
+{
+    AcquireSRWLockShared(&m_filesLock);
+    auto it = m_remoteVersions.find(token);
+    BOOL found = it != m_remoteVersions.end();
+    if (found)
+        etag = it->second;
+    ReleaseSRWLockShared(&m_filesLock);
+    return found;
+}
+
+CString CVDUFileSystemService::GetCacheDirPath()
+{
+    //Next to the work directory, cached files are not part of the drive
+    return GetWorkDirPath() + _T(".cache");
+}
+
+CString CVDUFileSystemService::GetCacheManifestPath()
+{
+    return GetCacheDirPath() + _T("\\manifest.txt");
+}
+
+void CVDUFileSystemService::QueueSaveCacheManifestLocked()
+{
+    if (m_manifestQueued)
+        return;
+
+    m_manifestQueued = TRUE;
+    APP->GetScheduler()->Schedule(CACHE_MANIFEST_DELAY, [this]()
+    {
+        APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this]()
+        {
+            SaveCacheManifest();
+            return EXIT_SUCCESS;
+        });
+    });
+}
+
+void CVDUFileSystemService::SaveCacheManifest()
+{
+    CString manifest = _T("#Cached (C) and accessed (A) files of the last run, token, version, size, file and release time of cached files\r\n");
+
+    AcquireSRWLockExclusive(&m_filesLock);
+    m_manifestQueued = FALSE;
+
+    //Oldest first, so eviction order survives the restart
+    std::vector<std::map<CString, VDUCachedFile>::iterator> cached;
+    for (auto it = m_cache.begin(); it != m_cache.end(); it++)
+        cached.push_back(it);
+    std::sort(cached.begin(), cached.end(), [](const std::map<CString, VDUCachedFile>::iterator& a, const std::map<CString, VDUCachedFile>::iterator& b)
+    {
+        return a->second.released < b->second.released;
+    });
+    for (auto it = cached.begin(); it != cached.end(); it++)
+        manifest.AppendFormat(_T("C\t%s\t%s\t%llu\t%s\t%llu\r\n"), (LPCTSTR)(*it)->first, (LPCTSTR)(*it)->second.etag, (*it)->second.size,
+            PathFindFileName((*it)->second.path), (*it)->second.released);
+
+    //Content of accessed files stays in the work directory, a crash leaves it there for the next start
+    for (auto it = m_files.begin(); it != m_files.end(); it++)
+    {
+        if (it->m_canRead && !it->m_etag.IsEmpty())
+            manifest.AppendFormat(_T("A\t%s\t%s\t\t%s\r\n"), (LPCTSTR)it->m_token, (LPCTSTR)it->m_etag, (LPCTSTR)it->m_name);
+    }
+    ReleaseSRWLockExclusive(&m_filesLock);
+
+    AcquireSRWLockExclusive(&m_manifestLock);
+    CreateDirectory(GetCacheDirPath(), NULL);
+    WriteTextFile(GetCacheManifestPath(), manifest);
+    ReleaseSRWLockExclusive(&m_manifestLock);
+}
+
+BOOL CVDUFileSystemService::WriteTextFile(CString path, CString text)
+{
+    //Written aside and swapped in, a crash never leaves half a file
+    CStringA content = CW2A(text, CP_UTF8);
+    HANDLE hFile = CreateFile(path + _T(".tmp"), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, content.GetString(), content.GetLength(), &written, NULL) && written == (DWORD)content.GetLength();
+    CloseHandle(hFile);
+
+    return ok && MoveFileEx(path + _T(".tmp"), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+BOOL CVDUFileSystemService::ReadTextFile(CString path, CString& text)
+{
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    LARGE_INTEGER size;
+    CStringA content;
+    DWORD readLen = 0;
+    BOOL ok = GetFileSizeEx(hFile, &size) && size.QuadPart < MAXDWORD;
+    if (ok)
+    {
+        ok = ReadFile(hFile, content.GetBufferSetLength((INT)size.QuadPart), (DWORD)size.QuadPart, &readLen, NULL);
+        content.ReleaseBufferSetLength(readLen);
+    }
+    CloseHandle(hFile);
+
+    text = CA2W(content, CP_UTF8);
+    return ok;
+}
+
+ULONGLONG CVDUFileSystemService::GetSystemTimeNow()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+void CVDUFileSystemService::LoadCacheManifest()
+{
+    CString manifest;
+    if (!ReadTextFile(GetCacheManifestPath(), manifest))
+        return;
+
+    //Nothing is checked here, content that is gone or changed is noticed when its file is accessed
+    CString cacheDir = GetCacheDirPath();
+    std::vector<std::pair<CString, VDUCachedFile>> cached;
+
+    AcquireSRWLockExclusive(&m_filesLock);
+    INT pos = 0;
+    CString line = manifest.Tokenize(_T("\r\n"), pos);
+    while (pos >= 0)
+    {
+        CString kind, token, etag, length, name, released;
+        AfxExtractSubString(kind, line, 0, '\t');
+        AfxExtractSubString(token, line, 1, '\t');
+        AfxExtractSubString(etag, line, 2, '\t');
+        AfxExtractSubString(length, line, 3, '\t');
+        AfxExtractSubString(name, line, 4, '\t');
+        AfxExtractSubString(released, line, 5, '\t');
+
+        if (!token.IsEmpty() && !etag.IsEmpty() && !name.IsEmpty())
+        {
+            if (kind == _T("C"))
+            {
+                VDUCachedFile entry;
+                entry.path = cacheDir + _T("\\") + name;
+                entry.etag = etag;
+                entry.size = _tcstoui64(length, NULL, 10);
+                entry.released = _tcstoui64(released, NULL, 10);
+                cached.push_back(std::make_pair(token, entry));
+            }
+            else if (kind == _T("A"))
+            {
+                m_leftovers[name] = std::make_pair(token, etag);
+            }
+        }
+
+        line = manifest.Tokenize(_T("\r\n"), pos);
+    }
+
+    //Content keeps its release time and ages out as if the client never stopped
+    //Manifests of older versions have none, their entries count as released now, in the order listed, oldest first
+    ULONGLONG now = GetSystemTimeNow() - cached.size();
+    for (auto it = cached.begin(); it != cached.end(); it++)
+    {
+        if (!it->second.released)
+            it->second.released = now;
+        now++;
+        m_cache[it->first] = it->second;
+    }
+    ReleaseSRWLockExclusive(&m_filesLock);
+
+    for (auto it = cached.begin(); it != cached.end(); it++)
+        ScheduleCacheExpiry(it->first, it->second.released);
+}
+
 NTSTATUS CVDUFileSystemService::OnStart(ULONG argc, PWSTR* argv)
 {
    // PWSTR DebugLogFile = _T("vfsdebug.log");
@@ -1238,7 +1812,13 @@ NTSTATUS CVDUFileSystemService::OnStart(ULONG argc, PWSTR* argv)
     if (CreateDirectory(PathBuf, NULL))
         SetFileAttributes(PathBuf, FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_READONLY);
 
-    //If not empty, erase contents
+    //If not empty, move contents aside with a single rename, they are deleted in the background
+    CString trashPath;
+    trashPath.Format(_T("%s.old%llu"), PathBuf, GetTickCount64());
+    if (!PathIsDirectoryEmpty(PathBuf) && MoveFile(PathBuf, trashPath) && CreateDirectory(PathBuf, NULL))
+        SetFileAttributes(PathBuf, FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_READONLY);
+
+    //Files still open elsewhere keep the folder from moving, erase what can be erased
     if (!PathIsDirectoryEmpty(PathBuf))
     {
         CString folder = CString(PathBuf);
@@ -1254,8 +1834,21 @@ NTSTATUS CVDUFileSystemService::OnStart(ULONG argc, PWSTR* argv)
 
             DeleteFile(folder + _T("\\") + FindData.cFileName);
         } while (FindNextFile(hFile, &FindData));
+        FindClose(hFile);
+    }
+
+    m_workDirPath = PathBuf;
+
+    //Content of the last run is revalidated when accessed, its unsent changes are uploaded, tests start without either
+    if (!APP->IsTestMode())
+    {
+        LoadCacheManifest();
+        LoadUploadQueue();
     }
 
+    AfxBeginThread(ThreadProcPurgeWorkDirs, (LPVOID)this, THREAD_PRIORITY_IDLE);
+    APP->EndStartupPhase(_T("workdir"));
+
     EnableBackupRestorePrivileges();
 
     Result = m_fs.SetPath(PathBuf);
@@ -1266,7 +1859,6 @@ NTSTATUS CVDUFileSystemService::OnStart(ULONG argc, PWSTR* argv)
         return Result;
     }
 
-    m_workDirPath = PathBuf;
     //Keep the workDirPath handle until the process exits
     //CreateFile(m_workDirPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
     m_host.SetFileSystemName(_T("VDUVFS"));
@@ -1279,6 +1871,9 @@ NTSTATUS CVDUFileSystemService::OnStart(ULONG argc, PWSTR* argv)
         return Result;
     }
 
+    APP->EndStartupPhase(_T("mount"));
+    SetEvent(m_started);
+
 #if defined(DEBUG_PRINT_FILESYSTEM_CALLS)
     if (AllocConsole())
     {
@@ -1295,6 +1890,19 @@ NTSTATUS CVDUFileSystemService::OnStop()
 #if defined(_DEBUG) && defined(DEBUG_PRINT_FILESYSTEM_CALLS)
     FreeConsole();
 #endif
+    //Partial downloads live in the temp directory, do not leave them behind
+    AcquireSRWLockExclusive(&m_filesLock);
+    for (auto it = m_partials.begin(); it != m_partials.end(); it++)
+        DeleteFile(it->second.path);
+    m_partials.clear();
+    ReleaseSRWLockExclusive(&m_filesLock);
+
+    //Content of accessed files is kept for the next start, which revalidates it when accessed
+    std::vector<CVDUFile> files = GetVDUFiles();
+    for (auto it = files.begin(); it != files.end(); it++)
+        CacheFileInternal(*it);
+    SaveCacheManifest();
+
     if (_tcslen(m_driveLetter) > 0)
     {
         CRegKey key;
@@ -1308,11 +1916,81 @@ NTSTATUS CVDUFileSystemService::OnStop()
     return STATUS_SUCCESS;
 }
 
-CString CVDUFileSystemService::CalcFileMD5Base64(CVDUFile file)
+UINT CVDUFileSystemService::ThreadProcPurgeWorkDirs(LPVOID service)
 {
-    CString finalHash;
+    CVDUFileSystemService* fs = (CVDUFileSystemService*)service;
+    ASSERT(fs);
+    CString workDir = fs->GetWorkDirPath();
+
+    //Lowers disk priority as well
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    //Folders of runs that did not finish their purge are included
+    CString parent = workDir.Left(workDir.ReverseFind('\\') + 1);
+    WIN32_FIND_DATA dirData;
+    HANDLE hDir = FindFirstFile(workDir + _T(".old*"), &dirData);
+    if (hDir != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(dirData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                continue;
+
+            CString folder = parent + dirData.cFileName;
+            WIN32_FIND_DATA fileData;
+            HANDLE hFile = FindFirstFile(folder + _T("\\*"), &fileData);
+            if (hFile != INVALID_HANDLE_VALUE)
+            {
+                do
+                {
+                    if (fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                        continue;
+
+                    CString filePath = folder + _T("\\") + fileData.cFileName;
+                    SetFileAttributes(filePath, FILE_ATTRIBUTE_NORMAL);
+
+                    //Left behind by a crash, kept if the manifest knows its version
+                    AcquireSRWLockExclusive(&fs->m_filesLock);
+                    auto leftover = fs->m_leftovers.find(fileData.cFileName);
+                    BOOL adopt = leftover != fs->m_leftovers.end();
+                    std::pair<CString, CString> tokenVersion;
+                    if (adopt)
+                    {
+                        tokenVersion = leftover->second;
+                        fs->m_leftovers.erase(leftover);
+                    }
+                    ReleaseSRWLockExclusive(&fs->m_filesLock);
+
+                    if (adopt)
+                        fs->CacheContentInternal(tokenVersion.first, tokenVersion.second, filePath);
+                    DeleteFile(filePath);
+                } while (FindNextFile(hFile, &fileData));
+                FindClose(hFile);
+            }
+
+            SetFileAttributes(folder, FILE_ATTRIBUTE_NORMAL);
+            RemoveDirectory(folder);
+        } while (FindNextFile(hDir, &dirData));
+        FindClose(hDir);
+    }
+
+    AcquireSRWLockExclusive(&fs->m_filesLock);
+    fs->m_leftovers.clear();
+    ReleaseSRWLockExclusive(&fs->m_filesLock);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return EXIT_SUCCESS;
+}
+
+CString CVDUFileSystemService::CalcFileMD5Base64(CVDUFile file)
+{
+    return CalcFileMD5Base64(GetWorkDirPath() + _T("\\") + file.m_name);
+}
+
+CString CVDUFileSystemService::CalcFileMD5Base64(CString filePath)
+{
+    CString finalHash;
     BYTE rgbHash[MD5_LEN] = { 0 };
-    CString filePath = GetWorkDirPath() + _T("\\") + file.m_name;
 
     HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
 
@@ -1336,14 +2014,15 @@ CString CVDUFileSystemService::CalcFileMD5Base64(CVDUFile file)
         return finalHash;
     }
 
-    BYTE rgbFile[0x400];
+    //Hashing precedes every upload, read it in large blocks
+    std::vector<BYTE> rgbFile(UPLOAD_CHUNK_MIN);
     DWORD readLen;
     BOOL bResult = FALSE;
-    while (bResult = ReadFile(hFile, rgbFile, ARRAYSIZE(rgbFile), &readLen, NULL))
+    while (bResult = ReadFile(hFile, rgbFile.data(), (DWORD)rgbFile.size(), &readLen, NULL))
     {
         if (readLen <= 0)
             break;
-        if (!CryptHashData(hHash, rgbFile, readLen, 0))
+        if (!CryptHashData(hHash, rgbFile.data(), readLen, 0))
         {
             CryptReleaseContext(hProv, 0);
             CryptDestroyHash(hHash);
@@ -1418,71 +2097,451 @@ NTSTATUS CVDUFileSystemService::Remount(CString DriveLetter)
     return result;
 }
 
-BOOL CVDUFileSystemService::CreateVDUFile(CVDUFile vdufile, CHttpFile* httpfile)
+//Shared state of a download fetched as concurrent ranges
+struct VDUDownloadParts
+{
+    SRWLOCK lock; //Guards the members below but received
+    CString serverURL; //Server to request ranges from
+    CString token; //File access token
+    CString etag; //Version all ranges have to belong to
+    HANDLE hFile; //Preallocated destination, parts are written at their offsets
+    ULONGLONG length; //File length
+    ULONGLONG next; //Start of the data no part was assigned yet
+    ULONGLONG partSize; //Size of the next assigned part, follows the rate of finished parts
+    std::vector<std::pair<ULONGLONG, ULONGLONG>> retry; //Rest of failed parts, first and end offset
+    UINT failures; //Failed parts so far
+    BOOL failed; //Set when the download cannot be finished
+    CString error; //Error of the last failed part, LastError of the thread that fetched it
+    UINT workers; //Threads fetching parts, including the one that started the download
+    UINT maxWorkers; //Most threads fetching parts
+    std::vector<VDUTaskResult> tasks; //Workers added on the pool
+    LARGE_INTEGER windowStart; //Start of the current rate measurement
+    ULONGLONG windowBytes; //Bytes finished in the current rate measurement
+    ULONGLONG windowRate; //Rate of the previous measurement, bytes per second
+    volatile LONG64 received; //Bytes written, for progress
+};
+
+static INT DownloadPartsWorker(std::shared_ptr<VDUDownloadParts> parts);
+
+//Reads a range response into the destination, returns the amount of bytes written from first
+static ULONGLONG ReadDownloadPart(VDUDownloadParts* parts, CHttpFile* response, ULONGLONG first, ULONGLONG end)
+{
+    std::vector<BYTE> buf(0x10000);
+    ULONGLONG position = first;
+    TRY
+    {
+        UINT readLen;
+        while (position < end && (readLen = response->Read(buf.data(), (UINT)min((ULONGLONG)buf.size(), end - position))) > 0)
+        {
+            OVERLAPPED ov = { 0 };
+            ov.Offset = (DWORD)position;
+            ov.OffsetHigh = (DWORD)(position >> 32);
+
+            DWORD writeLen;
+            if (!WriteFile(parts->hFile, buf.data(), readLen, &writeLen, &ov) || writeLen != readLen)
+                break;
+
+            position += readLen;
+            LONG64 received = InterlockedAdd64(&parts->received, readLen);
+
+            if (!APP->IsTestMode())
+            {
+                int newpos = (int)(((double)received / parts->length) * 100);
+                if (newpos != WND->GetProgressBar()->GetPos())
+                {
+                    WND->GetProgressBar()->SetPos(newpos);
+                    WND->UpdateStatus();
+                }
+            }
+        }
+    }
+    CATCH(CInternetException, e)
+    {
+        e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
+    }
+    END_CATCH;
+
+    return position - first;
+}
+
+//Requests a range of the same version and writes it into the destination, returns the amount of bytes written from first
+static ULONGLONG FetchDownloadPart(VDUDownloadParts* parts, ULONGLONG first, ULONGLONG end)
+{
+    CString headers;
+    headers.Format(_T("Range: bytes=%llu-%llu\r\nIf-Range: %s\r\n"), first, end - 1, parts->etag.GetString());
+
+    CVDUConnection con(parts->serverURL, VDUAPIType::GET_FILE, nullptr, headers, parts->token);
+    CHttpFile* response = con.Open();
+    if (!response)
+        return 0;
+
+    //Anything but the requested range means the file changed meanwhile, it has to be accessed again
+    DWORD statusCode = 0;
+    ULONGLONG rangeFirst, rangeTotal;
+    response->QueryInfoStatusCode(statusCode);
+    if (statusCode != HTTP_STATUS_PARTIAL_CONTENT || !CVDUSession::QueryContentRange(response, rangeFirst, rangeTotal) ||
+        rangeFirst != first || rangeTotal != parts->length)
+    {
+        StringCchCopy(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError), _T("File changed on the server while downloading, please access it again."));
+        AcquireSRWLockExclusive(&parts->lock);
+        parts->failed = TRUE;
+        ReleaseSRWLockExclusive(&parts->lock);
+        return 0;
+    }
+
+    return ReadDownloadPart(parts, response, first, end);
+}
+
+//Accounts a part, adapts part size and amount of workers, expects exclusive lock
+static void FinishDownloadPartLocked(std::shared_ptr<VDUDownloadParts> parts, ULONGLONG first, ULONGLONG end, ULONGLONG written, LONGLONG elapsedMs)
+{
+    if (first + written < end)
+    {
+        parts->error = CVDUConnection::LastError;
+
+        //Rest of the part is fetched again, every worker takes failed parts first
+        parts->retry.push_back(std::make_pair(first + written, end));
+        if (++parts->failures > DOWNLOAD_PART_MAX_FAILURES)
+            parts->failed = TRUE;
+        return;
+    }
+
+    //Parts should take about the same time, short enough to spread the tail evenly among workers
+    if (elapsedMs > 0)
+    {
+        ULONGLONG size = written * DOWNLOAD_PART_TARGET_MS / elapsedMs;
+        size = min(max(size, (ULONGLONG)DOWNLOAD_PART_MIN_SIZE), (ULONGLONG)DOWNLOAD_PART_MAX_SIZE);
+        parts->partSize = size & ~(ULONGLONG)(DOWNLOAD_PART_MIN_SIZE - 1);
+    }
+
+    //Another worker is added as long as the last one raised the total rate noticeably
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    parts->windowBytes += written;
+    LONGLONG windowMs = (now.QuadPart - parts->windowStart.QuadPart) * 1000 / freq.QuadPart;
+    if (windowMs >= DOWNLOAD_PARALLEL_WINDOW_MS)
+    {
+        ULONGLONG rate = parts->windowBytes * 1000 / windowMs;
+        if (rate > parts->windowRate + parts->windowRate / 10 && parts->workers < parts->maxWorkers && parts->next < parts->length)
+        {
+            parts->workers++;
+            parts->tasks.push_back(APP->GetWorkerPool()->Submit(VDUTaskCategory::DOWNLOAD, [parts]()
+            {
+                return DownloadPartsWorker(parts);
+            }));
+        }
+
+        parts->windowRate = rate;
+        parts->windowStart = now;
+        parts->windowBytes = 0;
+    }
+}
+
+//Fetches parts until none is left or the download failed
+static INT DownloadPartsWorker(std::shared_ptr<VDUDownloadParts> parts)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    for (;;)
+    {
+        ULONGLONG first, end;
+        AcquireSRWLockExclusive(&parts->lock);
+        if (parts->failed)
+        {
+            ReleaseSRWLockExclusive(&parts->lock);
+            return EXIT_FAILURE;
+        }
+
+        if (!parts->retry.empty())
+        {
+            first = parts->retry.back().first;
+            end = parts->retry.back().second;
+            parts->retry.pop_back();
+        }
+        else if (parts->next < parts->length)
+        {
+            first = parts->next;
+            end = min(first + parts->partSize, parts->length);
+            parts->next = end;
+        }
+        else
+        {
+            ReleaseSRWLockExclusive(&parts->lock);
+            return EXIT_SUCCESS;
+        }
+        ReleaseSRWLockExclusive(&parts->lock);
+
+        LARGE_INTEGER start, stop;
+        QueryPerformanceCounter(&start);
+        ULONGLONG written = FetchDownloadPart(parts.get(), first, end);
+        QueryPerformanceCounter(&stop);
+
+        AcquireSRWLockExclusive(&parts->lock);
+        FinishDownloadPartLocked(parts, first, end, written, (stop.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+        ReleaseSRWLockExclusive(&parts->lock);
+
+        if (first + written < end)
+            Sleep(DOWNLOAD_RETRY_DELAY);
+    }
+}
+
+BOOL CVDUFileSystemService::DownloadVDUFileParts(CVDUFile vdufile, CHttpFile* httpfile, CVDUConnection* owner, HANDLE hFile, ULONGLONG& received)
+{
+    //Whole file is allocated upfront, parts are written at their offsets in any order
+    LARGE_INTEGER size;
+    size.QuadPart = vdufile.m_length;
+    if (!SetFilePointerEx(hFile, size, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+        return FALSE;
+
+    std::shared_ptr<VDUDownloadParts> parts = std::make_shared<VDUDownloadParts>();
+    InitializeSRWLock(&parts->lock);
+    parts->serverURL = APP->GetSession()->GetServerURL();
+    parts->token = vdufile.m_token;
+    parts->etag = vdufile.m_etag;
+    parts->hFile = hFile;
+    parts->length = vdufile.m_length;
+    parts->partSize = DOWNLOAD_PART_INITIAL_SIZE;
+    parts->next = min((ULONGLONG)DOWNLOAD_PART_INITIAL_SIZE, vdufile.m_length);
+    ULONGLONG firstEnd = parts->next;
+    parts->failures = 0;
+    parts->failed = FALSE;
+    parts->maxWorkers = max(APP->GetProfileInt(SECTION_SETTINGS, _T("DownloadParallelParts"), DOWNLOAD_DEFAULT_PARALLEL_PARTS), (UINT)1);
+    parts->workers = min((UINT)DOWNLOAD_PARALLEL_START, parts->maxWorkers);
+    QueryPerformanceCounter(&parts->windowStart);
+    parts->windowBytes = 0;
+    parts->windowRate = 0;
+    parts->received = 0;
+
+    AcquireSRWLockExclusive(&parts->lock);
+    for (UINT i = 1; i < parts->workers; i++)
+    {
+        parts->tasks.push_back(APP->GetWorkerPool()->Submit(VDUTaskCategory::DOWNLOAD, [parts]()
+        {
+            return DownloadPartsWorker(parts);
+        }));
+    }
+    ReleaseSRWLockExclusive(&parts->lock);
+
+    //The response already open carries the first part, this thread then fetches parts like the others
+    LARGE_INTEGER freq, start, stop;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    ULONGLONG written = ReadDownloadPart(parts.get(), httpfile, 0, firstEnd);
+    QueryPerformanceCounter(&stop);
+
+    //Rest of the whole file is left unread, its connection is returned before this thread requests parts
+    owner->Close();
+
+    AcquireSRWLockExclusive(&parts->lock);
+    FinishDownloadPartLocked(parts, 0, firstEnd, written, (stop.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+    ReleaseSRWLockExclusive(&parts->lock);
+
+    DownloadPartsWorker(parts);
+
+    //Workers may add further workers until the last part is assigned
+    for (size_t i = 0; ; i++)
+    {
+        AcquireSRWLockShared(&parts->lock);
+        if (i >= parts->tasks.size())
+        {
+            ReleaseSRWLockShared(&parts->lock);
+            break;
+        }
+        VDUTaskResult task = parts->tasks[i];
+        ReleaseSRWLockShared(&parts->lock);
+
+        APP->GetWorkerPool()->Wait(task);
+    }
+
+    //Errors of parts fetched on workers are reported by this thread
+    if (!parts->error.IsEmpty())
+        StringCchCopy(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError), parts->error);
+
+    received = (ULONGLONG)parts->received;
+    return !parts->failed && received == vdufile.m_length;
+}
+
+BOOL CVDUFileSystemService::CreateVDUFile(CVDUFile vdufile, CHttpFile* httpfile, CVDUConnection* owner)
 {
     if (GetVDUFileByToken(vdufile.m_token).IsValid())
         return FALSE;
 
-    TCHAR tempBuf[MAX_PATH + 1] = { 0 };
-    GetTempPath(ARRAYSIZE(tempBuf), tempBuf);
+    DWORD statusCode = 0;
+    httpfile->QueryInfoStatusCode(statusCode);
 
-    TCHAR tmpFilePath[MAX_PATH] = { 0 };
-    if (GetTempFileName(tempBuf, _T("vdu"), 0, tmpFilePath) <= 0)
+    //Data of an earlier attempt is continued if the server sent the rest of the same version
+    VDUPartialDownload partial;
+    BOOL hasPartial = TakePartialDownloadInternal(vdufile.m_token, partial);
+    ULONGLONG rangeFirst, rangeTotal;
+    BOOL resume = hasPartial && statusCode == HTTP_STATUS_PARTIAL_CONTENT && partial.etag == vdufile.m_etag &&
+        CVDUSession::QueryContentRange(httpfile, rangeFirst, rangeTotal) && rangeFirst == partial.received;
+
+    if (hasPartial && !resume)
+        DeleteFile(partial.path);
+
+    //Server sent the content, a cached copy of it is outdated
+    VDUCachedFile cached;
+    if (TakeCachedFileInternal(vdufile.m_token, cached))
+        DeleteFile(cached.path);
+
+    //A range without the data it continues is of no use
+    if (statusCode == HTTP_STATUS_PARTIAL_CONTENT && !resume)
         return FALSE;
 
-    HANDLE hFile = CreateFile(tmpFilePath, GENERIC_ALL, NULL, NULL, CREATE_ALWAYS, NULL, NULL);
+    CString tmpFilePath = partial.path;
+    if (!resume)
+    {
+        TCHAR tempBuf[MAX_PATH + 1] = { 0 };
+        GetTempPath(ARRAYSIZE(tempBuf), tempBuf);
+
+        TCHAR tempFileName[MAX_PATH] = { 0 };
+        if (GetTempFileName(tempBuf, _T("vdu"), 0, tempFileName) <= 0)
+            return FALSE;
+        tmpFilePath = tempFileName;
+    }
+
+    HANDLE hFile = CreateFile(tmpFilePath, GENERIC_ALL, NULL, NULL, resume ? OPEN_EXISTING : CREATE_ALWAYS, NULL, NULL);
 
     //Cant open file?
     if (hFile == INVALID_HANDLE_VALUE)
         return FALSE;
 
-    TRY
+    ULONGLONG received = 0;
+    if (resume)
     {
-        if (!APP->IsTestMode())
+        LARGE_INTEGER offset;
+        offset.QuadPart = partial.received;
+        if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
         {
-            WND->GetProgressBar()->SetState(PBST_NORMAL);
-            WND->GetProgressBar()->SetPos(0);
-            WND->UpdateStatus();
+            CloseHandle(hFile);
+            DeleteFile(tmpFilePath);
+            return FALSE;
         }
+        received = partial.received;
+    }
 
-        BYTE buf[0x1000] = { 0 };   
-        UINT readLen, readTotal = 0;
-        while ((readLen = httpfile->Read(buf, ARRAYSIZE(buf))) > 0)
+    //Large files are fetched as concurrent ranges when the server serves them
+    CString acceptRanges;
+    BOOL parallel = owner && !resume && statusCode == HTTP_STATUS_OK && vdufile.m_length >= DOWNLOAD_PARTS_MIN_SIZE && !vdufile.m_etag.IsEmpty() &&
+        httpfile->QueryInfo(HTTP_QUERY_ACCEPT_RANGES, acceptRanges) && acceptRanges.CompareNoCase(_T("bytes")) == 0;
+
+    //Signatures of writable files are built while downloading, so the first upload can already be a delta
+    //Resumed and parallel downloads compute them from the finished file instead
+    std::unique_ptr<CVDUSignatureBuilder> signature;
+    if (!resume && !parallel && vdufile.m_canWrite && vdufile.m_length >= DELTA_MIN_FILE_SIZE)
+        signature.reset(new CVDUSignatureBuilder(vdufile.m_length));
+
+    if (!APP->IsTestMode())
+    {
+        WND->GetProgressBar()->SetState(PBST_NORMAL);
+        WND->GetProgressBar()->SetPos(0);
+        WND->UpdateStatus();
+    }
+
+    //Interrupted transfers continue with a range request for the rest of the same version
+    CHttpFile* response = parallel ? NULL : httpfile;
+    CVDUConnection* retry = NULL;
+    BOOL failed = parallel && !DownloadVDUFileParts(vdufile, httpfile, owner, hFile, received);
+    for (UINT attempt = 0; ; attempt++)
+    {
+        if (response)
         {
-            DWORD writeLen;
-            if (!WriteFile(hFile, buf, readLen, &writeLen, NULL))
+            TRY
+            {
+                BYTE buf[0x1000] = { 0 };
+                UINT readLen;
+                //Reading stops at the file length, the response may carry more after it, see CVDUSession::AccessFiles
+                while (received < vdufile.m_length &&
+                    (readLen = response->Read(buf, (UINT)min((ULONGLONG)ARRAYSIZE(buf), vdufile.m_length - received))) > 0)
+                {
+                    DWORD writeLen;
+                    if (!WriteFile(hFile, buf, readLen, &writeLen, NULL))
+                    {
+                        failed = TRUE;
+                        break;
+                    }
+
+                    if (signature)
+                        signature->Update(buf, readLen);
+
+                    received += readLen;
+
+                    if (!APP->IsTestMode())
+                    {
+                        int newpos = (int)(((double)received / vdufile.m_length) * 100);
+                        if (newpos != WND->GetProgressBar()->GetPos())
+                        {
+                            WND->GetProgressBar()->SetPos(newpos);
+                            WND->UpdateStatus();
+                        }
+                    }
+                }
+            }
+            CATCH(CInternetException, e)
             {
-                DWORD errid = GetLastError();
-                return FALSE;
+                e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
             }
+            END_CATCH;
+        }
 
-            if (!APP->IsTestMode())
+        if (failed || received >= vdufile.m_length || attempt >= DOWNLOAD_RETRY_COUNT || vdufile.m_etag.IsEmpty())
+            break;
+
+        //Broken response is returned before the range is requested, a batch response is still read by the caller
+        if (owner)
+            owner->Close();
+
+        Sleep(min(DOWNLOAD_RETRY_DELAY << attempt, DOWNLOAD_RETRY_DELAY_MAX));
+
+        CString headers;
+        headers.Format(_T("Range: bytes=%llu-\r\nIf-Range: %s\r\n"), received, vdufile.m_etag.GetString());
+
+        delete retry;
+        retry = new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::GET_FILE, nullptr, headers, vdufile.m_token);
+        response = retry->Open();
+
+        if (response)
+        {
+            //Anything but the requested range means the file changed meanwhile, it has to be accessed again
+            DWORD retryStatus = 0;
+            response->QueryInfoStatusCode(retryStatus);
+            if (retryStatus != HTTP_STATUS_PARTIAL_CONTENT || !CVDUSession::QueryContentRange(response, rangeFirst, rangeTotal) || rangeFirst != received)
             {
-                readTotal += readLen;
-                int newpos = (int)(((double)readTotal / vdufile.m_length) * 100);
-                if (newpos != WND->GetProgressBar()->GetPos())
-                {
-                    WND->GetProgressBar()->SetPos(newpos);
-                    WND->UpdateStatus();
-                }
+                StringCchCopy(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError), _T("File changed on the server while downloading, please access it again."));
+                failed = TRUE;
+                break;
             }
         }
-    } 
-    CATCH(CInternetException, e)
+    }
+
+    delete retry;
+
+    if (failed || received < vdufile.m_length)
     {
-        e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
         CloseHandle(hFile);
-        DeleteFile(tmpFilePath);
+
+        //Keep what arrived, accessing the file again continues from there
+        if (!failed && received > 0 && !vdufile.m_etag.IsEmpty())
+        {
+            VDUPartialDownload kept;
+            kept.path = tmpFilePath;
+            kept.etag = vdufile.m_etag;
+            kept.received = received;
+            SetPartialDownloadInternal(vdufile.m_token, kept);
+        }
+        else
+            DeleteFile(tmpFilePath);
 
         if (!APP->IsTestMode())
         {
             WND->GetProgressBar()->SetState(PBST_ERROR);
             WND->UpdateStatus();
         }
-         
+
         return FALSE;
     }
-    END_CATCH;
 
     if (!APP->IsTestMode())
     {
@@ -1517,7 +2576,68 @@ BOOL CVDUFileSystemService::CreateVDUFile(CVDUFile vdufile, CHttpFile* httpfile)
         return FALSE;
     }
 
-    m_files.push_back(vdufile);
+    //Concurrent access of the same token may have finished first
+    if (!AddFileInternal(vdufile))
+        return FALSE;
+
+    if (signature)
+        SetSignatureInternal(vdufile.m_token, signature->Finish());
+    else if (resume || parallel)
+        UpdateSignatureInternal(vdufile);
+
+    return TRUE;
+}
+
+BOOL CVDUFileSystemService::CreateVDUFileFromCache(CVDUFile vdufile)
+{
+    if (GetVDUFileByToken(vdufile.m_token).IsValid())
+        return FALSE;
+
+    VDUCachedFile cached;
+    if (!TakeCachedFileInternal(vdufile.m_token, cached))
+        return FALSE;
+
+    if (cached.etag != vdufile.m_etag)
+    {
+        DeleteFile(cached.path);
+        return FALSE;
+    }
+
+    vdufile.m_length = cached.size;
+
+    //Make sure directory exists
+    if (CreateDirectory(GetWorkDirPath(), NULL))
+        SetFileAttributes(GetWorkDirPath(), FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_READONLY);
+
+    CString finalPath = GetWorkDirPath() + _T("\\") + vdufile.m_name;
+    if (!MoveFileEx(cached.path, finalPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH | MOVEFILE_COPY_ALLOWED))
+    {
+        DeleteFile(cached.path);
+        return FALSE;
+    }
+
+    //Content may have been edited after its last upload, it has to match the version the server confirmed
+    if (CalcFileMD5Base64(vdufile) != vdufile.m_md5base64)
+    {
+        DeleteFile(finalPath);
+        return FALSE;
+    }
+
+    FILETIME lastModified;
+    HANDLE hFile = CreateFile(finalPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, NULL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        if (SystemTimeToFileTime(&vdufile.m_lastModified, &lastModified))
+            SetFileTime(hFile, NULL, NULL, &lastModified);
+        CloseHandle(hFile);
+    }
+
+    //Concurrent access of the same token may have finished first
+    if (!AddFileInternal(vdufile))
+        return FALSE;
+
+    UpdateSignatureInternal(vdufile);
+
     return TRUE;
 }
 
@@ -1532,43 +2652,1410 @@ INT CVDUFileSystemService::UpdateVDUFile(CVDUFile vdufile, CString newName, BOOL
     //headers += _T("Content-Length: ") + length + _T("\r\n");
     //Note: Content length is added automatically in CVDUConnection when writing out file
 
-    //If sync, we wait for this thread to finish to get its exit code
-    if (async)
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    ULONGLONG fileSize = ULLONG_MAX;
+    if (GetFileAttributesEx(GetWorkDirPath() + _T("\\") + vdufile.m_name, GetFileExInfoStandard, &attr))
+        fileSize = ((ULONGLONG)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+
+    //Small files share requests, unless they follow versions through the upload queue or go as delta
+    CString token = vdufile.m_token;
+    BOOL batch = fileSize <= UPLOAD_BATCH_MAX_FILE_SIZE && !IsUploadQueued(token) && !(GetSignatureInternal(token) && !vdufile.m_etag.IsEmpty());
+
+    VDUTaskResult result;
+    std::shared_ptr<CVDUTask> submit, submitBatch;
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    auto uploads = m_fileUploads.find(token);
+    BOOL pending = std::find_if(m_pendingUploads.begin(), m_pendingUploads.end(), [&token](const VDUPendingUpload& upload)
+    {
+        return upload.file.m_token == token;
+    }) != m_pendingUploads.end();
+
+    //Version saved while an upload of the file is in flight follows it, with the version the server confirmed by then
+    //Versions saved meanwhile replace each other, like small uploads waiting for a batch
+    if (uploads != m_fileUploads.end() && !pending)
+    {
+        if (!uploads->second.followUp)
+        {
+            uploads->second.followUp = std::make_shared<CVDUTask>(VDUTaskCategory::UPLOAD, [this, token]()
+            {
+                return SendFollowUpload(token);
+            });
+        }
+        uploads->second.file = vdufile;
+        uploads->second.headers = headers;
+        result.result = uploads->second.followUp->GetResult();
+        result.task = uploads->second.followUp;
+    }
+    else if (batch || pending)
     {
-        AfxBeginThread(CVDUConnection::ThreadProc, (LPVOID)new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILE,
-            CVDUSession::CallbackUploadFile, headers, vdufile.m_token, GetWorkDirPath() + _T("\\") + vdufile.m_name));
+        result = QueueBatchUploadLocked(vdufile, headers, fileSize, submitBatch);
+        m_fileUploads[token].inFlight = result;
     }
     else
     {
-        CWinThread* t = AfxBeginThread(CVDUConnection::ThreadProc, (LPVOID)new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILE,
-            CVDUSession::CallbackUploadFile, headers, vdufile.m_token, GetWorkDirPath() + _T("\\") + vdufile.m_name), 0, CREATE_SUSPENDED);
-
-        DWORD exitCode;
-        WAIT_THREAD_EXITCODE(t, exitCode);
+        //Large files go in parallel parts
+        submit = std::make_shared<CVDUTask>(VDUTaskCategory::UPLOAD, [this, vdufile, headers]()
+        {
+            return SendFileUpload(vdufile, headers);
+        });
+        result.result = submit->GetResult();
+        result.task = submit;
+        m_fileUploads[token].inFlight = result;
+    }
+    ReleaseSRWLockExclusive(&m_uploadsLock);
 
-        return exitCode;
+    //Tools rewriting many files do so within a short time, their uploads go together
+    if (submitBatch)
+    {
+        APP->GetScheduler()->Schedule(UPLOAD_BATCH_DELAY, [submitBatch]()
+        {
+            APP->GetWorkerPool()->Submit(submitBatch);
+        });
     }
 
+    if (submit)
+        APP->GetWorkerPool()->Submit(submit);
+
+    //If sync, we wait for the task to finish to get its exit code
+    if (!async)
+        return APP->GetWorkerPool()->Wait(result);
+
     return EXIT_SUCCESS;
 }
 
-INT CVDUFileSystemService::DeleteVDUFile(CVDUFile vdufile, BOOL async)
+INT CVDUFileSystemService::SendFileUpload(CVDUFile vdufile, CString headers)
 {
-    if (async)
+    INT result;
+    try
+    {
+        if (IsUploadQueued(vdufile.m_token))
+        {
+            //Versions queued before go first, this one follows them through the queue
+            result = QueueUpload(vdufile, headers, FALSE);
+            if (result == EXIT_SUCCESS)
+                ReplayQueuedUploads(vdufile.m_token);
+        }
+        else
+        {
+            VDU_DELTA_SIGNATURE signature = GetSignatureInternal(vdufile.m_token);
+            if (signature && !vdufile.m_etag.IsEmpty())
+                result = FinishUpload(vdufile, headers, UploadVDUFileDelta(vdufile, headers, signature));
+            else
+                result = FinishUpload(vdufile, headers, UploadVDUFileFull(vdufile, headers));
+        }
+    }
+    catch (...)
     {
-        AfxBeginThread(CVDUConnection::ThreadProc,
-            (LPVOID)new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::DELETE_FILE, CVDUSession::CallbackInvalidateFileToken, _T(""), vdufile.m_token));
+        //Versions saved meanwhile are still sent
+        EndFileUpload(vdufile.m_token);
+        throw;
     }
-    else
+
+    EndFileUpload(vdufile.m_token);
+    return result;
+}
+
+INT CVDUFileSystemService::SendFollowUpload(CString token)
+{
+    //Record stays while its follow-up is set
+    AcquireSRWLockShared(&m_uploadsLock);
+    VDUTaskResult previous = m_fileUploads.find(token)->second.inFlight;
+    ReleaseSRWLockShared(&m_uploadsLock);
+
+    //Condition of this version is read once the server answered the one before, whatever the answer was
+    try
+    {
+        APP->GetWorkerPool()->Wait(previous);
+    }
+    catch (...)
     {
-        CWinThread* t = AfxBeginThread(CVDUConnection::ThreadProc,
-            (LPVOID)new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::DELETE_FILE, CVDUSession::CallbackInvalidateFileToken, _T(""), vdufile.m_token), 0, CREATE_SUSPENDED);
+    }
+
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    VDUFileUploads& uploads = m_fileUploads.find(token)->second;
+    CVDUFile vdufile = uploads.file;
+    CString headers = uploads.headers;
+    uploads.inFlight.result = uploads.followUp->GetResult();
+    uploads.inFlight.task = uploads.followUp;
+    uploads.followUp = nullptr;
+    ReleaseSRWLockExclusive(&m_uploadsLock);
+
+    return SendFileUpload(vdufile, headers);
+}
+
+void CVDUFileSystemService::EndFileUpload(CString token)
+{
+    std::shared_ptr<CVDUTask> next;
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    auto uploads = m_fileUploads.find(token);
+    if (uploads != m_fileUploads.end())
+    {
+        next = uploads->second.followUp;
+        if (!next)
+            m_fileUploads.erase(uploads);
+    }
+    ReleaseSRWLockExclusive(&m_uploadsLock);
 
-        DWORD exitCode;
-        WAIT_THREAD_EXITCODE(t, exitCode);
+    //Follow-up a worker already runs while waiting for it is skipped by the pool
+    if (next)
+        APP->GetWorkerPool()->Submit(next);
+}
+
+VDUTaskResult CVDUFileSystemService::QueueBatchUploadLocked(CVDUFile vdufile, CString headers, ULONGLONG size, std::shared_ptr<CVDUTask>& submit)
+{
+    VDUTaskResult result;
 
-        return exitCode;
+    //One task sends everything queued meanwhile, a worker waiting for an upload may send the batch before the timer does
+    if (!m_batchTask)
+    {
+        m_batchTask = std::make_shared<CVDUTask>(VDUTaskCategory::UPLOAD, [this]()
+        {
+            return SendBatchUploads();
+        });
+        submit = m_batchTask;
     }
 
+    auto pending = std::find_if(m_pendingUploads.begin(), m_pendingUploads.end(), [&vdufile](const VDUPendingUpload& upload)
+    {
+        return upload.file.m_token == vdufile.m_token;
+    });
+
+    if (pending != m_pendingUploads.end())
+    {
+        pending->file = vdufile;
+        pending->headers = headers;
+        pending->size = size;
+        result = pending->result;
+    }
+    else
+    {
+        VDUPendingUpload upload;
+        upload.file = vdufile;
+        upload.headers = headers;
+        upload.size = size;
+        upload.promise = std::make_shared<std::promise<INT>>();
+        upload.result.result = upload.promise->get_future().share();
+        upload.result.task = m_batchTask;
+        m_pendingUploads.push_back(upload);
+        result = upload.result;
+    }
+
+    return result;
+}
+
+INT CVDUFileSystemService::SendBatchUploads()
+{
+    for (;;)
+    {
+        std::vector<VDUPendingUpload> batch;
+        ULONGLONG batchSize = 0;
+
+        AcquireSRWLockExclusive(&m_uploadsLock);
+        while (!m_pendingUploads.empty() && batch.size() < UPLOAD_BATCH_MAX_FILES &&
+            (batch.empty() || batchSize + m_pendingUploads.front().size <= UPLOAD_BATCH_MAX_SIZE))
+        {
+            batchSize += m_pendingUploads.front().size;
+            batch.push_back(m_pendingUploads.front());
+            m_pendingUploads.erase(m_pendingUploads.begin());
+        }
+
+        if (batch.empty())
+            m_batchTask = nullptr;
+        ReleaseSRWLockExclusive(&m_uploadsLock);
+
+        if (batch.empty())
+            break;
+
+        UploadVDUFileBatch(batch);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void CVDUFileSystemService::UploadVDUFileBatch(std::vector<VDUPendingUpload> uploads)
+{
+    std::vector<BOOL> answered(uploads.size(), FALSE);
+
+    //A single file gains nothing from the batch format
+    if (uploads.size() > 1)
+    {
+        //Parts are delimited by their length, the boundary only has to be unlikely in the data
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        CStringA boundary;
+        boundary.Format("vdubatch%016llx", counter.QuadPart);
+
+        CStringA body;
+        std::vector<BOOL> included(uploads.size(), FALSE);
+        std::map<CString, size_t> tokenIndex;
+        for (size_t i = 0; i < uploads.size(); i++)
+        {
+            HANDLE hFile = CreateFile(GetWorkDirPath() + _T("\\") + uploads[i].file.m_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (hFile == INVALID_HANDLE_VALUE)
+                continue;
+
+            //Files that grew meanwhile are left for an upload of their own
+            std::vector<BYTE> data(UPLOAD_BATCH_MAX_FILE_SIZE + 1);
+            DWORD readLen = 0;
+            BOOL bResult = ReadFile(hFile, data.data(), (DWORD)data.size(), &readLen, NULL);
+            CloseHandle(hFile);
+            if (!bResult || readLen > UPLOAD_BATCH_MAX_FILE_SIZE)
+                continue;
+
+            CStringA part;
+            part.Format("--%s\r\nX-File-Token: %s\r\n%sContent-Length: %u\r\n\r\n", boundary.GetString(),
+                CT2A(uploads[i].file.m_token, CP_UTF8).m_psz, CT2A(uploads[i].headers + GetUploadCondition(uploads[i].file.m_token), CP_UTF8).m_psz, readLen);
+            body += part;
+            body.Append((LPCSTR)data.data(), (int)readLen);
+            body += "\r\n";
+
+            included[i] = TRUE;
+            tokenIndex[uploads[i].file.m_token] = i;
+        }
+        body += "--" + boundary + "--\r\n";
+
+        CString requestHeaders;
+        requestHeaders.Format(_T("Content-Type: multipart/mixed; boundary=%s\r\n"), CString(boundary).GetString());
+
+        CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILES_UPLOAD, nullptr, requestHeaders);
+        con.SetContentData(body);
+        CHttpFile* response = con.Open();
+
+        DWORD statusCode = 0;
+        if (response)
+            response->QueryInfoStatusCode(statusCode);
+
+        if (statusCode == HTTP_STATUS_OK)
+        {
+            TRY
+            {
+                std::map<CStringA, CString> headers;
+                while (CVDUSession::ReadBatchPart(response, headers))
+                {
+                    auto index = tokenIndex.find(headers[FILE_TOKEN_HEADER]);
+                    if (index == tokenIndex.end() || answered[index->second])
+                        continue;
+
+                    //Timed out or damaged parts are sent again on their own, outdated files come with the server ETag
+                    DWORD partStatus = (DWORD)_ttoi(headers["status"]);
+                    if (partStatus == HTTP_STATUS_REQUEST_TIMEOUT || (partStatus == HTTP_STATUS_PRECOND_FAILED && headers["etag"].IsEmpty()))
+                        continue;
+
+                    VDUPendingUpload& upload = uploads[index->second];
+                    INT result = FinishUpload(upload.file, upload.headers,
+                        CVDUSession::UploadFileResult(upload.file.m_token, partStatus, headers["allow"], headers["expires"], headers["etag"]));
+                    EndFileUpload(upload.file.m_token);
+                    upload.promise->set_value(result);
+                    answered[index->second] = TRUE;
+                }
+            }
+            CATCH(CInternetException, e)
+            {
+                e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
+            }
+            END_CATCH;
+        }
+    }
+
+    //Servers without batch uploads take every file on its own
+    for (size_t i = 0; i < uploads.size(); i++)
+    {
+        if (!answered[i])
+        {
+            INT result = FinishUpload(uploads[i].file, uploads[i].headers, UploadVDUFileFull(uploads[i].file, uploads[i].headers));
+            EndFileUpload(uploads[i].file.m_token);
+            uploads[i].promise->set_value(result);
+        }
+    }
+}
+
+INT CVDUFileSystemService::UploadVDUFileDelta(CVDUFile vdufile, CString headers, VDU_DELTA_SIGNATURE signature)
+{
+    CString serverURL = APP->GetSession()->GetServerURL();
+    CString filePath = GetWorkDirPath() + _T("\\") + vdufile.m_name;
+    INT result = DELTA_RESULT_FALLBACK;
+
+    TCHAR tempBuf[MAX_PATH + 1] = { 0 };
+    GetTempPath(ARRAYSIZE(tempBuf), tempBuf);
+
+    TCHAR deltaPath[MAX_PATH] = { 0 };
+    if (GetTempFileName(tempBuf, _T("vdd"), 0, deltaPath) > 0)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        ULONGLONG deltaSize;
+        if (GetFileAttributesEx(filePath, GetFileExInfoStandard, &attr) && CVDUDelta::CreateDelta(filePath, *signature, deltaPath, deltaSize))
+        {
+            //Not worth it when most of the file changed
+            ULONGLONG fileSize = ((ULONGLONG)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+            if (deltaSize < fileSize / 2)
+            {
+                //Server rebuilds the file from the version it has, If-Match makes sure it is the one the blocks refer to
+                CString deltaHeaders = headers;
+                deltaHeaders += _T("If-Match: ") + vdufile.m_etag + _T("\r\n");
+
+                CVDUConnection con(serverURL, VDUAPIType::POST_FILE_DELTA, CVDUSession::CallbackUploadFileDelta, deltaHeaders, vdufile.m_token, deltaPath);
+                result = con.Process();
+            }
+        }
+
+        DeleteFile(deltaPath);
+    }
+
+    if (result != DELTA_RESULT_FALLBACK)
+        return result;
+
+    return UploadVDUFileFull(vdufile, headers);
+}
+
+CString CVDUFileSystemService::GetUploadCondition(CString filetoken)
+{
+    //Latest version is read when sending, an earlier upload of the same file may have finished meanwhile
+    CString etag = GetVDUFileByToken(filetoken).m_etag;
+    if (etag.IsEmpty())
+        return _T("");
+
+    return _T("If-Match: ") + etag + _T("\r\n");
+}
+
+INT CVDUFileSystemService::FinishUpload(CVDUFile vdufile, CString headers, INT result)
+{
+    if (result == UPLOAD_RESULT_OFFLINE)
+        return QueueUpload(vdufile, headers, TRUE);
+
+    //Server has a later version, the queued one must not be sent after it
+    if (result == EXIT_SUCCESS)
+    {
+        AcquireSRWLockExclusive(&m_uploadsLock);
+        auto queued = std::find_if(m_queuedUploads.begin(), m_queuedUploads.end(), [&vdufile](const VDUQueuedUpload& upload)
+        {
+            return upload.token == vdufile.m_token;
+        });
+        if (queued != m_queuedUploads.end())
+        {
+            DeleteFile(queued->path);
+            m_queuedUploads.erase(queued);
+            SaveUploadQueueLocked();
+        }
+        ReleaseSRWLockExclusive(&m_uploadsLock);
+    }
+
+    return result;
+}
+
+INT CVDUFileSystemService::QueueUpload(CVDUFile vdufile, CString headers, BOOL sent)
+{
+    //File may change again before the server is back, the queue keeps a copy of this version
+    CString queueDir = GetUploadQueueDirPath();
+    CreateDirectory(queueDir, NULL);
+    TCHAR copyPath[MAX_PATH] = { 0 };
+    if (!GetTempFileName(queueDir, _T("vdq"), 0, copyPath) || !CopyFile(GetWorkDirPath() + _T("\\") + vdufile.m_name, copyPath, FALSE))
+    {
+        DeleteFile(copyPath);
+        WND->MessageBoxNB(_T("Server is not reachable and the changes could not be kept to be uploaded later!"), TITLENAME, MB_ICONERROR);
+        return EXIT_FAILURE;
+    }
+
+    VDUQueuedUpload upload;
+    upload.token = vdufile.m_token;
+    upload.etag = GetVDUFileByToken(vdufile.m_token).m_etag;
+    upload.location = vdufile.m_name;
+    upload.type = vdufile.m_type;
+    upload.encoding = vdufile.m_encoding;
+    upload.path = copyPath;
+
+    auto headerValue = [&headers](CString name)
+    {
+        INT start = headers.Find(name + _T(": "));
+        if (start < 0)
+            return CString();
+        start += name.GetLength() + 2;
+        return headers.Mid(start, headers.Find(_T("\r\n"), start) - start);
+    };
+
+    //Renames are uploaded with the new name
+    if (!headerValue(_T("Content-Location")).IsEmpty())
+        upload.location = headerValue(_T("Content-Location"));
+
+    //Request may have reached the server with only the answer lost
+    if (sent)
+        upload.unanswered = headerValue(_T("Content-MD5"));
+
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    auto queued = std::find_if(m_queuedUploads.begin(), m_queuedUploads.end(), [&upload](const VDUQueuedUpload& other)
+    {
+        return other.token == upload.token;
+    });
+
+    //Only the latest version is kept, it builds on the version the server had when the first one was queued
+    if (queued != m_queuedUploads.end())
+    {
+        DeleteFile(queued->path);
+        upload.etag = queued->etag;
+        if (!queued->unanswered.IsEmpty())
+            upload.unanswered = upload.unanswered.IsEmpty() ? queued->unanswered : queued->unanswered + _T(",") + upload.unanswered;
+        *queued = upload;
+    }
+    else
+        m_queuedUploads.push_back(upload);
+
+    SaveUploadQueueLocked();
+    ScheduleReplayLocked();
+    ReleaseSRWLockExclusive(&m_uploadsLock);
+
+    return EXIT_SUCCESS;
+}
+
+BOOL CVDUFileSystemService::IsUploadQueued(CString token)
+{
+    AcquireSRWLockShared(&m_uploadsLock);
+    BOOL queued = std::find_if(m_queuedUploads.begin(), m_queuedUploads.end(), [&token](const VDUQueuedUpload& upload)
+    {
+        return upload.token == token;
+    }) != m_queuedUploads.end();
+    ReleaseSRWLockShared(&m_uploadsLock);
+    return queued;
+}
+
+void CVDUFileSystemService::ScheduleReplayLocked()
+{
+    if (m_replayScheduled || m_replayAwaitsLogin || m_queuedUploads.empty())
+        return;
+
+    m_replayScheduled = TRUE;
+    APP->GetScheduler()->Schedule(m_replayDelay, [this]()
+    {
+        APP->GetWorkerPool()->Submit(VDUTaskCategory::UPLOAD, [this]()
+        {
+            INT result = ReplayQueuedUploads(_T(""));
+
+            //Server that is still unreachable is asked less often
+            AcquireSRWLockExclusive(&m_uploadsLock);
+            m_replayScheduled = FALSE;
+            m_replayDelay = result == EXIT_SUCCESS ? UPLOAD_REPLAY_DELAY : min(m_replayDelay * 2, (DWORD)UPLOAD_REPLAY_DELAY_MAX);
+            ScheduleReplayLocked();
+            ReleaseSRWLockExclusive(&m_uploadsLock);
+
+            return result;
+        });
+    });
+}
+
+void CVDUFileSystemService::ResumeUploadReplay()
+{
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    m_replayAwaitsLogin = FALSE;
+    m_replayDelay = UPLOAD_REPLAY_DELAY;
+    ScheduleReplayLocked();
+    ReleaseSRWLockExclusive(&m_uploadsLock);
+}
+
+INT CVDUFileSystemService::ReplayQueuedUploads(CString token)
+{
+    INT result = EXIT_SUCCESS;
+
+    AcquireSRWLockExclusive(&m_replayLock);
+    for (;;)
+    {
+        //Queue may change while a version is sent
+        VDUQueuedUpload upload;
+        BOOL found = FALSE;
+        AcquireSRWLockShared(&m_uploadsLock);
+        for (auto it = m_queuedUploads.begin(); it != m_queuedUploads.end() && !found; it++)
+        {
+            if (token.IsEmpty() || it->token == token)
+            {
+                upload = *it;
+                found = TRUE;
+            }
+        }
+        ReleaseSRWLockShared(&m_uploadsLock);
+
+        if (!found)
+            break;
+
+        CString md5 = CalcFileMD5Base64(upload.path);
+        CString headers;
+        headers += _T("Content-Encoding: ") + upload.encoding + _T("\r\n");
+        headers += _T("Content-Type: ") + upload.type + _T("\r\n");
+        headers += _T("Content-Location: ") + upload.location + _T("\r\n");
+        headers += _T("Content-MD5: ") + md5 + _T("\r\n");
+        if (!upload.etag.IsEmpty())
+            headers += _T("If-Match: ") + upload.etag + _T("\r\n");
+
+        CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILE, nullptr, headers, upload.token, upload.path);
+        CHttpFile* response = con.Open();
+        DWORD statusCode = 0;
+        CString allow, expires, etag;
+        if (response)
+        {
+            response->QueryInfoStatusCode(statusCode);
+            response->QueryInfo(HTTP_QUERY_ALLOW, allow);
+            response->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+            response->QueryInfo(HTTP_QUERY_ETAG, etag);
+        }
+
+        //Version the server refuses may be one of ours whose answer was lost
+        if (statusCode == HTTP_STATUS_PRECOND_FAILED)
+        {
+            CVDUConnection check(APP->GetSession()->GetServerURL(), VDUAPIType::HEAD_FILE, nullptr, _T(""), upload.token);
+            CHttpFile* checkResponse = check.Open();
+            DWORD checkStatus = 0;
+            CString serverMD5;
+            if (checkResponse)
+            {
+                checkResponse->QueryInfoStatusCode(checkStatus);
+                checkResponse->QueryInfo(HTTP_QUERY_CONTENT_MD5, serverMD5);
+            }
+
+            if (checkStatus == HTTP_STATUS_OK && !serverMD5.IsEmpty())
+            {
+                CString serverEtag;
+                checkResponse->QueryInfo(HTTP_QUERY_ETAG, serverEtag);
+
+                //This very version landed
+                if (serverMD5 == md5)
+                {
+                    statusCode = HTTP_STATUS_CREATED;
+                    etag = serverEtag;
+                    checkResponse->QueryInfo(HTTP_QUERY_ALLOW, allow);
+                    checkResponse->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+                }
+                //An earlier one landed, this one builds on it now
+                else if ((_T(",") + upload.unanswered + _T(",")).Find(_T(",") + serverMD5 + _T(",")) >= 0)
+                {
+                    AcquireSRWLockExclusive(&m_uploadsLock);
+                    for (auto it = m_queuedUploads.begin(); it != m_queuedUploads.end(); it++)
+                    {
+                        if (it->token == upload.token)
+                        {
+                            it->etag = serverEtag;
+                            it->unanswered.Empty();
+                        }
+                    }
+                    SaveUploadQueueLocked();
+                    ReleaseSRWLockExclusive(&m_uploadsLock);
+                    continue;
+                }
+            }
+        }
+
+        //Still unreachable, or not logged in again after a restart
+        if (!statusCode || statusCode == HTTP_STATUS_DENIED || statusCode == HTTP_STATUS_REQUEST_TIMEOUT || statusCode >= HTTP_STATUS_SERVER_ERROR)
+        {
+            //Asking again does not help before the user logs in
+            if (statusCode == HTTP_STATUS_DENIED)
+            {
+                AcquireSRWLockExclusive(&m_uploadsLock);
+                m_replayAwaitsLogin = TRUE;
+                ReleaseSRWLockExclusive(&m_uploadsLock);
+            }
+
+            //Request may have reached the server with only the answer lost
+            if (!statusCode && CVDUConnection::IsServerUnreachable())
+            {
+                AcquireSRWLockExclusive(&m_uploadsLock);
+                for (auto it = m_queuedUploads.begin(); it != m_queuedUploads.end(); it++)
+                {
+                    if (it->token == upload.token && (_T(",") + it->unanswered + _T(",")).Find(_T(",") + md5 + _T(",")) < 0)
+                        it->unanswered = it->unanswered.IsEmpty() ? md5 : it->unanswered + _T(",") + md5;
+                }
+                SaveUploadQueueLocked();
+                ReleaseSRWLockExclusive(&m_uploadsLock);
+            }
+
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        //Taken or refused for good, either way it leaves the queue
+        AcquireSRWLockExclusive(&m_uploadsLock);
+        auto queued = std::find_if(m_queuedUploads.begin(), m_queuedUploads.end(), [&upload](const VDUQueuedUpload& other)
+        {
+            return other.token == upload.token;
+        });
+        BOOL current = queued != m_queuedUploads.end() && queued->path == upload.path;
+        if (current)
+            m_queuedUploads.erase(queued);
+        else if (queued != m_queuedUploads.end() && statusCode == HTTP_STATUS_CREATED)
+        {
+            //Version queued meanwhile builds on the one just sent
+            queued->etag = etag;
+            queued->unanswered.Empty();
+        }
+        SaveUploadQueueLocked();
+        ReleaseSRWLockExclusive(&m_uploadsLock);
+
+        if (current)
+            DeleteFile(upload.path);
+
+        //Accessed file takes the version the server confirmed, refusals are reported unless a later version replaced this one
+        if (statusCode == HTTP_STATUS_CREATED ? GetVDUFileByToken(upload.token).IsValid() : current)
+            CVDUSession::UploadFileResult(upload.token, statusCode, allow, expires, etag);
+    }
+    ReleaseSRWLockExclusive(&m_replayLock);
+
+    return result;
+}
+
+void CVDUFileSystemService::SaveUploadQueueLocked()
+{
+    CString journal = _T("#Versions the server did not receive, token, base version, name, type, encoding, copy and unanswered versions\r\n");
+    for (auto it = m_queuedUploads.begin(); it != m_queuedUploads.end(); it++)
+        journal.AppendFormat(_T("%s\t%s\t%s\t%s\t%s\t%s\t%s\r\n"), (LPCTSTR)it->token, (LPCTSTR)it->etag, (LPCTSTR)it->location,
+            (LPCTSTR)it->type, (LPCTSTR)it->encoding, PathFindFileName(it->path), (LPCTSTR)it->unanswered);
+
+    //Journal lists only copies that are complete, a crash loses at most the version being queued
+    CreateDirectory(GetUploadQueueDirPath(), NULL);
+    WriteTextFile(GetUploadQueueDirPath() + _T("\\queue.txt"), journal);
+}
+
+void CVDUFileSystemService::LoadUploadQueue()
+{
+    CString queueDir = GetUploadQueueDirPath();
+    CString journal;
+    ReadTextFile(queueDir + _T("\\queue.txt"), journal);
+
+    std::vector<VDUQueuedUpload> uploads;
+    INT pos = 0;
+    CString line = journal.Tokenize(_T("\r\n"), pos);
+    while (pos >= 0)
+    {
+        VDUQueuedUpload upload;
+        CString name;
+        AfxExtractSubString(upload.token, line, 0, '\t');
+        AfxExtractSubString(upload.etag, line, 1, '\t');
+        AfxExtractSubString(upload.location, line, 2, '\t');
+        AfxExtractSubString(upload.type, line, 3, '\t');
+        AfxExtractSubString(upload.encoding, line, 4, '\t');
+        AfxExtractSubString(name, line, 5, '\t');
+        AfxExtractSubString(upload.unanswered, line, 6, '\t');
+        upload.path = queueDir + _T("\\") + name;
+
+        if (line[0] != '#' && !upload.token.IsEmpty() && !name.IsEmpty() && GetFileAttributes(upload.path) != INVALID_FILE_ATTRIBUTES)
+            uploads.push_back(upload);
+
+        line = journal.Tokenize(_T("\r\n"), pos);
+    }
+
+    //Copies the journal does not list were being queued when the client stopped
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFile(queueDir + _T("\\vdq*"), &findData);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            CString path = queueDir + _T("\\") + findData.cFileName;
+            if (std::find_if(uploads.begin(), uploads.end(), [&path](const VDUQueuedUpload& upload) { return !upload.path.CompareNoCase(path); }) == uploads.end())
+                DeleteFile(path);
+        } while (FindNextFile(hFind, &findData));
+        FindClose(hFind);
+    }
+
+    AcquireSRWLockExclusive(&m_uploadsLock);
+    m_queuedUploads = uploads;
+    ScheduleReplayLocked();
+    ReleaseSRWLockExclusive(&m_uploadsLock);
+}
+
+CString CVDUFileSystemService::GetUploadQueueDirPath()
+{
+    //Next to the work directory, the copies are not part of the drive and survive its cleanup
+    return GetWorkDirPath() + _T(".uploads");
+}
+
+void CVDUFileSystemService::DrainUploads()
+{
+    //Small uploads otherwise wait for the batch timer, which does not fire once the client exits
+    BOOL pending;
+    AcquireSRWLockShared(&m_uploadsLock);
+    pending = !m_pendingUploads.empty();
+    ReleaseSRWLockShared(&m_uploadsLock);
+
+    if (pending)
+        SendBatchUploads();
+}
+
+INT CVDUFileSystemService::UploadVDUFileFull(CVDUFile vdufile, CString headers)
+{
+    CString filePath = GetWorkDirPath() + _T("\\") + vdufile.m_name;
+
+    //Server refuses to overwrite changes made since the file was accessed
+    headers += GetUploadCondition(vdufile.m_token);
+
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    ULONGLONG fileSize = 0;
+    if (GetFileAttributesEx(filePath, GetFileExInfoStandard, &attr))
+        fileSize = ((ULONGLONG)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+
+    INT result;
+    if (fileSize >= UPLOAD_PARTS_MIN_SIZE && UploadVDUFileParts(vdufile, headers, fileSize, result))
+        return result;
+
+    //A single request cannot carry more
+    if (fileSize > MAXDWORD)
+    {
+        WND->MessageBoxNB(_T("File is too large to be uploaded to this server!"), TITLENAME, MB_ICONERROR);
+        return EXIT_FAILURE;
+    }
+
+    //WinInet does not wait for 100 Continue, large bodies are only sent once HEAD confirmed the version
+    CString etag = GetVDUFileByToken(vdufile.m_token).m_etag;
+    if (fileSize >= UPLOAD_PRECHECK_MIN_SIZE && !etag.IsEmpty())
+    {
+        CVDUConnection check(APP->GetSession()->GetServerURL(), VDUAPIType::HEAD_FILE, nullptr, _T(""), vdufile.m_token);
+        CHttpFile* response = check.Open();
+        DWORD statusCode = 0;
+        CString serverEtag;
+        if (response)
+        {
+            response->QueryInfoStatusCode(statusCode);
+            response->QueryInfo(HTTP_QUERY_ETAG, serverEtag);
+        }
+
+        if (statusCode == HTTP_STATUS_OK && serverEtag != etag)
+            statusCode = HTTP_STATUS_PRECOND_FAILED;
+
+        //Anything else, e.g. a server without HEAD, is left to the upload itself
+        if (statusCode == HTTP_STATUS_PRECOND_FAILED || statusCode == HTTP_STATUS_NOT_FOUND || statusCode == HTTP_STATUS_DENIED)
+            return CVDUSession::UploadFileResult(vdufile.m_token, statusCode, _T(""), _T(""), _T(""));
+    }
+
+    //Compressible files are sent gzip compressed, like downloads the stored encoding and length move to their own headers
+    CString bodyPath = filePath;
+    CString gzipPath;
+    ULONGLONG contentLength = 0;
+    CString contentMD5;
+    if (fileSize >= UPLOAD_COMPRESS_MIN_SIZE)
+        gzipPath = CompressUpload(filePath, contentLength, contentMD5);
+
+    if (!gzipPath.IsEmpty())
+    {
+        CString compressedHeaders;
+        INT pos = 0;
+        CString line = headers.Tokenize(_T("\r\n"), pos);
+        while (pos >= 0)
+        {
+            //Content-MD5 is replaced by the hash of the bytes compressed, the server checks it once inflated
+            if (line.Find(_T("Content-Encoding:")) == 0)
+                compressedHeaders += CString(CONTENT_ENCODING_HEADER) + line.Mid(16) + _T("\r\n");
+            else if (line.Find(_T("Content-MD5:")) != 0)
+                compressedHeaders += line + _T("\r\n");
+            line = headers.Tokenize(_T("\r\n"), pos);
+        }
+
+        compressedHeaders += _T("Content-Encoding: gzip\r\n");
+        compressedHeaders.AppendFormat(_T("%s: %llu\r\n"), CONTENT_LENGTH_HEADER, contentLength);
+        compressedHeaders += _T("Content-MD5: ") + contentMD5 + _T("\r\n");
+        headers = compressedHeaders;
+        bodyPath = gzipPath;
+    }
+
+    CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::POST_FILE, CVDUSession::CallbackUploadFile, headers, vdufile.m_token, bodyPath);
+
+    //Conflicts and expired keys are answered before the body is sent
+    if (fileSize >= UPLOAD_EXPECT_MIN_SIZE)
+        con.SetExpectContinue(TRUE);
+
+    result = con.Process();
+    if (!gzipPath.IsEmpty())
+        DeleteFile(gzipPath);
+
+    return result;
+}
+
+CString CVDUFileSystemService::CompressUpload(CString filePath, ULONGLONG& contentLength, CString& contentMD5)
+{
+    HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return _T("");
+
+    //Start of the file tells whether it compresses at all, zip, png and alike are sent as they are
+    std::vector<BYTE> data(UPLOAD_COMPRESS_SAMPLE_SIZE);
+    std::vector<BYTE> compressed;
+    DWORD readLen = 0;
+    if (!ReadFile(hFile, data.data(), (DWORD)data.size(), &readLen, NULL) || readLen < UPLOAD_COMPRESS_MIN_SIZE)
+    {
+        CloseHandle(hFile);
+        return _T("");
+    }
+
+    CVDUGzipEncoder sample;
+    sample.Update(data.data(), readLen, compressed);
+    sample.Finish(compressed);
+    if (compressed.size() > readLen * UPLOAD_COMPRESS_MAX_RATIO)
+    {
+        CloseHandle(hFile);
+        return _T("");
+    }
+    compressed.clear();
+
+    TCHAR tempDir[MAX_PATH + 1] = { 0 };
+    TCHAR gzipPath[MAX_PATH] = { 0 };
+    HANDLE hGzip = INVALID_HANDLE_VALUE;
+    if (GetTempPath(ARRAYSIZE(tempDir), tempDir) && GetTempFileName(tempDir, _T("vdz"), 0, gzipPath))
+        hGzip = CreateFile(gzipPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    HCRYPTPROV hProv = NULL;
+    HCRYPTHASH hHash = NULL;
+    BOOL ok = hGzip != INVALID_HANDLE_VALUE && CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) &&
+        CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash);
+
+    //Hashed while compressed, Content-MD5 has to match the bytes the server inflates even if the file changed meanwhile
+    CVDUGzipEncoder encoder;
+    ULONGLONG written = 0;
+    BOOL finished = FALSE;
+    while (ok && !finished)
+    {
+        if (readLen > 0)
+        {
+            ok = CryptHashData(hHash, data.data(), readLen, 0);
+            encoder.Update(data.data(), readLen, compressed);
+        }
+        else
+        {
+            encoder.Finish(compressed);
+            finished = TRUE;
+        }
+
+        DWORD writeLen = 0;
+        ok = ok && WriteFile(hGzip, compressed.data(), (DWORD)compressed.size(), &writeLen, NULL) && writeLen == compressed.size();
+        written += compressed.size();
+        compressed.clear();
+
+        if (!finished)
+            ok = ok && ReadFile(hFile, data.data(), (DWORD)data.size(), &readLen, NULL);
+    }
+
+    //Whole file has to shrink as well, not only its start
+    ok = ok && written <= encoder.GetLength() * UPLOAD_COMPRESS_MAX_RATIO;
+
+    BYTE rgbHash[MD5_LEN] = { 0 };
+    DWORD cbHash = MD5_LEN;
+    ok = ok && CryptGetHashParam(hHash, HP_HASHVAL, rgbHash, &cbHash, 0);
+
+    if (hHash)
+        CryptDestroyHash(hHash);
+    if (hProv)
+        CryptReleaseContext(hProv, 0);
+    if (hGzip != INVALID_HANDLE_VALUE)
+        CloseHandle(hGzip);
+    CloseHandle(hFile);
+
+    if (!ok)
+    {
+        if (gzipPath[0])
+            DeleteFile(gzipPath);
+        return _T("");
+    }
+
+    BYTE md5base64[0x400] = { 0 };
+    INT md5base64len = ARRAYSIZE(md5base64);
+    Base64Encode(rgbHash, cbHash, (LPSTR)md5base64, &md5base64len);
+    contentMD5 = CString(md5base64);
+    contentLength = encoder.GetLength();
+    return CString(gzipPath);
+}
+
+BOOL CVDUFileSystemService::UploadVDUFileParts(CVDUFile vdufile, CString headers, ULONGLONG fileSize, INT& result)
+{
+    CString serverURL = APP->GetSession()->GetServerURL();
+    CString filePath = GetWorkDirPath() + _T("\\") + vdufile.m_name;
+
+    ULONGLONG partSize = UPLOAD_PART_SIZE;
+    while ((fileSize + partSize - 1) / partSize > UPLOAD_PART_MAX_COUNT)
+        partSize *= 2;
+    UINT partCount = (UINT)max((fileSize + partSize - 1) / partSize, (ULONGLONG)1);
+
+    //Servers without chunked uploads reject the start, the file is then sent in a single request
+    CString uploadId;
+    {
+        CString startHeaders;
+        startHeaders.Format(_T("X-Upload-Length: %llu\r\nX-Upload-Part-Size: %llu\r\n"), fileSize, partSize);
+        startHeaders += GetUploadCondition(vdufile.m_token);
+
+        CVDUConnection con(serverURL, VDUAPIType::POST_UPLOAD, nullptr, startHeaders, vdufile.m_token);
+        CHttpFile* response = con.Open();
+        DWORD statusCode = 0;
+        if (response)
+            response->QueryInfoStatusCode(statusCode);
+
+        //Outdated file is refused before any part is sent
+        if (statusCode == HTTP_STATUS_PRECOND_FAILED)
+        {
+            result = CVDUSession::UploadFileResult(vdufile.m_token, statusCode, _T(""), _T(""), _T(""));
+            return TRUE;
+        }
+
+        if (statusCode != HTTP_STATUS_CREATED || !CVDUSession::QueryCustomHeader(response, UPLOAD_ID_HEADER, uploadId))
+            return FALSE;
+    }
+
+    CString uploadParam = vdufile.m_token + _T("/uploads/") + uploadId;
+    UINT parallel = max(APP->GetProfileInt(SECTION_SETTINGS, _T("UploadParallelParts"), UPLOAD_DEFAULT_PARALLEL_PARTS), (UINT)1);
+    std::vector<BOOL> received(partCount, FALSE);
+    UINT missing = partCount;
+    BOOL unreachable = FALSE;
+
+    for (UINT round = 0; missing > 0 && round <= UPLOAD_PART_RETRY_COUNT; round++)
+    {
+        if (round > 0)
+        {
+            Sleep(UPLOAD_PART_RETRY_DELAY << (round - 1));
+
+            //A part may have arrived even if its response did not, the server knows which ones it has
+            CVDUConnection con(serverURL, VDUAPIType::GET_UPLOAD, nullptr, _T(""), uploadParam);
+            CHttpFile* response = con.Open();
+            DWORD statusCode = 0;
+            if (response)
+                response->QueryInfoStatusCode(statusCode);
+
+            if (statusCode == HTTP_STATUS_OK)
+            {
+                CStringA body;
+                TRY
+                {
+                    char buf[0x1000];
+                    UINT readLen;
+                    while ((readLen = response->Read(buf, sizeof(buf))) > 0)
+                        body.Append(buf, readLen);
+                }
+                CATCH(CInternetException, e)
+                {
+                    body.Empty();
+                }
+                END_CATCH;
+
+                int pos = 0;
+                CStringA token = body.Tokenize(",", pos);
+                while (!token.IsEmpty())
+                {
+                    UINT part = (UINT)atoi(token);
+                    if (part < partCount)
+                        received[part] = TRUE;
+                    token = body.Tokenize(",", pos);
+                }
+            }
+        }
+
+        //Keeps at most parallel parts in flight, every part is a range of the mapped file sent on its own pooled connection
+        std::vector<std::pair<UINT, VDUTaskResult>> inFlight;
+        auto finishOldest = [&]()
+        {
+            INT partResult = APP->GetWorkerPool()->Wait(inFlight.front().second);
+            if (partResult == EXIT_SUCCESS)
+                received[inFlight.front().first] = TRUE;
+            else
+                unreachable = partResult == UPLOAD_RESULT_OFFLINE;
+            inFlight.erase(inFlight.begin());
+        };
+
+        for (UINT part = 0; part < partCount; part++)
+        {
+            if (received[part])
+                continue;
+
+            if (inFlight.size() >= parallel)
+                finishOldest();
+
+            CString partParam;
+            partParam.Format(_T("%s/%u"), uploadParam.GetString(), part);
+            ULONGLONG offset = part * partSize;
+            ULONGLONG length = min(partSize, fileSize - offset);
+
+            inFlight.push_back(std::make_pair(part, APP->GetWorkerPool()->Submit(VDUTaskCategory::UPLOAD, [serverURL, partParam, filePath, offset, length]()
+            {
+                CVDUConnection con(serverURL, VDUAPIType::PUT_UPLOAD_PART, nullptr, _T(""), partParam, filePath);
+                con.SetContentRange(offset, length);
+
+                CHttpFile* response = con.Open();
+                DWORD statusCode = 0;
+                if (response)
+                    response->QueryInfoStatusCode(statusCode);
+                else if (CVDUConnection::IsServerUnreachable())
+                    return UPLOAD_RESULT_OFFLINE;
+
+                return statusCode == HTTP_STATUS_NO_CONTENT ? EXIT_SUCCESS : EXIT_FAILURE;
+            })));
+        }
+
+        while (!inFlight.empty())
+            finishOldest();
+
+        missing = 0;
+        for (UINT part = 0; part < partCount; part++)
+        {
+            if (!received[part])
+                missing++;
+        }
+    }
+
+    if (missing == 0)
+    {
+        //Server assembles the parts and checks them against Content-MD5, the response is that of a whole upload
+        CVDUConnection con(serverURL, VDUAPIType::POST_UPLOAD_COMMIT, CVDUSession::CallbackUploadFile, headers, uploadParam);
+        result = con.Process();
+        if (result == EXIT_SUCCESS)
+            return TRUE;
+    }
+    else if (unreachable)
+    {
+        //Server stopped answering, the whole version is sent again later
+        result = UPLOAD_RESULT_OFFLINE;
+    }
+    else
+    {
+        //Parts were refused or could not be read, e.g. the file shrank meanwhile
+        WND->MessageBoxNB(_T("Error uploading file!"), TITLENAME, MB_ICONERROR);
+        result = EXIT_FAILURE;
+    }
+
+    //Server drops the parts it received
+    CVDUConnection con(serverURL, VDUAPIType::DELETE_UPLOAD, nullptr, _T(""), uploadParam);
+    con.Process();
+
+    return TRUE;
+}
+
+INT CVDUFileSystemService::RenameVDUFile(CVDUFile vdufile, CString newName, BOOL async)
+{
+    VDUTaskResult result = APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, vdufile, newName]()
+    {
+        CString headers = _T("Content-Location: ") + newName + _T("\r\n");
+        headers += GetUploadCondition(vdufile.m_token);
+
+        CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::PATCH_FILE, CVDUSession::CallbackPatchFile, headers, vdufile.m_token);
+        INT patchResult = con.Process();
+        if (patchResult != PATCH_RESULT_FALLBACK)
+            return patchResult;
+
+        return UpdateVDUFile(vdufile, newName, FALSE);
+    });
+
+    //If sync, we wait for the task to finish to get its exit code
+    if (!async)
+        return APP->GetWorkerPool()->Wait(result);
+
+    return EXIT_SUCCESS;
+}
+
+void CVDUFileSystemService::RefreshVDUFiles()
+{
+    std::vector<VDUTaskResult> checks;
+    std::vector<CVDUFile> files = GetVDUFiles();
+    for (auto it = files.begin(); it != files.end(); it++)
+    {
+        checks.push_back(APP->GetWorkerPool()->Submit(
+            new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::HEAD_FILE, CVDUSession::CallbackRefreshFile, _T(""), it->m_token)));
+    }
+
+    for (auto it = checks.begin(); it != checks.end(); it++)
+        APP->GetWorkerPool()->Wait(*it);
+}
+
+void CVDUFileSystemService::ScheduleRefreshVDUFiles()
+{
+    //Every file is checked periodically, 0 disables the checks
+    UINT interval = APP->GetProfileInt(SECTION_SETTINGS, _T("FileRefreshInterval"), FILE_REFRESH_DEFAULT_INTERVAL);
+    if (!interval)
+        return;
+
+    APP->GetScheduler()->Schedule(interval * 1000ULL, [this]()
+    {
+        APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this]()
+        {
+            if (APP->GetSession()->IsLoggedIn() && GetVDUFileCount() > 0)
+                RefreshVDUFiles();
+
+            ScheduleRefreshVDUFiles();
+            return EXIT_SUCCESS;
+        });
+    });
+}
+
+BOOL CVDUFileSystemService::WaitVDUFileEvents(CString& sequence)
+{
+    std::vector<CVDUFile> files = GetVDUFiles();
+
+    //Body lists file tokens one per line, like batch access
+    //Files the server no longer has are not waited for
+    CStringA body;
+    for (auto it = files.begin(); it != files.end(); it++)
+    {
+        CString remoteVersion;
+        if (!GetRemoteVersionInternal(it->m_token, remoteVersion) || !remoteVersion.IsEmpty())
+            body += CStringA(it->m_token) + "\r\n";
+    }
+    if (body.IsEmpty())
+        return FALSE;
+
+    CString headers;
+    headers.Format(_T("%s: %s\r\nContent-Type: text/plain\r\n"), EVENT_SEQUENCE_HEADER, sequence.GetString());
+
+    CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::POST_EVENTS, nullptr, headers);
+    con.SetContentData(body);
+    CHttpFile* response = con.Open();
+    if (!response)
+        return FALSE;
+
+    DWORD statusCode = 0;
+    response->QueryInfoStatusCode(statusCode);
+
+    CString newSequence;
+    if ((statusCode != HTTP_STATUS_OK && statusCode != HTTP_STATUS_NO_CONTENT) ||
+        !CVDUSession::QueryCustomHeader(response, EVENT_SEQUENCE_HEADER, newSequence))
+        return FALSE;
+
+    //Nothing changed while the server waited
+    if (statusCode == HTTP_STATUS_NO_CONTENT)
+    {
+        sequence = newSequence;
+        return TRUE;
+    }
+
+    //Every part names a file and the version the server has now, no content follows
+    std::vector<VDUTaskResult> prefetches;
+    BOOL failed = FALSE;
+    TRY
+    {
+        std::map<CStringA, CString> parts;
+        while (CVDUSession::ReadBatchPart(response, parts))
+        {
+            CVDUFile vdufile = GetVDUFileByToken(parts[FILE_TOKEN_HEADER]);
+            if (!vdufile.IsValid())
+                continue;
+
+            DWORD partStatus = (DWORD)_ttoi(parts["status"]);
+            CString etag = parts["etag"];
+            if (partStatus == HTTP_STATUS_NOT_FOUND)
+            {
+                if (ReportRemoteVersionInternal(vdufile.m_token, _T("")) && !APP->IsTestMode())
+                    WND->TrayNotify(vdufile.m_name, _T("File is no longer available on the server."), SIID_WARNING);
+            }
+            else if (partStatus == HTTP_STATUS_OK && !etag.IsEmpty() && etag != vdufile.m_etag)
+            {
+                prefetches.push_back(APP->GetWorkerPool()->Submit(VDUTaskCategory::DOWNLOAD, [this, vdufile, etag]()
+                {
+                    if (PrefetchVDUFile(vdufile))
+                    {
+                        if (!APP->IsTestMode())
+                        {
+                            WND->TrayNotify(vdufile.m_name, _T("File was updated to the new version from the server."), SIID_DOCASSOC);
+                            WND->UpdateStatus();
+                        }
+                        return EXIT_SUCCESS;
+                    }
+
+                    //Edits stay based on the version the client has, the user learns of the conflict before uploading them
+                    if (ReportRemoteVersionInternal(vdufile.m_token, etag) && !APP->IsTestMode())
+                        WND->TrayNotify(vdufile.m_name, _T("File was changed on the server, re-access it to get the new version."), SIID_WARNING);
+                    return EXIT_FAILURE;
+                }));
+            }
+        }
+    }
+    CATCH(CInternetException, e)
+    {
+        e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
+        failed = TRUE;
+    }
+    END_CATCH;
+
+    con.Close();
+
+    //Files are not announced twice while their new versions are being fetched
+    for (auto it = prefetches.begin(); it != prefetches.end(); it++)
+        APP->GetWorkerPool()->Wait(*it);
+
+    //Events of a response that broke off are sent again
+    if (failed)
+        return FALSE;
+
+    sequence = newSequence;
+    return TRUE;
+}
+
+BOOL CVDUFileSystemService::PrefetchVDUFile(CVDUFile vdufile)
+{
+    CString filePath = GetWorkDirPath() + _T("\\") + vdufile.m_name;
+
+    //Edited copies are left to be uploaded, or resolved by the user if the upload is refused
+    WIN32_FILE_ATTRIBUTE_DATA checked;
+    if (!GetFileAttributesEx(filePath, GetFileExInfoStandard, &checked) || CalcFileMD5Base64(filePath) != vdufile.m_md5base64)
+        return FALSE;
+
+    CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::GET_FILE, nullptr, _T(""), vdufile.m_token);
+    CHttpFile* response = con.Open();
+
+    DWORD statusCode = 0;
+    if (response)
+        response->QueryInfoStatusCode(statusCode);
+    if (statusCode != HTTP_STATUS_OK)
+        return FALSE;
+
+    CString contentLength;
+    if (!CVDUSession::QueryCustomHeader(response, CONTENT_LENGTH_HEADER, contentLength))
+        response->QueryInfo(HTTP_QUERY_CONTENT_LENGTH, contentLength);
+
+    CString contentLocation;
+    response->QueryInfo(HTTP_QUERY_CONTENT_LOCATION, contentLocation);
+
+    CString contentMD5;
+    response->QueryInfo(HTTP_QUERY_CONTENT_MD5, contentMD5);
+
+    CString etag;
+    response->QueryInfo(HTTP_QUERY_ETAG, etag);
+
+    CString allow;
+    response->QueryInfo(HTTP_QUERY_ALLOW, allow);
+    allow = allow.MakeUpper();
+
+    CString lastModified;
+    response->QueryInfo(HTTP_QUERY_LAST_MODIFIED, lastModified);
+    SYSTEMTIME lastModifiedST;
+    InternetTimeToSystemTime(lastModified, &lastModifiedST, 0);
+
+    CString expires;
+    response->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+    SYSTEMTIME expiresST;
+    InternetTimeToSystemTime(expires, &expiresST, 0);
+
+    //A renamed file shows under its new name when it is accessed again
+    if (contentLocation != vdufile.m_name || etag.IsEmpty() || contentLength.IsEmpty())
+        return FALSE;
+
+    TCHAR tempBuf[MAX_PATH + 1] = { 0 };
+    GetTempPath(ARRAYSIZE(tempBuf), tempBuf);
+
+    TCHAR tmpFilePath[MAX_PATH] = { 0 };
+    if (GetTempFileName(tempBuf, _T("vdu"), 0, tmpFilePath) <= 0)
+        return FALSE;
+
+    //New version is received aside, the local copy stays usable until it is complete
+    HANDLE hTemp = CreateFile(tmpFilePath, GENERIC_WRITE, NULL, NULL, CREATE_ALWAYS, NULL, NULL);
+    BOOL failed = hTemp == INVALID_HANDLE_VALUE;
+    ULONGLONG received = 0;
+    if (!failed)
+    {
+        TRY
+        {
+            std::vector<BYTE> buf(UPLOAD_CHUNK_MIN);
+            UINT readLen;
+            while ((readLen = response->Read(buf.data(), (UINT)buf.size())) > 0)
+            {
+                DWORD writeLen;
+                if (!WriteFile(hTemp, buf.data(), readLen, &writeLen, NULL))
+                {
+                    failed = TRUE;
+                    break;
+                }
+                received += readLen;
+            }
+        }
+        CATCH(CInternetException, e)
+        {
+            e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
+            failed = TRUE;
+        }
+        END_CATCH;
+
+        CloseHandle(hTemp);
+    }
+
+    con.Close();
+
+    if (failed || received != _ttoi64(contentLength) || CalcFileMD5Base64(CString(tmpFilePath)) != contentMD5)
+    {
+        DeleteFile(tmpFilePath);
+        return FALSE;
+    }
+
+    //No handle may be open, a program holding the old content would save it over the new version
+    //The copy must not have been written since it was found unedited
+    HANDLE hFile = CreateFile(filePath, GENERIC_READ | GENERIC_WRITE, NULL, NULL, OPEN_EXISTING, NULL, NULL);
+    BY_HANDLE_FILE_INFORMATION info;
+    if (hFile == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(hFile, &info) ||
+        CompareFileTime(&info.ftLastWriteTime, &checked.ftLastWriteTime) != 0 ||
+        info.nFileSizeHigh != checked.nFileSizeHigh || info.nFileSizeLow != checked.nFileSizeLow)
+    {
+        if (hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hFile);
+        DeleteFile(tmpFilePath);
+        return FALSE;
+    }
+
+    //Content is written into the existing file, which keeps its place in the file system
+    hTemp = CreateFile(tmpFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    BOOL copied = hTemp != INVALID_HANDLE_VALUE;
+    if (copied)
+    {
+        std::vector<BYTE> buf(UPLOAD_CHUNK_MIN);
+        while (copied)
+        {
+            DWORD readLen, writeLen;
+            copied = ReadFile(hTemp, buf.data(), (DWORD)buf.size(), &readLen, NULL);
+            if (!copied || readLen == 0)
+                break;
+            copied = WriteFile(hFile, buf.data(), readLen, &writeLen, NULL);
+        }
+        CloseHandle(hTemp);
+    }
+    copied = copied && SetEndOfFile(hFile);
+
+    FILETIME lastModifiedFT;
+    if (copied && SystemTimeToFileTime(&lastModifiedST, &lastModifiedFT))
+        SetFileTime(hFile, NULL, NULL, &lastModifiedFT);
+
+    CloseHandle(hFile);
+    DeleteFile(tmpFilePath);
+
+    //Half written copy matches no version, the file has to be accessed again
+    if (!copied)
+    {
+        DeleteFileInternal(vdufile.m_token);
+        return FALSE;
+    }
+
+    vdufile.m_etag = etag;
+    vdufile.m_length = received;
+    vdufile.m_md5base64 = contentMD5;
+    vdufile.m_lastModified = lastModifiedST;
+    vdufile.m_expires = expiresST;
+    vdufile.m_canRead = allow.Find(_T("GET")) != -1;
+    vdufile.m_canWrite = allow.Find(_T("POST")) != -1;
+    UpdateFileInternal(vdufile);
+
+    //Next upload of this version can be a delta
+    UpdateSignatureInternal(vdufile);
+
+    return TRUE;
+}
+
+INT CVDUFileSystemService::DeleteVDUFile(CVDUFile vdufile, BOOL async)
+{
+    VDUTaskResult result;
+    if (IsUploadQueued(vdufile.m_token))
+    {
+        //Changes the server did not receive yet would be lost with the token, they are sent first
+        CString token = vdufile.m_token;
+        result = APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, token]()
+        {
+            if (ReplayQueuedUploads(token) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+
+            CVDUConnection con(APP->GetSession()->GetServerURL(), VDUAPIType::DELETE_FILE, CVDUSession::CallbackInvalidateFileToken, _T(""), token);
+            return con.Process();
+        });
+    }
+    else
+    {
+        result = APP->GetWorkerPool()->Submit(
+            new CVDUConnection(APP->GetSession()->GetServerURL(), VDUAPIType::DELETE_FILE, CVDUSession::CallbackInvalidateFileToken, _T(""), vdufile.m_token));
+    }
+
+    //If sync, we wait for the task to finish to get its exit code
+    if (!async)
+        return APP->GetWorkerPool()->Wait(result);
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -34,10 +34,15 @@
 #include <bcrypt.h>
 #include <winfsp/winfsp.hpp>
 #include <vector>
+#include <map>
+#include <future>
 #include <Wincrypt.h>
 #include "VDUClientDlg.h"
 #include "VDUFile.h"
 #include "VDUClient.h"
+#include "VDUDelta.h"
+#include "VDUConnection.h"
+#include "VDUWorkerPool.h"
 #include <VersionHelpers.h>
 
 //Disable the use of Windows internals
@@ -197,9 +202,106 @@ struct VdufsFileDesc
     }
     HANDLE Handle;
     PVOID DirBuffer;
+    CString Token; //Token of the VDU file the handle is open on, empty for other files
 };
 
 
+#define DOWNLOAD_RETRY_COUNT 5 //Attempts to continue an interrupted download
+#define DOWNLOAD_RETRY_DELAY 500 //Delay in ms before the first attempt, doubles with every further attempt
+#define DOWNLOAD_RETRY_DELAY_MAX 8000 //Longest delay in ms between attempts
+#define DOWNLOAD_PARTS_MIN_SIZE 0x4000000 //Files from 64 MB up are downloaded as concurrent ranges if the server supports it
+#define DOWNLOAD_PART_INITIAL_SIZE 0x400000 //Size of the first parts, 4 MB
+#define DOWNLOAD_PART_MIN_SIZE 0x100000 //Smallest part, 1 MB, parts are multiples of it
+#define DOWNLOAD_PART_MAX_SIZE 0x4000000 //Largest part, 64 MB
+#define DOWNLOAD_PART_TARGET_MS 1000 //Parts are sized to take about this long at the rate of the previous one
+#define DOWNLOAD_PART_MAX_FAILURES 16 //Failed parts of a single download before it is given up
+#define DOWNLOAD_PARALLEL_START 4 //Ranges fetched at once when the download starts
+#define DOWNLOAD_DEFAULT_PARALLEL_PARTS 8 //Most ranges fetched at once
+#define DOWNLOAD_PARALLEL_WINDOW_MS 500 //Total rate is measured over this long, a worker is added while it keeps growing
+
+#define UPLOAD_PARTS_MIN_SIZE 0x4000000 //Files from 64 MB up are uploaded in parallel parts if the server supports it
+#define UPLOAD_PART_SIZE 0x800000 //Part size, 8 MB, grows for files that would need too many parts
+#define UPLOAD_PART_MAX_COUNT 10000 //Most parts of a single upload
+#define UPLOAD_DEFAULT_PARALLEL_PARTS 4 //Parts of a file sent at once
+#define UPLOAD_PART_RETRY_COUNT 3 //Rounds resending parts the server did not receive
+#define UPLOAD_PART_RETRY_DELAY 1000 //Delay in ms before the first round, doubles with every further round
+
+#define UPLOAD_BATCH_MAX_FILE_SIZE 0x40000 //Files up to 256 KB are uploaded together with other small files
+#define UPLOAD_BATCH_MAX_FILES 100 //Most files in a single batch upload
+#define UPLOAD_BATCH_MAX_SIZE 0x400000 //Most data in a single batch upload, 4 MB
+#define UPLOAD_BATCH_DELAY 50 //Time in ms small uploads are gathered before they are sent
+#define UPLOAD_EXPECT_MIN_SIZE 0x10000 //Single uploads from 64 KB wait for the server to accept them before sending the body
+
+#define UPLOAD_PRECHECK_MIN_SIZE 0x1000000 //Single uploads from 16 MB check the server version with HEAD before sending the body
+
+#define UPLOAD_COMPRESS_MIN_SIZE 0x400 //Single uploads from 1 KB are sent gzip compressed if they shrink enough
+#define UPLOAD_COMPRESS_SAMPLE_SIZE 0x10000 //Start of the file compressed to decide on compression, also the read size while compressing
+#define UPLOAD_COMPRESS_MAX_RATIO 0.9 //Sample and whole file have to compress at least to this ratio, skips zip, png and alike
+
+#define UPLOAD_REPLAY_DELAY 1000 //Time in ms before queued uploads are sent again, doubles with every failure
+#define UPLOAD_REPLAY_DELAY_MAX 60000 //Longest time in ms between attempts to send queued uploads
+
+#define FILE_REFRESH_DEFAULT_INTERVAL 300 //Seconds between metadata checks of accessed files, 0 disables periodic checks
+#define FILE_REFRESH_EXPIRES_MARGIN 60 //File tokens are extended this many seconds before they expire
+#define FILE_KEEPALIVE_MIN_DELAY 1000 //Shortest time in ms between attempts to extend a file token
+#define FILE_EVENTS_RETRY_DELAY 60000 //Time in ms before waiting for file changes again after the server failed or does not announce them
+
+#define FILESYSTEM_START_TIMEOUT 10000 //Time in ms the file system service has to mount the drive
+
+#define CACHE_DEFAULT_SIZE_MB 1024 //Most content of released files kept for revalidation, in MB
+#define CACHE_MAX_FILES 256 //Most released files kept for revalidation, unless the CacheFiles setting says otherwise
+#define CACHE_MAX_AGE 86400 //Seconds content of a released file is kept for revalidation
+#define CACHE_MANIFEST_DELAY 1000 //Time in ms changes of cached and accessed files are gathered before the cache manifest is saved
+
+//Small upload waiting to be sent in a batch
+struct VDUPendingUpload
+{
+    CVDUFile file; //File to upload
+    CString headers; //Headers of a single upload of the file
+    ULONGLONG size; //File size when the upload was queued
+    std::shared_ptr<std::promise<INT>> promise; //Completes result
+    VDUTaskResult result; //Upload result, completed by the task sending the batch
+};
+
+//Upload of a file in flight and the version saved after it
+//The server refuses the later of two uploads sent with the same If-Match, so one upload of a file is in flight at a time
+struct VDUFileUploads
+{
+    VDUTaskResult inFlight; //Upload in flight
+    std::shared_ptr<CVDUTask> followUp; //Sends the latest version saved meanwhile once the one in flight is answered, empty if there is none
+    CVDUFile file; //Latest version saved meanwhile
+    CString headers; //Its headers
+};
+
+//Version of a file the server did not receive, kept on disk until it is uploaded
+struct VDUQueuedUpload
+{
+    CString token; //File token
+    CString etag; //Version the changes are based on, empty if unknown
+    CString location; //Name the file is uploaded with
+    CString type; //Content type
+    CString encoding; //Content encoding
+    CString path; //Copy of the content in the upload queue directory
+    CString unanswered; //MD5 of versions sent without an answer, comma separated, the server may have them
+};
+
+//Content of a released file, reused when the file is accessed again and the server still has the same version
+struct VDUCachedFile
+{
+    CString path; //File in the cache directory
+    CString etag; //Version of the file the content belongs to
+    ULONGLONG size; //Size of the content
+    ULONGLONG released; //System time in FILETIME units when the file was released, oldest files are evicted first
+};
+
+//Data of a download that was interrupted, continued when the file is accessed again
+struct VDUPartialDownload
+{
+    CString path; //Temporary file holding the data received so far
+    CString etag; //Version of the file the data belongs to
+    ULONGLONG received; //Bytes received
+};
+
 //File system service that handles the filesystem
 class CVDUFileSystemService : public Fsp::Service
 {
@@ -208,13 +310,136 @@ private:
     Fsp::FileSystemHost m_host; //File system host
     TCHAR m_driveLetter[128]; //Drive letter buffer
     CString m_workDirPath; //Path to work directory
+    HANDLE m_started; //Manual reset event, set once the drive is mounted
     SRWLOCK m_filesLock; //Lock for accssing files vector
     std::vector<CVDUFile> m_files; //Vector of accessable files
+    std::map<CString, VDU_DELTA_SIGNATURE> m_signatures; //Block signatures of the version the server has, by token, guarded by m_filesLock
+    std::map<CString, VDUPartialDownload> m_partials; //Interrupted downloads by token, guarded by m_filesLock
+    std::map<CString, VDUCachedFile> m_cache; //Content of released files by token, guarded by m_filesLock
+    std::map<CString, CString> m_remoteVersions; //Versions the server reported for accessed files it changed, by token, guarded by m_filesLock
+    std::map<CString, ULONGLONG> m_keepAliveTimers; //Timers extending tokens of accessed files before they expire, by token, guarded by m_filesLock
+    std::map<CString, UINT> m_openHandles; //Handles open on accessed files, by token, guarded by m_filesLock
+    SRWLOCK m_uploadsLock; //Lock for pending uploads
+    std::vector<VDUPendingUpload> m_pendingUploads; //Small uploads gathered for a batch, guarded by m_uploadsLock
+    std::shared_ptr<CVDUTask> m_batchTask; //Task sending pending uploads, set while one is planned or running, guarded by m_uploadsLock
+    std::map<CString, VDUFileUploads> m_fileUploads; //Uploads in flight by token, guarded by m_uploadsLock
+    std::map<CString, std::pair<CString, CString>> m_leftovers; //Token and version of files accessed in the last run, by name, guarded by m_filesLock
+    SRWLOCK m_manifestLock; //Serializes writes of the cache manifest
+    BOOL m_manifestQueued; //Set while saving the cache manifest is planned, guarded by m_filesLock
+    std::vector<VDUQueuedUpload> m_queuedUploads; //Versions the server did not receive, oldest first, guarded by m_uploadsLock
+    BOOL m_replayScheduled; //Set while sending queued uploads is planned, guarded by m_uploadsLock
+    DWORD m_replayDelay; //Time in ms until queued uploads are sent again, guarded by m_uploadsLock
+    BOOL m_replayAwaitsLogin; //Set after the server refused the auth token of a queued upload, guarded by m_uploadsLock
+    SRWLOCK m_replayLock; //Serializes sending of queued uploads
+
+    //Queues small upload to be sent with others, returns its result, expects exclusive lock of m_uploadsLock
+    //A file queued again before it was sent is uploaded once, with the latest headers
+    //Returns the task sending the batch in submit if the caller has to plan it, once the lock is released
+    VDUTaskResult QueueBatchUploadLocked(CVDUFile vdufile, CString headers, ULONGLONG size, std::shared_ptr<CVDUTask>& submit);
+
+    //Uploads version of file on its own, through the upload queue if earlier versions wait there, and ends its upload in flight
+    //This function is BLOCKING, run it on a worker
+    INT SendFileUpload(CVDUFile vdufile, CString headers);
+
+    //Uploads the latest version saved while an upload of the file was in flight, once that one is answered
+    //This function is BLOCKING, run it on a worker
+    INT SendFollowUpload(CString token);
+
+    //Ends the upload of file in flight, plans the version saved meanwhile if there is one
+    void EndFileUpload(CString token);
+
+    //Sends pending uploads until none is left
+    //This function is BLOCKING, run it on a worker
+    INT SendBatchUploads();
+
+    //Plans extending the token of file shortly before it expires, replaces the planned one, expects exclusive lock of m_filesLock
+    //Edits are uploaded with the token, it must not expire while the file is open, tokens of files no one has open are left to expire
+    void ScheduleKeepAliveLocked(CVDUFile file);
+
+    //Plans extending the token of file again after a failed attempt, if the file is still accessed
+    void RescheduleKeepAlive(CString token);
+
+    //Extends the token of file with a touch, falls back to a metadata check on servers without touch
+    //This function is BLOCKING, run it on a worker
+    INT KeepAliveVDUFile(CString token);
+
+    //Uploads files in a single request, files the server did not take from the batch are uploaded one by one
+    //Completes results of all uploads
+    //This function is BLOCKING, run it on a worker
+    void UploadVDUFileBatch(std::vector<VDUPendingUpload> uploads);
+
+    //Returns If-Match header with the version of file the server last confirmed, empty if unknown
+    CString GetUploadCondition(CString filetoken);
+
+    //Queues the version of file if the server did not answer its upload, an upload that succeeded drops a queued older version
+    //Returns result of the upload, success once the version is queued
+    INT FinishUpload(CVDUFile vdufile, CString headers, INT result);
+
+    //Copies the content of file to the upload queue directory, replaces a queued older version of it
+    //If sent, the version described by headers went out without an answer
+    INT QueueUpload(CVDUFile vdufile, CString headers, BOOL sent);
+
+    //Returns TRUE if a version of token waits in the upload queue
+    BOOL IsUploadQueued(CString token);
+
+    //Plans sending queued uploads after m_replayDelay, expects exclusive lock of m_uploadsLock
+    //Nothing is planned while the uploads wait for a login
+    void ScheduleReplayLocked();
+
+    //Sends queued uploads of token, or all of them if token is empty, stops at the first the server does not answer
+    //Returns EXIT_SUCCESS if none of them is left queued
+    //This function is BLOCKING, run it on a worker
+    INT ReplayQueuedUploads(CString token);
+
+    //Writes queued uploads to the upload journal, expects exclusive lock of m_uploadsLock
+    void SaveUploadQueueLocked();
+
+    //Reads the upload journal of the last run, its uploads are sent again
+    void LoadUploadQueue();
+
+    //Returns the directory queued uploads are kept in
+    CString GetUploadQueueDirPath();
+
+    //Moves content at filePath into the cache for token, evicts the oldest content over the cache limits
+    void CacheContentInternal(CString token, CString etag, CString filePath);
+
+    //Plans eviction of content of token released at system time released, once it is CACHE_MAX_AGE old
+    void ScheduleCacheExpiry(CString token, ULONGLONG released);
+
+    //Plans saving the cache manifest, changes shortly after each other are saved once, expects exclusive lock of m_filesLock
+    void QueueSaveCacheManifestLocked();
+
+    //Writes cached and accessed files to the cache manifest, the next start reuses their content
+    void SaveCacheManifest();
+
+    //Reads the cache manifest of the last run, content is revalidated with the server when its file is accessed
+    void LoadCacheManifest();
+
+    //Returns path of the cache manifest
+    CString GetCacheManifestPath();
+
+    //Replaces file at path with text in UTF-8, the old content stays if writing fails
+    static BOOL WriteTextFile(CString path, CString text);
+
+    //Reads UTF-8 text of file at path, returns FALSE if it cannot be read
+    static BOOL ReadTextFile(CString path, CString& text);
+
+    //Returns current system time in FILETIME units, it keeps counting while the client is not running
+    static ULONGLONG GetSystemTimeNow();
+
+    //Deletes work directories of earlier runs, moved aside by OnStart
+    //Content of files accessed in the last run is moved into the cache instead
+    //Runs with background priority, so it does not slow down the first accesses
+    static UINT ThreadProcPurgeWorkDirs(LPVOID service);
 protected:
     NTSTATUS OnStart(ULONG Argc, PWSTR* Argv);
     NTSTATUS OnStop();
 public:
     CVDUFileSystemService(CString DriveLetter);
+    ~CVDUFileSystemService();
+
+    //Waits until the drive is mounted, returns FALSE on timeout
+    BOOL WaitStarted(DWORD timeout);
 
     //Returns the filesystem host for mounting
     Fsp::FileSystemHost& GetHost();
@@ -228,27 +453,124 @@ public:
     CVDUFile GetVDUFileByToken(CString token);
     //Ammount of accesisibile files
     ULONGLONG GetVDUFileCount();
+    //Returns copy of all accessible VDU files
+    std::vector<CVDUFile> GetVDUFiles();
     //Deletes a VDU file internally, from disk, from memory
     void DeleteFileInternal(CString token);
+    //Adds a VDU file internally, fails if file with the same token exists
+    BOOL AddFileInternal(CVDUFile newfile);
     //Updates a VDU file internally
     void UpdateFileInternal(CVDUFile newfile);
+    //Counts a handle opened on VDU file of token, its token is kept alive while any handle is open
+    void OpenHandleInternal(CString token);
+    //Counts a closed handle of VDU file of token, the token is no longer extended once the last one is closed
+    void CloseHandleInternal(CString token);
+    //Returns block signatures of the version of file the server has, nullptr if unknown
+    VDU_DELTA_SIGNATURE GetSignatureInternal(CString token);
+    //Stores block signatures of the version of file the server has, nullptr forgets them
+    void SetSignatureInternal(CString token, VDU_DELTA_SIGNATURE signature);
+    //Calculates and stores block signatures of the local file if it is eligible for delta uploads
+    void UpdateSignatureInternal(CVDUFile file);
+    //Returns interrupted download of token, FALSE if there is none
+    BOOL GetPartialDownloadInternal(CString token, VDUPartialDownload& partial);
+    //Removes and returns interrupted download of token, FALSE if there is none
+    BOOL TakePartialDownloadInternal(CString token, VDUPartialDownload& partial);
+    //Keeps interrupted download of token, replaces the previous one
+    void SetPartialDownloadInternal(CString token, VDUPartialDownload partial);
+    //Returns cached content of token, FALSE if there is none
+    BOOL GetCachedFileInternal(CString token, VDUCachedFile& cached);
+    //Removes and returns cached content of token, FALSE if there is none
+    BOOL TakeCachedFileInternal(CString token, VDUCachedFile& cached);
+    //Moves content of a released file into the cache, evicts the oldest files over the cache limits
+    void CacheFileInternal(CVDUFile file);
+    //Returns the directory cached content is kept in
+    CString GetCacheDirPath();
+    //Remembers version of file the server reported, returns FALSE if it was reported before
+    BOOL ReportRemoteVersionInternal(CString token, CString etag);
+    //Returns version of file the server reported, empty if the server no longer has it, FALSE if none was reported
+    BOOL GetRemoteVersionInternal(CString token, CString& etag);
 
     //Calculated MD5 of contents in file
     //https://docs.microsoft.com/en-us/windows/win32/seccrypto/example-c-program--creating-an-md-5-hash-from-file-content
     //Returns base64 of md5 bytes or empty string on failure
     CString CalcFileMD5Base64(CVDUFile file);
+    //Calculates MD5 of contents of file at filePath, e.g. a download not yet moved into the work directory
+    CString CalcFileMD5Base64(CString filePath);
 
     //Remount filesystem to different drive letter
     NTSTATUS Remount(CString DriveLetter);
 
     //Create a new VDU file in filesystem from httpFile
-    BOOL CreateVDUFile(CVDUFile vdufile, CHttpFile* httpfile);
+    //Interrupted transfers are continued with range requests, data of a failed download is kept for the next access
+    //Reads exactly the file length from httpfile, so it can also be a part of a batch response
+    //owner is the connection of httpfile, it is closed before further requests are opened, parts are only fetched with it
+    BOOL CreateVDUFile(CVDUFile vdufile, CHttpFile* httpfile, CVDUConnection* owner = nullptr);
+
+    //Fetches file as concurrent range requests written at their offsets into hFile, httpfile is the open response of the whole file
+    //owner is closed once the first part was read from httpfile, before any part is requested
+    //Part size and amount of parallel requests adapt to the measured rate, received is set to the bytes written
+    //Returns FALSE if the download failed
+    BOOL DownloadVDUFileParts(CVDUFile vdufile, CHttpFile* httpfile, CVDUConnection* owner, HANDLE hFile, ULONGLONG& received);
+
+    //Creates VDU file from content cached when it was released, after the server confirmed the version is current
+    //Returns FALSE if the content is not cached or does not match, the file has to be downloaded then
+    BOOL CreateVDUFileFromCache(CVDUFile vdufile);
+
+    //Sends small uploads waiting for a batch right away, versions the server does not take stay queued on disk
+    //This function is BLOCKING
+    void DrainUploads();
+
+    //Sends queued uploads again after a login, those refused for the auth token wait for it
+    void ResumeUploadReplay();
 
     //Sends update of VDU file data to the server
+    //One upload of a file is in flight at a time, the latest version saved meanwhile is sent once it is answered
+    //Versions the server does not answer are queued on disk and sent again once it is reachable
     //This function is BLOCKING if async is FALSE
     //Returns success or exit code if not async
     INT UpdateVDUFile(CVDUFile vdufile, CString newName = _T(""), BOOL async = TRUE);
 
+    //Uploads only blocks changed since the version described by signature, uploads the whole file if the server cannot apply the delta
+    //This function is BLOCKING, run it on a worker
+    INT UploadVDUFileDelta(CVDUFile vdufile, CString headers, VDU_DELTA_SIGNATURE signature);
+
+    //Uploads the whole file, large files in parallel parts
+    //This function is BLOCKING, run it on a worker
+    INT UploadVDUFileFull(CVDUFile vdufile, CString headers);
+
+    //Compresses file at filePath into a temporary gzip file, unless it does not shrink below UPLOAD_COMPRESS_MAX_RATIO
+    //contentLength and contentMD5 are set to the length and base64 MD5 of the bytes compressed, the file may have changed since it was hashed
+    //Returns path of the temporary file, the caller deletes it, empty if the file is sent as is
+    CString CompressUpload(CString filePath, ULONGLONG& contentLength, CString& contentMD5);
+
+    //Uploads file in parts sent in parallel and resent on failure, result is set to the upload result
+    //Returns FALSE if the server does not support chunked uploads and nothing was sent
+    //This function is BLOCKING, run it on a worker
+    BOOL UploadVDUFileParts(CVDUFile vdufile, CString headers, ULONGLONG fileSize, INT& result);
+
+    //Renames VDU file on the server without sending its content, uploads it with the new name if the server cannot
+    //This function is BLOCKING if async is FALSE
+    //Returns success or exit code if not async
+    INT RenameVDUFile(CVDUFile vdufile, CString newName, BOOL async = TRUE);
+
+    //Checks metadata of every accessed file with HEAD, which also extends their expiration
+    //This function is BLOCKING, run it on a worker
+    void RefreshVDUFiles();
+
+    //Plans the next periodic check of all accessed files, every check plans the following one
+    void ScheduleRefreshVDUFiles();
+
+    //Waits for the server to announce changes of accessed files newer than sequence, which receives the last one seen
+    //New versions of files nobody edited are fetched, users are notified of the others
+    //Returns FALSE if there is no file to wait for, or the server failed or does not announce changes
+    //This function is BLOCKING while the server waits, run it on its own thread
+    BOOL WaitVDUFileEvents(CString& sequence);
+
+    //Replaces the local copy of file with the version the server has now, if it was not edited and is not open
+    //Returns FALSE if the copy was kept
+    //This function is BLOCKING, run it on a worker
+    BOOL PrefetchVDUFile(CVDUFile vdufile);
+
     //Request token invalidation for VDU file
     //This function is BLOCKING if async is FALSE
     //Returns success or exit code if not async
@@ -0,0 +1,256 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUGzip.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUGzip.h"
+#include <string.h>
+
+#define GZIP_HASH_SIZE (1 << GZIP_HASH_BITS)
+#define GZIP_MIN_LOOKAHEAD (GZIP_MAX_MATCH + GZIP_MIN_MATCH + 1) //Data kept back while more is coming, so a match is never cut short
+#define GZIP_MAX_DISTANCE (GZIP_WINDOW_SIZE - GZIP_MIN_LOOKAHEAD) //Farthest match, the data it refers to survives sliding the window
+
+//Lengths and distances are coded as a symbol for a range and extra bits for the offset within it (RFC 1951, 3.2.5)
+static const UINT16 LengthBase[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const BYTE LengthExtra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const UINT16 DistanceBase[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+	4097, 6145, 8193, 12289, 16385, 24577 };
+static const BYTE DistanceExtra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+//Huffman codes are written starting with their highest bit, the stream takes the lowest first
+static UINT32 ReverseBits(UINT32 code, UINT length)
+{
+	UINT32 reversed = 0;
+	for (UINT i = 0; i < length; i++)
+	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	return reversed;
+}
+
+CVDUGzipEncoder::CVDUGzipEncoder() : m_window(2 * GZIP_WINDOW_SIZE), m_head(GZIP_HASH_SIZE, -1), m_prev(GZIP_WINDOW_SIZE, -1),
+	m_position(0), m_lookahead(0), m_bits(0), m_bitCount(0), m_crc(0), m_length(0), m_started(FALSE)
+{
+}
+
+UINT32 CVDUGzipEncoder::Crc32(UINT32 crc, const BYTE* data, size_t length)
+{
+	//Table is built once, statics are initialized thread-safe
+	static const std::vector<UINT32> table = []()
+	{
+		std::vector<UINT32> entries(256);
+		for (UINT32 n = 0; n < 256; n++)
+		{
+			UINT32 c = n;
+			for (INT k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+		return entries;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+void CVDUGzipEncoder::PutBits(UINT32 value, UINT count, std::vector<BYTE>& out)
+{
+	m_bits |= (ULONGLONG)value << m_bitCount;
+	m_bitCount += count;
+	while (m_bitCount >= 8)
+	{
+		out.push_back((BYTE)m_bits);
+		m_bits >>= 8;
+		m_bitCount -= 8;
+	}
+}
+
+void CVDUGzipEncoder::PutSymbol(UINT symbol, std::vector<BYTE>& out)
+{
+	//Fixed literal/length code (RFC 1951, 3.2.6)
+	if (symbol < 144)
+		PutBits(ReverseBits(0x30 + symbol, 8), 8, out);
+	else if (symbol < 256)
+		PutBits(ReverseBits(0x190 + symbol - 144, 9), 9, out);
+	else if (symbol < 280)
+		PutBits(ReverseBits(symbol - 256, 7), 7, out);
+	else
+		PutBits(ReverseBits(0xC0 + symbol - 280, 8), 8, out);
+}
+
+void CVDUGzipEncoder::PutMatch(UINT length, UINT distance, std::vector<BYTE>& out)
+{
+	UINT code = ARRAYSIZE(LengthBase) - 1;
+	while (LengthBase[code] > length)
+		code--;
+	PutSymbol(257 + code, out);
+	PutBits(length - LengthBase[code], LengthExtra[code], out);
+
+	//Fixed distance codes are plain 5 bit numbers
+	code = ARRAYSIZE(DistanceBase) - 1;
+	while (DistanceBase[code] > distance)
+		code--;
+	PutBits(ReverseBits(code, 5), 5, out);
+	PutBits(distance - DistanceBase[code], DistanceExtra[code], out);
+}
+
+UINT CVDUGzipEncoder::Hash(size_t position)
+{
+	const BYTE* data = &m_window[position];
+	return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & (GZIP_HASH_SIZE - 1);
+}
+
+void CVDUGzipEncoder::Insert(size_t position)
+{
+	UINT hash = Hash(position);
+	m_prev[position & (GZIP_WINDOW_SIZE - 1)] = m_head[hash];
+	m_head[hash] = (INT)position;
+}
+
+void CVDUGzipEncoder::Slide()
+{
+	memmove(&m_window[0], &m_window[GZIP_WINDOW_SIZE], GZIP_WINDOW_SIZE);
+	m_position -= GZIP_WINDOW_SIZE;
+
+	//Positions keep their index in m_prev, those that left the window are forgotten
+	for (auto it = m_head.begin(); it != m_head.end(); it++)
+		*it = *it >= GZIP_WINDOW_SIZE ? *it - GZIP_WINDOW_SIZE : -1;
+	for (auto it = m_prev.begin(); it != m_prev.end(); it++)
+		*it = *it >= GZIP_WINDOW_SIZE ? *it - GZIP_WINDOW_SIZE : -1;
+}
+
+void CVDUGzipEncoder::Deflate(BOOL finish, std::vector<BYTE>& out)
+{
+	while (m_lookahead >= (finish ? 1 : GZIP_MIN_LOOKAHEAD))
+	{
+		UINT bestLength = 0;
+		UINT bestDistance = 0;
+		if (m_lookahead >= GZIP_MIN_MATCH)
+		{
+			INT candidate = m_head[Hash(m_position)];
+			Insert(m_position);
+
+			//Longest earlier occurrence, greedy, the latest ones are tried first
+			UINT maxLength = (UINT)min(m_lookahead, (size_t)GZIP_MAX_MATCH);
+			size_t limit = m_position > GZIP_MAX_DISTANCE ? m_position - GZIP_MAX_DISTANCE : 0;
+			const BYTE* current = &m_window[m_position];
+			for (UINT chain = 0; candidate >= 0 && (size_t)candidate >= limit && chain < GZIP_MAX_CHAIN; chain++)
+			{
+				const BYTE* earlier = &m_window[candidate];
+				if (earlier[bestLength] == current[bestLength])
+				{
+					UINT length = 0;
+					while (length < maxLength && earlier[length] == current[length])
+						length++;
+
+					if (length > bestLength)
+					{
+						bestLength = length;
+						bestDistance = (UINT)(m_position - candidate);
+						if (length >= GZIP_NICE_MATCH || length == maxLength)
+							break;
+					}
+				}
+
+				//Chain only leads further back, anything else is a stale entry
+				INT next = m_prev[candidate & (GZIP_WINDOW_SIZE - 1)];
+				if (next >= candidate)
+					break;
+				candidate = next;
+			}
+		}
+
+		if (bestLength >= GZIP_MIN_MATCH)
+		{
+			PutMatch(bestLength, bestDistance, out);
+
+			//Positions inside the match can start later matches as well
+			for (UINT i = 1; i < bestLength; i++)
+			{
+				if (m_lookahead - i >= GZIP_MIN_MATCH)
+					Insert(m_position + i);
+			}
+			m_position += bestLength;
+			m_lookahead -= bestLength;
+		}
+		else
+		{
+			PutSymbol(m_window[m_position], out);
+			m_position++;
+			m_lookahead--;
+		}
+	}
+}
+
+void CVDUGzipEncoder::Start(std::vector<BYTE>& out)
+{
+	if (m_started)
+		return;
+	m_started = TRUE;
+
+	//Deflate, no flags, no modification time, no extra flags, NTFS
+	static const BYTE header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 11 };
+	out.insert(out.end(), header, header + sizeof(header));
+
+	//Single final block with fixed codes, it ends with the stream
+	PutBits(1, 1, out);
+	PutBits(1, 2, out);
+}
+
+void CVDUGzipEncoder::Update(const BYTE* data, size_t length, std::vector<BYTE>& out)
+{
+	Start(out);
+	m_crc = Crc32(m_crc, data, length);
+	m_length += length;
+
+	while (length > 0)
+	{
+		//Coding stops short of the end of the window only while less than the longest match is left
+		size_t end = m_position + m_lookahead;
+		if (end == m_window.size())
+		{
+			Slide();
+			end -= GZIP_WINDOW_SIZE;
+		}
+
+		size_t count = min(length, m_window.size() - end);
+		memcpy(&m_window[end], data, count);
+		m_lookahead += count;
+		data += count;
+		length -= count;
+
+		Deflate(FALSE, out);
+	}
+}
+
+void CVDUGzipEncoder::Finish(std::vector<BYTE>& out)
+{
+	Start(out);
+	Deflate(TRUE, out);
+	PutSymbol(256, out);
+
+	//Block ends within a byte, the trailer starts at the next one
+	if (m_bitCount > 0)
+		PutBits(0, 8 - m_bitCount, out);
+
+	for (INT i = 0; i < 4; i++)
+		out.push_back((BYTE)(m_crc >> (8 * i)));
+	for (INT i = 0; i < 4; i++)
+		out.push_back((BYTE)(m_length >> (8 * i)));
+}
+
+ULONGLONG CVDUGzipEncoder::GetLength()
+{
+	return m_length;
+}
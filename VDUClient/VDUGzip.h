@@ -0,0 +1,76 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUGzip.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include <vector>
+
+#define GZIP_WINDOW_SIZE 0x8000 //Farthest back a match may refer to, 32 KB as deflate allows
+#define GZIP_HASH_BITS 15 //Size of the table finding earlier occurrences of 3 bytes, 2^15 entries
+#define GZIP_MIN_MATCH 3 //Shortest match deflate can code
+#define GZIP_MAX_MATCH 258 //Longest match deflate can code
+#define GZIP_MAX_CHAIN 64 //Most earlier occurrences compared for a match, bounds time spent on repetitive data
+#define GZIP_NICE_MATCH 128 //Match long enough to stop looking for a longer one
+
+//Compresses data fed in order into a gzip stream (RFC 1952), e.g. an upload body
+//Matches are coded with the fixed Huffman codes of deflate, text shrinks to a third or so without a codec dependency
+class CVDUGzipEncoder
+{
+protected:
+	std::vector<BYTE> m_window; //Data seen last, twice the window so a whole window stays behind the current position
+	std::vector<INT> m_head; //Latest position of every hash, -1 if none
+	std::vector<INT> m_prev; //Previous position of the same hash, by position within the window
+	size_t m_position; //Position in m_window of the next byte to code
+	size_t m_lookahead; //Bytes in m_window from m_position not coded yet
+	ULONGLONG m_bits; //Bits not written yet, first bit lowest
+	UINT m_bitCount; //Amount of bits in m_bits
+	UINT32 m_crc; //CRC-32 of data fed so far
+	ULONGLONG m_length; //Amount of data fed so far
+	BOOL m_started; //Set once the gzip header and the block header are out
+
+	//Appends gzip header and starts the only deflate block, if not done yet
+	void Start(std::vector<BYTE>& out);
+
+	//Appends bits, first bit lowest, to out once they fill bytes
+	void PutBits(UINT32 value, UINT count, std::vector<BYTE>& out);
+
+	//Appends code of literal, length or end of block symbol
+	void PutSymbol(UINT symbol, std::vector<BYTE>& out);
+
+	//Appends a match of length at distance back
+	void PutMatch(UINT length, UINT distance, std::vector<BYTE>& out);
+
+	//Returns hash of the 3 bytes at position
+	UINT Hash(size_t position);
+
+	//Remembers position for later matches
+	void Insert(size_t position);
+
+	//Moves the upper half of the window down to make room for more data
+	void Slide();
+
+	//Codes buffered data, keeps enough of it for the longest match unless finishing
+	void Deflate(BOOL finish, std::vector<BYTE>& out);
+public:
+	CVDUGzipEncoder();
+
+	//Feeds next part of the data, compressed bytes ready are appended to out
+	void Update(const BYTE* data, size_t length, std::vector<BYTE>& out);
+
+	//Ends the stream, appends the rest of it to out
+	void Finish(std::vector<BYTE>& out);
+
+	//Amount of data fed so far
+	ULONGLONG GetLength();
+
+	//CRC-32 as used by gzip, continues crc over data
+	static UINT32 Crc32(UINT32 crc, const BYTE* data, size_t length);
+};
@@ -0,0 +1,103 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUScheduler.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUScheduler.h"
+
+CVDUScheduler::CVDUScheduler() : m_lock(SRWLOCK_INIT), m_changed(CONDITION_VARIABLE_INIT), m_wheel(GetTick()),
+m_wakeTick(TIMERWHEEL_NEVER), m_stopping(FALSE)
+{
+	m_thread = AfxBeginThread(ThreadProc, (LPVOID)this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+	ASSERT(m_thread);
+	m_thread->m_bAutoDelete = FALSE;
+	m_thread->ResumeThread();
+}
+
+CVDUScheduler::~CVDUScheduler()
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_stopping = TRUE;
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_changed);
+
+	WaitForSingleObject(m_thread->m_hThread, INFINITE);
+	delete m_thread;
+}
+
+ULONGLONG CVDUScheduler::GetTick()
+{
+	return GetTickCount64() / SCHEDULER_TICK;
+}
+
+ULONGLONG CVDUScheduler::Schedule(ULONGLONG delay, VDU_TIMER_CALLBACK callback)
+{
+	//Rounded up, the current tick is partly gone already
+	ULONGLONG deadline = GetTick() + (delay + SCHEDULER_TICK - 1) / SCHEDULER_TICK + 1;
+
+	AcquireSRWLockExclusive(&m_lock);
+	ULONGLONG id = m_wheel.Schedule(deadline, callback);
+	BOOL wake = deadline < m_wakeTick;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	if (wake)
+		WakeAllConditionVariable(&m_changed);
+
+	return id;
+}
+
+BOOL CVDUScheduler::Cancel(ULONGLONG id)
+{
+	//Thread may wake up for nothing afterwards, cheaper than waking it now
+	AcquireSRWLockExclusive(&m_lock);
+	BOOL cancelled = m_wheel.Cancel(id);
+	ReleaseSRWLockExclusive(&m_lock);
+	return cancelled;
+}
+
+UINT CVDUScheduler::ThreadProc(LPVOID scheduler0)
+{
+	CVDUScheduler* scheduler = (CVDUScheduler*)scheduler0;
+	ASSERT(scheduler);
+
+	std::vector<VDU_TIMER_CALLBACK> expired;
+	AcquireSRWLockExclusive(&scheduler->m_lock);
+	while (!scheduler->m_stopping)
+	{
+		scheduler->m_wheel.Advance(GetTick(), expired);
+
+		//Callbacks may schedule and cancel timers themselves
+		if (!expired.empty())
+		{
+			scheduler->m_wakeTick = 0;
+			ReleaseSRWLockExclusive(&scheduler->m_lock);
+			for (auto it = expired.begin(); it != expired.end(); it++)
+				(*it)();
+			expired.clear();
+			AcquireSRWLockExclusive(&scheduler->m_lock);
+			continue;
+		}
+
+		scheduler->m_wakeTick = scheduler->m_wheel.GetNextTick();
+		DWORD wait = INFINITE;
+		if (scheduler->m_wakeTick != TIMERWHEEL_NEVER)
+		{
+			ULONGLONG wakeTime = scheduler->m_wakeTick * SCHEDULER_TICK;
+			ULONGLONG now = GetTickCount64();
+			wait = (DWORD)min(wakeTime > now ? wakeTime - now : 0, (ULONGLONG)INFINITE - 1);
+		}
+
+		SleepConditionVariableSRW(&scheduler->m_changed, &scheduler->m_lock, wait, 0);
+	}
+	ReleaseSRWLockExclusive(&scheduler->m_lock);
+
+	return EXIT_SUCCESS;
+}
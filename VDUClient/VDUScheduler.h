@@ -0,0 +1,46 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUScheduler.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include "VDUTimerWheel.h"
+
+#define SCHEDULER_TICK 10 //Resolution of timers in ms
+
+//Single thread expiring all timers of the client: auth token refresh, file expiry checks, upload gathering, cache eviction
+//Replaces a sleeping thread per duty
+//Callbacks run on the scheduler thread one after another, they have to be short and hand any request to the worker pool
+class CVDUScheduler
+{
+protected:
+	SRWLOCK m_lock; //Guards all members below
+	CONDITION_VARIABLE m_changed; //Signalled when a timer earlier than the planned wakeup is scheduled, or on stop
+	CVDUTimerWheel m_wheel; //Scheduled timers, in ticks of SCHEDULER_TICK
+	ULONGLONG m_wakeTick; //Tick the thread sleeps until
+	CWinThread* m_thread; //Thread expiring timers
+	BOOL m_stopping; //Thread exits once set
+
+	//Current tick
+	static ULONGLONG GetTick();
+public:
+	CVDUScheduler();
+	~CVDUScheduler();
+
+	//Runs callback on the scheduler thread once delay in ms passed, never earlier
+	//Returns id of the timer
+	ULONGLONG Schedule(ULONGLONG delay, VDU_TIMER_CALLBACK callback);
+
+	//Removes a timer that did not expire yet, returns FALSE if it already expired or was cancelled
+	BOOL Cancel(ULONGLONG id);
+
+	//Scheduler thread procedure
+	static UINT ThreadProc(LPVOID scheduler);
+};
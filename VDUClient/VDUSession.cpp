@@ -14,55 +14,218 @@
 #include "VDUSession.h"
 #include "VDUClient.h"
 #include "VDUClientDlg.h"
+#include "VDUWorkerPool.h"
+#include "VDUScheduler.h"
+#include "VDUDelta.h"
 #include "afxdialogex.h"
+#include <algorithm>
 
-CVDUSession::CVDUSession(CString serverURL) : m_lock(SRWLOCK_INIT)
+CVDUSession::CVDUSession(CString serverURL) : m_lock(SRWLOCK_INIT), m_refreshTimer(0), m_random(std::random_device{}())
 {
 	Reset(serverURL);
+
+	//Random per process, the server leaves out notifications of changes this client made itself
+	GUID guid;
+	WCHAR guidBuf[64] = { 0 };
+	if (SUCCEEDED(CoCreateGuid(&guid)) && StringFromGUID2(guid, guidBuf, ARRAYSIZE(guidBuf)) > 0)
+		m_clientId = CString(guidBuf).Trim(_T("{}"));
 }
 
 CVDUSession::~CVDUSession()
 {
-
 }
 
 CString CVDUSession::GetServerURL()
 {
-	return m_serverURL;
+	AcquireSRWLockShared(&m_lock);
+	CString serverURL = m_serverURL;
+	ReleaseSRWLockShared(&m_lock);
+	return serverURL;
+}
+
+CString CVDUSession::GetClientId()
+{
+	//Set once on construction, needs no lock
+	return m_clientId;
 }
 
 CString CVDUSession::GetAuthToken()
 {
-	return m_authToken;
+	AcquireSRWLockShared(&m_lock);
+	CString authToken = m_authToken;
+	ReleaseSRWLockShared(&m_lock);
+	return authToken;
 }
 
 CTime CVDUSession::GetAuthTokenExpires()
 {
-	return m_authTokenExpires;
+	AcquireSRWLockShared(&m_lock);
+	CTime expires = m_authTokenExpires;
+	ReleaseSRWLockShared(&m_lock);
+	return expires;
 }
 
 CString CVDUSession::GetUser()
 {
-	return m_user;
+	AcquireSRWLockShared(&m_lock);
+	CString user = m_user;
+	ReleaseSRWLockShared(&m_lock);
+	return user;
 }
 
 void CVDUSession::Reset(CString serverURL)
 {
+	AcquireSRWLockExclusive(&m_lock);
 	m_serverURL = serverURL;
 	m_user = _T("");
 	m_authToken = _T("");
 	m_authTokenExpires = CTime(0);
+	ReleaseSRWLockExclusive(&m_lock);
+
+	ScheduleRefresh();
 }
 
 void CVDUSession::SetAuthData(CString authToken, CTime expires)
 {
+	AcquireSRWLockExclusive(&m_lock);
 	m_authToken = authToken;
 	m_authTokenExpires = expires;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	ScheduleRefresh();
+}
+
+void CVDUSession::ScheduleRefresh(DWORD retryDelay)
+{
+	//Session is created before the scheduler, nobody can be logged in by then
+	CVDUScheduler* scheduler = APP->GetScheduler();
+	if (!scheduler)
+		return;
+
+	//NOTE: CTime::GetCurrentTime() is offset by timezone, do not use
+	SYSTEMTIME cstime;
+	SecureZeroMemory(&cstime, sizeof(cstime));
+	GetSystemTime(&cstime);
+	CTime now(cstime);
+
+	AcquireSRWLockExclusive(&m_lock);
+	scheduler->Cancel(m_refreshTimer);
+	m_refreshTimer = 0;
+	if (m_authTokenExpires > 0 && !m_authToken.IsEmpty())
+	{
+		ULONGLONG wait = retryDelay;
+		if (!retryDelay)
+		{
+			//Refresh well before expiry, requests sent meanwhile never carry a key about to expire
+			LONGLONG remaining = max((m_authTokenExpires - now).GetTotalSeconds(), 0LL) * 1000;
+			LONGLONG lead = min(LOGIN_REFRESH_MARGIN * 1000LL, remaining / 2);
+			LONGLONG jitter = std::uniform_int_distribution<LONGLONG>(0, min(LOGIN_REFRESH_JITTER * 1000LL, lead / 2))(m_random);
+			wait = (ULONGLONG)(remaining - lead - jitter);
+		}
+
+		CString authToken = m_authToken;
+		m_refreshTimer = scheduler->Schedule(wait, [this, authToken, retryDelay]()
+		{
+			APP->GetWorkerPool()->Submit(VDUTaskCategory::CONTROL, [this, authToken, retryDelay]()
+			{
+				CVDUConnection con(GetServerURL(), VDUAPIType::GET_AUTH_KEY, CallbackLoginRefresh);
+				INT result = con.Process();
+
+				//New key is swapped in by the callback and plans the next refresh, requests in flight keep the one they were sent with
+				//Failed refreshes are tried again with growing delays while the key is still valid
+				if (result == LOGIN_REFRESH_RETRY && GetAuthToken() == authToken)
+					ScheduleRefresh(retryDelay ? min(retryDelay * 2, (DWORD)LOGIN_REFRESH_RETRY_DELAY_MAX) : LOGIN_REFRESH_RETRY_DELAY);
+
+				return result;
+			});
+		});
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+void CVDUSession::GetAuthData(CString& authToken, CTime& expires)
+{
+	AcquireSRWLockShared(&m_lock);
+	authToken = m_authToken;
+	expires = m_authTokenExpires;
+	ReleaseSRWLockShared(&m_lock);
+}
+
+BOOL CVDUSession::AdoptRenewedAuthData(CHttpFile* file, CString sentToken)
+{
+	CString authToken;
+	CString expires;
+	if (sentToken.IsEmpty() || !QueryCustomHeader(file, APIKEY_HEADER, authToken) || !QueryCustomHeader(file, APIKEY_EXPIRES_HEADER, expires))
+		return FALSE;
+
+	SYSTEMTIME expTime;
+	SecureZeroMemory(&expTime, sizeof(expTime));
+	if (authToken.IsEmpty() || !InternetTimeToSystemTime(expires, &expTime, NULL))
+		return FALSE;
+
+	//NOTE: CTime::GetCurrentTime() is offset by timezone, do not use
+	SYSTEMTIME cstime;
+	SecureZeroMemory(&cstime, sizeof(cstime));
+	GetSystemTime(&cstime);
+	CTime now(cstime);
+	CTime exp(expTime);
+	if (exp < now)
+		return FALSE;
+
+	AcquireSRWLockExclusive(&m_lock);
+	BOOL adopted = m_authToken == sentToken;
+	if (adopted)
+	{
+		m_authToken = authToken;
+		m_authTokenExpires = exp;
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+
+	//Next refresh is planned by the new expiration
+	if (adopted)
+		ScheduleRefresh();
+
+	return adopted;
 }
 
 void CVDUSession::SetUser(CString user)
 {
+	AcquireSRWLockExclusive(&m_lock);
 	m_user = user;
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+BOOL CVDUSession::QueryCustomHeader(CHttpFile* file, LPCTSTR name, CString& value)
+{
+	TCHAR buf[0x400] = { 0 };
+	StringCchCopy(buf, ARRAYSIZE(buf), name);
+	DWORD bufLen = sizeof(buf);
+
+	if (!file->QueryInfo(HTTP_QUERY_CUSTOM, (LPVOID)buf, &bufLen))
+		return FALSE;
+
+	value = buf;
+	return TRUE;
+}
+
+BOOL CVDUSession::QueryContentRange(CHttpFile* file, ULONGLONG& first, ULONGLONG& total)
+{
+	CString contentRange;
+	if (!file->QueryInfo(HTTP_QUERY_CONTENT_RANGE, contentRange))
+		return FALSE;
+
+	//bytes first-last/total
+	ULONGLONG last;
+	return _stscanf_s(contentRange, _T("bytes %llu-%llu/%llu"), &first, &last, &total) == 3;
+}
+
+CString CVDUSession::FileTokenFromObject(CString object)
+{
+	CString token = object.Right(object.GetLength() - 6);
+	int end = token.Find(_T('/'));
+	if (end != -1)
+		token = token.Left(end);
+	return token;
 }
 
 INT CVDUSession::CallbackPing(CHttpFile* file)
@@ -158,6 +321,8 @@ INT CVDUSession::CallbackLogin(CHttpFile* file)
 
 			//Login successful
 			session->SetAuthData(apiKey, exp);
+			APP->WakeFileEvents();
+			APP->GetFileSystemService()->ResumeUploadReplay();
 
 			if (!APP->IsTestMode())
 			{
@@ -213,30 +378,22 @@ INT CVDUSession::CallbackLoginRefresh(CHttpFile* file)
 
 		if (statusCode == HTTP_STATUS_OK)
 		{
+			//A response without a usable key is tried again like a failed one, the current key stays valid until it expires
 			TCHAR apiKey[0x400] = { APIKEY_HEADER };
 			DWORD apiLeyLen = sizeof(apiKey) / sizeof(apiKey[0]);
 
 			if (!file->QueryInfo(HTTP_QUERY_CUSTOM, (LPVOID)apiKey, &apiLeyLen))
-			{
-				WND->MessageBoxNB(_T("Server did not send auth key!"), TITLENAME, MB_ICONERROR);
-				return EXIT_FAILURE;
-			}
+				return LOGIN_REFRESH_RETRY;
 
 			CString expires;
 			if (!file->QueryInfo(HTTP_QUERY_EXPIRES, expires))
-			{
-				WND->MessageBoxNB(_T("Server did not send Expiration Date!"), TITLENAME, MB_ICONERROR);
-				return EXIT_FAILURE;
-			}
+				return LOGIN_REFRESH_RETRY;
 
 			SYSTEMTIME expTime;
 			SecureZeroMemory(&expTime, sizeof(expTime));
 
 			if (!InternetTimeToSystemTime(expires, &expTime, NULL))
-			{
-				WND->MessageBoxNB(_T("Failed to convert auth token Expiration time!"), TITLENAME, MB_ICONERROR);
-				return EXIT_FAILURE;
-			}
+				return LOGIN_REFRESH_RETRY;
 
 			SYSTEMTIME cstime;
 			SecureZeroMemory(&cstime, sizeof(cstime));
@@ -246,10 +403,7 @@ INT CVDUSession::CallbackLoginRefresh(CHttpFile* file)
 
 			//Expiration date has to be in future
 			if (exp < now)
-			{
-				WND->MessageBoxNB(_T("Auth expiration date in the past!"), TITLENAME, MB_ICONERROR);
-				return EXIT_FAILURE;
-			}
+				return LOGIN_REFRESH_RETRY;
 
 			session->SetAuthData(apiKey, exp);
 
@@ -257,6 +411,11 @@ INT CVDUSession::CallbackLoginRefresh(CHttpFile* file)
 
 			return EXIT_SUCCESS;
 		}
+		else if (statusCode != HTTP_STATUS_DENIED)
+		{
+			//Server errors and timeouts pass, the key stays valid until it expires
+			return LOGIN_REFRESH_RETRY;
+		}
 		else
 		{
 			session->Reset(session->GetServerURL());
@@ -274,8 +433,8 @@ INT CVDUSession::CallbackLoginRefresh(CHttpFile* file)
 	}
 	else
 	{
-		//Connection failed, let refreshing thread know to sleep for a bit and try again later
-		return 2;
+		//Connection failed, the refresh is tried again a bit later
+		return LOGIN_REFRESH_RETRY;
 	}
 
 	return EXIT_FAILURE;
@@ -331,10 +490,9 @@ INT CVDUSession::CallbackLogout(CHttpFile* file)
 	return EXIT_FAILURE;
 }
 
-INT CVDUSession::CallbackDownloadFile(CHttpFile* file)
+INT CVDUSession::DownloadFile(CVDUConnection& con)
 {
-	CVDUSession* session = APP->GetSession();
-	ASSERT(session);
+	CHttpFile* file = con.Open();
 
 	if (!APP->IsTestMode())
 	{
@@ -347,23 +505,31 @@ INT CVDUSession::CallbackDownloadFile(CHttpFile* file)
 		DWORD statusCode;
 		file->QueryInfoStatusCode(statusCode);
 
-		if (statusCode == HTTP_STATUS_OK)
+		//Partial content continues an interrupted download, not modified reuses the cached content
+		if (statusCode == HTTP_STATUS_OK || statusCode == HTTP_STATUS_PARTIAL_CONTENT || statusCode == HTTP_STATUS_NOT_MODIFIED)
 		{
+			//Compressed transfers carry the length of the file itself in a separate header, ranges in Content-Range
 			CString contentLength;
-			if (!file->QueryInfo(HTTP_QUERY_CONTENT_LENGTH, contentLength))
+			ULONGLONG rangeFirst, rangeTotal;
+			if (statusCode == HTTP_STATUS_PARTIAL_CONTENT && QueryContentRange(file, rangeFirst, rangeTotal))
+				contentLength.Format(_T("%llu"), rangeTotal);
+			else if (!QueryCustomHeader(file, CONTENT_LENGTH_HEADER, contentLength) &&
+				!file->QueryInfo(HTTP_QUERY_CONTENT_LENGTH, contentLength) && statusCode != HTTP_STATUS_NOT_MODIFIED)
 			{
 				WND->MessageBoxNB(_T("Server did not send Content-Length!"), TITLENAME, MB_ICONERROR);
 				//return;
 			}
 
-			int contentLen = _ttoi(contentLength);
+			ULONGLONG contentLen = _ttoi64(contentLength);
 
 			CString allow;
 			file->QueryInfo(HTTP_QUERY_ALLOW, allow);
 			allow = allow.MakeUpper();
 
+			//Content-Encoding describes the transfer when the server compressed the body, stored encoding is sent separately
 			CString contentEncoding;
-			file->QueryInfo(HTTP_QUERY_CONTENT_ENCODING, contentEncoding);
+			if (!QueryCustomHeader(file, CONTENT_ENCODING_HEADER, contentEncoding))
+				file->QueryInfo(HTTP_QUERY_CONTENT_ENCODING, contentEncoding);
 
 			CString contentLocation;
 			file->QueryInfo(HTTP_QUERY_CONTENT_LOCATION, contentLocation);
@@ -393,13 +559,24 @@ INT CVDUSession::CallbackDownloadFile(CHttpFile* file)
 
 			BOOL canRead = allow.Find(_T("GET")) != -1;
 			BOOL canWrite = allow.Find(_T("POST")) != -1;
-			CString filetoken = file->GetObject();
-			filetoken = filetoken.Right(filetoken.GetLength() - 6);
+			CString filetoken = FileTokenFromObject(file->GetObject());
 
 			CVDUFile vfile(filetoken, canRead, canWrite, contentLen, contentEncoding, contentLocation, contentType, lastModifiedST, expiresST, contentMD5W, etag);
 
+			BOOL created;
+			if (statusCode == HTTP_STATUS_NOT_MODIFIED)
+			{
+				created = APP->GetFileSystemService()->CreateVDUFileFromCache(vfile);
+
+				//Cached content is gone or was changed, the file is downloaded again after this connection is returned
+				if (!created)
+					return DOWNLOAD_RESULT_REFETCH;
+			}
+			else
+				created = APP->GetFileSystemService()->CreateVDUFile(vfile, file, &con);
+
 			//If file created successfuly, open it and notify user
-			if (APP->GetFileSystemService()->CreateVDUFile(vfile, file))
+			if (created)
 			{
 				//Dont open anything in test mode
 				if (!APP->IsTestMode())
@@ -441,89 +618,174 @@ INT CVDUSession::CallbackDownloadFile(CHttpFile* file)
 }
 
 INT CVDUSession::CallbackUploadFile(CHttpFile* file)
+{
+	if (file)
+	{
+		DWORD statusCode;
+		file->QueryInfoStatusCode(statusCode);
+
+		CString expires;
+		file->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+
+		CString etag;
+		file->QueryInfo(HTTP_QUERY_ETAG, etag);
+
+		CString allow;
+		file->QueryInfo(HTTP_QUERY_ALLOW, allow);
+
+		return UploadFileResult(FileTokenFromObject(file->GetObject()), statusCode, allow, expires, etag);
+	}
+
+	//Changes are kept on disk until the server is reachable again
+	if (CVDUConnection::IsServerUnreachable())
+		return UPLOAD_RESULT_OFFLINE;
+
+	//Local errors, refused certificates and the like do not pass by waiting
+	WND->MessageBoxNB(CVDUConnection::LastError, TITLENAME, MB_ICONERROR);
+	return EXIT_FAILURE;
+}
+
+INT CVDUSession::UploadFileResult(CString filetoken, DWORD statusCode, CString allow, CString expires, CString etag)
 {
 	CVDUSession* session = APP->GetSession();
 	ASSERT(session);
 
+	CVDUFile vdufile = APP->GetFileSystemService()->GetVDUFileByToken(filetoken);
+
+	if (statusCode == HTTP_STATUS_CREATED)
+	{
+		if (vdufile != CVDUFile::InvalidFile)
+		{
+			SYSTEMTIME expiresST;
+			InternetTimeToSystemTime(expires, &expiresST, 0);
+
+			allow = allow.MakeUpper();
+
+			vdufile.m_etag = etag;
+			vdufile.m_expires = expiresST;
+			vdufile.m_canRead = allow.Find(_T("GET")) != -1;
+			vdufile.m_canWrite = allow.Find(_T("POST")) != -1;
+			vdufile.m_md5base64 = APP->GetFileSystemService()->CalcFileMD5Base64(vdufile);
+
+			//Next upload of this version can be a delta
+			APP->GetFileSystemService()->UpdateSignatureInternal(vdufile);
+
+			APP->GetFileSystemService()->UpdateFileInternal(vdufile);
+
+			WND->UpdateStatus();
+		}
+		else
+		{
+			WND->MessageBoxNB(_T("Local file does not exist!\r\nPlease re-access the file."), TITLENAME, MB_ICONERROR);
+		}
+		return EXIT_SUCCESS;
+	}
+	else if (statusCode == HTTP_STATUS_RESET_CONTENT)
+	{
+		APP->GetFileSystemService()->DeleteFileInternal(filetoken);
+
+		WND->UpdateStatus();
+
+		WND->MessageBoxNB(_T("Token for currently edited file has expired after last successful upload.\r\nIn order to continue work on the file, access via new token."),
+			TITLENAME, MB_ICONINFORMATION);
+
+		return EXIT_SUCCESS;
+	}
+	else if (statusCode == HTTP_STATUS_CONFLICT)
+	{
+		WND->MessageBoxNB(_T("The changes you made to the file are in conflict!\r\nPlease resolve these changes or delete your file."), TITLENAME, MB_ICONERROR);
+	}
+	else if (statusCode == HTTP_STATUS_PRECOND_FAILED)
+	{
+		WND->MessageBoxNB(_T("File was changed on the server since you accessed it!\r\nYour changes were not uploaded, please save them elsewhere and re-access the file."), TITLENAME, MB_ICONERROR);
+	}
+	else if (statusCode == HTTP_STATUS_NOT_FOUND)
+	{
+		WND->MessageBoxNB(_T("File does not exist!"), TITLENAME, MB_ICONERROR);
+	}
+	else if (statusCode == HTTP_STATUS_BAD_METHOD)
+	{
+		WND->MessageBoxNB(_T("Method not allowed!\r\nYoure trying to write to a read-only resource?"), TITLENAME, MB_ICONERROR);
+	}
+	else if (statusCode == HTTP_STATUS_REQUEST_TIMEOUT)
+	{
+		WND->MessageBoxNB(_T("Server timed out!"), TITLENAME, MB_ICONERROR);
+	}
+	else if (statusCode == HTTP_STATUS_DENIED)
+	{
+		WND->MessageBoxNB(_T("Invalid authorization token!\r\nPlease log in again."), TITLENAME, MB_ICONERROR);
+	}
+	else
+	{
+		WND->MessageBoxNB(_T("Error accessing file!"), TITLENAME, MB_ICONERROR);
+	}
+
+	return EXIT_FAILURE;
+}
+
+INT CVDUSession::CallbackUploadFileDelta(CHttpFile* file)
+{
 	if (file)
 	{
 		DWORD statusCode;
 		file->QueryInfoStatusCode(statusCode);
 
-		CString filetoken = file->GetObject();
-		filetoken = filetoken.Right(filetoken.GetLength() - 6);
-		CVDUFile vdufile = APP->GetFileSystemService()->GetVDUFileByToken(filetoken);
+		//Server has a different base version, cannot rebuild the file or does not support deltas
+		if (statusCode == HTTP_STATUS_PRECOND_FAILED || statusCode == HTTP_STATUS_BAD_REQUEST ||
+			statusCode == HTTP_STATUS_NOT_FOUND || statusCode == HTTP_STATUS_NOT_SUPPORTED)
+			return DELTA_RESULT_FALLBACK;
+	}
 
-		if (statusCode == HTTP_STATUS_CREATED)
+	//Everything else is handled like a whole upload
+	return CallbackUploadFile(file);
+}
+
+INT CVDUSession::CallbackPatchFile(CHttpFile* file)
+{
+	if (file)
+	{
+		DWORD statusCode;
+		file->QueryInfoStatusCode(statusCode);
+
+		//Server without metadata updates
+		if (statusCode == HTTP_STATUS_NOT_SUPPORTED)
+			return PATCH_RESULT_FALLBACK;
+
+		CString expires;
+		file->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+
+		CString etag;
+		file->QueryInfo(HTTP_QUERY_ETAG, etag);
+
+		CString allow;
+		file->QueryInfo(HTTP_QUERY_ALLOW, allow);
+
+		CString filetoken = FileTokenFromObject(file->GetObject());
+		if (statusCode == HTTP_STATUS_OK)
 		{
+			//Content did not change, its MD5 and signature stay valid
+			CVDUFile vdufile = APP->GetFileSystemService()->GetVDUFileByToken(filetoken);
 			if (vdufile != CVDUFile::InvalidFile)
 			{
-				CString expires;
-				file->QueryInfo(HTTP_QUERY_EXPIRES, expires);
 				SYSTEMTIME expiresST;
 				InternetTimeToSystemTime(expires, &expiresST, 0);
 
-				CString etag;
-				file->QueryInfo(HTTP_QUERY_ETAG, etag);
-
-				CString allow;
-				file->QueryInfo(HTTP_QUERY_ALLOW, allow);
 				allow = allow.MakeUpper();
 
 				vdufile.m_etag = etag;
 				vdufile.m_expires = expiresST;
 				vdufile.m_canRead = allow.Find(_T("GET")) != -1;
 				vdufile.m_canWrite = allow.Find(_T("POST")) != -1;
-				vdufile.m_md5base64 = APP->GetFileSystemService()->CalcFileMD5Base64(vdufile);
 
 				APP->GetFileSystemService()->UpdateFileInternal(vdufile);
 
 				WND->UpdateStatus();
 			}
-			else
-			{
-				WND->MessageBoxNB(_T("Local file does not exist!\r\nPlease re-access the file."), TITLENAME, MB_ICONERROR);
-			}
 			return EXIT_SUCCESS;
 		}
-		else if (statusCode == HTTP_STATUS_RESET_CONTENT)
-		{
-			APP->GetFileSystemService()->DeleteFileInternal(filetoken);
 
-			WND->UpdateStatus();
-
-			WND->MessageBoxNB(_T("Token for currently edited file has expired after last successful upload.\r\nIn order to continue work on the file, access via new token."),
-				TITLENAME, MB_ICONINFORMATION);
-
-			return EXIT_SUCCESS;
-		}
-		else
-		{
-			if (statusCode == HTTP_STATUS_CONFLICT)
-			{
-				WND->MessageBoxNB(_T("The changes you made to the file are in conflict!\r\nPlease resolve these changes or delete your file."), TITLENAME, MB_ICONERROR);
-			}
-			else if (statusCode == HTTP_STATUS_NOT_FOUND)
-			{
-				WND->MessageBoxNB(_T("File does not exist!"), TITLENAME, MB_ICONERROR);
-			}
-			else if (statusCode == HTTP_STATUS_BAD_METHOD)
-			{
-				WND->MessageBoxNB(_T("Method not allowed!\r\nYoure trying to write to a read-only resource?"), TITLENAME, MB_ICONERROR);
-			}
-			else if (statusCode == HTTP_STATUS_REQUEST_TIMEOUT)
-			{
-				WND->MessageBoxNB(_T("Server timed out!"), TITLENAME, MB_ICONERROR);
-			}
-			else if (statusCode == HTTP_STATUS_DENIED)
-			{
-				WND->MessageBoxNB(_T("Invalid authorization token!\r\nPlease log in again."), TITLENAME, MB_ICONERROR);
-			}
-			else
-			{
-				WND->MessageBoxNB(_T("Error accessing file!"), TITLENAME, MB_ICONERROR);
-			}
-		}
+		//Everything else is answered like an upload
+		return UploadFileResult(filetoken, statusCode, allow, expires, etag);
 	}
 	else
 	{
@@ -533,6 +795,91 @@ INT CVDUSession::CallbackUploadFile(CHttpFile* file)
 	return EXIT_FAILURE;
 }
 
+INT CVDUSession::CallbackRefreshFile(CHttpFile* file)
+{
+	//Background check, failures are silent and retried with the next one
+	if (!file)
+		return EXIT_FAILURE;
+
+	DWORD statusCode;
+	file->QueryInfoStatusCode(statusCode);
+
+	CString filetoken = FileTokenFromObject(file->GetObject());
+	CVDUFile vdufile = APP->GetFileSystemService()->GetVDUFileByToken(filetoken);
+	if (!vdufile.IsValid())
+		return EXIT_FAILURE;
+
+	if (statusCode == HTTP_STATUS_OK)
+	{
+		CString expires;
+		file->QueryInfo(HTTP_QUERY_EXPIRES, expires);
+		SYSTEMTIME expiresST;
+		InternetTimeToSystemTime(expires, &expiresST, 0);
+
+		CString etag;
+		file->QueryInfo(HTTP_QUERY_ETAG, etag);
+
+		CString allow;
+		file->QueryInfo(HTTP_QUERY_ALLOW, allow);
+		allow = allow.MakeUpper();
+
+		vdufile.m_expires = expiresST;
+		vdufile.m_canRead = allow.Find(_T("GET")) != -1;
+		vdufile.m_canWrite = allow.Find(_T("POST")) != -1;
+		APP->GetFileSystemService()->UpdateFileInternal(vdufile);
+
+		//Local edits stay based on the version the client has, uploading them will be refused
+		if (etag != vdufile.m_etag && APP->GetFileSystemService()->ReportRemoteVersionInternal(filetoken, etag) && !APP->IsTestMode())
+			WND->TrayNotify(vdufile.m_name, _T("File was changed on the server, re-access it to get the new version."), SIID_WARNING);
+
+		if (!APP->IsTestMode())
+			WND->UpdateStatus();
+
+		return EXIT_SUCCESS;
+	}
+	else if (statusCode == HTTP_STATUS_NOT_FOUND)
+	{
+		if (APP->GetFileSystemService()->ReportRemoteVersionInternal(filetoken, _T("")) && !APP->IsTestMode())
+			WND->TrayNotify(vdufile.m_name, _T("File is no longer available on the server."), SIID_WARNING);
+	}
+
+	return EXIT_FAILURE;
+}
+
+INT CVDUSession::CallbackTouchFile(CHttpFile* file)
+{
+	//Background keep-alive, anything unexpected is left to the metadata check
+	if (!file)
+		return EXIT_FAILURE;
+
+	DWORD statusCode;
+	file->QueryInfoStatusCode(statusCode);
+	if (statusCode != HTTP_STATUS_NO_CONTENT)
+		return TOUCH_RESULT_FALLBACK;
+
+	CString filetoken = FileTokenFromObject(file->GetObject());
+	CVDUFile vdufile = APP->GetFileSystemService()->GetVDUFileByToken(filetoken);
+	if (!vdufile.IsValid())
+		return EXIT_FAILURE;
+
+	CString expires;
+	SYSTEMTIME expiresST;
+	if (!file->QueryInfo(HTTP_QUERY_EXPIRES, expires) || !InternetTimeToSystemTime(expires, &expiresST, 0))
+		return TOUCH_RESULT_FALLBACK;
+
+	CString etag;
+	file->QueryInfo(HTTP_QUERY_ETAG, etag);
+
+	vdufile.m_expires = expiresST;
+	APP->GetFileSystemService()->UpdateFileInternal(vdufile);
+
+	//Version comes for free, changes are announced like with a metadata check
+	if (!etag.IsEmpty() && etag != vdufile.m_etag && APP->GetFileSystemService()->ReportRemoteVersionInternal(filetoken, etag) && !APP->IsTestMode())
+		WND->TrayNotify(vdufile.m_name, _T("File was changed on the server, re-access it to get the new version."), SIID_WARNING);
+
+	return EXIT_SUCCESS;
+}
+
 INT CVDUSession::CallbackInvalidateFileToken(CHttpFile* file)
 {
 	CVDUSession* session = APP->GetSession();
@@ -545,9 +892,10 @@ INT CVDUSession::CallbackInvalidateFileToken(CHttpFile* file)
 
 		if (statusCode == HTTP_STATUS_NO_CONTENT)
 		{
-			CString filetoken = file->GetObject();
-			filetoken = filetoken.Right(filetoken.GetLength() - 6);
+			CString filetoken = FileTokenFromObject(file->GetObject());
 
+			//Content is kept, accessing the file again only needs the server to confirm it
+			APP->GetFileSystemService()->CacheFileInternal(APP->GetFileSystemService()->GetVDUFileByToken(filetoken));
 			APP->GetFileSystemService()->DeleteFileInternal(filetoken);
 
 			WND->UpdateStatus();
@@ -585,74 +933,299 @@ INT CVDUSession::Login(CString user, CString certPath, BOOL async)
 	headers += GetUser();
 	headers += _T("\r\n");
 
-	if (async)
-	{
-		AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)(new CVDUConnection(GetServerURL(), VDUAPIType::POST_AUTH_KEY, CVDUSession::CallbackLogin, headers, _T(""), certPath)));
-	}
-	else
-	{
-		CWinThread* t = AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)(new CVDUConnection(GetServerURL(), VDUAPIType::POST_AUTH_KEY, CVDUSession::CallbackLogin, headers, _T(""), certPath)), 0, CREATE_SUSPENDED);
+	VDUTaskResult result = APP->GetWorkerPool()->Submit(
+		new CVDUConnection(GetServerURL(), VDUAPIType::POST_AUTH_KEY, CVDUSession::CallbackLogin, headers, _T(""), certPath));
 
-		DWORD exitCode;
-		WAIT_THREAD_EXITCODE(t, exitCode);
-
-		return exitCode;
-	}
+	//If sync, we wait for the task to finish to get its exit code
+	if (!async)
+		return APP->GetWorkerPool()->Wait(result);
 
 	return EXIT_SUCCESS;
 }
 
 BOOL CVDUSession::IsLoggedIn()
 {
-	return !GetUser().IsEmpty() && !GetAuthToken().IsEmpty();
+	AcquireSRWLockShared(&m_lock);
+	BOOL loggedIn = !m_user.IsEmpty() && !m_authToken.IsEmpty();
+	ReleaseSRWLockShared(&m_lock);
+	return loggedIn;
 }
 
 INT CVDUSession::Logout(BOOL async)
 {
-	if (async)
+	if (async && !IsLoggedIn())
+		return EXIT_SUCCESS;
+
+	VDUTaskResult result = APP->GetWorkerPool()->Submit(
+		new CVDUConnection(GetServerURL(), VDUAPIType::DELETE_AUTH_KEY, CVDUSession::CallbackLogout));
+
+	//If sync, we wait for the task to finish to get its exit code
+	if (!async)
+		return APP->GetWorkerPool()->Wait(result);
+
+	return EXIT_SUCCESS;
+}
+
+VDUTaskResult CVDUSession::SubmitAccessFile(CString fileToken)
+{
+	//Continue an interrupted download of this token if the server still has the same version
+	CString headers;
+	//Otherwise content kept since the file was released is reused if it is still current
+	VDUPartialDownload partial;
+	VDUCachedFile cached;
+	if (APP->GetFileSystemService()->GetPartialDownloadInternal(fileToken, partial))
+		headers.Format(_T("Range: bytes=%llu-\r\nIf-Range: %s\r\n"), partial.received, partial.etag.GetString());
+	else if (APP->GetFileSystemService()->GetCachedFileInternal(fileToken, cached))
+		headers.Format(_T("If-None-Match: %s\r\n"), cached.etag.GetString());
+
+	CString serverURL = GetServerURL();
+	return APP->GetWorkerPool()->Submit(VDUTaskCategory::DOWNLOAD, [serverURL, headers, fileToken]()
 	{
-		if (!IsLoggedIn())
-			return EXIT_SUCCESS;
+		CVDUConnection con(serverURL, VDUAPIType::GET_FILE, nullptr, headers, fileToken);
+		INT result = DownloadFile(con);
+		con.Close();
+		if (result != DOWNLOAD_RESULT_REFETCH)
+			return result;
+
+		//A request is never opened while another one is held, that could wait for a connection forever
+		CVDUConnection refetch(serverURL, VDUAPIType::GET_FILE, nullptr, _T(""), fileToken);
+		return DownloadFile(refetch);
+	});
+}
+
+INT CVDUSession::AccessFile(CString fileToken, BOOL async)
+{
+	if (!IsLoggedIn() || APP->GetFileSystemService()->GetVDUFileByToken(fileToken).IsValid())
+		return EXIT_FAILURE;
+
+	VDUTaskResult result = SubmitAccessFile(fileToken);
 
-		AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)new CVDUConnection(GetServerURL(), VDUAPIType::DELETE_AUTH_KEY, CVDUSession::CallbackLogout));
+	//If sync, we wait for the task to finish to get its exit code
+	if (!async)
+		return APP->GetWorkerPool()->Wait(result);
+
+	return EXIT_SUCCESS;
+}
+
+INT CVDUSession::AccessFiles(std::vector<CString> fileTokens, BOOL async, std::vector<INT>* results)
+{
+	if (results)
+		results->assign(fileTokens.size(), EXIT_FAILURE);
+
+	if (!IsLoggedIn())
+		return EXIT_FAILURE;
+
+	//Tokens already accessed or listed twice fail like they do in AccessFile
+	std::vector<CString> pending;
+	std::vector<size_t> pendingIndex;
+	INT result = EXIT_SUCCESS;
+	for (size_t i = 0; i < fileTokens.size(); i++)
+	{
+		if (APP->GetFileSystemService()->GetVDUFileByToken(fileTokens[i]).IsValid() ||
+			std::find(pending.begin(), pending.end(), fileTokens[i]) != pending.end())
+		{
+			if (result == EXIT_SUCCESS)
+				result = EXIT_FAILURE;
+			continue;
+		}
+
+		pending.push_back(fileTokens[i]);
+		pendingIndex.push_back(i);
 	}
-	else
+
+	//Single files keep the plain request, which supports ranges and compression
+	if (pending.size() == 1)
 	{
-		CWinThread* t = AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)new CVDUConnection(GetServerURL(), VDUAPIType::DELETE_AUTH_KEY, CVDUSession::CallbackLogout), 0, CREATE_SUSPENDED);
+		INT single = AccessFile(pending[0], async);
+		if (results)
+			(*results)[pendingIndex[0]] = single;
+		return result == EXIT_SUCCESS ? single : result;
+	}
 
-		DWORD exitCode;
-		WAIT_THREAD_EXITCODE(t, exitCode);
+	std::vector<VDUTaskResult> batches;
+	std::vector<std::shared_ptr<std::vector<INT>>> batchResults;
+	for (size_t first = 0; first < pending.size(); first += BATCH_MAX_TOKENS)
+	{
+		std::vector<CString> batch(pending.begin() + first, pending.begin() + min(first + BATCH_MAX_TOKENS, pending.size()));
+		std::shared_ptr<std::vector<INT>> batchResult = std::make_shared<std::vector<INT>>();
 
-		return exitCode;
+		batches.push_back(APP->GetWorkerPool()->Submit(VDUTaskCategory::DOWNLOAD, [this, batch, batchResult]()
+		{
+			return AccessFileBatch(batch, *batchResult);
+		}));
+		batchResults.push_back(batchResult);
 	}
 
-	return EXIT_SUCCESS;
+	//If sync, we wait for the tasks to finish to get their exit codes
+	if (async)
+		return result;
+
+	for (size_t b = 0; b < batches.size(); b++)
+	{
+		APP->GetWorkerPool()->Wait(batches[b]);
+
+		std::vector<INT>& batchResult = *batchResults[b];
+		for (size_t i = 0; i < batchResult.size(); i++)
+		{
+			if (results)
+				(*results)[pendingIndex[b * BATCH_MAX_TOKENS + i]] = batchResult[i];
+			if (result == EXIT_SUCCESS)
+				result = batchResult[i];
+		}
+	}
+
+	return result;
 }
 
-INT CVDUSession::AccessFile(CString fileToken, BOOL async)
+INT CVDUSession::AccessFileBatch(std::vector<CString> fileTokens, std::vector<INT>& results)
 {
-	if (!IsLoggedIn() || APP->GetFileSystemService()->GetVDUFileByToken(fileToken).IsValid())
+	results.assign(fileTokens.size(), EXIT_FAILURE);
+	std::vector<BOOL> answered(fileTokens.size(), FALSE);
+
+	std::map<CString, size_t> tokenIndex;
+	CStringA body;
+	for (size_t i = 0; i < fileTokens.size(); i++)
+	{
+		tokenIndex[fileTokens[i]] = i;
+		body += CStringA(fileTokens[i]) + "\r\n";
+	}
+
+	CVDUConnection con(GetServerURL(), VDUAPIType::POST_FILES);
+	con.SetContentData(body);
+	CHttpFile* response = con.Open();
+
+	DWORD statusCode = 0;
+	if (response)
+		response->QueryInfoStatusCode(statusCode);
+
+	if (statusCode == HTTP_STATUS_DENIED)
+	{
+		WND->MessageBoxNB(_T("Invalid authorization token!\r\nPlease log in again."), TITLENAME, MB_ICONERROR);
 		return EXIT_FAILURE;
+	}
 
-	if (async)
+	UINT accessed = 0;
+	UINT missing = 0;
+	if (statusCode == HTTP_STATUS_OK)
 	{
-		AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)new CVDUConnection(GetServerURL(), VDUAPIType::GET_FILE, CVDUSession::CallbackDownloadFile, _T(""), fileToken));
+		//Header lines are read byte by byte, buffering keeps that off the network
+		response->SetReadBufferSize(0x1000);
+
+		TRY
+		{
+			std::map<CStringA, CString> headers;
+			while (ReadBatchPart(response, headers))
+			{
+				auto index = tokenIndex.find(headers[FILE_TOKEN_HEADER]);
+				if (index == tokenIndex.end())
+					break;
+
+				size_t i = index->second;
+				INT partStatus = _ttoi(headers["status"]);
+				if (partStatus == HTTP_STATUS_OK)
+				{
+					SYSTEMTIME lastModifiedST, expiresST;
+					InternetTimeToSystemTime(headers["last-modified"], &lastModifiedST, 0);
+					InternetTimeToSystemTime(headers["expires"], &expiresST, 0);
+
+					CString allow = headers["allow"].MakeUpper();
+					CVDUFile vfile(fileTokens[i], allow.Find(_T("GET")) != -1, allow.Find(_T("POST")) != -1, _ttoi64(headers["content-length"]),
+						headers["content-encoding"], headers["content-location"], headers["content-type"], lastModifiedST, expiresST,
+						headers["content-md5"], headers["etag"]);
+
+					//Where a failed file ended in the response is unknown, the rest is accessed one by one
+					if (!APP->GetFileSystemService()->CreateVDUFile(vfile, response))
+						break;
+
+					results[i] = EXIT_SUCCESS;
+					answered[i] = TRUE;
+					accessed++;
+
+					//Dont open anything in test mode
+					if (!APP->IsTestMode())
+						ShellExecute(WND->GetSafeHwnd(), _T("open"), APP->GetFileSystemService()->GetDrivePath() + vfile.m_name, NULL, NULL, SW_SHOWNORMAL);
+				}
+				else if (partStatus == HTTP_STATUS_NOT_FOUND || partStatus == HTTP_STATUS_BAD_METHOD)
+				{
+					answered[i] = TRUE;
+					missing++;
+				}
+
+				//Other parts, e.g. files too large for a batch, are left for a request of their own
+			}
+		}
+		CATCH(CInternetException, e)
+		{
+			e->GetErrorMessage(CVDUConnection::LastError, ARRAYSIZE(CVDUConnection::LastError));
+		}
+		END_CATCH;
 	}
-	else
+
+	con.Close();
+
+	//Servers without batch access answer every file on its own
+	std::vector<std::pair<size_t, VDUTaskResult>> singles;
+	for (size_t i = 0; i < fileTokens.size(); i++)
 	{
-		CWinThread* t = AfxBeginThread(CVDUConnection::ThreadProc,
-			(LPVOID)new CVDUConnection(GetServerURL(), VDUAPIType::GET_FILE, CVDUSession::CallbackDownloadFile, _T(""), fileToken), 0, CREATE_SUSPENDED);
+		if (!answered[i])
+			singles.push_back(std::make_pair(i, SubmitAccessFile(fileTokens[i])));
+	}
 
-		DWORD exitCode;
-		WAIT_THREAD_EXITCODE(t, exitCode);
+	for (auto& single : singles)
+		results[single.first] = APP->GetWorkerPool()->Wait(single.second);
 
-		return exitCode;
+	if (!APP->IsTestMode() && accessed > 0)
+	{
+		CString message;
+		message.Format(_T("%u files successfuly accessed!"), accessed);
+		WND->TrayNotify(_T("Batch access"), message, SIID_DOCASSOC);
+		WND->UpdateStatus();
+	}
+
+	if (missing > 0)
+	{
+		CString message;
+		message.Format(_T("%u files do not exist or can not be read!"), missing);
+		WND->MessageBoxNB(message, TITLENAME, MB_ICONERROR);
+	}
+
+	for (INT result : results)
+	{
+		if (result != EXIT_SUCCESS)
+			return result;
 	}
 
 	return EXIT_SUCCESS;
+}
+
+BOOL CVDUSession::ReadBatchPart(CHttpFile* file, std::map<CStringA, CString>& headers)
+{
+	headers.clear();
+
+	CStringA line;
+	char c;
+	while (file->Read(&c, 1) == 1)
+	{
+		if (c != '\n')
+		{
+			line += c;
+			continue;
+		}
+
+		line.TrimRight('\r');
+
+		//Empty line ends the headers, the file follows
+		if (line.IsEmpty())
+			return !headers.empty();
+
+		int colon = line.Find(':');
+		if (colon > 0)
+		{
+			CStringA name = line.Left(colon).Trim().MakeLower();
+			headers[name] = CString(CA2T(line.Mid(colon + 1).Trim(), CP_UTF8));
+		}
+		line.Empty();
+	}
+
+	return FALSE;
 }
\ No newline at end of file
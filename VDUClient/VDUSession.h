@@ -14,31 +14,73 @@
 #include "VDUConnection.h"
 #include "VDUFilesystem.h"
 #include <time.h>
+#include <vector>
+#include <map>
+#include <future>
+#include <random>
 
 #define APIKEY_HEADER _T("X-Api-Key")
+#define APIKEY_EXPIRES_HEADER _T("X-Api-Key-Expires") //Expiration of a renewed key the server sent with a regular response
+#define CONTENT_ENCODING_HEADER _T("X-Content-Encoding") //Stored encoding of a file sent with transfer compression
+#define CONTENT_LENGTH_HEADER _T("X-Content-Length") //Uncompressed length of a file sent with transfer compression
+#define UPLOAD_ID_HEADER _T("X-Upload-Id") //Id of a started chunked upload
+#define CLIENT_ID_HEADER _T("X-Client-Id") //Identifies the client instance that sent a request
+#define EVENT_SEQUENCE_HEADER _T("X-Event-Sequence") //Last file event a client has seen
+#define FILE_TOKEN_HEADER "x-file-token" //File token of a part of a batch response, lower case as parsed
+#define BATCH_MAX_TOKENS 100 //Most files accessed in a single batch request
+#define DOWNLOAD_RESULT_REFETCH 2 //Download result when cached content cannot be reused, the file is downloaded again once the response is closed
+#define PATCH_RESULT_FALLBACK 2 //Callback result when the server cannot update metadata and the file has to be uploaded with it
+#define TOUCH_RESULT_FALLBACK 2 //Callback result when the server did not extend the file token, its metadata is checked instead
+#define UPLOAD_RESULT_OFFLINE 3 //Callback result when an upload did not get through to the server, the version is queued and sent again later
+#define LOGIN_REFRESH_RETRY 2 //Callback result when the auth token could not be refreshed for a passing reason, it is tried again
+#define LOGIN_REFRESH_MARGIN 30 //Seconds before expiry the auth token is refreshed, at most half of its remaining lifetime
+#define LOGIN_REFRESH_JITTER 10 //Up to this many seconds are added to the margin at random, so clients do not refresh in lockstep
+#define LOGIN_REFRESH_RETRY_DELAY 1000 //Time in ms before a failed refresh is tried again, doubles with every failure
+#define LOGIN_REFRESH_RETRY_DELAY_MAX 30000 //Longest time in ms between attempts to refresh
 
 class CVDUSession
 {
-public:
-	SRWLOCK m_lock; //Used to handle writing to session data
 private:
+	SRWLOCK m_lock; //Guards session data, held only for the duration of a single accessor
 	CString m_serverURL; //Server url
+	CString m_clientId; //Identifies this client instance to the server, constant after construction
 	CString m_user; //Logged in user
 	CString m_authToken; //Current autorization token
 	CTime m_authTokenExpires; //When auth token expires
+	ULONGLONG m_refreshTimer; //Timer of the next auth token refresh
+	std::mt19937 m_random; //Spreads refreshes of many clients
+
+	//Plans the next auth token refresh by the current expiration, replaces any planned refresh
+	//retryDelay in ms is used instead when not 0, nothing is planned while nobody is logged in
+	void ScheduleRefresh(DWORD retryDelay = 0);
+
+	//Queues download of VDU file of fileToken, continues an interrupted download if there is one
+	VDUTaskResult SubmitAccessFile(CString fileToken);
+
+	//Downloads VDU files of fileTokens in a single request, files the response does not carry are accessed one by one
+	//This function is BLOCKING, run it on a worker
+	//results receives exit code for every token
+	INT AccessFileBatch(std::vector<CString> fileTokens, std::vector<INT>& results);
 public:
 	CVDUSession(CString serverURL);
 	~CVDUSession();
 
-	//Functions are only to be used while having exclusive access to session
+	//Accessors are thread-safe, the lock is never held across a server request
 
 	void Reset(CString serverURL); //Resets session state for new server
 	CString GetServerURL(); //Returns the current server URL
+	CString GetClientId(); //Returns the id of this client instance
 	CString GetUser(); //Returns the current user
 	CString GetAuthToken(); //Returns current auth token
 	CTime GetAuthTokenExpires(); //Returns time when auth token expires
 	void SetUser(CString user); //Sets current user name
 	void SetAuthData(CString authToken, CTime expires); //Sets authorization data
+	void GetAuthData(CString& authToken, CTime& expires); //Reads token and its expiration in one consistent snapshot
+
+	//Adopts a renewed auth token the server sent with a response to a request authorized by sentToken
+	//The token is only replaced if it is still sentToken, an older response never undoes a newer renewal
+	//Returns TRUE if the token was replaced
+	BOOL AdoptRenewedAuthData(CHttpFile* file, CString sentToken);
 
 	BOOL IsLoggedIn(); //Checks if an user is logged in
 
@@ -57,12 +99,42 @@ public:
 	//Returns success or exit code if not async
 	INT AccessFile(CString fileToken, BOOL async = TRUE);
 
-	//Callbacks are guaranteed to have exclusive access to session
+	//Attempts to download VDU files of fileTokens with as few requests as possible and add them to the filesystem
+	//This function is BLOCKING if async is FALSE
+	//Returns success if all files were accessed or exit code of the first failure if not async
+	//results receives exit code for every token in order if not async
+	INT AccessFiles(std::vector<CString> fileTokens, BOOL async = TRUE, std::vector<INT>* results = nullptr);
+
+	//Reads a response header by name, returns FALSE if not present
+	static BOOL QueryCustomHeader(CHttpFile* file, LPCTSTR name, CString& value);
+
+	//Reads first byte and total length from Content-Range, returns FALSE if not present or malformed
+	static BOOL QueryContentRange(CHttpFile* file, ULONGLONG& first, ULONGLONG& total);
+
+	//Extracts file token from a /file/{token}[/...] object path
+	static CString FileTokenFromObject(CString object);
+
+	//Downloads VDU file with the GET request of con, which is opened here and may be closed before the file is complete
+	//Returns DOWNLOAD_RESULT_REFETCH when the file has to be requested again without conditions
+	static INT DownloadFile(CVDUConnection& con);
+
+	//Reads header lines of the next part of a batch response, names are lower case
+	//Returns FALSE at the end of the response
+	static BOOL ReadBatchPart(CHttpFile* file, std::map<CStringA, CString>& headers);
+
+	//Applies server answer to an upload of file, shared by single and batch uploads
+	//Returns success if the server took the file
+	static INT UploadFileResult(CString filetoken, DWORD statusCode, CString allow, CString expires, CString etag);
+
+	//Callbacks run concurrently, session data is only changed through the accessors
 	static INT CallbackPing(CHttpFile* file);
 	static INT CallbackLogin(CHttpFile* file);
 	static INT CallbackLoginRefresh(CHttpFile* file);
 	static INT CallbackLogout(CHttpFile* file);
-	static INT CallbackDownloadFile(CHttpFile* file);
 	static INT CallbackUploadFile(CHttpFile* file);
+	static INT CallbackUploadFileDelta(CHttpFile* file);
+	static INT CallbackPatchFile(CHttpFile* file);
+	static INT CallbackRefreshFile(CHttpFile* file);
+	static INT CallbackTouchFile(CHttpFile* file);
 	static INT CallbackInvalidateFileToken(CHttpFile* file);
 };
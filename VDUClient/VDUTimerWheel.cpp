@@ -0,0 +1,226 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUTimerWheel.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUTimerWheel.h"
+#include <algorithm>
+
+CVDUTimerWheel::CVDUTimerWheel(ULONGLONG now) : m_free(TIMERWHEEL_NONE), m_count(0), m_now(now), m_sequence(0)
+{
+	for (size_t level = 0; level < TIMERWHEEL_LEVELS; level++)
+	{
+		m_levelCount[level] = 0;
+		for (size_t slot = 0; slot < TIMERWHEEL_SLOTS; slot++)
+			m_slots[level][slot] = TIMERWHEEL_NONE;
+	}
+}
+
+CVDUTimerWheel::~CVDUTimerWheel()
+{
+}
+
+void CVDUTimerWheel::Place(UINT32 index)
+{
+	Timer& timer = m_entries[index];
+	ULONGLONG diff = timer.deadline - m_now;
+
+	//Level is chosen by distance, slot by the deadline itself so it stays put while time passes
+	size_t level = 0;
+	while (level + 1 < TIMERWHEEL_LEVELS && diff >> (TIMERWHEEL_SLOT_BITS * (level + 1)))
+		level++;
+
+	size_t shift = TIMERWHEEL_SLOT_BITS * level;
+	ULONGLONG key = timer.deadline >> shift;
+
+	//Beyond the range of the wheel, park in the slot reached last and place again from there
+	if (diff >> (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS))
+		key = (m_now >> shift) + TIMERWHEEL_SLOT_MASK;
+
+	timer.level = (UINT16)level;
+	timer.slot = (UINT16)(key & TIMERWHEEL_SLOT_MASK);
+	timer.prev = TIMERWHEEL_NONE;
+	timer.next = m_slots[level][timer.slot];
+	if (timer.next != TIMERWHEEL_NONE)
+		m_entries[timer.next].prev = index;
+	m_slots[level][timer.slot] = index;
+	m_levelCount[level]++;
+}
+
+void CVDUTimerWheel::Unlink(UINT32 index)
+{
+	Timer& timer = m_entries[index];
+	if (timer.prev != TIMERWHEEL_NONE)
+		m_entries[timer.prev].next = timer.next;
+	else
+		m_slots[timer.level][timer.slot] = timer.next;
+	if (timer.next != TIMERWHEEL_NONE)
+		m_entries[timer.next].prev = timer.prev;
+	m_levelCount[timer.level]--;
+}
+
+void CVDUTimerWheel::Free(UINT32 index)
+{
+	Timer& timer = m_entries[index];
+	timer.id = 0;
+	timer.callback = nullptr;
+	timer.next = m_free;
+	m_free = index;
+	m_count--;
+}
+
+size_t CVDUTimerWheel::Cascade(size_t level)
+{
+	size_t slot = (size_t)((m_now >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_SLOT_MASK);
+
+	UINT32 index = m_slots[level][slot];
+	m_slots[level][slot] = TIMERWHEEL_NONE;
+	while (index != TIMERWHEEL_NONE)
+	{
+		UINT32 next = m_entries[index].next;
+		m_levelCount[level]--;
+		Place(index);
+		index = next;
+	}
+
+	return slot;
+}
+
+ULONGLONG CVDUTimerWheel::GetNextCascadeTick()
+{
+	ULONGLONG next = TIMERWHEEL_NEVER;
+	for (size_t level = 1; level < TIMERWHEEL_LEVELS; level++)
+	{
+		if (!m_levelCount[level])
+			continue;
+
+		//Current slot moves down when its first tick is processed, afterwards it holds the next round
+		size_t shift = TIMERWHEEL_SLOT_BITS * level;
+		ULONGLONG lap = m_now >> shift;
+		ULONGLONG first = (m_now & ((1ULL << shift) - 1)) ? 1 : 0;
+		for (ULONGLONG k = first; k <= TIMERWHEEL_SLOTS; k++)
+		{
+			if (m_slots[level][(lap + k) & TIMERWHEEL_SLOT_MASK] != TIMERWHEEL_NONE)
+			{
+				next = min(next, (lap + k) << shift);
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+ULONGLONG CVDUTimerWheel::Schedule(ULONGLONG deadline, VDU_TIMER_CALLBACK callback)
+{
+	UINT32 index = m_free;
+	if (index != TIMERWHEEL_NONE)
+	{
+		m_free = m_entries[index].next;
+	}
+	else
+	{
+		index = (UINT32)m_entries.size();
+		m_entries.push_back(Timer());
+		m_entries[index].generation = 0;
+	}
+
+	Timer& timer = m_entries[index];
+	timer.generation++;
+	timer.id = ((ULONGLONG)timer.generation << 32) | index;
+	timer.sequence = m_sequence++;
+	timer.deadline = max(deadline, m_now);
+	timer.callback = callback;
+
+	Place(index);
+	m_count++;
+	return timer.id;
+}
+
+BOOL CVDUTimerWheel::Cancel(ULONGLONG id)
+{
+	//Ids of expired or cancelled timers no longer match their entry
+	UINT32 index = (UINT32)id;
+	if (!id || index >= m_entries.size() || m_entries[index].id != id)
+		return FALSE;
+
+	Unlink(index);
+	Free(index);
+	return TRUE;
+}
+
+void CVDUTimerWheel::Advance(ULONGLONG now, std::vector<VDU_TIMER_CALLBACK>& expired)
+{
+	std::vector<UINT32> due;
+	while (m_now <= now)
+	{
+		//Nothing to move closer, time can jump
+		if (!m_count)
+		{
+			m_now = now + 1;
+			break;
+		}
+
+		size_t slot = (size_t)(m_now & TIMERWHEEL_SLOT_MASK);
+
+		//End of a lap, the next part of the level above moves down
+		if (!slot && !Cascade(1) && !Cascade(2))
+			Cascade(3);
+
+		//Nothing is due before timers of a higher level move down, time can jump to that
+		if (!m_levelCount[0])
+		{
+			m_now = min(GetNextCascadeTick(), now + 1);
+			continue;
+		}
+
+		//Every timer of the slot has this very deadline
+		for (UINT32 index = m_slots[0][slot]; index != TIMERWHEEL_NONE; index = m_entries[index].next)
+			due.push_back(index);
+		m_slots[0][slot] = TIMERWHEEL_NONE;
+		m_levelCount[0] -= due.size();
+
+		//Timers of the same deadline expire in the order they were scheduled
+		std::sort(due.begin(), due.end(), [this](UINT32 a, UINT32 b) { return m_entries[a].sequence < m_entries[b].sequence; });
+		for (auto it = due.begin(); it != due.end(); it++)
+		{
+			expired.push_back(std::move(m_entries[*it].callback));
+			Free(*it);
+		}
+		due.clear();
+
+		m_now++;
+	}
+}
+
+ULONGLONG CVDUTimerWheel::GetNextTick()
+{
+	if (!m_count)
+		return TIMERWHEEL_NEVER;
+
+	ULONGLONG cascade = GetNextCascadeTick();
+
+	//Every lowest slot holds a single deadline within the next 256 ticks
+	if (m_levelCount[0])
+	{
+		for (ULONGLONG tick = m_now; tick < m_now + TIMERWHEEL_SLOTS && tick < cascade; tick++)
+		{
+			if (m_slots[0][tick & TIMERWHEEL_SLOT_MASK] != TIMERWHEEL_NONE)
+				return tick;
+		}
+	}
+
+	return cascade;
+}
+
+size_t CVDUTimerWheel::GetCount()
+{
+	return m_count;
+}
@@ -0,0 +1,91 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUTimerWheel.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#define TIMERWHEEL_LEVELS 4 //Levels of the wheel, each covers 256 times the range of the one below
+#define TIMERWHEEL_SLOT_BITS 8 //Every level has 2^8 slots
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_NEVER ((ULONGLONG)-1) //No timer is scheduled
+#define TIMERWHEEL_NONE ((UINT32)-1) //End of a slot list
+
+//Work done when a timer expires
+typedef std::function<void()> VDU_TIMER_CALLBACK;
+
+//Hierarchical timer wheel, time is counted in abstract ticks
+//Scheduling and cancelling take constant time, timers are only sorted when they get close to their deadline
+//Not thread-safe, the owner serializes access
+class CVDUTimerWheel
+{
+protected:
+	//Timer entry, linked in the list of its slot while scheduled
+	//Entries are reused, the id tells apart timers that used the same entry
+	struct Timer
+	{
+		ULONGLONG id; //Handle given out by Schedule, 0 while the entry is free
+		ULONGLONG sequence; //Order the timer was scheduled in
+		ULONGLONG deadline; //Tick the timer expires at
+		VDU_TIMER_CALLBACK callback; //Work to do on expiry
+		UINT32 prev; //Previous entry in the slot
+		UINT32 next; //Next entry in the slot, or next free entry
+		UINT32 generation; //Times the entry was used, upper half of the id
+		UINT16 level; //Level the timer is linked in
+		UINT16 slot; //Slot the timer is linked in
+	};
+
+	UINT32 m_slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; //First entry of every slot
+	size_t m_levelCount[TIMERWHEEL_LEVELS]; //Timers per level
+	std::vector<Timer> m_entries; //All entries, the index is the lower half of the id
+	UINT32 m_free; //First free entry
+	size_t m_count; //Scheduled timers
+	ULONGLONG m_now; //Next tick to be processed, every earlier tick has expired
+	ULONGLONG m_sequence; //Sequence of the next scheduled timer
+
+	//Links entry in the slot its deadline falls into
+	void Place(UINT32 index);
+
+	//Unlinks entry from its slot
+	void Unlink(UINT32 index);
+
+	//Returns entry to the free list
+	void Free(UINT32 index);
+
+	//Moves all timers of a slot to lower levels, returns index of the slot
+	size_t Cascade(size_t level);
+
+	//Returns the first tick a non-empty slot of a higher level moves down at, TIMERWHEEL_NEVER if there is none
+	ULONGLONG GetNextCascadeTick();
+public:
+	CVDUTimerWheel(ULONGLONG now);
+	~CVDUTimerWheel();
+
+	//Schedules callback to expire at deadline, deadlines in the past expire with the next processed tick
+	//Returns id of the timer, never 0
+	ULONGLONG Schedule(ULONGLONG deadline, VDU_TIMER_CALLBACK callback);
+
+	//Removes a timer that did not expire yet, returns FALSE if there is none of that id
+	BOOL Cancel(ULONGLONG id);
+
+	//Processes all ticks up to and including now
+	//Callbacks of expired timers are appended to expired by deadline, timers of the same deadline in the order they were scheduled
+	void Advance(ULONGLONG now, std::vector<VDU_TIMER_CALLBACK>& expired);
+
+	//Returns the first tick Advance has work at, TIMERWHEEL_NEVER if no timer is scheduled
+	//Moving far timers closer counts as work, so the result can be earlier than the first deadline
+	ULONGLONG GetNextTick();
+
+	//Amount of scheduled timers
+	size_t GetCount();
+};
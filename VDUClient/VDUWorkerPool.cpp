@@ -0,0 +1,268 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUWorkerPool.cpp
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include "pch.h"
+#include "framework.h"
+#include "VDUWorkerPool.h"
+#include "VDUConnection.h"
+#include <algorithm>
+
+//Set for threads owned by a worker pool
+static thread_local BOOL t_isWorker = FALSE;
+
+CVDUTask::CVDUTask(VDUTaskCategory category, VDU_TASK work) : m_work(work), m_claimed(FALSE), category(category)
+{
+	m_result = m_promise.get_future().share();
+}
+
+std::shared_future<INT> CVDUTask::GetResult()
+{
+	return m_result;
+}
+
+BOOL CVDUTask::Claim()
+{
+	return !InterlockedExchange(&m_claimed, TRUE);
+}
+
+void CVDUTask::Run()
+{
+	//Exceptions reach whoever gets the result
+	try
+	{
+		m_promise.set_value(m_work());
+	}
+	catch (...)
+	{
+		m_promise.set_exception(std::current_exception());
+	}
+	m_work = nullptr;
+}
+
+BOOL CVDUTask::Cancel(INT result)
+{
+	if (!Claim())
+		return FALSE;
+
+	m_promise.set_value(result);
+	m_work = nullptr;
+	return TRUE;
+}
+
+CVDUWorkerPool::CVDUWorkerPool(UINT threadCount) : m_lock(SRWLOCK_INIT), m_queued(CONDITION_VARIABLE_INIT), m_transferLimit(0), m_stopping(FALSE)
+{
+	threadCount = max(threadCount, 1);
+
+	for (size_t i = 0; i < (size_t)VDUTaskCategory::COUNT; i++)
+	{
+		m_running[i] = 0;
+		m_limits[i] = threadCount;
+	}
+
+	//Keep a worker free for short control requests while transfers are running
+	m_transferLimit = threadCount > 1 ? threadCount - 1 : threadCount;
+
+	for (UINT i = 0; i < threadCount; i++)
+	{
+		CWinThread* t = AfxBeginThread(ThreadProc, (LPVOID)this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+		ASSERT(t);
+		t->m_bAutoDelete = FALSE;
+		t->ResumeThread();
+		m_threads.push_back(t);
+	}
+}
+
+CVDUWorkerPool::~CVDUWorkerPool()
+{
+	//Queued tasks never run once workers stop, whoever waits for them gets a failure instead of a broken promise
+	std::deque<std::shared_ptr<CVDUTask>> cancelled;
+	AcquireSRWLockExclusive(&m_lock);
+	m_stopping = TRUE;
+	cancelled.swap(m_queue);
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_queued);
+
+	for (auto it = cancelled.begin(); it != cancelled.end(); it++)
+		(*it)->Cancel(EXIT_FAILURE);
+
+	for (auto it = m_threads.begin(); it != m_threads.end(); it++)
+	{
+		WaitForSingleObject((*it)->m_hThread, INFINITE);
+		delete (*it);
+	}
+}
+
+void CVDUWorkerPool::SetCategoryLimit(VDUTaskCategory category, UINT limit)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_limits[(size_t)category] = max(limit, 1);
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_queued);
+}
+
+VDUTaskResult CVDUWorkerPool::Submit(VDUTaskCategory category, VDU_TASK task)
+{
+	return Submit(std::make_shared<CVDUTask>(category, task));
+}
+
+VDUTaskResult CVDUWorkerPool::Submit(std::shared_ptr<CVDUTask> task)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	BOOL stopping = m_stopping;
+	if (!stopping)
+		m_queue.push_back(task);
+	ReleaseSRWLockExclusive(&m_lock);
+
+	//Running tasks may still submit work while the pool stops
+	if (stopping)
+		task->Cancel(EXIT_FAILURE);
+	else
+		WakeAllConditionVariable(&m_queued);
+
+	VDUTaskResult result;
+	result.result = task->GetResult();
+	result.task = task;
+	return result;
+}
+
+VDUTaskResult CVDUWorkerPool::Submit(CVDUConnection* con)
+{
+	ASSERT(con);
+
+	VDUTaskCategory category;
+	switch (con->GetType())
+	{
+	case VDUAPIType::GET_FILE:
+	case VDUAPIType::POST_FILES:
+		category = VDUTaskCategory::DOWNLOAD;
+		break;
+	case VDUAPIType::POST_FILE:
+	case VDUAPIType::POST_FILE_DELTA:
+	case VDUAPIType::PUT_UPLOAD_PART:
+	case VDUAPIType::POST_FILES_UPLOAD:
+		category = VDUTaskCategory::UPLOAD;
+		break;
+	default:
+		category = VDUTaskCategory::CONTROL;
+		break;
+	}
+
+	//Connection goes with the work, also when the task is cancelled before it ran
+	std::shared_ptr<CVDUConnection> owned(con);
+	return Submit(category, [owned]()
+	{
+		return owned->Process();
+	});
+}
+
+BOOL CVDUWorkerPool::IsTransfer(VDUTaskCategory category)
+{
+	return category == VDUTaskCategory::DOWNLOAD || category == VDUTaskCategory::UPLOAD;
+}
+
+BOOL CVDUWorkerPool::PopRunnableLocked(std::shared_ptr<CVDUTask>& out)
+{
+	for (auto it = m_queue.begin(); it != m_queue.end();)
+	{
+		size_t category = (size_t)(*it)->category;
+		if (m_running[category] < m_limits[category] &&
+			(!IsTransfer((*it)->category) || m_running[(size_t)VDUTaskCategory::DOWNLOAD] + m_running[(size_t)VDUTaskCategory::UPLOAD] < m_transferLimit))
+		{
+			std::shared_ptr<CVDUTask> task = *it;
+			it = m_queue.erase(it);
+			if (!task->Claim())
+				continue;
+
+			out = task;
+			m_running[category]++;
+			return TRUE;
+		}
+		it++;
+	}
+	return FALSE;
+}
+
+void CVDUWorkerPool::Execute(std::shared_ptr<CVDUTask> task)
+{
+	task->Run();
+
+	AcquireSRWLockExclusive(&m_lock);
+	m_running[(size_t)task->category]--;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	//Tasks of the freed category may be runnable now
+	WakeAllConditionVariable(&m_queued);
+}
+
+INT CVDUWorkerPool::Wait(VDUTaskResult result)
+{
+	//A worker blocked on a task no one started would hold its thread hostage, it runs the task itself
+	//The task counts towards its category like on any other worker
+	if (IsWorkerThread() && result.task)
+	{
+		AcquireSRWLockExclusive(&m_lock);
+		BOOL claimed = result.task->Claim();
+		if (claimed)
+		{
+			auto queued = std::find(m_queue.begin(), m_queue.end(), result.task);
+			if (queued != m_queue.end())
+				m_queue.erase(queued);
+			m_running[(size_t)result.task->category]++;
+		}
+		ReleaseSRWLockExclusive(&m_lock);
+
+		if (claimed)
+			Execute(result.task);
+	}
+
+	//Task running elsewhere is waited for, it does not depend on this thread
+	return result.result.get();
+}
+
+ULONGLONG CVDUWorkerPool::GetPendingCount()
+{
+	AcquireSRWLockShared(&m_lock);
+	ULONGLONG count = m_queue.size();
+	for (size_t i = 0; i < (size_t)VDUTaskCategory::COUNT; i++)
+		count += m_running[i];
+	ReleaseSRWLockShared(&m_lock);
+	return count;
+}
+
+BOOL CVDUWorkerPool::IsWorkerThread()
+{
+	return t_isWorker;
+}
+
+UINT CVDUWorkerPool::ThreadProc(LPVOID pool0)
+{
+	CVDUWorkerPool* pool = (CVDUWorkerPool*)pool0;
+	ASSERT(pool);
+	t_isWorker = TRUE;
+
+	while (TRUE)
+	{
+		std::shared_ptr<CVDUTask> task;
+		BOOL found = FALSE;
+
+		AcquireSRWLockExclusive(&pool->m_lock);
+		while (!pool->m_stopping && !(found = pool->PopRunnableLocked(task)))
+			SleepConditionVariableSRW(&pool->m_queued, &pool->m_lock, INFINITE, 0);
+		ReleaseSRWLockExclusive(&pool->m_lock);
+
+		if (!found)
+			break;
+
+		pool->Execute(task);
+	}
+
+	return EXIT_SUCCESS;
+}
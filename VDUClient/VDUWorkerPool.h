@@ -0,0 +1,123 @@
+/*
+ * @copyright 2015-2022 Bill Zissimopoulos
+ *
+ * @file VDUWorkerPool.h
+ * This file is licensed under the GPLv3 licence.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+
+#define WORKERPOOL_DEFAULT_THREADS 8 //Default amount of worker threads
+
+//Categories of work, each category has its own concurrency limit
+enum class VDUTaskCategory
+{
+	CONTROL, //Short requests: ping, auth keys, token invalidation
+	DOWNLOAD, //File downloads
+	UPLOAD, //File uploads
+	COUNT
+};
+
+//Unit of work, return value is the task result
+typedef std::function<INT()> VDU_TASK;
+
+class CVDUConnection;
+
+//Submitted work and its result, the work runs once, on a worker or on a worker waiting for the result
+class CVDUTask
+{
+protected:
+	VDU_TASK m_work; //The work
+	std::promise<INT> m_promise; //Completed with the result of the work
+	std::shared_future<INT> m_result; //Result of the work
+	volatile LONG m_claimed; //Set once a thread took the work
+public:
+	const VDUTaskCategory category; //Category the task counts towards
+
+	CVDUTask(VDUTaskCategory category, VDU_TASK work);
+
+	//Returns result of the work
+	std::shared_future<INT> GetResult();
+
+	//Takes the work for the calling thread, FALSE if it was taken before
+	BOOL Claim();
+
+	//Runs claimed work and completes the result
+	void Run();
+
+	//Completes the result with 'result' without running the work, FALSE if the work was taken before
+	BOOL Cancel(INT result);
+};
+
+//Result of a submitted task
+//A worker waiting for the result runs the task itself if no one started it yet
+struct VDUTaskResult
+{
+	std::shared_future<INT> result; //The result
+	std::shared_ptr<CVDUTask> task; //Task completing result, directly or as part of its work, e.g. a batch of uploads
+};
+
+//Fixed amount of worker threads executing queued tasks
+//Replaces a thread per request, so bursts of requests do not create unbounded threads
+class CVDUWorkerPool
+{
+protected:
+	SRWLOCK m_lock; //Guards all members below
+	CONDITION_VARIABLE m_queued; //Signalled when a task is queued or a category slot frees up
+	std::deque<std::shared_ptr<CVDUTask>> m_queue; //Tasks waiting for a worker
+	UINT m_running[(size_t)VDUTaskCategory::COUNT]; //Running tasks per category
+	UINT m_limits[(size_t)VDUTaskCategory::COUNT]; //Concurrency limit per category
+	UINT m_transferLimit; //Concurrency limit of downloads and uploads together
+	std::vector<CWinThread*> m_threads; //Worker threads
+	BOOL m_stopping; //Workers exit once set, tasks submitted afterwards are cancelled
+
+	//Is the category a download or upload, those share one limit
+	static BOOL IsTransfer(VDUTaskCategory category);
+
+	//Takes the first queued task whose category is under its limit and claims it, expects exclusive lock
+	//Tasks claimed by a waiting worker before they were queued are dropped
+	BOOL PopRunnableLocked(std::shared_ptr<CVDUTask>& out);
+
+	//Runs the claimed task and frees its category slot
+	void Execute(std::shared_ptr<CVDUTask> task);
+public:
+	CVDUWorkerPool(UINT threadCount = WORKERPOOL_DEFAULT_THREADS);
+	//Cancels queued tasks, their results are EXIT_FAILURE, and waits for running ones
+	~CVDUWorkerPool();
+
+	//Sets maximum of concurrently running tasks of a category
+	void SetCategoryLimit(VDUTaskCategory category, UINT limit);
+
+	//Queues a task, returns its result
+	VDUTaskResult Submit(VDUTaskCategory category, VDU_TASK task);
+
+	//Queues a task created before, e.g. one planned for later that a waiting worker may run earlier
+	VDUTaskResult Submit(std::shared_ptr<CVDUTask> task);
+
+	//Queues connection processing, connection has to be created by 'new' and is deleted when done
+	VDUTaskResult Submit(CVDUConnection* con);
+
+	//Blocks until the task is done and returns its result
+	//When called on a worker thread, the awaited task is run right away if no one started it, so nested waits cannot starve the pool
+	//Other queued work is left to other workers, the waiting thread never gets stuck in unrelated long transfers
+	INT Wait(VDUTaskResult result);
+
+	//Amount of queued and running tasks
+	ULONGLONG GetPendingCount();
+
+	//Is the calling thread a worker of this pool
+	static BOOL IsWorkerThread();
+
+	//Worker thread procedure
+	static UINT ThreadProc(LPVOID pool);
+};
@@ -14,7 +14,7 @@
 #
 #
 
-import os, time, subprocess
+import os, time, subprocess, json
 thispath = os.path.dirname(os.path.realpath(__file__))
 
 #===============================================
@@ -22,6 +22,18 @@ thispath = os.path.dirname(os.path.realpath(__file__))
 VDUCLIENT = thispath + "\\Release\\x64\\VDUClient.exe" 
 VDUSERVER = thispath + "\\vdusrv.py"
 LOCAL_SERVER_ADDRESS = "127.0.0.1:4443"
+STATS_FILE = thispath + "\\stats.json"
+#Resumed downloads may resend at most this fraction of the file
+RESUME_MAX_OVERHEAD = 0.05
+#Upload of a small edit sent as a delta may carry at most this fraction of the file
+DELTA_MAX_FRACTION = 0.01
+#Files from this size up are uploaded in parallel parts, see UPLOAD_PARTS_MIN_SIZE in VDUClient/VDUFilesystem.h
+UPLOAD_PARTS_MIN_SIZE = 0x4000000
+#Compressible text above the size of batch uploads, see UPLOAD_BATCH_MAX_FILE_SIZE in VDUClient/VDUFilesystem.h
+LOG_FILE = thispath + "\\TestFiles\\log.txt"
+LOG_FILE_SIZE = 0x100000
+#Whole upload of a compressible file may carry at most this fraction of the file
+GZIP_MAX_FRACTION = 0.5
 PADDING = (20 * "=")
 #===============================================
 # Action list
@@ -34,14 +46,28 @@ PADDING = (20 * "=")
 # -logout                   Logs out current user
 # -write [token] [text]     Writes `text` at the beginning of a file
 # -read [token] [cmpText]   Reads text of the length of `cmpText` from the beginning of a file and compares them
+# -check [token] [count]    Checks metadata of a file `count` times at once
+# -wait [ms]                Waits `ms` milliseconds before the next action
+# -hold [token] [ms]        Keeps a file open for `ms` milliseconds
 
 def Log(msg):
     print(("[%s] " + str(msg)) % time.strftime('%H:%M:%S'))
 
+#End of the last upload the server answered, single and batch uploads alike
+def UploadsEnd(stats):
+    return max(route["Last"] for name, route in stats["Requests"].items() if name in ("POST /file/{}", "POST /files/upload"))
+
+#Time from the start of the first request to the end of the last one, waits for file events are held open on purpose and left out
+def RequestsSpan(stats):
+    routes = [route for name, route in stats["Requests"].items() if name != "POST /events"]
+    return max(route["Last"] for route in routes) - min(route["First"] for route in routes)
+
 EXIT_SUCCESS = 0
 EXIT_FAILURE = 1
 #Array of tests
 #Each test is the name, the instructions of test and expected exit code
+#Optionally followed by server arguments and a file whose size the bytes sent by the server must stay close to
+#and by a check of the server stats, given the stats and the size of that file
 Tests = [
     ["server_bad", "-server 0.0.0.0:4443 -user john", EXIT_FAILURE],
     ["login_ok", "-user john", EXIT_SUCCESS], #Simple login test, can we login under this name?
@@ -55,6 +81,9 @@ Tests = [
     ["thetwotime", "-user john -accessfile d -deletefile d -accessfile d -deletefile d -logout", EXIT_SUCCESS],
     ["tworeqs", "-user john -accessfile b -accessfile b", EXIT_FAILURE], #File already exists, fails
     ["allfiles", "-user john -accessfile a -accessfile b -accessfile c -accessfile d -accessfile e -accessfile f -logout", EXIT_SUCCESS],
+    ["allfiles_edit", "-user john -accessfile a -accessfile b -accessfile c -write a Edit_a -write b Edit_b -write c Edit_c -read a Edit_a -read b Edit_b -read c Edit_c -deletefile a -deletefile b -deletefile c -logout", EXIT_SUCCESS, "-delay 200", None,
+        lambda stats, size: RequestsSpan(stats) < 12 * 0.2 * 0.75], #Actions on different files run at the same time against a slow server, 12 actions one by one would take 2.4 s
+    ["batch_ne", "-user john -accessfile a -accessfile 012a -accessfile c -deletefile a -deletefile c", EXIT_FAILURE], #Batch with a file that doesnt exist
     ["rename_bf", "-user john -accessfile a -rename a test.txt -deletefile a -accessfile a -rename a plain.txt -deletefile a -logout", EXIT_SUCCESS],
     ["rename_ne", "-user john -rename c test", EXIT_FAILURE], #Rename non existent file
     ["write_ok", "-user john -accessfile a -write a Testing_Writing_Works -deletefile a -logout", EXIT_SUCCESS],
@@ -63,8 +92,30 @@ Tests = [
     ["read_ok", "-user john -accessfile a -write a Apple -deletefile a -accessfile a -read a Apple -deletefile a -logout", EXIT_SUCCESS],
     ["read_bad", "-user john -accessfile a -write a Pear -deletefile a -accessfile a -read a Citron -deletefile a", EXIT_FAILURE],
     ["read_two", "-user john -accessfile a -write a Citron_is_healthy -deletefile a -accessfile a -read a Citron -write a Banana -deletefile a -accessfile a -read a Banana_is_healthy -logout", EXIT_SUCCESS],
+    ["keyrefresh", "-user john -accessfile a -check a 10000 -deletefile a -logout", EXIT_SUCCESS, "-keylifetime 6"], #Requests across several key refreshes, none may be refused
+    ["keepalive", "-user john -accessfile d -hold d 10000 -write d Long_edit -hold d 10000 -write d Longer_edit -deletefile d -logout", EXIT_SUCCESS, "-keylifetime 6", thispath + "\\TestFiles\\hugefile.bin"], #Edits outlive the file token lifetime while the file is open, no re-access and no second download
+    ["resume", "-user john -accessfile d -deletefile d -logout", EXIT_SUCCESS, "-dropcount 3", thispath + "\\TestFiles\\hugefile.bin"], #Download cut 3 times at random offsets
+    ["download_overlap", "-user john -accessfile a -accessfile b -check a 1 -accessfile d -write a Overlap_a -write b Overlap_b -deletefile a -deletefile b -deletefile d -logout", EXIT_SUCCESS, "-delay 200 -latency 20", thispath + "\\TestFiles\\hugefile.bin",
+        lambda stats, size: UploadsEnd(stats) < stats["Requests"]["GET /file/{}"]["Last"]], #Small uploads are answered while a large download is still running
+    ["delta_edit", "-user john -accessfile d -write d Delta_edit -deletefile d -logout", EXIT_SUCCESS, "", thispath + "\\TestFiles\\hugefile.bin",
+        lambda stats, size: "POST /file/{}/delta" in stats["Requests"] and stats["Received"] <= size * DELTA_MAX_FRACTION], #Small edit of a large file uploads only the changed blocks
+    ["parts_upload", "-user john -accessfile d -write d Parts_edit -deletefile d -logout", EXIT_SUCCESS, "-nodelta", thispath + "\\TestFiles\\hugefile.bin",
+        lambda stats, size: size >= UPLOAD_PARTS_MIN_SIZE and "PUT /file/{}/uploads/{}/{}" in stats["Requests"] and stats["Received"] <= size * (1 + RESUME_MAX_OVERHEAD)], #Whole upload of a file of 64 MB or more goes in parts, none sent twice
+    ["batch_upload", "-user john -accessfile a -accessfile b -accessfile c -write a Batch_a -write b Batch_b -write c Batch_c -deletefile a -deletefile b -deletefile c -logout", EXIT_SUCCESS, "", None,
+        lambda stats, size: "POST /files/upload" in stats["Requests"]], #Small files written at the same time share an upload request
+    ["gzip_upload", "-user john -accessfile g -write g Gzip_edit -deletefile g -accessfile g -read g Gzip_edit -deletefile g -logout", EXIT_SUCCESS, "-nodelta", LOG_FILE,
+        lambda stats, size: "POST /file/{}" in stats["Requests"] and stats["Received"] <= size * GZIP_MAX_FRACTION], #Whole upload of text goes gzip compressed, the server stores it inflated
+    ["offline_edit", "-user john -accessfile a -write a Offline_edit -wait 8000 -deletefile a -accessfile a -read a Offline_edit -deletefile a -logout", EXIT_SUCCESS, "-dropuploads 2"], #Unanswered uploads are queued and sent again, the edit still lands
 ]
 
+#Log lines like those of the server, generated once
+if (not os.path.exists(LOG_FILE)):
+    with open(LOG_FILE, "w") as f:
+        line = 0
+        while (f.tell() < LOG_FILE_SIZE):
+            f.write("[12:%02d:%02d] [SERVER] POST /file/%d From:john (201)\n" % ((line // 60) % 60, line % 60, line % 7))
+            line += 1
+
 #Add base actions to set test mode and set our local server
 VDUCLIENT += " -insecure -testmode -server %s " % (LOCAL_SERVER_ADDRESS)
 VDUSERVER = "python " + VDUSERVER
@@ -74,8 +125,14 @@ for test in Tests:
     testName = test[0]
     testInstructions = test[1]
     expectedCode = test[2]
+    serverArgs = test[3] if len(test) > 3 else ""
+    sizeFile = test[4] if len(test) > 4 else None
+    statsCheck = test[5] if len(test) > 5 else None
 
-    pserver = subprocess.Popen(VDUSERVER, stdout=subprocess.PIPE)
+    if (os.path.exists(STATS_FILE)):
+        os.remove(STATS_FILE)
+
+    pserver = subprocess.Popen(VDUSERVER + " -stats \"%s\" %s" % (STATS_FILE, serverArgs), stdout=subprocess.PIPE)
 
     p = subprocess.Popen(VDUCLIENT + testInstructions)
     p.wait()
@@ -83,8 +140,22 @@ for test in Tests:
     pserver.terminate()
     while pserver.poll() == None:
         None
+
+    #Interrupted transfers must continue where they stopped instead of starting over
+    sentOk = True
+    if (sizeFile != None):
+        with open(STATS_FILE) as f:
+            sent = json.load(f)["Sent"]
+        sentOk = sent <= os.path.getsize(sizeFile) * (1 + RESUME_MAX_OVERHEAD)
+        Log("[Test] [%s] server sent %d bytes for %d byte file" % (testName, sent, os.path.getsize(sizeFile)))
+
+    #What the server saw, e.g. which requests ran at the same time
+    statsOk = True
+    if (statsCheck != None):
+        with open(STATS_FILE) as f:
+            statsOk = statsCheck(json.load(f), os.path.getsize(sizeFile) if sizeFile != None else 0)
                 
-    if (p.returncode == expectedCode):
+    if (p.returncode == expectedCode and sentOk and statsOk):
         Log("[Test]  OK  [%s] %d" % (testName, p.returncode))
         successfulTestCount = successfulTestCount + 1
     else:
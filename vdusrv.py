@@ -13,15 +13,33 @@
 # * @copyright 2015-2020 Bill Zissimopoulos
 #
 
-import os, ssl, http.server, time, random, hashlib, base64, mimetypes
+import os, ssl, http.server, socketserver, time, random, hashlib, base64, mimetypes, zlib, threading, struct, argparse, json
 thispath = os.path.dirname(os.path.realpath(__file__))
 
 #File chunk read delay, seconds
 FILE_CHUNK_READ_DELAY = 0
 #Api key / file token expiration time, seconds
 KEY_EXPIRATION_TIME = 120
+#Time a refreshed api key stays valid, so requests sent with it before the refresh are not refused, seconds
+KEY_ROTATION_GRACE = 10
+#Keys in this last part of their lifetime are renewed with any authenticated response, fraction of KEY_EXPIRATION_TIME
+KEY_RENEWAL_FRACTION = 0.5
 #Probability that file request will time out (for testing)
 TIMEOUT_PROBABILITY = 0
+#Files smaller than this are never compressed, bytes
+COMPRESSION_MIN_SIZE = 1024
+#Files are compressed only if their sample compresses at least to this ratio, skips zip, png and alike
+COMPRESSION_MAX_RATIO = 0.9
+#Size of the sample used to decide on compression, bytes
+COMPRESSION_SAMPLE_SIZE = 0x10000
+#Files larger than this are not sent in batch access responses, clients download them on their own, bytes
+BATCH_MAX_FILE_SIZE = 0x100000
+#Bytes a download sends per emulated round trip, like a TCP window that does not grow, see -latency
+EMULATED_WINDOW_SIZE = 0x10000
+#Longest time a wait for file events is held open, below the 30 s receive timeout of WinInet, seconds
+EVENTS_WAIT_TIME = 20
+#File events kept for clients that wait again, clients behind them get the current version of every file
+EVENTS_MAX_KEPT = 1000
 
 #Current list of users who can generate keys, 
 Users = ["test@example.com", "john"]
@@ -34,9 +52,37 @@ FileTokens = {
     "d" : {"Path" : thispath + "\\TestFiles\\hugefile.bin", "ETag": "1", "Expires":0},
     "e" : {"Path" : thispath + "\\TestFiles\\rand.py", "ETag": "1", "Expires":0}, 
     "f" : {"Path" : thispath + "\\TestFiles\\document.docx", "ETag": "1", "Expires":0}, 
+    "g" : {"Path" : thispath + "\\TestFiles\\log.txt", "ETag": "1", "Expires":0}, 
     }
 #Current valid api keys, will be generated on user login
 ApiKeys = {}
+ApiKeysLock = threading.Lock()
+#Bytes of file content served and bytes actually sent over the wire
+#Requests holds count, start of the first and end of the last request of each route in seconds since the server started
+TransferStats = {"Content": 0, "Sent": 0, "Received": 0, "Requests": {}}
+TransferStatsLock = threading.Lock()
+#Changes of files for clients waiting on /events, list of (sequence, file, client id that made the change)
+#Sequence starts above 0, which stands for a client that has not seen any
+Events = []
+EventsSequence = 1
+EventsCondition = threading.Condition()
+#Chunked uploads in progress by upload id
+Uploads = {}
+UploadsLock = threading.Lock()
+#File downloads left to cut at a random offset (for testing), set by -dropcount
+DropCount = 0
+#Uploads left unanswered like by an unreachable server (for testing), set by -dropuploads
+UploadDropCount = 0
+#File the transfer stats are written to after every download (for testing), set by -stats
+StatsPath = None
+#Emulated round trip time of file downloads in seconds (for testing), set by -latency
+RoundTripDelay = 0
+#Emulated processing time of every request in seconds (for testing), set by -delay
+ResponseDelay = 0
+#Whether uploads of changed blocks are applied, cleared by -nodelta so clients upload whole files (for testing)
+DeltaUploads = True
+#Time the server started, request times in the stats are relative to it
+ServerStart = time.time()
 
 def Log(msg):
     print(("[%s] [SERVER] " + str(msg)) % time.strftime('%H:%M:%S'))
@@ -52,6 +98,212 @@ def FileMD5(fpath):
         f.close()
     return file_hash.digest()
 
+#Base64 MD5 of the file of a token, computed again only after the file changed
+def TokenMD5(finst):
+    fstat = os.stat(finst["Path"])
+    key = (finst["Path"], fstat.st_mtime_ns, fstat.st_size)
+    if (finst.get("MD5Key") != key):
+        finst["MD5"] = base64.b64encode(FileMD5(finst["Path"])).decode("utf-8")
+        finst["MD5Key"] = key
+    return finst["MD5"]
+
+def ShouldCompress(fpath, size):
+    if (size < COMPRESSION_MIN_SIZE):
+        return False
+    with open(fpath, "rb") as f:
+        sample = f.read(COMPRESSION_SAMPLE_SIZE)
+        f.close()
+    return len(zlib.compress(sample, 1)) <= len(sample) * COMPRESSION_MAX_RATIO
+
+def AcceptsGzip(acceptEncoding):
+    for coding in (acceptEncoding or "").split(","):
+        params = coding.strip().split(";")
+        if (params[0].strip().lower() == "gzip"):
+            return not any(p.strip().replace(" ", "") in ("q=0", "q=0.0", "q=0.00", "q=0.000") for p in params[1:])
+    return False
+
+def AddTransferStats(content, sent):
+    with TransferStatsLock:
+        TransferStats["Content"] += content
+        TransferStats["Sent"] += sent
+        total = TransferStats["Content"]
+        saved = total - TransferStats["Sent"]
+        WriteStatsLocked()
+    Log("Sent %d of %d bytes, saved %d of %d bytes in total" % (sent, content, saved, total))
+
+#Counts request body bytes received, rejected uploads should not add any
+def AddUploadStats(received):
+    with TransferStatsLock:
+        TransferStats["Received"] += received
+        WriteStatsLocked()
+
+#Route of a request with tokens, upload ids and part numbers left out, e.g. "POST /file/{}/delta"
+def RouteName(command, path):
+    parts = (path or "").split("?")[0].split("/")
+    if (len(parts) > 2 and parts[1] == "file"):
+        parts[2] = "{}"
+        if (len(parts) > 4 and parts[3] == "uploads"):
+            parts[4] = "{}"
+        if (len(parts) > 5 and parts[5].isdigit()):
+            parts[5] = "{}"
+    return "%s %s" % (command, "/".join(parts))
+
+#Accounts a handled request to its route, started is the time it arrived
+def AddRequestStats(command, path, started):
+    with TransferStatsLock:
+        route = TransferStats["Requests"].setdefault(RouteName(command, path), {"Count": 0, "First": started - ServerStart, "Last": 0})
+        route["Count"] += 1
+        route["Last"] = time.time() - ServerStart
+        WriteStatsLocked()
+
+#Writes stats to the file set by -stats, expects TransferStatsLock
+def WriteStatsLocked():
+    if (StatsPath):
+        with open(StatsPath, "w") as f:
+            json.dump(TransferStats, f)
+
+#Bumps file version after a successful upload, returns response status and headers
+#Records a new version of file and wakes clients waiting for it
+def PublishEvent(finst, origin):
+    global EventsSequence
+    with EventsCondition:
+        EventsSequence += 1
+        Events.append((EventsSequence, finst, origin))
+        del Events[:-EVENTS_MAX_KEPT]
+        EventsCondition.notify_all()
+
+def UploadResult(finst, allowMode, origin):
+    #Increase version
+    finst["ETag"] = str(int(finst["ETag"]) + 1)
+    PublishEvent(finst, origin)
+
+    #A case for sending 205 response, if send after expiration date
+    if (time.time() > finst["Expires"]):
+        return 205, []
+
+    #New expiration time
+    finst["Expires"] = time.time() + KEY_EXPIRATION_TIME
+    return 201, [("Allow", allowMode), ("Expires", finst["Expires"]), ("ETag", finst["ETag"])]
+
+#Splits a multipart body whose parts all carry Content-Length, returns list of (headers, data) or None if malformed
+def ParseMultipart(body, boundary):
+    delimiter = b"--" + boundary.encode("utf-8")
+    parts = []
+    pos = body.find(delimiter)
+    while (pos >= 0):
+        pos += len(delimiter)
+        if (body[pos:pos + 2] == b"--"):
+            return parts
+        headersEnd = body.find(b"\r\n\r\n", pos)
+        if (body[pos:pos + 2] != b"\r\n" or headersEnd < 0):
+            return None
+        headers = {}
+        for line in body[pos + 2:headersEnd].decode("utf-8").split("\r\n"):
+            name, sep, value = line.partition(":")
+            headers[name.strip().lower()] = value.strip()
+        try:
+            length = int(headers["content-length"])
+        except (KeyError, ValueError):
+            return None
+        data = body[headersEnd + 4:headersEnd + 4 + length]
+        pos = headersEnd + 4 + length
+        if (len(data) != length or body[pos:pos + 2] != b"\r\n" or not body.startswith(delimiter, pos + 2)):
+            return None
+        parts.append((headers, data))
+        pos += 2
+    return None
+
+#Drops api keys past their expiration, requests carrying them are refused
+def DropExpiredApiKeys():
+    now = time.time()
+    for apiKey, key in list(ApiKeys.items()):
+        if (key["Expires"] < now):
+            ApiKeys.pop(apiKey, None)
+
+#Returns successor of api key and its expiration if the key is close to expiry, otherwise (None, 0)
+#The successor is created once and handed out with every response to the old key during its grace period
+def RenewApiKey(apiKey):
+    with ApiKeysLock:
+        key = ApiKeys.get(apiKey)
+        if (key is None or (key.get("Successor") not in ApiKeys and key["Expires"] - time.time() > KEY_EXPIRATION_TIME * KEY_RENEWAL_FRACTION)):
+            return None, 0
+        if (key.get("Successor") not in ApiKeys):
+            successor = GenerateRandomToken(ApiKeys)
+            ApiKeys[successor] = {"Expires": time.time() + KEY_EXPIRATION_TIME, "User": key["User"]}
+            key["Successor"] = successor
+            key["Expires"] = min(key["Expires"], time.time() + KEY_ROTATION_GRACE)
+        return key["Successor"], ApiKeys[key["Successor"]]["Expires"]
+
+#Takes one pending connection drop, returns True if this download should be cut
+def TakeDrop():
+    global DropCount
+    with TransferStatsLock:
+        if (DropCount <= 0):
+            return False
+        DropCount -= 1
+        return True
+
+#Takes one pending upload drop, returns True if this upload should be left unanswered
+def TakeUploadDrop():
+    global UploadDropCount
+    with TransferStatsLock:
+        if (UploadDropCount <= 0):
+            return False
+        UploadDropCount -= 1
+        return True
+
+#Parses a single "bytes=first-last" range, returns (first, last), None to ignore the header or (-1, -1) if not satisfiable
+def ParseRange(rangeHeader, size):
+    if (not rangeHeader.startswith("bytes=") or "," in rangeHeader):
+        return None
+    first, sep, last = rangeHeader[6:].strip().partition("-")
+    try:
+        if (first == ""):
+            #Suffix range, the last N bytes
+            first, last = max(size - int(last), 0), size - 1
+        else:
+            first, last = int(first), min(int(last), size - 1) if last else size - 1
+    except ValueError:
+        return None
+    if (first >= size or first > last):
+        return (-1, -1)
+    return (first, last)
+
+#Rebuilds a file from its previous version and a delta (layout in VDUClient/VDUDelta.h)
+#Returns False when the delta is malformed or does not fit the previous version
+def ApplyDelta(basePath, delta, outPath):
+    if (len(delta) < 16 or delta[0:4] != b"VDUD"):
+        return False
+    blockSize, length = struct.unpack_from("<IQ", delta, 4)
+    baseSize = os.path.getsize(basePath)
+    pos = 16
+    with open(basePath, "rb") as base, open(outPath, "wb") as out:
+        while (pos < len(delta)):
+            op = delta[pos:pos + 1]
+            if (op == b"C" and pos + 9 <= len(delta)):
+                first, count = struct.unpack_from("<II", delta, pos + 1)
+                pos += 9
+                if (first * blockSize >= baseSize):
+                    return False
+                base.seek(first * blockSize)
+                remaining = count * blockSize
+                while (remaining > 0):
+                    chunk = base.read(min(remaining, 0x100000))
+                    if not chunk:
+                        break
+                    out.write(chunk)
+                    remaining -= len(chunk)
+            elif (op == b"L" and pos + 5 <= len(delta)):
+                literalLen = struct.unpack_from("<I", delta, pos + 1)[0]
+                pos += 5
+                if (pos + literalLen > len(delta)):
+                    return False
+                out.write(delta[pos:pos + literalLen])
+                pos += literalLen
+            else:
+                return False
+        return out.tell() == length
+
 def GenerateRandomToken(duplicateCheckDict = None):
     token = ""
     while True:
@@ -62,6 +314,81 @@ def GenerateRandomToken(duplicateCheckDict = None):
     return token
 
 class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
+    #Keep-alive connections, so clients can reuse them for following requests
+    protocol_version = "HTTP/1.1"
+    sentContentLength = False
+    expectContinue = False
+
+    def handle_one_request(self):
+        #Waits for the next request on a kept-alive connection are not counted
+        self.started = None
+        try:
+            super().handle_one_request()
+        finally:
+            if (self.started):
+                AddRequestStats(self.command, getattr(self, "path", None), self.started)
+
+    def parse_request(self):
+        #Keys are checked as valid at the time the request arrives
+        DropExpiredApiKeys()
+        self.started = time.time()
+        if (ResponseDelay):
+            time.sleep(ResponseDelay)
+        return super().parse_request()
+
+    def handle_expect_100(self):
+        #100 Continue is only sent once the request was checked, rejected uploads never transmit their body
+        self.expectContinue = True
+        return True
+
+    def send_response_only(self, code, message=None):
+        #204 and 304 never carry a body nor its length
+        self.sentContentLength = code in (204, 304)
+        super().send_response_only(code, message)
+
+    def send_header(self, keyword, value):
+        if (keyword.lower() in ("content-length", "transfer-encoding")):
+            self.sentContentLength = True
+        super().send_header(keyword, value)
+
+    def end_headers(self):
+        #Keys close to expiry are renewed with any authenticated response, the client needs no refresh request
+        if (self.path != "/auth/key"):
+            renewedKey, expires = RenewApiKey(self.headers.get("X-Api-Key"))
+            if (renewedKey):
+                super().send_header("X-Api-Key", renewedKey)
+                super().send_header("X-Api-Key-Expires", self.date_time_string(expires))
+        #Responses without a body still need a length for the connection to stay alive
+        if (not self.sentContentLength):
+            super().send_header("Content-Length", 0)
+        #Body the client holds back cannot be skipped, the connection is not reused
+        if (self.expectContinue):
+            self.expectContinue = False
+            self.close_connection = True
+            super().send_header("Connection", "close")
+        super().end_headers()
+
+    #Reads request body, asks for it first if the client waits for 100 Continue
+    def ReadBody(self, length):
+        if (self.expectContinue):
+            self.expectContinue = False
+            http.server.BaseHTTPRequestHandler.send_response_only(self, 100)
+            http.server.BaseHTTPRequestHandler.end_headers(self)
+        data = self.rfile.read(length)
+        AddUploadStats(len(data))
+        return data
+
+    #Consumes body of an answered request, bodies never asked for are not transmitted
+    def SkipBody(self, length):
+        if (not self.close_connection):
+            self.ReadBody(length)
+
+    #Writes one chunk of a chunked body, returns length of data written
+    def WriteChunk(self, data):
+        if (data):
+            self.wfile.write(b"%x\r\n" % len(data) + data + b"\r\n")
+        return len(data)
+
     def do_GET(self):
         global ApiKeys, Users, KEY_EXPIRATION_TIME, FileTokens
 
@@ -78,28 +405,49 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                 self.end_headers()
                 Log("GET %s (401)" % (self.path))
             else:
-                newApiKey = GenerateRandomToken(ApiKeys)
-                expires = time.time() + KEY_EXPIRATION_TIME
-                ApiKeys[newApiKey] = {"Expires": expires, "User": ApiKeys[apiKey]["User"]}
-                ApiKeys.pop(apiKey)
+                with ApiKeysLock:
+                    newApiKey = GenerateRandomToken(ApiKeys)
+                    expires = time.time() + KEY_EXPIRATION_TIME
+                    ApiKeys[newApiKey] = {"Expires": expires, "User": ApiKeys[apiKey]["User"]}
+                    ApiKeys[apiKey]["Expires"] = min(ApiKeys[apiKey]["Expires"], time.time() + KEY_ROTATION_GRACE)
+                    ApiKeys[apiKey]["Successor"] = newApiKey
                 self.send_response_only(200)
                 self.send_header("X-Api-Key", newApiKey)
                 self.send_header("Date", self.date_time_string())
                 self.send_header("Expires", self.date_time_string(expires))
                 self.end_headers()
                 Log("GET %s From:%s (200)" % (self.path, ApiKeys[newApiKey]["User"]))
+        elif (self.path.startswith("/file/") and "/uploads/" in self.path):
+            #Chunked upload status, body lists received part numbers
+            parts = self.path.split("/")
+            if (len(parts) != 5):
+                self.send_response_only(404)
+                self.end_headers()
+                return
+            if (not self.AuthorizeFile("GET", parts[2])):
+                return
+            upload = self.FindUpload("GET", parts[2], parts[4])
+            if (upload):
+                with UploadsLock:
+                    body = ",".join(str(n) for n in sorted(upload["Parts"])).encode("utf-8")
+                self.send_response_only(200)
+                self.send_header("Content-Type", "text/plain")
+                self.send_header("Content-Length", len(body))
+                self.end_headers()
+                self.wfile.write(body)
+                Log("GET %s %d of %d parts (200)" % (self.path, len(upload["Parts"]), upload["PartCount"]))
         elif (self.path.startswith("/file/")):
             apiKey = self.headers.get("X-Api-Key")
             if (apiKey not in ApiKeys):
                 self.send_response_only(401)
                 self.end_headers()
-                Log("GET %s (401)" % (self.path))
+                Log("%s %s (401)" % (self.command, self.path))
             else:
                 fileToken = self.path.split("/file/")[1]
                 if (fileToken not in FileTokens):
                     self.send_response_only(404)
                     self.end_headers()
-                    Log("GET %s From:%s (404)" % (self.path, ApiKeys[apiKey]["User"]))
+                    Log("%s %s From:%s (404)" % (self.command, self.path, ApiKeys[apiKey]["User"]))
                 else:
                     finst = FileTokens[fileToken]
                     fpath = finst["Path"]
@@ -107,7 +455,7 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                     if (not os.access(fpath, os.R_OK)):
                         self.send_response_only(405)
                         self.end_headers()
-                        Log("GET %s From:%s File:%s (405)" % (self.path, ApiKeys[apiKey]["User"], fpath))
+                        Log("%s %s From:%s File:%s (405)" % (self.command, self.path, ApiKeys[apiKey]["User"], fpath))
                     else:
                         fstat = os.stat(fpath)
                         allowMode = ""
@@ -117,15 +465,55 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                         if (os.access(fpath, os.W_OK)):
                             allowMode += " POST"
                         
+                        #If-Range with another ETag means the client holds parts of an older version, it gets the whole file
+                        size = fstat.st_size
+                        first, last = 0, size - 1
+                        status = 200
+                        rangeHeader = self.headers.get("Range")
+                        ifRange = self.headers.get("If-Range")
+
+                        #Client that still holds this version only gets its headers
+                        ifNoneMatch = self.headers.get("If-None-Match")
+                        if (ifNoneMatch and finst["ETag"] in [t.strip().strip('"') for t in ifNoneMatch.split(",")]):
+                            status = 304
+                        elif (rangeHeader and (ifRange is None or ifRange.strip('"') == finst["ETag"])):
+                            byteRange = ParseRange(rangeHeader, size)
+                            if (byteRange == (-1, -1)):
+                                self.send_response_only(416)
+                                self.send_header("Content-Range", "bytes */%d" % size)
+                                self.end_headers()
+                                Log("%s %s From:%s File:%s (416)" % (self.command, self.path, ApiKeys[apiKey]["User"], fpath))
+                                return
+                            elif (byteRange):
+                                first, last = byteRange
+                                status = 206
+
                         mimeType = mimetypes.guess_type(fpath)
-                        self.send_response_only(200)
+                        #Clients accepting gzip get Content-Encoding as transfer coding, stored encoding moves to X-Content-Encoding
+                        #Ranges are always sent as they are stored, so offsets stay valid
+                        acceptsGzip = AcceptsGzip(self.headers.get("Accept-Encoding"))
+                        head = self.command == "HEAD"
+                        compress = status == 200 and not head and acceptsGzip and ShouldCompress(fpath, size)
+                        self.send_response_only(status)
                         self.send_header("Allow", allowMode)
-                        self.send_header("Content-Encoding", mimeType[1])
+                        self.send_header("Accept-Ranges", "bytes")
+                        if (status == 206):
+                            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, size))
+                        if (acceptsGzip):
+                            self.send_header("Vary", "Accept-Encoding")
+                            self.send_header("X-Content-Encoding", mimeType[1])
+                            self.send_header("X-Content-Length", fstat.st_size)
+                        else:
+                            self.send_header("Content-Encoding", mimeType[1])
                         filedirpath, filename = os.path.split(fpath)
                         filedirpath
                         self.send_header("Content-Location", filename)
-                        self.send_header("Content-Length", fstat.st_size)
-                        self.send_header("Content-MD5", base64.b64encode(FileMD5(fpath)).decode("utf-8"))
+                        if (compress):
+                            self.send_header("Content-Encoding", "gzip")
+                            self.send_header("Transfer-Encoding", "chunked")
+                        elif (status != 304):
+                            self.send_header("Content-Length", last - first + 1)
+                        self.send_header("Content-MD5", TokenMD5(finst))
                         self.send_header("Content-Type", mimeType[0])
                         self.send_header("Date", self.date_time_string())
                         self.send_header("Last-Modified", self.date_time_string(fstat.st_mtime))
@@ -133,26 +521,119 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                         self.send_header("Expires", self.date_time_string(finst["Expires"]))
                         self.send_header("ETag", finst["ETag"])
                         self.end_headers()
-                        Log("GET %s From:%s File:%s (200)" % (self.path, ApiKeys[apiKey]["User"], fpath))
+                        Log("%s %s From:%s File:%s (%d%s)" % (self.command, self.path, ApiKeys[apiKey]["User"], fpath, status, ", gzip" if compress else ""))
+                        if (status == 304):
+                            AddTransferStats(size, 0)
+                            return
+                        if (head):
+                            return
+                        sent = 0
+                        remaining = last - first + 1
+                        #Cut the connection somewhere in the body to test resuming
+                        dropAt = random.randrange(remaining) if remaining > 0 and TakeDrop() else -1
+                        #gzip container (wbits 16 + 15), compressed length is unknown upfront so the body is chunked
+                        compressor = zlib.compressobj(6, zlib.DEFLATED, 31) if compress else None
+                        windowLeft = EMULATED_WINDOW_SIZE
                         with open(fpath, "rb") as f:
-                            while True:
-                                chunk = f.read(8192)
+                            f.seek(first)
+                            while (remaining > 0):
+                                chunk = f.read(min(8192, remaining))
                                 if not chunk:
                                     break
-                                self.wfile.write(chunk)
+                                if (dropAt >= 0 and dropAt < len(chunk)):
+                                    #A partial chunk would break the framing of a compressed body, cut it at the chunk boundary
+                                    if (not compressor):
+                                        self.wfile.write(chunk[:dropAt])
+                                        sent += dropAt
+                                    self.close_connection = True
+                                    AddTransferStats(last - first + 1, sent)
+                                    Log("%s %s dropped after %d bytes" % (self.command, self.path, last - first + 1 - remaining + dropAt))
+                                    return
+                                dropAt -= len(chunk)
+                                remaining -= len(chunk)
+                                if (compressor):
+                                    sent += self.WriteChunk(compressor.compress(chunk))
+                                else:
+                                    self.wfile.write(chunk)
+                                    sent += len(chunk)
                                 if (FILE_CHUNK_READ_DELAY):
                                     time.sleep(FILE_CHUNK_READ_DELAY)
+                                #A single stream cannot be faster than one window per round trip
+                                windowLeft -= len(chunk)
+                                if (RoundTripDelay and windowLeft <= 0):
+                                    time.sleep(RoundTripDelay)
+                                    windowLeft += EMULATED_WINDOW_SIZE
                             f.close()
+                        if (compressor):
+                            sent += self.WriteChunk(compressor.flush())
+                            self.wfile.write(b"0\r\n\r\n")
+                        AddTransferStats(last - first + 1, sent)
                 
+    #Checks api key and file token of a /file/{token}/... request, responds with an error and returns None if invalid
+    def AuthorizeFile(self, verb, fileToken):
+        apiKey = self.headers.get("X-Api-Key")
+        if (apiKey not in ApiKeys):
+            self.send_response_only(401)
+            self.end_headers()
+            Log("%s %s (401)" % (verb, self.path))
+            return None
+        if (fileToken not in FileTokens):
+            self.send_response_only(404)
+            self.end_headers()
+            Log("%s %s From:%s (404)" % (verb, self.path, ApiKeys[apiKey]["User"]))
+            return None
+        return ApiKeys[apiKey]["User"]
+
+    #Returns chunked upload of /file/{token}/uploads/{id}/..., responds with 404 and returns None if unknown
+    def FindUpload(self, verb, fileToken, uploadId):
+        with UploadsLock:
+            upload = Uploads.get(uploadId)
+        if (upload is None or upload["Token"] != fileToken):
+            self.send_response_only(404)
+            self.end_headers()
+            Log("%s %s unknown upload (404)" % (verb, self.path))
+            return None
+        return upload
+
+    #Responds with 412 and returns True if the upload is based on another version than the server has
+    def RejectOutdated(self, finst, user):
+        ifMatch = self.headers.get("If-Match")
+        if (ifMatch is None or ifMatch.strip('"') == finst["ETag"]):
+            return False
+        self.send_response_only(412)
+        self.send_header("ETag", finst["ETag"])
+        self.end_headers()
+        Log("%s %s From:%s File:%s outdated (412)" % (self.command, self.path, user, finst["Path"]))
+        return True
+
+    #Bumps file version and responds to a successful upload
+    def SendUploadResponse(self, finst, allowMode, user):
+        status, headers = UploadResult(finst, allowMode, self.headers.get("X-Client-Id"))
+        self.send_response_only(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        if (status == 201):
+            self.send_header("Date", self.date_time_string())
+        self.end_headers()
+        Log("POST %s From:%s File:%s (%d)" % (self.path, user, finst["Path"], status))
+
     def do_POST(self):
         global ApiKeys, Users, KEY_EXPIRATION_TIME, FileTokens
         
-        contentLen = int(self.headers.get("Content-Length"))
+        contentLen = int(self.headers.get("Content-Length", 0))
+
+        #Connection is closed without a response, the client has to keep the changes and send them again
+        isUpload = self.path == "/files/upload" or (self.path.startswith("/file/") and not self.path.endswith("/touch"))
+        if (isUpload and TakeUploadDrop()):
+            self.close_connection = True
+            Log("POST %s (dropped)" % self.path)
+            return
 
         if (self.path == "/auth/key"):
             #Log("\n" + self.headers.as_string())
             user = self.headers.get("From")
-            #Log(str(self.rfile.read(contentLen)))
+            #Body has to be consumed for the connection to be reused
+            self.ReadBody(contentLen)
             if (user not in Users):
                 self.send_response_only(401)
                 self.end_headers()
@@ -167,25 +648,399 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                 self.send_header("Expires", self.date_time_string(expires))
                 self.end_headers()
                 Log("POST %s From:%s (201)" % (self.path, user))
+        elif (self.path == "/files"):
+            #Batch access, body lists file tokens one per line
+            #Response is a stream of parts, each has header lines like a single GET /file response including X-File-Token
+            #and Status, an empty line and Content-Length bytes of the file
+            tokens = [t.strip() for t in self.ReadBody(contentLen).decode("utf-8").splitlines() if t.strip()]
+            apiKey = self.headers.get("X-Api-Key")
+            if (apiKey not in ApiKeys):
+                self.send_response_only(401)
+                self.end_headers()
+                Log("POST %s (401)" % (self.path))
+                return
+            user = ApiKeys[apiKey]["User"]
+
+            self.send_response_only(200)
+            self.send_header("Content-Type", "application/vnd.vdu.batch")
+            self.send_header("Transfer-Encoding", "chunked")
+            self.send_header("Date", self.date_time_string())
+            self.end_headers()
+
+            content = 0
+            sent = 0
+            statuses = {}
+            for fileToken in tokens:
+                headers = "X-File-Token: %s\r\n" % fileToken
+                data = b""
+                finst = FileTokens.get(fileToken)
+                if (finst is None):
+                    status = 404
+                elif (not os.access(finst["Path"], os.R_OK)):
+                    status = 405
+                elif (os.path.getsize(finst["Path"]) > BATCH_MAX_FILE_SIZE):
+                    status = 413
+                else:
+                    status = 200
+                    fpath = finst["Path"]
+                    with open(fpath, "rb") as f:
+                        data = f.read()
+                    mimeType = mimetypes.guess_type(fpath)
+                    finst["Expires"] = time.time() + KEY_EXPIRATION_TIME
+                    headers += "Allow: %s\r\n" % ("GET POST" if os.access(fpath, os.W_OK) else "GET")
+                    headers += "Content-Encoding: %s\r\n" % mimeType[1]
+                    headers += "Content-Location: %s\r\n" % os.path.split(fpath)[1]
+                    headers += "Content-Length: %d\r\n" % len(data)
+                    headers += "Content-MD5: %s\r\n" % base64.b64encode(hashlib.md5(data).digest()).decode("utf-8")
+                    headers += "Content-Type: %s\r\n" % mimeType[0]
+                    headers += "Last-Modified: %s\r\n" % self.date_time_string(os.stat(fpath).st_mtime)
+                    headers += "Expires: %s\r\n" % self.date_time_string(finst["Expires"])
+                    headers += "ETag: %s\r\n" % finst["ETag"]
+                headers += "Status: %d\r\n\r\n" % status
+                statuses[status] = statuses.get(status, 0) + 1
+                content += len(data)
+                sent += self.WriteChunk(headers.encode("utf-8") + data)
+            self.wfile.write(b"0\r\n\r\n")
+            AddTransferStats(content, sent)
+            Log("POST %s From:%s %d files %s (200)" % (self.path, user, len(tokens), statuses))
+        elif (self.path == "/events"):
+            #Waits for new versions of files, body lists file tokens one per line like batch access
+            #X-Event-Sequence is the last event the client has seen, 0 asks for the current version of every file
+            #Response is a stream of parts like the one of batch access with X-File-Token, ETag and Status, without file data
+            #Changes made by the waiting client itself, told by X-Client-Id, are left out
+            tokens = [t.strip() for t in self.ReadBody(contentLen).decode("utf-8").splitlines() if t.strip()]
+            apiKey = self.headers.get("X-Api-Key")
+            if (apiKey not in ApiKeys):
+                self.send_response_only(401)
+                self.end_headers()
+                Log("POST %s (401)" % (self.path))
+                return
+            user = ApiKeys[apiKey]["User"]
+            clientId = self.headers.get("X-Client-Id")
+            try:
+                since = int(self.headers.get("X-Event-Sequence", "0"))
+            except ValueError:
+                since = 0
+
+            def Changed():
+                return [t for t in tokens if t in FileTokens and
+                    any(seq > since and finst is FileTokens[t] and (origin is None or origin != clientId) for seq, finst, origin in Events)]
+
+            with EventsCondition:
+                #Clients that missed events, e.g. after a server restart, get every file
+                snapshot = since <= 0 or since > EventsSequence or (len(Events) > 0 and since < Events[0][0] - 1)
+                gone = [t for t in tokens if t not in FileTokens]
+                if (snapshot):
+                    changed = [t for t in tokens if t in FileTokens]
+                else:
+                    if (len(gone) == 0):
+                        EventsCondition.wait_for(lambda: len(Changed()) > 0, EVENTS_WAIT_TIME)
+                    changed = Changed()
+                sequence = EventsSequence
+
+            if (len(changed) == 0 and len(gone) == 0):
+                self.send_response_only(204)
+                self.send_header("X-Event-Sequence", sequence)
+                self.end_headers()
+                Log("POST %s From:%s %d files (204)" % (self.path, user, len(tokens)))
+                return
+
+            body = "".join("X-File-Token: %s\r\nETag: %s\r\nStatus: 200\r\n\r\n" % (t, FileTokens[t]["ETag"]) for t in changed)
+            body += "".join("X-File-Token: %s\r\nStatus: 404\r\n\r\n" % t for t in gone)
+            body = body.encode("utf-8")
+            self.send_response_only(200)
+            self.send_header("Content-Type", "application/vnd.vdu.batch")
+            self.send_header("Content-Length", len(body))
+            self.send_header("X-Event-Sequence", sequence)
+            self.end_headers()
+            self.wfile.write(body)
+            Log("POST %s From:%s %d files %d changed %d gone (200)" % (self.path, user, len(tokens), len(changed), len(gone)))
+        elif (self.path == "/files/upload"):
+            #Batch upload, multipart body with a part per file, every part carries X-File-Token and the headers of a single upload
+            #Response is a stream of parts like the one of batch access, without file data
+            apiKey = self.headers.get("X-Api-Key")
+            if (apiKey not in ApiKeys):
+                self.send_response_only(401)
+                self.end_headers()
+                self.SkipBody(contentLen)
+                Log("POST %s (401)" % (self.path))
+                return
+            user = ApiKeys[apiKey]["User"]
+            body = self.ReadBody(contentLen)
+
+            contentType, sep, params = self.headers.get("Content-Type", "").partition(";")
+            boundary = params.strip()[9:].strip('"') if params.strip().startswith("boundary=") else ""
+            parts = ParseMultipart(body, boundary) if (contentType.strip() == "multipart/mixed" and boundary) else None
+            if (parts is None):
+                self.send_response_only(400)
+                self.end_headers()
+                Log("POST %s From:%s (400)" % (self.path, user))
+                return
+
+            response = b""
+            statuses = {}
+            for headers, data in parts:
+                fileToken = headers.get("x-file-token")
+                finst = FileTokens.get(fileToken)
+                resultHeaders = []
+                if (finst is None):
+                    status = 404
+                elif (random.random() <= TIMEOUT_PROBABILITY):
+                    status = 408
+                elif (not os.access(finst["Path"], os.W_OK)):
+                    status = 405
+                elif (headers.get("if-match") is not None and headers["if-match"].strip('"') != finst["ETag"]):
+                    #File changed since the client accessed it, ETag tells it apart from a damaged part
+                    status = 412
+                    resultHeaders = [("ETag", finst["ETag"])]
+                elif (base64.b64encode(hashlib.md5(data).digest()).decode("utf-8") != headers.get("content-md5")):
+                    #Part arrived damaged, the file keeps its content
+                    status = 412
+                else:
+                    fpath = finst["Path"]
+                    filedirpath, filename = os.path.split(fpath)
+                    allowMode = ("GET" if os.access(fpath, os.R_OK) else "") + " POST"
+
+                    #Needs renaming?
+                    newFileName = headers.get("content-location")
+                    if (newFileName and newFileName != filename):
+                        os.rename(fpath, filedirpath + "\\" + newFileName)
+                        fpath = filedirpath + "\\" + newFileName
+                        finst["Path"] = fpath
+
+                    try:
+                        with open(fpath, "wb") as f:
+                            f.write(data)
+                        status, resultHeaders = UploadResult(finst, allowMode, self.headers.get("X-Client-Id"))
+                    except OSError:
+                        status = 409
+
+                statuses[status] = statuses.get(status, 0) + 1
+                part = "X-File-Token: %s\r\n" % fileToken
+                for name, value in resultHeaders:
+                    part += "%s: %s\r\n" % (name, value)
+                part += "Status: %d\r\n\r\n" % status
+                response += part.encode("utf-8")
+
+            self.send_response_only(200)
+            self.send_header("Content-Type", "application/vnd.vdu.batch")
+            self.send_header("Content-Length", len(response))
+            self.send_header("Date", self.date_time_string())
+            self.end_headers()
+            self.wfile.write(response)
+            Log("POST %s From:%s %d files %s (200)" % (self.path, user, len(parts), statuses))
+        elif (self.path.startswith("/file/") and self.path.endswith("/uploads")):
+            #Starts a chunked upload, the client picks the part size
+            self.ReadBody(contentLen)
+            fileToken = self.path.split("/")[2]
+            user = self.AuthorizeFile("POST", fileToken)
+            if (not user):
+                return
+            fpath = FileTokens[fileToken]["Path"]
+            try:
+                length = int(self.headers.get("X-Upload-Length"))
+                partSize = int(self.headers.get("X-Upload-Part-Size"))
+            except (TypeError, ValueError):
+                length, partSize = -1, 0
+            if (length < 0 or partSize <= 0):
+                self.send_response_only(400)
+                self.end_headers()
+                Log("POST %s From:%s (400)" % (self.path, user))
+                return
+            if (not os.access(fpath, os.W_OK)):
+                self.send_response_only(405)
+                self.end_headers()
+                Log("POST %s From:%s (405)" % (self.path, user))
+                return
+            if (self.RejectOutdated(FileTokens[fileToken], user)):
+                return
+
+            with UploadsLock:
+                uploadId = GenerateRandomToken(Uploads)
+                stagingPath = fpath + "." + uploadId[:16] + ".part"
+                with open(stagingPath, "wb") as f:
+                    f.truncate(length)
+                Uploads[uploadId] = {"Token": fileToken, "Length": length, "PartSize": partSize,
+                    "PartCount": max((length + partSize - 1) // partSize, 1), "Parts": set(), "Path": stagingPath}
+            self.send_response_only(201)
+            self.send_header("X-Upload-Id", uploadId)
+            self.send_header("Location", "/file/%s/uploads/%s" % (fileToken, uploadId))
+            self.end_headers()
+            Log("POST %s From:%s %d bytes in parts of %d (201)" % (self.path, user, length, partSize))
+        elif (self.path.startswith("/file/") and self.path.endswith("/commit")):
+            #Finishes a chunked upload once all parts arrived and the whole file matches Content-MD5
+            self.ReadBody(contentLen)
+            parts = self.path.split("/")
+            if (len(parts) != 6):
+                self.send_response_only(404)
+                self.end_headers()
+                return
+            fileToken, uploadId = parts[2], parts[4]
+            user = self.AuthorizeFile("POST", fileToken)
+            if (not user):
+                return
+            upload = self.FindUpload("POST", fileToken, uploadId)
+            if (not upload):
+                return
+
+            with UploadsLock:
+                missing = upload["PartCount"] - len(upload["Parts"])
+            if (missing > 0):
+                self.send_response_only(409)
+                self.end_headers()
+                Log("POST %s From:%s %d parts missing (409)" % (self.path, user, missing))
+                return
+            if (self.RejectOutdated(FileTokens[fileToken], user)):
+                return
+            if (base64.b64encode(FileMD5(upload["Path"])).decode("utf-8") != self.headers.get("Content-MD5")):
+                self.send_response_only(412)
+                self.end_headers()
+                Log("POST %s From:%s MD5 mismatch (412)" % (self.path, user))
+                return
+
+            with UploadsLock:
+                Uploads.pop(uploadId, None)
+
+            finst = FileTokens[fileToken]
+            fpath = finst["Path"]
+            filedirpath, filename = os.path.split(fpath)
+            allowMode = ("GET" if os.access(fpath, os.R_OK) else "") + " POST"
+            os.replace(upload["Path"], fpath)
+
+            #Needs renaming?
+            newFileName = self.headers.get("Content-Location")
+            if (newFileName and newFileName != filename):
+                os.rename(fpath, filedirpath + "\\" + newFileName)
+                fpath = filedirpath + "\\" + newFileName
+                finst["Path"] = fpath
+
+            self.SendUploadResponse(finst, allowMode, user)
+        elif (self.path.startswith("/file/") and self.path.endswith("/touch")):
+            #Extends the file token without sending or checking content, the file itself is not touched
+            self.ReadBody(contentLen)
+            parts = self.path.split("/")
+            if (len(parts) != 4):
+                self.send_response_only(404)
+                self.end_headers()
+                Log("POST %s (404)" % (self.path))
+                return
+            user = self.AuthorizeFile("POST", parts[2])
+            if (not user):
+                return
+
+            finst = FileTokens[parts[2]]
+            #Like an upload after expiration, an expired token cannot be extended
+            if (time.time() > finst["Expires"]):
+                self.send_response_only(205)
+                self.end_headers()
+                Log("POST %s From:%s File:%s (205)" % (self.path, user, finst["Path"]))
+                return
+
+            finst["Expires"] = time.time() + KEY_EXPIRATION_TIME
+            self.send_response_only(204)
+            self.send_header("Expires", self.date_time_string(finst["Expires"]))
+            self.send_header("ETag", finst["ETag"])
+            self.end_headers()
+            Log("POST %s From:%s File:%s (204)" % (self.path, user, finst["Path"]))
+        elif (self.path.startswith("/file/") and self.path.endswith("/delta")):
+            apiKey = self.headers.get("X-Api-Key")
+            #The delta is read upfront, small compared to the file it describes
+            delta = self.ReadBody(contentLen)
+            if (not DeltaUploads):
+                self.send_response_only(501)
+                self.end_headers()
+                Log("POST %s (501)" % (self.path))
+                return
+
+            if (apiKey not in ApiKeys):
+                self.send_response_only(401)
+                self.end_headers()
+                Log("POST %s (401)" % (self.path))
+                return
+
+            fileToken = self.path.split("/file/")[1].split("/")[0]
+            if (fileToken not in FileTokens):
+                self.send_response_only(404)
+                self.end_headers()
+                Log("POST %s From:%s (404)" % (self.path, ApiKeys[apiKey]["User"]))
+                return
+
+            if (random.random() <= TIMEOUT_PROBABILITY):
+                self.send_response_only(408)
+                self.end_headers()
+                Log("POST %s From:%s (408)" % (self.path, ApiKeys[apiKey]["User"]))
+                return
+
+            finst = FileTokens[fileToken]
+            fpath = finst["Path"]
+            filedirpath, filename = os.path.split(fpath)
+
+            allowMode = ""
+            if (os.access(fpath, os.R_OK)):
+                allowMode += "GET"
+
+            if (os.access(fpath, os.W_OK)):
+                allowMode += " POST"
+            else:
+                self.send_response_only(405)
+                self.end_headers()
+                Log("POST %s From:%s (405)" % (self.path, ApiKeys[apiKey]["User"]))
+                return
+
+            #Blocks in the delta refer to the version the client has
+            if (self.headers.get("If-Match", "").strip('"') != finst["ETag"]):
+                self.send_response_only(412)
+                self.end_headers()
+                Log("POST %s From:%s File:%s (412)" % (self.path, ApiKeys[apiKey]["User"], fpath))
+                return
+
+            tmpPath = fpath + ".delta"
+            if (not ApplyDelta(fpath, delta, tmpPath)):
+                if (os.path.exists(tmpPath)):
+                    os.remove(tmpPath)
+                self.send_response_only(400)
+                self.end_headers()
+                Log("POST %s From:%s File:%s (400)" % (self.path, ApiKeys[apiKey]["User"], fpath))
+                return
+
+            #Rebuilt file must be exactly what the client has, otherwise it has to upload it whole
+            if (base64.b64encode(FileMD5(tmpPath)).decode("utf-8") != self.headers.get("Content-MD5")):
+                os.remove(tmpPath)
+                self.send_response_only(412)
+                self.end_headers()
+                Log("POST %s From:%s File:%s MD5 mismatch (412)" % (self.path, ApiKeys[apiKey]["User"], fpath))
+                return
+
+            os.replace(tmpPath, fpath)
+            Log("Delta of %d bytes rebuilt %d byte file %s" % (len(delta), os.path.getsize(fpath), fpath))
+
+            #Needs renaming?
+            newFileName = self.headers.get("Content-Location")
+            if (newFileName and newFileName != filename):
+                os.rename(fpath, filedirpath + "\\" + newFileName)
+                fpath = filedirpath + "\\" + newFileName
+                finst["Path"] = fpath
+
+            self.SendUploadResponse(finst, allowMode, ApiKeys[apiKey]["User"])
         elif (self.path.startswith("/file/")):
             apiKey = self.headers.get("X-Api-Key")
             if (apiKey not in ApiKeys):
                 self.send_response_only(401)
                 self.end_headers()
-                self.rfile.read(contentLen)
+                self.SkipBody(contentLen)
                 Log("POST %s (401)" % (self.path))
             else:
                 fileToken = self.path.split("/file/")[1]
                 if (fileToken not in FileTokens):
                     self.send_response_only(404)
                     self.end_headers()
-                    self.rfile.read(contentLen)
+                    self.SkipBody(contentLen)
                     Log("POST %s From:%s (404)" % (self.path, ApiKeys[apiKey]["User"]))
                 else:
                     if (random.random() <= TIMEOUT_PROBABILITY):
                         self.send_response_only(408)
                         self.end_headers()
-                        self.rfile.read(contentLen)
+                        self.SkipBody(contentLen)
                         Log("POST %s From:%s (408)" % (self.path, ApiKeys[apiKey]["User"]))
                         return
 
@@ -202,10 +1057,24 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                     else:
                         self.send_response_only(405)
                         self.end_headers()
-                        self.rfile.read(contentLen)
+                        self.SkipBody(contentLen)
                         Log("POST %s From:%s (405)" % (self.path, ApiKeys[apiKey]["User"]))
                         return
 
+                    #Upload based on an older version would overwrite changes made meanwhile
+                    if (self.RejectOutdated(finst, ApiKeys[apiKey]["User"])):
+                        self.SkipBody(contentLen)
+                        return
+
+                    #Body sent gzip compressed carries the stored encoding and length in X-Content-Encoding and X-Content-Length
+                    compressed = self.headers.get("X-Content-Length") is not None
+                    if (compressed and (self.headers.get("Content-Encoding") or "").lower() != "gzip"):
+                        self.send_response_only(415)
+                        self.end_headers()
+                        self.SkipBody(contentLen)
+                        Log("POST %s From:%s (415)" % (self.path, ApiKeys[apiKey]["User"]))
+                        return
+
                     #Needs renaming?
                     newFileName = self.headers.get("Content-Location")
                     if (newFileName != filename):
@@ -217,10 +1086,25 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                     calculatedMD5 = base64.b64encode(FileMD5(fpath)).decode("utf-8")
                     receivedMD5 = self.headers.get("Content-MD5")
                     if (calculatedMD5 != receivedMD5):
+                        data = self.ReadBody(contentLen)
+
+                        #Content-MD5 covers the stored bytes, a compressed body is checked once inflated
+                        if (compressed):
+                            try:
+                                data = zlib.decompress(data, 16 + zlib.MAX_WBITS)
+                            except zlib.error:
+                                data = None
+                            if (data is None or base64.b64encode(hashlib.md5(data).digest()).decode("utf-8") != receivedMD5):
+                                self.send_response_only(400)
+                                self.end_headers()
+                                Log("POST %s From:%s (400, gzip body does not match Content-MD5)" % (self.path, ApiKeys[apiKey]["User"]))
+                                return
+                            Log("POST %s From:%s received %d bytes gzip for %d bytes" % (self.path, ApiKeys[apiKey]["User"], contentLen, len(data)))
+
                         #Write new contents
                         try:
                             with open(fpath, "wb") as f:
-                                f.write(self.rfile.read(contentLen))
+                                f.write(data)
                                 f.close()
                         except:
                             self.send_response_only(409)
@@ -228,18 +1112,18 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                             Log("POST %s From:%s (409)" % (self.path, ApiKeys[apiKey]["User"]))
                             return
                     else:
-                        #Not reading rfile with content can cause abnormal termination of connection
-                        self.rfile.read(contentLen)
+                        #Server has the content already, a client waiting for 100 Continue does not send it
+                        self.SkipBody(contentLen)
 
                     #Size should be matching as well
                     fstat = os.stat(fpath)
-                    newSize = int(self.headers.get("Content-Length"))
+                    newSize = int(self.headers.get("X-Content-Length" if compressed else "Content-Length"))
                     if (newSize != fstat.st_size):
                         Log("Length mismatch!!")
 
                     #Mime type check
                     mimeType = mimetypes.guess_type(fpath)
-                    newEncoding = self.headers.get("Content-Encoding")
+                    newEncoding = self.headers.get("X-Content-Encoding" if compressed else "Content-Encoding")
                     newType = self.headers.get("Content-Type")
 
                     if (str(mimeType[1]) != newEncoding):
@@ -247,29 +1131,125 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                     if (str(mimeType[0]) != newType):
                         Log("Type mismatch!!!")
 
-                    #Increase version
-                    finst["ETag"] = str(int(finst["ETag"]) + 1)
+                    self.SendUploadResponse(finst, allowMode, ApiKeys[apiKey]["User"])
+                    return
+    
+    def do_HEAD(self):
+        #Metadata of /file/{token}, the headers of GET without the body
+        parts = self.path.split("/")
+        if (len(parts) == 3 and parts[1] == "file"):
+            self.do_GET()
+        else:
+            self.send_response_only(404)
+            self.end_headers()
+            Log("HEAD %s (404)" % (self.path))
 
-                    #A case for sending 205 response, if send after expiration date
-                    if (time.time() > finst["Expires"]):
-                        self.send_response_only(205)
-                        self.end_headers()
-                        Log("POST %s From:%s File:%s (205)" % (self.path, ApiKeys[apiKey]["User"], fpath))
-                        return
-                    
-                    self.send_response_only(201)
-                    self.send_header("Allow", allowMode)
-                    self.send_header("Date", self.date_time_string())
+    def do_PATCH(self):
+        contentLen = int(self.headers.get("Content-Length", 0))
+        self.ReadBody(contentLen)
 
-                    #New expiration time
-                    finst["Expires"] = time.time() + KEY_EXPIRATION_TIME
+        #Metadata update of /file/{token}, renames the file without its content being sent
+        parts = self.path.split("/")
+        if (len(parts) != 3 or parts[1] != "file"):
+            self.send_response_only(404)
+            self.end_headers()
+            Log("PATCH %s (404)" % (self.path))
+            return
+
+        fileToken = parts[2]
+        user = self.AuthorizeFile("PATCH", fileToken)
+        if (not user):
+            return
+
+        finst = FileTokens[fileToken]
+        fpath = finst["Path"]
+        filedirpath, filename = os.path.split(fpath)
+        if (not os.access(fpath, os.W_OK)):
+            self.send_response_only(405)
+            self.end_headers()
+            Log("PATCH %s From:%s (405)" % (self.path, user))
+            return
+        if (self.RejectOutdated(finst, user)):
+            return
+
+        newFileName = self.headers.get("Content-Location")
+        if (not newFileName or "/" in newFileName or "\\" in newFileName):
+            self.send_response_only(400)
+            self.end_headers()
+            Log("PATCH %s From:%s (400)" % (self.path, user))
+            return
+
+        if (newFileName != filename):
+            try:
+                os.rename(fpath, filedirpath + "\\" + newFileName)
+            except OSError:
+                self.send_response_only(409)
+                self.end_headers()
+                Log("PATCH %s From:%s (409)" % (self.path, user))
+                return
+            fpath = filedirpath + "\\" + newFileName
+            finst["Path"] = fpath
+
+        #Same answer as an upload, only without new content
+        allowMode = ("GET" if os.access(fpath, os.R_OK) else "") + " POST"
+        status, headers = UploadResult(finst, allowMode, self.headers.get("X-Client-Id"))
+        status = 200 if status == 201 else status
+        self.send_response_only(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Date", self.date_time_string())
+        self.end_headers()
+        Log("PATCH %s From:%s File:%s (%d)" % (self.path, user, fpath, status))
+
+    def do_PUT(self):
+        contentLen = int(self.headers.get("Content-Length", 0))
+
+        #Part of a chunked upload, /file/{token}/uploads/{id}/{part}
+        parts = self.path.split("/")
+        if (len(parts) != 6 or parts[1] != "file" or parts[3] != "uploads"):
+            self.ReadBody(contentLen)
+            self.send_response_only(404)
+            self.end_headers()
+            Log("PUT %s (404)" % (self.path))
+            return
+
+        fileToken, uploadId = parts[2], parts[4]
+        data = self.ReadBody(contentLen)
+        user = self.AuthorizeFile("PUT", fileToken)
+        if (not user):
+            return
+        upload = self.FindUpload("PUT", fileToken, uploadId)
+        if (not upload):
+            return
+
+        if (random.random() <= TIMEOUT_PROBABILITY):
+            self.send_response_only(408)
+            self.end_headers()
+            Log("PUT %s From:%s (408)" % (self.path, user))
+            return
+
+        try:
+            part = int(parts[5])
+        except ValueError:
+            part = -1
+        offset = part * upload["PartSize"]
+        expected = min(upload["PartSize"], upload["Length"] - offset)
+        if (part < 0 or part >= upload["PartCount"] or len(data) != expected):
+            self.send_response_only(400)
+            self.end_headers()
+            Log("PUT %s From:%s (400)" % (self.path, user))
+            return
+
+        #Parts arrive concurrently, each one owns its region of the staging file
+        with open(upload["Path"], "r+b") as f:
+            f.seek(offset)
+            f.write(data)
+        with UploadsLock:
+            upload["Parts"].add(part)
+        self.send_response_only(204)
+        self.end_headers()
+        Log("PUT %s From:%s %d bytes (204)" % (self.path, user, len(data)))
 
-                    self.send_header("Expires", finst["Expires"])
-                    self.send_header("ETag", finst["ETag"])
-                    self.end_headers()
-                    Log("POST %s From:%s File:%s (201)" % (self.path, ApiKeys[apiKey]["User"], fpath))
-                    return
-    
     def do_DELETE(self):
         global ApiKeys, Users, KEY_EXPIRATION_TIME, FileTokens
         
@@ -285,6 +1265,25 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                 self.end_headers()
                 Log("DELETE %s From:%s (204)" % (self.path, ApiKeys[apiKey]["User"]))
                 ApiKeys.pop(apiKey)
+        elif (self.path.startswith("/file/") and "/uploads/" in self.path):
+            #Abandons a chunked upload
+            parts = self.path.split("/")
+            if (len(parts) != 5):
+                self.send_response_only(404)
+                self.end_headers()
+                return
+            user = self.AuthorizeFile("DELETE", parts[2])
+            if (not user):
+                return
+            upload = self.FindUpload("DELETE", parts[2], parts[4])
+            if (upload):
+                with UploadsLock:
+                    Uploads.pop(parts[4], None)
+                if (os.path.exists(upload["Path"])):
+                    os.remove(upload["Path"])
+                self.send_response_only(204)
+                self.end_headers()
+                Log("DELETE %s From:%s (204)" % (self.path, user))
         elif (self.path.startswith("/file/")):
             apiKey = self.headers.get("X-Api-Key")
             if (apiKey not in ApiKeys):
@@ -308,6 +1307,27 @@ class VDUHTTPRequestHandler(http.server.BaseHTTPRequestHandler):
                         Log("DELETE %s From:%s (204)" % (self.path, ApiKeys[apiKey]["User"]))
 
 
-httpd = http.server.HTTPServer(("0.0.0.0", 4443), VDUHTTPRequestHandler)
+#Every connection is handled on its own thread, so a long download does not stall other clients
+class ThreadingHTTPServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-dropcount", type=int, default=0, help="Cut this many file downloads at a random offset")
+parser.add_argument("-stats", default=None, help="Write transfer stats to this file after every download")
+parser.add_argument("-latency", type=int, default=0, help="Emulated round trip time of file downloads in ms")
+parser.add_argument("-delay", type=int, default=0, help="Emulated processing time of every request in ms")
+parser.add_argument("-dropuploads", type=int, default=0, help="Leave this many uploads unanswered, like an unreachable server")
+parser.add_argument("-nodelta", action="store_true", help="Refuse uploads of changed blocks, clients upload whole files")
+parser.add_argument("-keylifetime", type=int, default=KEY_EXPIRATION_TIME, help="Expiration time of api keys and file tokens in seconds")
+options = parser.parse_args()
+KEY_EXPIRATION_TIME = options.keylifetime
+DropCount = options.dropcount
+UploadDropCount = options.dropuploads
+StatsPath = options.stats
+RoundTripDelay = options.latency / 1000
+ResponseDelay = options.delay / 1000
+DeltaUploads = not options.nodelta
+
+httpd = ThreadingHTTPServer(("0.0.0.0", 4443), VDUHTTPRequestHandler)
 httpd.socket = ssl.wrap_socket(httpd.socket, server_side=True, certfile=thispath + "\\server_.pem")
 httpd.serve_forever()
\ No newline at end of file